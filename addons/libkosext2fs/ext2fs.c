@@ -123,6 +123,48 @@ int ext2_block_write_nc(ext2_fs_t *fs, uint32_t block_num, const uint8_t *blk) {
     return 0;
 }
 
+#ifndef EXT2_NOT_IN_KOS
+int ext2_block_read_async(ext2_fs_t *fs, uint32_t block_num, uint32_t count,
+                          uint8_t *buf) {
+    int fs_per_block = fs->sb.s_log_block_size - fs->dev->l_block_size + 10;
+    ext2_cache_t **cache = fs->bcache;
+    int i;
+
+    if(!fs->dev->read_blocks_async || !fs->dev->async_status)
+        return -ENOTSUP;
+
+    if(fs_per_block < 0)
+        return -EINVAL;
+
+    if(fs->sb.s_blocks_count < block_num + count)
+        return -EINVAL;
+
+    /* The disk has to be up to date with the cache before we go around it. */
+    for(i = fs->cache_size - 1; i >= 0; --i) {
+        if((cache[i]->flags & EXT2_CACHE_FLAG_DIRTY) &&
+           cache[i]->block >= block_num &&
+           cache[i]->block < block_num + count) {
+            if(ext2_block_write_nc(fs, cache[i]->block, cache[i]->data))
+                return -EIO;
+
+            cache[i]->flags &= ~EXT2_CACHE_FLAG_DIRTY;
+        }
+    }
+
+    if(fs->dev->read_blocks_async(fs->dev, block_num << fs_per_block,
+                                  count << fs_per_block, buf))
+        return -errno;
+
+    return 0;
+}
+
+int ext2_block_async_status(ext2_fs_t *fs) {
+    int rv = fs->dev->async_status(fs->dev);
+
+    return rv < 0 ? -errno : rv;
+}
+#endif
+
 int ext2_block_mark_dirty(ext2_fs_t *fs, uint32_t block_num) {
     int i;
     ext2_cache_t **cache = fs->bcache;
@@ -110,6 +110,19 @@ int ext2_block_cache_wb(ext2_fs_t *fs);
 
 uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err);
 
+#ifndef EXT2_NOT_IN_KOS
+/* Start reading count consecutive blocks straight into buf, bypassing the
+   cache, if the block device can do that asynchronously. Any dirty cached
+   copies of the blocks are written back first. Returns 0 if the read was
+   started, -ENOTSUP if the device can't do it, or another negative error. */
+int ext2_block_read_async(ext2_fs_t *fs, uint32_t block_num, uint32_t count,
+                          uint8_t *buf);
+
+/* Check on a read started with ext2_block_read_async(). Returns 1 while it is
+   still going, 0 when it is done, or a negative error. */
+int ext2_block_async_status(ext2_fs_t *fs);
+#endif
+
 __END_DECLS
 
 #endif /* !__EXT2_EXT2FS_H */
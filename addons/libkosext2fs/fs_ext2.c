@@ -15,6 +15,7 @@
 
 #include <kos/fs.h>
 #include <kos/mutex.h>
+#include <kos/thread.h>
 #include <kos/dbglog.h>
 
 #include <ext2/fs_ext2.h>
@@ -52,8 +53,14 @@ static struct {
     dirent_t dent;
     ext2_inode_t *inode;
     fs_ext2_fs_t *fs;
+    ssize_t async_rv;
 } fh[MAX_EXT2_FILES];
 
+/* The handle with a direct-to-buffer read in flight (from a pread on a file
+   opened with O_ASYNC), or -1. The block devices we know of can only do one of
+   these at a time. */
+static file_t async_fd = -1;
+
 static int create_empty_file(fs_ext2_fs_t *fs, const char *fn,
                              ext2_inode_t **rinode, uint32_t *rinode_num) {
     int irv;
@@ -232,6 +239,14 @@ static int fs_ext2_close(void *h) {
     mutex_lock(&ext2_mutex);
 
     if(fd < MAX_EXT2_FILES && fh[fd].mode) {
+        /* Don't leave a transfer running into a buffer nobody will claim. */
+        if(async_fd == fd) {
+            while(ext2_block_async_status(fh[fd].fs->fs) == 1)
+                thd_pass();
+
+            async_fd = -1;
+        }
+
         ext2_inode_put(fh[fd].inode);
         fh[fd].inode_num = 0;
         fh[fd].mode = 0;
@@ -241,124 +256,115 @@ static int fs_ext2_close(void *h) {
     return 0;
 }
 
-static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
-    file_t fd = ((file_t)h) - 1;
-    ext2_fs_t *fs;
-    uint32_t bs, lbs, bo;
-    uint8_t *block;
-    uint8_t *bbuf = (uint8_t *)buf;
-    ssize_t rv;
-    uint64_t sz;
+/* Check that fd is an open file that can be read (or written, if wr is set).
+   Assumes the mutex is held. */
+static int ext2_check_fd(file_t fd, int wr) {
     int mode;
 
-    mutex_lock(&ext2_mutex);
-
     /* Check that the fd is valid */
     if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
-        mutex_unlock(&ext2_mutex);
         errno = EBADF;
         return -1;
     }
 
-    /* Make sure the fd is open for reading */
+    /* Make sure the fd is open for the right thing */
     mode = fh[fd].mode & O_MODE_MASK;
-    if(mode != O_RDONLY && mode != O_RDWR) {
-        mutex_unlock(&ext2_mutex);
+    if(wr && mode != O_WRONLY && mode != O_RDWR) {
+        errno = EBADF;
+        return -1;
+    }
+    else if(!wr && mode != O_RDONLY && mode != O_RDWR) {
         errno = EBADF;
         return -1;
     }
 
     /* Make sure we're not trying to read a directory with read */
     if(fh[fd].mode & O_DIR) {
-        mutex_unlock(&ext2_mutex);
         errno = EISDIR;
         return -1;
     }
 
+    return 0;
+}
+
+/* Read from the file at *ptr, advancing *ptr. Assumes the mutex is held and
+   that the fd has been checked. */
+static ssize_t ext2_read_at(file_t fd, void *buf, size_t cnt, uint64_t *ptr) {
+    ext2_fs_t *fs;
+    uint32_t bs, lbs, bo;
+    uint8_t *block;
+    uint8_t *bbuf = (uint8_t *)buf;
+    ssize_t rv;
+    uint64_t sz;
+
     /* Do we have enough left? */
     sz = ext2_inode_size(fh[fd].inode);
-    if((fh[fd].ptr + cnt) > sz)
-        cnt = sz - fh[fd].ptr;
+    if(*ptr >= sz)
+        return 0;
+
+    if((*ptr + cnt) > sz)
+        cnt = sz - *ptr;
 
     fs = fh[fd].fs->fs;
     bs = ext2_block_size(fs);
     lbs = ext2_log_block_size(fs);
     rv = (ssize_t)cnt;
-    bo = fh[fd].ptr & ((1 << lbs) - 1);
+    bo = *ptr & ((1 << lbs) - 1);
 
     /* Handle the first block specially if we are offset within it. */
     if(bo) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, *ptr >> lbs,
                                            NULL, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
         if(cnt > bs - bo) {
             memcpy(bbuf, block + bo, bs - bo);
-            fh[fd].ptr += bs - bo;
+            *ptr += bs - bo;
             cnt -= bs - bo;
             bbuf += bs - bo;
         }
         else {
             memcpy(bbuf, block + bo, cnt);
-            fh[fd].ptr += cnt;
+            *ptr += cnt;
             cnt = 0;
         }
     }
 
     /* While we still have more to read, do it. */
     while(cnt) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, *ptr >> lbs,
                                            NULL, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
         if(cnt > bs) {
             memcpy(bbuf, block, bs);
-            fh[fd].ptr += bs;
+            *ptr += bs;
             cnt -= bs;
             bbuf += bs;
         }
         else {
             memcpy(bbuf, block, cnt);
-            fh[fd].ptr += cnt;
+            *ptr += cnt;
             cnt = 0;
         }
     }
 
-    /* We're done, clean up and return. */
-    mutex_unlock(&ext2_mutex);
     return rv;
 }
 
-static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
-    file_t fd = ((file_t)h) - 1;
+/* Write to the file at *ptr, advancing *ptr. Assumes the mutex is held and
+   that the fd has been checked. */
+static ssize_t ext2_write_at(file_t fd, const void *buf, size_t cnt,
+                             uint64_t *ptr) {
     ext2_fs_t *fs;
     uint32_t bs, lbs, bo, bn;
     uint8_t *block;
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
     uint64_t sz;
-    int err, mode;
-
-    mutex_lock(&ext2_mutex);
-
-    /* Check that the fd is valid */
-    if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num) {
-        mutex_unlock(&ext2_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
-    /* Make sure the fd is open for writing */
-    mode = fh[fd].mode & O_MODE_MASK;
-    if(mode != O_WRONLY && mode != O_RDWR) {
-        mutex_unlock(&ext2_mutex);
-        errno = EBADF;
-        return -1;
-    }
+    int err;
 
     fs = fh[fd].fs->fs;
     bs = ext2_block_size(fs);
@@ -366,24 +372,18 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
     rv = (ssize_t)cnt;
     sz = ext2_inode_size(fh[fd].inode);
 
-    /* Reset the file pointer to the end of the file if we've got the append
-       flag set. */
-    if(fh[fd].mode & O_APPEND)
-        fh[fd].ptr = sz;
-
     /* If we have already moved beyond the end of the file with a seek
        operation, allocate any blank blocks we need to to satisfy that. */
-    if(fh[fd].ptr > sz) {
+    if(*ptr > sz) {
         /* Are we staying within the same block? */
-        if(((sz - 1) >> lbs) == ((fh[fd].ptr - 1) >> lbs)) {
+        if(((sz - 1) >> lbs) == ((*ptr - 1) >> lbs)) {
             if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
-                                               (fh[fd].ptr - 1) >> lbs, &bn,
+                                               (*ptr - 1) >> lbs, &bn,
                                                &errno))) {
-                mutex_unlock(&ext2_mutex);
                 return -1;
             }
 
-            memset(block + (sz & (bs - 1)), 0, fh[fd].ptr - sz);
+            memset(block + (sz & (bs - 1)), 0, *ptr - sz);
             ext2_block_mark_dirty(fs, bn);
         }
         /* Nope, we need to allocate a new one... */
@@ -393,7 +393,6 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
                 if(!(block = ext2_inode_read_block(fs, fh[fd].inode,
                                                    (sz - 1) >> lbs,
                                                    &bn, &errno))) {
-                    mutex_unlock(&ext2_mutex);
                     return -1;
                 }
 
@@ -404,10 +403,9 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
             }
 
             /* The size should now be nicely at a block boundary... */
-            while(sz < fh[fd].ptr) {
+            while(sz < *ptr) {
                 if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
                                                     sz >> lbs, &errno))) {
-                    mutex_unlock(&ext2_mutex);
                     return -1;
                 }
 
@@ -415,27 +413,26 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
             }
         }
 
-        ext2_inode_set_size(fh[fd].inode, fh[fd].ptr);
-        sz = fh[fd].ptr;
+        ext2_inode_set_size(fh[fd].inode, *ptr);
+        sz = *ptr;
     }
 
     /* Handle the first block specially if we are offset within it. */
-    if((bo = fh[fd].ptr & ((1 << lbs) - 1))) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
+    if((bo = *ptr & ((1 << lbs) - 1))) {
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, *ptr >> lbs,
                                            &bn, &errno))) {
-            mutex_unlock(&ext2_mutex);
             return -1;
         }
 
         if(cnt > bs - bo) {
             memcpy(block + bo, bbuf, bs - bo);
-            fh[fd].ptr += bs - bo;
+            *ptr += bs - bo;
             cnt -= bs - bo;
             bbuf += bs - bo;
         }
         else {
             memcpy(block + bo, bbuf, cnt);
-            fh[fd].ptr += cnt;
+            *ptr += cnt;
             cnt = 0;
         }
 
@@ -444,17 +441,15 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
 
     /* While we still have more to write, do it. */
     while(cnt) {
-        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, fh[fd].ptr >> lbs,
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, *ptr >> lbs,
                                            &bn, &err))) {
             if(err != EINVAL) {
-                mutex_unlock(&ext2_mutex);
                 errno = err;
                 return -1;
             }
 
             if(!(block = ext2_inode_alloc_block(fs, fh[fd].inode,
-                                                fh[fd].ptr >> lbs, &errno))) {
-                mutex_unlock(&ext2_mutex);
+                                                *ptr >> lbs, &errno))) {
                 return -1;
             }
         }
@@ -464,24 +459,323 @@ static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
 
         if(cnt > bs) {
             memcpy(block, bbuf, bs);
-            fh[fd].ptr += bs;
+            *ptr += bs;
             cnt -= bs;
             bbuf += bs;
         }
         else {
             memcpy(block, bbuf, cnt);
-            fh[fd].ptr += cnt;
+            *ptr += cnt;
             cnt = 0;
         }
     }
 
     /* Update the file's size and modification time. */
-    if(fh[fd].ptr > sz)
-        ext2_inode_set_size(fh[fd].inode, fh[fd].ptr);
+    if(*ptr > sz)
+        ext2_inode_set_size(fh[fd].inode, *ptr);
 
     fh[fd].inode->i_mtime = time(NULL);
     ext2_inode_mark_dirty(fh[fd].inode);
 
+    return rv;
+}
+
+static ssize_t fs_ext2_read(void *h, void *buf, size_t cnt) {
+    file_t fd = ((file_t)h) - 1;
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 0)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    rv = ext2_read_at(fd, buf, cnt, &fh[fd].ptr);
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+static ssize_t fs_ext2_write(void *h, const void *buf, size_t cnt) {
+    file_t fd = ((file_t)h) - 1;
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 1)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    /* Reset the file pointer to the end of the file if we've got the append
+       flag set. */
+    if(fh[fd].mode & O_APPEND)
+        fh[fd].ptr = ext2_inode_size(fh[fd].inode);
+
+    rv = ext2_write_at(fd, buf, cnt, &fh[fd].ptr);
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+/* Try to start a read straight from the disk into the caller's buffer. This
+   only works for block-aligned reads into a suitably aligned buffer, and only
+   covers the run of blocks that are contiguous on disk, so the read may come
+   up short. Returns 0 if the transfer was started, or -1 if the caller should
+   do a normal read instead. Assumes the mutex is held. */
+static int ext2_start_async(file_t fd, void *buf, size_t cnt, uint64_t pos) {
+    ext2_fs_t *fs = fh[fd].fs->fs;
+    uint32_t bs = ext2_block_size(fs), lbs = ext2_log_block_size(fs);
+    uint32_t first, blk, nblks, i;
+    uint64_t sz = ext2_inode_size(fh[fd].inode);
+    int err;
+
+    if(async_fd != -1 || ((uint32_t)buf & 31) || (pos & (bs - 1)) ||
+       cnt < bs || pos >= sz)
+        return -1;
+
+    /* Don't go past the end of the buffer or the file. */
+    nblks = cnt >> lbs;
+
+    if(nblks > ((sz - pos + bs - 1) >> lbs))
+        nblks = (sz - pos + bs - 1) >> lbs;
+
+    if(ext2_inode_map_block(fs, fh[fd].inode, pos >> lbs, &first, &err))
+        return -1;
+
+    /* Holes read back as zeros, which the disk won't do for us. */
+    if(!first)
+        return -1;
+
+    for(i = 1; i < nblks; ++i) {
+        if(ext2_inode_map_block(fs, fh[fd].inode, (pos >> lbs) + i, &blk,
+                                &err) || blk != first + i)
+            break;
+    }
+
+    if(ext2_block_read_async(fs, first, i, (uint8_t *)buf))
+        return -1;
+
+    fh[fd].async_rv = (ssize_t)i << lbs;
+
+    if(pos + fh[fd].async_rv > sz)
+        fh[fd].async_rv = sz - pos;
+
+    async_fd = fd;
+    return 0;
+}
+
+static ssize_t fs_ext2_pread(void *h, void *buf, size_t cnt, off_t offset) {
+    file_t fd = ((file_t)h) - 1;
+    uint64_t pos = (uint64_t)offset;
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 0)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    /* Files opened with O_ASYNC get their data straight from the disk when
+       possible. The result is collected with fs_complete(). */
+    if((fh[fd].mode & O_ASYNC) && !ext2_start_async(fd, buf, cnt, pos)) {
+        mutex_unlock(&ext2_mutex);
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    rv = ext2_read_at(fd, buf, cnt, &pos);
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+/* Hand the file to fs_sendfile() a block at a time. Each block is copied out
+   of the block cache and the lock dropped before the sink gets it, since the
+   sink may block on a socket, or take another filesystem's locks while that
+   one is waiting for ours. */
+static ssize_t fs_ext2_splice(void *h, off_t offset, size_t cnt,
+                              fs_splice_sink_t sink, void *ctx) {
+    file_t fd = ((file_t)h) - 1;
+    uint64_t pos = (uint64_t)offset, sz;
+    ext2_fs_t *fs;
+    uint32_t lbs, bo, n;
+    uint8_t *block, *bounce = NULL;
+    ssize_t rv = 0, sent;
+
+    while(cnt) {
+        mutex_lock(&ext2_mutex);
+
+        if(ext2_check_fd(fd, 0)) {
+            mutex_unlock(&ext2_mutex);
+            free(bounce);
+            return rv ? rv : -1;
+        }
+
+        sz = ext2_inode_size(fh[fd].inode);
+
+        if(pos >= sz) {
+            mutex_unlock(&ext2_mutex);
+            break;
+        }
+
+        fs = fh[fd].fs->fs;
+        lbs = ext2_log_block_size(fs);
+        bo = pos & ((1 << lbs) - 1);
+        n = (1 << lbs) - bo;
+
+        if(n > cnt)
+            n = cnt;
+
+        if(n > sz - pos)
+            n = sz - pos;
+
+        if(!bounce && !(bounce = (uint8_t *)malloc(1 << lbs))) {
+            mutex_unlock(&ext2_mutex);
+            errno = ENOMEM;
+            return rv ? rv : -1;
+        }
+
+        if(!(block = ext2_inode_read_block(fs, fh[fd].inode, pos >> lbs,
+                                           NULL, &errno))) {
+            mutex_unlock(&ext2_mutex);
+            free(bounce);
+            return rv ? rv : -1;
+        }
+
+        memcpy(bounce, block + bo, n);
+        mutex_unlock(&ext2_mutex);
+
+        if((sent = sink(ctx, bounce, n)) <= 0) {
+            free(bounce);
+            return rv ? rv : sent;
+        }
+
+        pos += sent;
+        cnt -= sent;
+        rv += sent;
+
+        if((uint32_t)sent < n)
+            break;
+    }
+
+    free(bounce);
+    return rv;
+}
+
+static int fs_ext2_complete(void *h, ssize_t *rv) {
+    file_t fd = ((file_t)h) - 1;
+    int st;
+
+    mutex_lock(&ext2_mutex);
+
+    if(fd >= MAX_EXT2_FILES || !fh[fd].inode_num || async_fd != fd) {
+        mutex_unlock(&ext2_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if((st = ext2_block_async_status(fh[fd].fs->fs)) == 1) {
+        mutex_unlock(&ext2_mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    async_fd = -1;
+    mutex_unlock(&ext2_mutex);
+
+    if(st < 0) {
+        errno = -st;
+        *rv = -1;
+    }
+    else {
+        *rv = fh[fd].async_rv;
+    }
+
+    return 0;
+}
+
+static ssize_t fs_ext2_pwrite(void *h, const void *buf, size_t cnt,
+                              off_t offset) {
+    file_t fd = ((file_t)h) - 1;
+    uint64_t pos = (uint64_t)offset;
+    ssize_t rv;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 1)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    /* Like POSIX pwrite(), the offset is used as given even if the file was
+       opened with O_APPEND. */
+    rv = ext2_write_at(fd, buf, cnt, &pos);
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+static ssize_t fs_ext2_readv(void *h, const iovec_t *iov, int iovcnt) {
+    file_t fd = ((file_t)h) - 1;
+    ssize_t rv = 0, n;
+    int i;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 0)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; ++i) {
+        if((n = ext2_read_at(fd, iov[i].iov_base, iov[i].iov_len,
+                             &fh[fd].ptr)) < 0) {
+            if(!rv)
+                rv = -1;
+
+            break;
+        }
+
+        rv += n;
+
+        if((size_t)n < iov[i].iov_len)
+            break;
+    }
+
+    mutex_unlock(&ext2_mutex);
+    return rv;
+}
+
+static ssize_t fs_ext2_writev(void *h, const iovec_t *iov, int iovcnt) {
+    file_t fd = ((file_t)h) - 1;
+    ssize_t rv = 0, n;
+    int i;
+
+    mutex_lock(&ext2_mutex);
+
+    if(ext2_check_fd(fd, 1)) {
+        mutex_unlock(&ext2_mutex);
+        return -1;
+    }
+
+    if(fh[fd].mode & O_APPEND)
+        fh[fd].ptr = ext2_inode_size(fh[fd].inode);
+
+    for(i = 0; i < iovcnt; ++i) {
+        if((n = ext2_write_at(fd, iov[i].iov_base, iov[i].iov_len,
+                              &fh[fd].ptr)) < 0) {
+            if(!rv)
+                rv = -1;
+
+            break;
+        }
+
+        rv += n;
+    }
+
     mutex_unlock(&ext2_mutex);
     return rv;
 }
@@ -1809,7 +2103,7 @@ static vfs_handler_t vh = {
     fs_ext2_rename,             /* rename */
     fs_ext2_unlink,             /* unlink */
     NULL,                       /* mmap */
-    NULL,                       /* complete */
+    fs_ext2_complete,           /* complete */
     fs_ext2_stat,               /* stat */
     fs_ext2_mkdir,              /* mkdir */
     fs_ext2_rmdir,              /* rmdir */
@@ -1821,7 +2115,12 @@ static vfs_handler_t vh = {
     fs_ext2_tell64,             /* tell64 */
     fs_ext2_total64,            /* total64 */
     fs_ext2_readlink,           /* readlink */
-    fs_ext2_rewinddir           /* rewinddir */
+    fs_ext2_rewinddir,          /* rewinddir */
+    fs_ext2_pread,              /* pread */
+    fs_ext2_pwrite,             /* pwrite */
+    fs_ext2_readv,              /* readv */
+    fs_ext2_writev,             /* writev */
+    fs_ext2_splice              /* splice */
 };
 
 static int initted = 0;
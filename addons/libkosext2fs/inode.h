@@ -158,6 +158,11 @@ uint8_t *ext2_inode_read_block(ext2_fs_t *fs, const ext2_inode_t *inode,
                                uint32_t block_num, uint32_t *r_block,
                                int *err);
 
+/* Find the filesystem block that holds the given block of the inode, without
+   reading the block itself. */
+int ext2_inode_map_block(ext2_fs_t *fs, const ext2_inode_t *inode,
+                         uint32_t block_num, uint32_t *r_block, int *err);
+
 /* In symlink.c */
 int ext2_resolve_symlink(ext2_fs_t *fs, ext2_inode_t *inode, char *rv,
                          size_t *rv_len);
@@ -36,6 +36,7 @@ __BEGIN_DECLS
 #include <kos/fs_romdisk.h>
 #include <kos/fs_ramdisk.h>
 #include <kos/fs_pty.h>
+#include <kos/aio.h>
 #include <kos/limits.h>
 #include <kos/thread.h>
 #include <kos/sem.h>
@@ -45,11 +46,16 @@ __BEGIN_DECLS
 #include <kos/mutex.h>
 #include <kos/cond.h>
 #include <kos/genwait.h>
+#include <kos/ktimer.h>
+#include <kos/job.h>
 #include <kos/library.h>
 #include <kos/net.h>
+#include <kos/dns.h>
 #include <kos/nmmgr.h>
 #include <kos/exports.h>
 #include <kos/dbgio.h>
+#include <kos/slab.h>
+#include <kos/mprof.h>
 
 #include <arch/arch.h>
 #include <arch/cache.h>
@@ -84,6 +90,7 @@ __BEGIN_DECLS
 #   include <dc/matrix.h>
 #   include <dc/sound/stream.h>
 #   include <dc/sound/sfxmgr.h>
+#   include <dc/sound/adpcm.h>
 #   include <dc/net/broadband_adapter.h>
 #   include <dc/net/lan_adapter.h>
 #   include <dc/modem/modem.h>
@@ -0,0 +1,204 @@
+/* KallistiOS ##version##
+
+   kos/aio.h
+
+*/
+
+/** \file   kos/aio.h
+    \brief  Asynchronous file reads.
+
+    This file provides a small asynchronous I/O engine on top of the VFS. You
+    fill in a batch of read requests and submit them; a pool of worker threads
+    services them with fs_pread(), so any number of requests against the same
+    file can run without fighting over its file pointer. You can then poll the
+    requests, wait for some or all of them, or have a callback run as each one
+    finishes.
+
+    Files opened with O_ASYNC on filesystems that support it (the ISO9660 and
+    ext2 filesystems, when backed by the GD-ROM or a G1 ATA device in DMA mode)
+    have suitably aligned requests transferred by DMA straight into the
+    request's buffer. The worker sleeps while the transfer runs rather than
+    copying the data through the filesystem's cache. For the best results, use
+    32-byte aligned buffers and offsets and lengths that are multiples of the
+    filesystem's block size (2048 bytes on a CD).
+
+    The engine keeps counts of queued and in-flight requests and a histogram of
+    request latencies, see aio_get_stats().
+*/
+
+#ifndef __KOS_AIO_H
+#define __KOS_AIO_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <arch/types.h>
+#include <kos/fs.h>
+
+/** \defgroup aio_states            Request states
+
+    @{
+*/
+#define AIO_IDLE        0   /**< \brief Not submitted */
+#define AIO_QUEUED      1   /**< \brief Waiting for a worker */
+#define AIO_RUNNING     2   /**< \brief Being serviced by a worker */
+#define AIO_DONE        3   /**< \brief Finished (rv and err are valid) */
+#define AIO_CALLBACK    4   /**< \brief Finished, callback still running */
+/** @} */
+
+/** \brief  The most worker threads aio_init() will create. */
+#define AIO_MAX_WORKERS     8
+
+/** \brief  Number of buckets in the latency histogram.
+
+    Bucket 0 counts requests that took less than 128 microseconds from
+    submission to completion, and bucket n (for n > 0) those that took from
+    2^(n + 6) up to 2^(n + 7) microseconds. The last bucket also counts
+    anything slower than that.
+*/
+#define AIO_LAT_BUCKETS     16
+
+/** \brief  An asynchronous read request.
+
+    Fill in the first group of fields and pass the request to aio_submit(). The
+    request must stay allocated, and the buffer untouched, until its state is
+    AIO_DONE.
+
+    The state field must be AIO_IDLE (zeroing the whole request is enough)
+    before the request is first submitted; aio_submit() reads it to catch
+    requests that are already queued. After that, the engine keeps it up to
+    date.
+
+    \headerfile kos/aio.h
+*/
+typedef struct aio_req {
+    file_t  fd;         /**< \brief File to read from */
+    void    *buf;       /**< \brief Buffer to read into */
+    size_t  cnt;        /**< \brief Number of bytes to read */
+    off_t   offset;     /**< \brief Offset in the file to read from */
+
+    /** \brief  Called from a worker thread when the request finishes (may be
+                NULL), with the state set to AIO_CALLBACK. The request only
+                becomes AIO_DONE once this returns. It may be resubmitted
+                from here, in which case it's queued again once this
+                returns instead. */
+    void (*callback)(struct aio_req *req);
+    void    *data;      /**< \brief For the caller's use */
+
+    volatile int state; /**< \brief One of the \ref aio_states */
+    ssize_t rv;         /**< \brief What fs_pread() returned */
+    int     err;        /**< \brief errno, if rv is -1 */
+
+    /** \cond */
+    TAILQ_ENTRY(aio_req) q;
+    uint64  submitted;
+    int     requeue;
+    /** \endcond */
+} aio_req_t;
+
+/** \brief  Asynchronous I/O statistics.
+    \headerfile kos/aio.h
+*/
+typedef struct aio_stats {
+    uint32  workers;        /**< \brief Number of worker threads */
+    uint32  queued;         /**< \brief Requests waiting for a worker */
+    uint32  queued_max;     /**< \brief Most requests ever waiting */
+    uint32  in_flight;      /**< \brief Requests being serviced */
+    uint32  in_flight_max;  /**< \brief Most requests ever being serviced */
+    uint32  native;         /**< \brief Requests in a native (DMA) transfer */
+    uint32  submitted;      /**< \brief Total requests submitted */
+    uint32  completed;      /**< \brief Total requests finished */
+    uint32  failed;         /**< \brief Requests that finished with an error */
+    uint32  canceled;       /**< \brief Requests canceled before starting */
+    uint32  native_total;   /**< \brief Requests done by native transfers */
+    uint64  bytes;          /**< \brief Total bytes read */
+    uint32  latency[AIO_LAT_BUCKETS];   /**< \brief Latency histogram */
+} aio_stats_t;
+
+/** \brief  Start the asynchronous I/O engine.
+
+    \param  workers         The number of worker threads to start (1 to
+                            AIO_MAX_WORKERS). This is the most requests that
+                            can be in flight at once.
+    \retval 0               On success.
+    \retval -1              On failure, setting errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - workers is out of range \n
+    \em     EBUSY - the engine is already running \n
+    \em     ENOMEM - a worker thread could not be created
+*/
+int aio_init(int workers);
+
+/** \brief  Stop the asynchronous I/O engine.
+
+    Requests that haven't started yet are finished as canceled, as are any
+    resubmitted from a callback from here on. This waits for the requests
+    that are in flight to finish.
+*/
+void aio_shutdown(void);
+
+/** \brief  Submit a batch of read requests.
+
+    All of the requests are checked before any of them are queued, so either
+    all of them are submitted or none are. They are serviced in order, though
+    with more than one worker they may finish in any order.
+
+    \param  reqs            The requests to submit.
+    \param  n               The number of requests.
+    \return                 n on success, -1 on failure.
+
+    \par    Error Conditions:
+    \em     ENXIO - the engine isn't running \n
+    \em     EINVAL - a request is bad or already submitted
+*/
+int aio_submit(aio_req_t *reqs[], int n);
+
+/** \brief  Count how many requests in a batch have finished.
+
+    \param  reqs            The requests to check.
+    \param  n               The number of requests.
+    \return                 The number of requests in the AIO_DONE state.
+*/
+int aio_poll(aio_req_t *reqs[], int n);
+
+/** \brief  Wait for requests in a batch to finish.
+
+    \param  reqs            The requests to wait on.
+    \param  n               The number of requests.
+    \param  min             The number that must be finished before returning.
+    \param  timeout         The most milliseconds to wait, or 0 for no limit.
+    \return                 The number of finished requests (at least min), or
+                            -1 on timeout.
+
+    \par    Error Conditions:
+    \em     ETIMEDOUT - fewer than min requests finished in time
+*/
+int aio_wait(aio_req_t *reqs[], int n, int min, int timeout);
+
+/** \brief  Cancel a request that hasn't started yet.
+
+    \param  req             The request to cancel.
+    \retval 0               The request was canceled. It is now AIO_DONE, with
+                            rv set to -1 and err to ECANCELED.
+    \retval -1              The request wasn't waiting for a worker.
+
+    \par    Error Conditions:
+    \em     EINPROGRESS - the request is already being serviced \n
+    \em     EINVAL - the request isn't submitted
+*/
+int aio_cancel(aio_req_t *req);
+
+/** \brief  Read the asynchronous I/O statistics.
+    \param  st              Where to store the statistics.
+*/
+void aio_get_stats(aio_stats_t *st);
+
+/** \brief  Reset the totals, high-water marks and latency histogram. */
+void aio_reset_stats(void);
+
+__END_DECLS
+
+#endif  /* __KOS_AIO_H */
@@ -121,6 +121,33 @@ typedef struct kos_blockdev {
         \retval -1          On failure. Set errno as appropriate.
     */
     int (*flush)(struct kos_blockdev *d);
+
+    /** \brief  Start reading a number of blocks without waiting (optional).
+
+        This function should start reading the specified blocks into the given
+        buffer and return without waiting for the data to arrive. Devices that
+        cannot do this should leave this NULL. Only one such read may be
+        outstanding on a device at a time.
+
+        \param  d           The device to read from.
+        \param  block       The first block to read.
+        \param  count       The number of blocks to read.
+        \param  buf         The buffer to read into. This may have alignment
+                            requirements imposed by the device.
+        \retval 0           On success (the read has been started).
+        \retval -1          On failure. Set errno as appropriate.
+    */
+    int (*read_blocks_async)(struct kos_blockdev *d, uint64_t block,
+                             size_t count, void *buf);
+
+    /** \brief  Check on a read started with read_blocks_async.
+
+        \param  d           The device to check.
+        \retval 1           The read is still in progress.
+        \retval 0           The read has finished successfully.
+        \retval -1          The read failed. Set errno as appropriate.
+    */
+    int (*async_status)(struct kos_blockdev *d);
 } kos_blockdev_t;
 
 __END_DECLS
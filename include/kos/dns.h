@@ -0,0 +1,147 @@
+/* KallistiOS ##version##
+
+   kos/dns.h
+
+*/
+
+/** \file   kos/dns.h
+    \brief  DNS resolver control and asynchronous lookups.
+
+    getaddrinfo() and gethostbyname() look names up through a small caching
+    resolver. Answers are kept for as long as their TTL allows, and names that
+    don't exist are remembered for as long as the server says (or 30 seconds,
+    if it doesn't say), so looking the same name up again doesn't go back to
+    the server. Timeouts and server failures aren't cached. If a name is
+    already being looked up, another lookup for it waits for that answer
+    rather than sending a query of its own.
+
+    This file lets you size and flush the cache, point the resolver at a
+    particular server (such as a stub server on the loopback interface, for
+    testing), and start a lookup without blocking.
+*/
+
+#ifndef __KOS_DNS_H
+#define __KOS_DNS_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+/** \defgroup dns_states            Asynchronous request states
+
+    @{
+*/
+#define DNS_IDLE        0   /**< \brief Not started */
+#define DNS_PENDING     1   /**< \brief Being looked up */
+#define DNS_DONE        2   /**< \brief Finished (rv, err and res are valid) */
+/** @} */
+
+/** \brief  An asynchronous lookup.
+
+    Fill in the first group of fields and pass the request to
+    dns_resolve_async(). The request, and the strings and hints it points to,
+    must stay around until its state is DNS_DONE, which isn't set until the
+    callback (if any) has returned.
+
+    \headerfile kos/dns.h
+*/
+typedef struct dns_req {
+    const char *node;               /**< \brief As for getaddrinfo() */
+    const char *service;            /**< \brief As for getaddrinfo() */
+    const struct addrinfo *hints;   /**< \brief As for getaddrinfo() */
+
+    /** \brief  Called when the lookup finishes (may be NULL). This runs on a
+                resolver thread, or from dns_resolve_async() itself if the
+                answer was cached. rv, err and res are filled in, but state
+                is still DNS_PENDING. */
+    void (*callback)(struct dns_req *req);
+    void *data;                     /**< \brief For the caller's use */
+
+    volatile int state;             /**< \brief One of the \ref dns_states */
+    int rv;                         /**< \brief What getaddrinfo() returned */
+    int err;                        /**< \brief errno, if rv is EAI_SYSTEM */
+    struct addrinfo *res;           /**< \brief The result, to be freed with
+                                                freeaddrinfo() */
+} dns_req_t;
+
+/** \brief  Resolver statistics.
+    \headerfile kos/dns.h
+*/
+typedef struct dns_stats {
+    uint32 hits;            /**< \brief Lookups answered from the cache */
+    uint32 neg_hits;        /**< \brief Lookups answered from the cache with
+                                        "no such name" */
+    uint32 misses;          /**< \brief Lookups that had to ask the server */
+    uint32 coalesced;       /**< \brief Lookups that waited for another
+                                        lookup of the same name */
+    uint32 queries;         /**< \brief Queries sent, counting retries */
+    uint32 timeouts;        /**< \brief Lookups the server never answered */
+    uint32 evicted;         /**< \brief Entries thrown out to make room */
+    uint32 entries;         /**< \brief Entries in the cache now */
+} dns_stats_t;
+
+/** \brief  Start looking up a name without waiting for it.
+
+    If the answer is already cached, the request is finished before this
+    returns. Otherwise, it is looked up on a thread of its own.
+
+    \param  req             The request to start.
+    \retval 0               On success.
+    \retval -1              On failure, setting errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - the request is already pending \n
+    \em     ENOMEM - a thread couldn't be created for the lookup
+*/
+int dns_resolve_async(dns_req_t *req);
+
+/** \brief  Wait for an asynchronous lookup to finish.
+
+    \param  req             The request to wait on.
+    \param  timeout         The most milliseconds to wait, or 0 for no limit.
+    \retval 0               The request is finished.
+    \retval -1              On timeout (errno is ETIMEDOUT).
+*/
+int dns_wait(dns_req_t *req, int timeout);
+
+/** \brief  Set how many names the cache may hold.
+
+    Each name (per address family) takes one entry. Shrinking the cache throws
+    out the least recently used entries. A size of 0 turns caching off, but
+    concurrent lookups of the same name still share one query.
+
+    \param  entries         The number of entries (32 by default).
+    \retval 0               On success.
+    \retval -1              If entries is negative (errno is EINVAL).
+*/
+int dns_cache_set_size(int entries);
+
+/** \brief  Forget everything in the cache. */
+void dns_cache_flush(void);
+
+/** \brief  Set the DNS server to use.
+
+    By default, the first DNS server of the default network interface (usually
+    from DHCP) is used, on port 53. Changing the server flushes the cache.
+
+    \param  server          The server's address and port, or NULL to go back
+                            to the default.
+    \retval 0               On success.
+    \retval -1              If the address isn't IPv4 (errno is EAFNOSUPPORT).
+*/
+int dns_set_server(const struct sockaddr_in *server);
+
+/** \brief  Read the resolver statistics.
+    \param  st              Where to store the statistics.
+*/
+void dns_get_stats(dns_stats_t *st);
+
+/** \brief  Reset the resolver statistics. */
+void dns_reset_stats(void);
+
+__END_DECLS
+
+#endif  /* __KOS_DNS_H */
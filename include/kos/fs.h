@@ -20,6 +20,7 @@ __BEGIN_DECLS
 #include <sys/stat.h>
 
 #include <kos/nmmgr.h>
+#include <kos/iovec.h>
 
 /** \file   kos/fs.h
     \brief  Virtual filesystem support.
@@ -88,6 +89,21 @@ typedef int file_t;
 /** \brief  Invalid file handle constant (for open failure, etc) */
 #define FILEHND_INVALID ((file_t)-1)
 
+/** \brief  Sink for a VFS handler's splice function.
+
+    A handler's splice function calls this with each piece of the file, in
+    order, straight from wherever the handler keeps it (the romdisk image, a
+    ramdisk file, etc) where it can. Handlers that would have to hold a lock
+    to keep the data in place pass a copy instead.
+
+    \param  ctx             The context passed to the splice function.
+    \param  buf             The next piece of the file.
+    \param  cnt             The size of the piece, in bytes.
+    \return                 The number of bytes consumed, or -1 on error. If
+                            this is less than cnt, the splice stops.
+*/
+typedef ssize_t (*fs_splice_sink_t)(void *ctx, const void *buf, size_t cnt);
+
 /** \brief  VFS handler interface.
 
     All VFS handlers must implement this interface.
@@ -193,21 +209,67 @@ typedef struct vfs_handler {
 
     /** \brief Rewind a directory stream to the start */
     int (*rewinddir)(void *hnd);
+
+    /* Positional and vectored I/O. These are all optional; if a handler leaves
+       them NULL, the VFS emulates them with read/write and seek. Handlers that
+       implement pread/pwrite must not touch the file pointer, so that several
+       threads can read one file at the same time. */
+
+    /** \brief Read from a file at the given offset, without moving the file
+               pointer */
+    ssize_t (*pread)(void *hnd, void *buffer, size_t cnt, off_t offset);
+
+    /** \brief Write to a file at the given offset, without moving the file
+               pointer */
+    ssize_t (*pwrite)(void *hnd, const void *buffer, size_t cnt,
+                      off_t offset);
+
+    /** \brief Read from a file into a scatter array */
+    ssize_t (*readv)(void *hnd, const iovec_t *iov, int iovcnt);
+
+    /** \brief Write a gather array to a file */
+    ssize_t (*writev)(void *hnd, const iovec_t *iov, int iovcnt);
+
+    /** \brief Pass up to cnt bytes of the file, starting at offset, to the
+               sink, without copying them where the handler can avoid it.
+               Returns the number of bytes the sink consumed, or -1 if
+               nothing could be passed. The sink may block or take other
+               filesystems' locks, so it must not be called with the
+               handler's own locks held. Optional; used by fs_sendfile(). */
+    ssize_t (*splice)(void *hnd, off_t offset, size_t cnt,
+                      fs_splice_sink_t sink, void *ctx);
+
+    /** \brief Like complete, but sleep until the I/O is done rather than
+               failing with EAGAIN. Optional; used by fs_complete_wait(). */
+    int (*complete_wait)(void *hnd, ssize_t *rv);
 } vfs_handler_t;
 
-/** \brief  The number of distinct file descriptors that can be in use at a
-            time.
+/** \brief  The default limit on the number of file descriptors that can be in
+            use at a time. This can be changed with fs_fd_set_max().
 */
 #define FD_SETSIZE  1024
 
-/** \cond */
-/* This is the private struct that will be used as raw file handles
-   underlying descriptors. */
-struct fs_hnd;
+/** \brief  The most file descriptors that can ever be in use at a time. */
+#define FS_FD_LIMIT     8192
 
-/* The kernel-wide file descriptor table. These will reference to open files. */
-extern struct fs_hnd *fd_table[FD_SETSIZE];
-/** \endcond */
+/** \brief  File descriptors are allocated in blocks of this many. */
+#define FS_FD_CHUNK     64
+
+/** \brief  File descriptor table statistics.
+
+    This structure is filled in by fs_fd_get_stats().
+
+    \headerfile kos/fs.h
+*/
+typedef struct fs_fd_stats {
+    uint32  max;            /**< \brief Current limit on descriptors */
+    uint32  open;           /**< \brief Descriptors currently in use */
+    uint32  open_peak;      /**< \brief High-water mark of open */
+    uint32  chunks;         /**< \brief Blocks of descriptors allocated */
+    uint32  opens;          /**< \brief Total descriptors handed out */
+    uint32  closes;         /**< \brief Total descriptors closed */
+    uint32  failures;       /**< \brief Allocations that failed (EMFILE or ENOMEM) */
+} fs_fd_stats_t;
 
 /* Open modes */
 #include <sys/fcntl.h>
@@ -287,6 +349,119 @@ ssize_t fs_read(file_t hnd, void *buffer, size_t cnt);
 */
 ssize_t fs_write(file_t hnd, const void *buffer, size_t cnt);
 
+/** \brief  The largest number of elements that may be passed in an iovec_t
+            array to fs_readv() or fs_writev(). */
+#define FS_IOV_MAX  1024
+
+/** \brief  Read from an opened file at a given offset.
+
+    This function reads from the file at the specified offset, without using or
+    modifying the file pointer. Several threads may read from the same file
+    descriptor this way without locking around a seek and a read.
+
+    If the underlying filesystem does not provide this operation, it is emulated
+    with a seek and a read, restoring the file pointer afterwards. In that case
+    the call is only atomic with respect to other fs_pread()/fs_pwrite() calls.
+
+    \param  hnd             The file descriptor to read from.
+    \param  buffer          The buffer to read into.
+    \param  cnt             The number of bytes requested.
+    \param  offset          The offset in the file to read from.
+    \return                 The number of bytes read, or -1 on error.
+
+    \par    Error Conditions:
+    \em     EBADF - hnd is not a valid file descriptor \n
+    \em     EINVAL - offset is negative \n
+    \em     ESPIPE - hnd is not seekable
+*/
+ssize_t fs_pread(file_t hnd, void *buffer, size_t cnt, off_t offset);
+
+/** \brief  Write to an opened file at a given offset.
+
+    This function writes to the file at the specified offset, without using or
+    modifying the file pointer. See fs_pread() for notes on the emulation used
+    when the filesystem does not implement this itself.
+
+    \param  hnd             The file descriptor to write into.
+    \param  buffer          The data to write into the file.
+    \param  cnt             The size of the buffer, in bytes.
+    \param  offset          The offset in the file to write at.
+    \return                 The number of bytes written, or -1 on error.
+
+    \par    Error Conditions:
+    \em     EBADF - hnd is not a valid file descriptor \n
+    \em     EINVAL - offset is negative \n
+    \em     ESPIPE - hnd is not seekable
+*/
+ssize_t fs_pwrite(file_t hnd, const void *buffer, size_t cnt, off_t offset);
+
+/** \brief  Read from an opened file into several buffers.
+
+    This function fills each of the buffers in iov in turn, reading from the
+    current file pointer, as if by one fs_read() into a single buffer. A short
+    read stops at the end of the data, leaving the later buffers untouched.
+
+    \param  hnd             The file descriptor to read from.
+    \param  iov             The array of buffers to read into.
+    \param  iovcnt          The number of elements in iov (at most
+                            FS_IOV_MAX).
+    \return                 The total number of bytes read, or -1 on error.
+
+    \par    Error Conditions:
+    \em     EBADF - hnd is not a valid file descriptor \n
+    \em     EINVAL - iovcnt is out of range, or the lengths overflow ssize_t
+*/
+ssize_t fs_readv(file_t hnd, const iovec_t *iov, int iovcnt);
+
+/** \brief  Write several buffers to an opened file.
+
+    This function writes each of the buffers in iov in turn at the current file
+    pointer, as if by one fs_write() of a single buffer.
+
+    \param  hnd             The file descriptor to write into.
+    \param  iov             The array of buffers to write.
+    \param  iovcnt          The number of elements in iov (at most
+                            FS_IOV_MAX).
+    \return                 The total number of bytes written, or -1 on error.
+
+    \par    Error Conditions:
+    \em     EBADF - hnd is not a valid file descriptor \n
+    \em     EINVAL - iovcnt is out of range, or the lengths overflow ssize_t
+*/
+ssize_t fs_writev(file_t hnd, const iovec_t *iov, int iovcnt);
+
+/** \brief  Copy data from one file to another (usually a socket).
+
+    This function writes up to count bytes from in_fd to out_fd. If the
+    filesystem of in_fd supports it, the data is written straight from where the
+    filesystem keeps it (the romdisk image, a ramdisk file, or the ISO9660 or
+    ext2 block caches), so the only copy made is the one made by out_fd itself
+    (e.g. into a TCP socket's send buffer). Otherwise, the data is copied
+    through a temporary buffer FS_SENDFILE_CHUNK bytes at a time.
+
+    \param  out_fd          The file descriptor to write to.
+    \param  in_fd           The file descriptor to read from.
+    \param  offset          If not NULL, where in in_fd to start reading from.
+                            It is updated to just past the last byte sent, and
+                            in_fd's file pointer is left alone. If NULL, reading
+                            starts at in_fd's file pointer, which is advanced.
+    \param  count           The most bytes to send.
+    \return                 The number of bytes sent (which may be less than
+                            count at the end of the file, or if out_fd took
+                            less than it was given), or -1 if nothing was sent
+                            because of an error.
+
+    \par    Error Conditions:
+    \em     EBADF - out_fd or in_fd isn't a valid file descriptor \n
+    \em     EINVAL - the offset is negative \n
+    \em     ENOMEM - the temporary buffer could not be allocated
+*/
+ssize_t fs_sendfile(file_t out_fd, file_t in_fd, off_t *offset, size_t count);
+
+/** \brief  Size of the temporary buffer used by fs_sendfile() when the input
+            file can't be spliced. */
+#define FS_SENDFILE_CHUNK   16384
+
 /** \brief  Seek to a new position within a file.
 
     This function moves the file pointer to the specified position within the
@@ -433,6 +608,14 @@ void *fs_mmap(file_t hnd);
     This function is used with asynchronous I/O to perform an I/O completion on
     the given file descriptor.
 
+    On a file opened with O_ASYNC, fs_pread() may start a transfer straight
+    into the caller's buffer and fail with errno set to EINPROGRESS. The buffer
+    must then be left alone until this function returns 0, at which point rv
+    holds what fs_pread() would have returned. Until then, it returns -1 with
+    errno set to EAGAIN. Only one such transfer may be outstanding per file,
+    and it must be completed from the thread that started it (others get
+    EBUSY). See kos/aio.h for a higher level interface to this.
+
     \param  fd              The descriptor to complete I/O on.
     \param  rv              A buffer to store the size of the I/O in.
     \return                 0 on success, -1 on failure.
@@ -444,6 +627,19 @@ void *fs_mmap(file_t hnd);
 */
 int fs_complete(file_t fd, ssize_t *rv);
 
+/** \brief  Wait for an I/O completion on the given file descriptor.
+
+    This is fs_complete(), except that it sleeps until the transfer is done
+    instead of returning EAGAIN. Filesystems that can't sleep on their
+    transfers are polled every millisecond instead.
+
+    \param  fd              The descriptor to complete I/O on.
+    \param  rv              A buffer to store the size of the I/O in.
+    \return                 0 on success, -1 on failure (errno is EBUSY if
+                            the transfer was started by another thread).
+*/
+int fs_complete_wait(file_t fd, ssize_t *rv);
+
 /** \brief  Create a directory.
 
     This function creates the specified directory, if possible.
@@ -671,6 +867,45 @@ ssize_t fs_load(const char *src, void **out_ptr);
 */
 ssize_t fs_path_append(char *dst, const char *src, size_t len);
 
+/** \brief  Change the limit on the number of open file descriptors.
+
+    New descriptors are always the lowest numbered free one, and are below this
+    limit. The table grows as needed up to the limit, FS_FD_CHUNK descriptors at
+    a time. Note that fd_set (and so select()) can only handle descriptors
+    below FD_SETSIZE; use poll() if you raise the limit past that.
+
+    \param  max             The new limit (1 to FS_FD_LIMIT).
+    \retval 0               On success.
+    \retval -1              On failure, setting errno as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - max is out of range \n
+    \em     EBUSY - a descriptor at or above max is open
+*/
+int fs_fd_set_max(int max);
+
+/** \brief  Retrieve the limit on the number of open file descriptors.
+    \return                 The current limit.
+*/
+int fs_fd_get_max(void);
+
+/** \brief  Retrieve file descriptor table statistics.
+    \param  stats           Where to store the statistics.
+*/
+void fs_fd_get_stats(fs_fd_stats_t *stats);
+
+/** \brief  Print a list of all open file descriptors.
+
+    Each open descriptor is listed with the filesystem it belongs to, its
+    handler-internal handle, the number of descriptors that share the handle
+    (through fs_dup() and the like) and the number of times the descriptor
+    number has been handed out.
+
+    \param  pf              The printf-like function to print with.
+    \retval 0               On success.
+*/
+int fs_fd_pslist(int (*pf)(const char *fmt, ...));
+
 /** \brief  Initialize the virtual filesystem.
 
     This is normally done for you by default when KOS starts. In general, there
@@ -680,6 +915,17 @@ ssize_t fs_path_append(char *dst, const char *src, size_t len);
 */
 int fs_init();
 
+/** \brief  Close every open file descriptor.
+
+    This is done for you by the normal shutdown procedure of KOS, before the
+    filesystems are shut down, so that each handler gets to close its own
+    files. There should not really be any reason for you to call this
+    function yourself.
+
+    \retval 0               On success.
+*/
+int fs_fdtbl_destroy();
+
 /** \brief  Shut down the virtual filesystem.
 
     This is done for you by the normal shutdown procedure of KOS. There should
@@ -14,6 +14,12 @@
     useful, for (for instance) cacheing files read from the CD-ROM or for making
     temporary files.
 
+    Files are stored in fixed-size extents, so appending to a file never copies
+    what's already there, and holes left by seeking past the end of a file take
+    no memory. Memory-mapping a file gathers it into one contiguous block first.
+    File data is accounted per mount, and the memory the /ram mount uses for
+    it can be limited with fs_ramdisk_set_quota().
+
     You only have one ramdisk available, and its mounted on /ram.
 
     \author Dan Potter
@@ -58,6 +64,30 @@ int fs_ramdisk_attach(const char * fn, void * obj, size_t size);
 */
 int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size);
 
+/** \brief  Limit the memory used by the ramdisk.
+
+    Once the file data in the ramdisk takes up this many bytes, writes that
+    need more memory fail with ENOSPC (or write as much as fits). Lowering the
+    quota below the current usage doesn't free anything; it just stops further
+    growth until enough is deleted. Blocks attached with fs_ramdisk_attach()
+    count towards the quota.
+
+    \param  bytes           The most bytes of file data to allow, or 0 for no
+                            limit (the default).
+    \retval 0               On success
+*/
+int fs_ramdisk_set_quota(size_t bytes);
+
+/** \brief  Retrieve the ramdisk's memory quota.
+    \return                 The quota in bytes, or 0 if there is no limit.
+*/
+size_t fs_ramdisk_get_quota(void);
+
+/** \brief  Retrieve the memory used by file data in the ramdisk.
+    \return                 The number of bytes allocated to files.
+*/
+size_t fs_ramdisk_get_usage(void);
+
 /** \cond */
 int fs_ramdisk_init();
 int fs_ramdisk_shutdown();
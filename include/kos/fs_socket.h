@@ -334,6 +334,41 @@ typedef struct fs_socket_proto {
                             currently true in the socket. 0 if none are true.
     */
     short (*poll)(net_socket_t *s, short events);
+
+    /** \brief  Receive multiple messages.
+
+        This function should implement the ::recvmmsg() system call for the
+        protocol. It may be NULL, in which case fs_socket calls recvfrom for
+        each message instead.
+
+        \param  s           The socket to receive on.
+        \param  msgvec      The messages to fill in.
+        \param  vlen        The number of elements in msgvec.
+        \param  flags       Flags to the function.
+        \param  timeout     Milliseconds to wait for the first message, or 0
+                            to wait forever.
+        \retval -1          On error (set errno appropriately).
+        \retval n           The number of messages received.
+    */
+    int (*recvmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags, int timeout);
+
+    /** \brief  Send multiple messages.
+
+        This function should implement the ::sendmmsg() system call for the
+        protocol. It may be NULL, in which case fs_socket calls sendto for
+        each message instead.
+
+        \param  s           The socket to send on.
+        \param  msgvec      The messages to send.
+        \param  vlen        The number of elements in msgvec.
+        \param  flags       Flags to the function.
+        \retval -1          On error, if no message was sent (set errno
+                            appropriately).
+        \retval n           The number of messages sent.
+    */
+    int (*sendmmsg)(net_socket_t *s, struct mmsghdr *msgvec, unsigned int vlen,
+                    int flags);
 } fs_socket_proto_t;
 
 /** \brief  Initializer for the entry field in the fs_socket_proto_t struct. */
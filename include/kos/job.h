@@ -0,0 +1,230 @@
+/* KallistiOS ##version##
+
+   include/kos/job.h
+
+*/
+
+/** \file   kos/job.h
+    \brief  Kernel job scheduler.
+
+    This file provides a pool of worker threads that run short functions
+    ("jobs") handed to them, so that code with work to get off its own
+    thread doesn't have to start a thread and build its own queue for it.
+
+    A job can be made to wait for other jobs to finish before it starts
+    (job_depend()), and job_then() adds a continuation that runs once a job
+    is done. job_parallel_for() splits a loop up between the pool and the
+    calling thread.
+
+    Jobs created with \ref JOB_BACKGROUND go to a separate lane, run by one
+    thread at low priority, so they only use time that nothing else wants
+    and never hold up the pool.
+
+    Jobs may block. When one of the pool's workers sleeps in a job (on a
+    mutex, semaphore or anything else built on genwait), one of a few spare
+    workers is let in to keep the pool busy, and a worker that waits for
+    another job with job_wait() runs queued jobs itself in the meantime.
+    All the same, jobs that spend most of their time blocked are better off
+    with a thread of their own.
+
+    The Dreamcast has one CPU, so the pool is about overlapping work with
+    waiting and keeping the number of threads down rather than running
+    things in parallel.
+
+    utils/jobbench builds the queueing, dependency and spare worker code for
+    the host, to check it and measure its overhead.
+*/
+
+#ifndef __KOS_JOB_H
+#define __KOS_JOB_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+#include <kos/thread.h>
+
+/** \brief  An opaque job. */
+typedef struct job job_t;
+
+/** \brief  Job function type.
+    \param  data            The data passed when the job was created.
+*/
+typedef void (*job_func_t)(void *data);
+
+/** \brief  Run the job on the low-priority background lane. */
+#define JOB_BACKGROUND      0x00000001
+
+/** \brief  Pool size used if the pool is started on demand. */
+#define JOB_WORKERS_DEFAULT 2
+
+/** \brief  Largest pool. */
+#define JOB_WORKERS_MAX     8
+
+/** \brief  Extra workers that stand in for ones blocked in a job. */
+#define JOB_SPARE_WORKERS   2
+
+/** \brief  Priority of the background lane's thread. */
+#define JOB_BACKGROUND_PRIO (PRIO_DEFAULT + 5)
+
+/** \brief  Job scheduler statistics.
+    \headerfile kos/job.h
+*/
+typedef struct job_stats {
+    uint32  submitted;      /**< \brief Jobs submitted */
+    uint32  completed;      /**< \brief Jobs finished */
+    uint32  queued;         /**< \brief Pool jobs waiting to run now */
+    uint32  queued_max;     /**< \brief Most pool jobs waiting at once */
+    uint32  bg_queued;      /**< \brief Background jobs waiting to run now */
+    uint32  bg_queued_max;  /**< \brief Most background jobs waiting at once */
+    uint32  active;         /**< \brief Workers running jobs (not blocked) */
+    uint32  blocked;        /**< \brief Times a running job blocked */
+    uint32  helped;         /**< \brief Jobs run by workers in job_wait() */
+} job_stats_t;
+
+/** \brief  Start the worker pool.
+
+    This is done with \ref JOB_WORKERS_DEFAULT workers the first time a job
+    is created, if it hasn't been done before. It does nothing if the pool
+    is already running.
+
+    \param  workers         Number of jobs to run at once, from 1 to
+                            \ref JOB_WORKERS_MAX.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL for a bad worker
+                            count, or ENOMEM if the threads couldn't be
+                            created).
+*/
+int job_init(int workers);
+
+/** \brief  Stop the worker pool.
+
+    This waits for the jobs that are running to finish. Jobs still waiting
+    to run are not run.
+*/
+void job_shutdown(void);
+
+/** \brief  Create a job.
+
+    The job doesn't run until it has been submitted with job_submit(), which
+    must be done for every job created, and it must be released with
+    job_release() when the caller is done with it.
+
+    \param  func            The function to run.
+    \param  data            Passed to func.
+    \param  flags           0, or \ref JOB_BACKGROUND.
+    \return                 The new job, or NULL on error (errno is EINVAL
+                            if func is NULL, or ENOMEM).
+*/
+job_t *job_create(job_func_t func, void *data, int flags);
+
+/** \brief  Make a job wait for another one.
+
+    \param  job             The job to hold back, which must not have been
+                            submitted yet.
+    \param  on              The job it waits for. If that has already
+                            finished, this does nothing.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if job has been
+                            submitted, or ENOMEM).
+*/
+int job_depend(job_t *job, job_t *on);
+
+/** \brief  Submit a job.
+
+    The job runs as soon as a worker is free and all the jobs it depends on
+    have finished. This may be called from an interrupt.
+
+    \param  job             The job to submit.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if the job has already
+                            been submitted).
+*/
+int job_submit(job_t *job);
+
+/** \brief  Create and submit a job.
+    \param  func            The function to run.
+    \param  data            Passed to func.
+    \param  flags           0, or \ref JOB_BACKGROUND.
+    \return                 The job, which must be released with
+                            job_release(), or NULL on error.
+*/
+job_t *job_run(job_func_t func, void *data, int flags);
+
+/** \brief  Add a continuation to a job.
+
+    This creates and submits a job that runs once job has finished.
+
+    \param  job             The job to follow.
+    \param  func            The function to run.
+    \param  data            Passed to func.
+    \param  flags           0, or \ref JOB_BACKGROUND.
+    \return                 The new job, which must be released with
+                            job_release(), or NULL on error.
+*/
+job_t *job_then(job_t *job, job_func_t func, void *data, int flags);
+
+/** \brief  Check if a job has finished.
+    \param  job             The job to check.
+    \return                 Non-zero if it has.
+*/
+int job_done(job_t *job);
+
+/** \brief  Wait for a job to finish.
+
+    When called from a job on the pool, this runs other queued jobs while it
+    waits, rather than taking a worker out of the pool.
+
+    \param  job             The job to wait for.
+    \param  timeout         Maximum time to sleep, in milliseconds, or 0 to
+                            wait forever.
+    \retval 0               Once the job has finished.
+    \retval -1              On error (errno is ETIMEDOUT on timeout, EINVAL
+                            if the job was never submitted, or EPERM if
+                            called from an interrupt).
+*/
+int job_wait(job_t *job, int timeout);
+
+/** \brief  Release a job.
+
+    The job is freed once it has finished and been released; it doesn't
+    have to have finished yet.
+
+    \param  job             The job to release.
+*/
+void job_release(job_t *job);
+
+/** \brief  Run a loop over a range on the pool.
+
+    The range is split into chunks of grain iterations, which are handed out
+    to the calling thread and as many of the workers as are free, and func
+    is called for each. This returns once every chunk has been done.
+
+    \param  start           The first index.
+    \param  end             One past the last index.
+    \param  grain           Iterations per chunk, or 0 to pick a size that
+                            gives each worker a few chunks.
+    \param  func            Called for each chunk with its first and one past
+                            its last index.
+    \param  data            Passed to func.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL for a bad argument).
+*/
+int job_parallel_for(int start, int end, int grain,
+                     void (*func)(int first, int last, void *data),
+                     void *data);
+
+/** \brief  Retrieve job scheduler statistics.
+    \param  stats           Where to store the statistics.
+*/
+void job_get_stats(job_stats_t *stats);
+
+/** \cond */
+/* Called by genwait_wait() with interrupts disabled, when a thread running
+   a pool job goes to sleep and wakes up again. */
+void job_worker_blocked(int blocked);
+/** \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_JOB_H */
@@ -0,0 +1,150 @@
+/* KallistiOS ##version##
+
+   include/kos/ktimer.h
+
+*/
+
+/** \file   kos/ktimer.h
+    \brief  Kernel timers.
+
+    This file provides one-shot and periodic timers that call a function when
+    they expire. Pending timers are kept in deadline order, and a single
+    kernel thread sleeps until the earliest one is due, so an idle system
+    with no timers due doesn't wake up to poll for them. The scheduler
+    shortens its next tick when a timed wait is due before it, so timers
+    fire within a millisecond or so of their deadline, rather than on the
+    next 1000 / HZ ms tick.
+
+    Timers can be armed and cancelled from interrupt handlers. The callbacks
+    always run on the timer thread, one at a time, so they may block, but a
+    slow callback delays every other timer behind it.
+
+    The timer structure belongs to the caller, and must stay around until it
+    has been cancelled (or a one-shot timer has fired).
+*/
+
+#ifndef __KOS_KTIMER_H
+#define __KOS_KTIMER_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <sys/queue.h>
+#include <arch/types.h>
+
+struct ktimer;
+
+/** \brief  Timer callback type.
+
+    \param  timer           The timer that expired. A periodic timer has
+                            already been re-armed for its next period, and
+                            may be cancelled or re-armed from here.
+    \param  data            The data passed to ktimer_setup().
+*/
+typedef void (*ktimer_cb_t)(struct ktimer *timer, void *data);
+
+/** \brief  A kernel timer.
+
+    Set one up with ktimer_setup(); the fields are private.
+
+    \headerfile kos/ktimer.h
+*/
+typedef struct ktimer {
+    /** \cond */
+    TAILQ_ENTRY(ktimer) q;
+    uint64 deadline;
+    uint32 period;
+    int pending;
+    ktimer_cb_t cb;
+    void *data;
+    /** \endcond */
+} ktimer_t;
+
+/** \brief  Timer statistics.
+
+    Lateness is how long after its deadline a timer's callback was started.
+
+    \headerfile kos/ktimer.h
+*/
+typedef struct ktimer_stats {
+    uint32 fired;           /**< \brief Callbacks run */
+    uint32 late;            /**< \brief Callbacks started 1ms or more late */
+    uint32 skipped;         /**< \brief Periods dropped by periodic timers
+                                        that fell behind */
+    uint64 lateness_total;  /**< \brief Total lateness, in microseconds */
+    uint32 lateness_max;    /**< \brief Worst lateness, in microseconds */
+    uint32 pending;         /**< \brief Timers currently armed */
+} ktimer_stats_t;
+
+/** \brief  Set up a timer.
+
+    This must be done before the timer is first armed. It doesn't arm it.
+
+    \param  timer           The timer to set up.
+    \param  cb              The function to call when it expires.
+    \param  data            Passed to cb.
+*/
+void ktimer_setup(ktimer_t *timer, ktimer_cb_t cb, void *data);
+
+/** \brief  Arm a timer.
+
+    The timer will expire ms milliseconds from now and, if period isn't 0,
+    every period milliseconds after that. Periods are counted from the
+    deadlines, not from when the callbacks ran, so a periodic timer doesn't
+    drift; if one falls more than a whole period behind, the missed periods
+    are skipped rather than run back to back. Arming a timer that is already
+    pending moves it.
+
+    This may be called from an interrupt.
+
+    \param  timer           The timer to arm.
+    \param  ms              Milliseconds until it first expires.
+    \param  period          Milliseconds between expiries after that, or 0
+                            for a one-shot timer.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if the timer was never
+                            set up).
+*/
+int ktimer_arm(ktimer_t *timer, uint32 ms, uint32 period);
+
+/** \brief  Cancel a timer.
+
+    Once this returns from a thread, the callback isn't running and won't
+    run again until the timer is re-armed: if the callback is running on the
+    timer thread, this waits for it to finish. It can't wait when called
+    from an interrupt or from a timer callback, so there it only stops the
+    timer from being run again.
+
+    \param  timer           The timer to cancel.
+    \retval 1               If the timer was pending.
+    \retval 0               If it wasn't.
+*/
+int ktimer_cancel(ktimer_t *timer);
+
+/** \brief  Check if a timer is armed.
+    \param  timer           The timer to check.
+    \return                 Non-zero if it will expire.
+*/
+int ktimer_pending(ktimer_t *timer);
+
+/** \brief  Check if the calling thread is the timer thread.
+    \return                 Non-zero when called from a timer callback.
+*/
+int ktimer_is_current(void);
+
+/** \brief  Retrieve timer statistics.
+    \param  stats           Where to store the statistics.
+*/
+void ktimer_get_stats(ktimer_stats_t *stats);
+
+/** \brief  Reset the timer statistics (apart from the pending count). */
+void ktimer_reset_stats(void);
+
+/** \cond */
+int ktimer_init(void);
+void ktimer_shutdown(void);
+/** \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_KTIMER_H */
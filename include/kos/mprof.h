@@ -0,0 +1,156 @@
+/* KallistiOS ##version##
+
+   include/kos/mprof.h
+
+*/
+
+/** \file   kos/mprof.h
+    \brief  Heap allocation profiler.
+
+    This file provides a low-overhead profiler for the main heap. While it is
+    running, every call to malloc(), calloc(), realloc(), memalign() and free()
+    is recorded in a fixed-size ring buffer along with the address of the code
+    that made the call. The profiler also keeps per-call-site counters of live
+    bytes, so you can see who holds memory at any point without having to
+    replay the trace.
+
+    The trace can be written out with mprof_dump() to any file, including one
+    on the host through /pc when using dcload. The utils/mprof tool turns a
+    dump into per-site summaries and a fragmentation timeline.
+
+    All of the memory used by the profiler is allocated up front in
+    mprof_start(), so recording never calls back into malloc.
+*/
+
+#ifndef __KOS_MPROF_H
+#define __KOS_MPROF_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <arch/types.h>
+
+/** \defgroup mprof_ops             Recorded operation types
+
+    These values are stored in the top four bits of the size field of each
+    trace record.
+
+    @{
+*/
+#define MPROF_OP_MALLOC     0   /**< \brief malloc() */
+#define MPROF_OP_CALLOC     1   /**< \brief calloc() */
+#define MPROF_OP_MEMALIGN   2   /**< \brief memalign() */
+#define MPROF_OP_REALLOC    3   /**< \brief New block from realloc() */
+#define MPROF_OP_FREE       4   /**< \brief free(), or old block of realloc() */
+/** @} */
+
+/** \brief  Dump file magic number ("KMPF" in a little-endian file). */
+#define MPROF_MAGIC         0x46504d4b
+
+/** \brief  Dump file format version. */
+#define MPROF_VERSION       2
+
+/** \brief  Trace record.
+
+    All fields in the dump file are stored little-endian.
+
+    \headerfile kos/mprof.h
+*/
+typedef struct mprof_rec {
+    uint32 time;        /**< \brief Microseconds since mprof_start(), low */
+    uint32 time_hi;     /**< \brief Microseconds since mprof_start(), high */
+    uint32 pc;          /**< \brief Return address of the caller */
+    uint32 ptr;         /**< \brief Block address */
+    uint32 size;        /**< \brief Op in bits 28-31, size in bits 0-27 */
+} mprof_rec_t;
+
+/** \brief  Per-call-site counters.
+    \headerfile kos/mprof.h
+*/
+typedef struct mprof_site {
+    uint32 pc;          /**< \brief Return address of the caller (0 = other) */
+    uint32 allocs;      /**< \brief Number of allocations */
+    uint32 frees;       /**< \brief Number of those allocations freed */
+    uint32 total_bytes; /**< \brief Total bytes ever allocated */
+    uint32 live_bytes;  /**< \brief Bytes currently allocated */
+    uint32 peak_bytes;  /**< \brief High-water mark of live_bytes */
+} mprof_site_t;
+
+/** \brief  Dump file header.
+
+    The header is followed by rec_count trace records in time order, then by
+    site_count call site records.
+
+    \headerfile kos/mprof.h
+*/
+typedef struct mprof_hdr {
+    uint32 magic;       /**< \brief MPROF_MAGIC */
+    uint32 version;     /**< \brief MPROF_VERSION */
+    uint32 rec_count;   /**< \brief Number of trace records that follow */
+    uint32 rec_lost;    /**< \brief Records overwritten before the dump, or
+                             made while an earlier dump was written */
+    uint32 site_count;  /**< \brief Number of site records that follow */
+    uint32 untracked;   /**< \brief Blocks the live table had no room for */
+    uint32 heap_base;   /**< \brief Start of the heap */
+    uint32 heap_size;   /**< \brief Heap size (from mallinfo) at dump time */
+} mprof_hdr_t;
+
+/** \brief  Start profiling.
+
+    \param  ring_entries    Number of trace records to keep. Older records are
+                            overwritten once the ring is full.
+    \param  live_entries    Number of live blocks that can be tracked for
+                            per-site accounting.
+    \retval 0               On success.
+    \retval -1              If already running, a dump is in progress, or
+                            out of memory.
+*/
+int mprof_start(size_t ring_entries, size_t live_entries);
+
+/** \brief  Stop profiling.
+
+    Recording stops, but the collected data is kept until the next call to
+    mprof_start() or mprof_shutdown(), so it can still be dumped.
+*/
+void mprof_stop(void);
+
+/** \brief  Write the collected trace to a file.
+
+    The calling thread's own operations are not recorded while the file is
+    written, so the profiler's file I/O does not show up in the trace. Other
+    threads' operations are still counted in the call site and live block
+    tables, but don't go into the trace until the dump is done; they are
+    counted in the next dump's rec_lost instead.
+
+    \param  fn              The file to write, e.g. "/pc/tmp/heap.mprof".
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if there is nothing to
+                            dump or another dump is in progress).
+*/
+int mprof_dump(const char *fn);
+
+/** \brief  Print call sites that currently hold memory.
+
+    \param  pf              The printf-like function to print with.
+    \retval 0               On success.
+*/
+int mprof_pslist(int (*pf)(const char *fmt, ...));
+
+/** \brief  Stop profiling and free all profiler memory. */
+void mprof_shutdown(void);
+
+/* \cond */
+/* Hooks used by malloc(); don't call these yourself. */
+extern volatile int mprof_active;
+void mprof_record(int op, void *ptr, size_t size, uint32 pc);
+
+#define MPROF_HOOK(op, p, sz, pc) do { \
+        if(mprof_active) \
+            mprof_record((op), (p), (sz), (pc)); \
+    } while(0)
+/* \endcond */
+
+__END_DECLS
+
+#endif  /* __KOS_MPROF_H */
@@ -242,6 +242,26 @@ typedef struct ipv6_hdr_s {
 
 /***** net_arp.c **********************************************************/
 
+/** \brief  ARP cache statistics structure.
+
+    This structure holds some basic statistics about the ARP cache, and can be
+    retrieved with the appropriate function.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_arp_stats {
+    uint32  hits;                   /**< \brief Lookups answered from cache */
+    uint32  misses;                 /**< \brief Lookups of unresolved addrs */
+    uint32  queries;                /**< \brief Who-has queries sent */
+    uint32  refreshes;              /**< \brief Queries sent to refresh entries
+                                                still in use */
+    uint32  queued;                 /**< \brief Packets held for resolution */
+    uint32  queue_sent;             /**< \brief Held packets sent on reply */
+    uint32  queue_dropped;          /**< \brief Held packets dropped */
+    uint32  expired;                /**< \brief Entries timed out */
+    uint32  entries;                /**< \brief Entries in the cache now */
+} net_arp_stats_t;
+
 /** \brief  Init ARP.
     \retval 0               On success (no error conditions defined).
 */
@@ -265,8 +285,13 @@ int net_arp_insert(netif_t *nif, const uint8 mac[6], const uint8 ip[4],
 /** \brief  Look up an entry from the ARP cache.
 
     If no entry is found, then an ARP query will be sent and an error will be
-    returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    returned. If you specify a packet with the call, it will be held and sent
+    when the reply comes in. Each unresolved address holds up to four packets;
+    beyond that, the oldest are dropped. An address that doesn't answer a few
+    queries a second apart is given up on, and its packets dropped.
+
+    Entries that are in use are queried again shortly before they expire, so
+    an active peer's entry is normally refreshed without a miss.
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
@@ -276,8 +301,11 @@ int net_arp_insert(netif_t *nif, const uint8 mac[6], const uint8 ip[4],
     \param  data            Packet data to go with the header.
     \param  data_size       The size of data.
     \retval 0               On success.
-    \retval -1              A query is outstanding for that address.
-    \retval -2              Address not found, query generated.
+    \retval -1              A query is outstanding for that address, and the
+                            packet (if any) couldn't be held.
+    \retval -2              Address not found, and a query is outstanding or
+                            has been generated. The packet (if any) will be
+                            sent when the reply comes in.
 */
 int net_arp_lookup(netif_t *nif, const uint8 ip_in[4], uint8 mac_out[6],
                    const ip_hdr_t *pkt, const uint8 *data, int data_size);
@@ -310,6 +338,11 @@ int net_arp_input(netif_t *nif, const uint8 *pkt, int len);
 */
 int net_arp_query(netif_t *nif, const uint8 ip[4]);
 
+/** \brief  Retrieve statistics from the ARP cache.
+    \return                 The global ARP stats structure.
+*/
+net_arp_stats_t net_arp_get_stats(void);
+
 
 /***** net_input.c *********************************************************/
 
@@ -411,6 +444,14 @@ typedef struct net_ipv4_stats {
     uint32  pkt_recv_bad_size;      /** \brief Packets of a bad size */
     uint32  pkt_recv_bad_chksum;    /** \brief Packets with a bad checksum */
     uint32  pkt_recv_bad_proto;     /** \brief Packets with an unknown proto */
+    uint32  frag_recv;              /** \brief Fragments received */
+    uint32  frag_reassembled;       /** \brief Datagrams reassembled */
+    uint32  frag_timeouts;          /** \brief Partial datagrams timed out */
+    uint32  frag_dropped;           /** \brief Partial datagrams dropped as
+                                                malformed or for lack of
+                                                memory */
+    uint32  frag_evicted;           /** \brief Partial datagrams thrown away
+                                                to make room for newer ones */
 } net_ipv4_stats_t;
 
 /** \brief  Retrieve statistics from the IPv4 layer.
@@ -561,6 +602,26 @@ net_ipv6_stats_t net_ipv6_get_stats(void);
 
 /***** net_ndp.c **********************************************************/
 
+/** \brief  NDP cache statistics structure.
+
+    This structure holds some basic statistics about the NDP neighbor cache,
+    and can be retrieved with the appropriate function.
+
+    \headerfile kos/net.h
+*/
+typedef struct net_ndp_stats {
+    uint32  hits;                   /**< \brief Lookups answered from cache */
+    uint32  misses;                 /**< \brief Lookups of incomplete addrs */
+    uint32  queries;                /**< \brief Solicitations sent */
+    uint32  refreshes;              /**< \brief Solicitations sent to refresh
+                                                entries still in use */
+    uint32  queued;                 /**< \brief Packets held for resolution */
+    uint32  queue_sent;             /**< \brief Held packets sent on reply */
+    uint32  queue_dropped;          /**< \brief Held packets dropped */
+    uint32  expired;                /**< \brief Entries timed out */
+    uint32  entries;                /**< \brief Entries in the cache now */
+} net_ndp_stats_t;
+
 /** \brief  Init NDP.
     \retval 0               On success (no error conditions defined).
 */
@@ -570,7 +631,10 @@ int net_ndp_init(void);
 void net_ndp_shutdown(void);
 
 /** \brief  Garbage collect timed out NDP entries.
-    This will be called periodically as NDP queries come in.
+
+    This also solicits incomplete entries again, and entries in use that
+    haven't been confirmed for a while. It is called once a second from the
+    network timer.
 */
 void net_ndp_gc(void);
 
@@ -587,8 +651,9 @@ int net_ndp_insert(netif_t *nif, const uint8 mac[6], const struct in6_addr *ip,
 /** \brief  Look up an entry from the NDP cache.
 
     If no entry is found, then an NDP query will be sent and an error will be
-    returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    returned. If you specify a packet with the call, it will be held and sent
+    when the reply comes in. As with ARP, each incomplete entry holds up to
+    four packets, dropping the oldest beyond that.
 
     \param  net             The network device to use.
     \param  ip              The IPv6 address to query.
@@ -597,11 +662,21 @@ int net_ndp_insert(netif_t *nif, const uint8 mac[6], const struct in6_addr *ip,
                             when a reply comes in.
     \param  data            Anything that comes after the header.
     \param  data_size       The size of data.
-    \return                 0 on success, <0 on failure.
+    \retval 0               On success.
+    \retval -1              A query is outstanding for that address, and the
+                            packet (if any) couldn't be held.
+    \retval -2              Address not found, and a query is outstanding or
+                            has been generated. The packet (if any) will be
+                            sent when the reply comes in.
 */
 int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8 mac_out[6],
                    const ipv6_hdr_t *pkt, const uint8 *data, int data_size);
 
+/** \brief  Retrieve statistics from the NDP cache.
+    \return                 The global NDP stats structure.
+*/
+net_ndp_stats_t net_ndp_get_stats(void);
+
 /***** net_udp.c **********************************************************/
 
 /** \brief  UDP statistics structure.
@@ -618,6 +693,9 @@ typedef struct net_udp_stats {
     uint32  pkt_recv_bad_size;      /**< \brief Packets of a bad size */
     uint32  pkt_recv_bad_chksum;    /**< \brief Packets with a bad checksum */
     uint32  pkt_recv_no_sock;       /**< \brief Packets with to a closed port */
+    uint32  pkt_recv_dropped;       /**< \brief Packets dropped because the
+                                                 socket's receive buffer was
+                                                 full */
 } net_udp_stats_t;
 
 /** \brief  Retrieve statistics from the UDP layer.
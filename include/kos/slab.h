@@ -0,0 +1,139 @@
+/* KallistiOS ##version##
+
+   include/kos/slab.h
+
+*/
+
+/** \file   kos/slab.h
+    \brief  Fixed-size object caches.
+
+    This file defines a simple slab allocator for kernel objects that are
+    allocated and freed often and are always the same size (threads, file
+    handles, sockets, and so on). Each object type gets its own cache. A cache
+    carves power-of-two sized slabs out of the main heap and hands out objects
+    from them, so many small allocations turn into a few large ones, and the
+    objects of one type are kept together rather than scattered between other
+    allocations in the heap.
+
+    Objects are optionally passed through a constructor once, when the slab
+    holding them is first created. They are not re-constructed when freed and
+    allocated again, so a constructor should only set up state that the users
+    of the cache leave intact when they free an object.
+
+    Allocating and freeing objects is safe from inside an interrupt. Creating,
+    destroying and shrinking caches is not.
+*/
+
+#ifndef __KOS_SLAB_H
+#define __KOS_SLAB_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <arch/types.h>
+
+/* \cond */
+struct slab_cache;
+/* \endcond */
+
+/** \brief  Opaque slab cache type. */
+typedef struct slab_cache slab_cache_t;
+
+/** \defgroup slab_flags            Slab cache creation flags
+
+    These flags can be ORed together and passed to slab_cache_create().
+
+    @{
+*/
+#define SLAB_DEFAULTS       0       /**< \brief No special behavior */
+#define SLAB_CACHE_ALIGN    1       /**< \brief Align objects to cache lines */
+#define SLAB_ZERO           2       /**< \brief Zero objects on allocation */
+/** @} */
+
+/** \brief  Slab cache statistics.
+
+    This structure is filled in by slab_cache_stats().
+
+    \headerfile kos/slab.h
+*/
+typedef struct slab_stats {
+    size_t obj_size;        /**< \brief Object size, including padding */
+    size_t slab_size;       /**< \brief Size of each slab in bytes */
+    uint32 slabs;           /**< \brief Slabs currently allocated */
+    uint32 objs_total;      /**< \brief Object slots in all slabs */
+    uint32 objs_inuse;      /**< \brief Objects currently allocated */
+    uint32 objs_peak;       /**< \brief High-water mark of objs_inuse */
+    uint32 allocs;          /**< \brief Total successful allocations */
+    uint32 frees;           /**< \brief Total frees */
+    uint32 failures;        /**< \brief Allocations that failed */
+} slab_stats_t;
+
+/** \brief  Create a new object cache.
+
+    \param  name            A name for the cache, used in slab_pslist(). The
+                            string is not copied.
+    \param  size            The size of each object.
+    \param  flags           Creation flags (see \ref slab_flags).
+    \param  ctor            Constructor run once on each new object, or NULL.
+    \return                 The new cache, or NULL on failure (errno will be
+                            set as appropriate).
+
+    \par    Error Conditions:
+    \em     EINVAL - size is zero or too big for a slab \n
+    \em     ENOMEM - out of memory
+*/
+slab_cache_t *slab_cache_create(const char *name, size_t size, int flags,
+                                void (*ctor)(void *obj));
+
+/** \brief  Destroy an object cache.
+
+    All of the slabs in the cache are returned to the heap. Any objects still
+    allocated from the cache are lost, so make sure to free them first.
+
+    \param  cache           The cache to destroy.
+*/
+void slab_cache_destroy(slab_cache_t *cache);
+
+/** \brief  Allocate an object from a cache.
+
+    \param  cache           The cache to allocate from.
+    \return                 The object, or NULL if out of memory.
+*/
+void *slab_alloc(slab_cache_t *cache);
+
+/** \brief  Return an object to its cache.
+
+    \param  cache           The cache the object came from.
+    \param  obj             The object to free (may be NULL).
+*/
+void slab_free(slab_cache_t *cache, void *obj);
+
+/** \brief  Release empty slabs back to the heap.
+
+    Each cache normally holds on to one completely empty slab so that it does
+    not bounce a slab in and out of the heap when objects are allocated and
+    freed in quick succession. This function gives that slab back.
+
+    \param  cache           The cache to shrink.
+    \return                 The number of bytes returned to the heap.
+*/
+size_t slab_cache_shrink(slab_cache_t *cache);
+
+/** \brief  Retrieve statistics about a cache.
+
+    \param  cache           The cache to look at.
+    \param  stats           Where to store the statistics.
+*/
+void slab_cache_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+/** \brief  Print a list of all object caches.
+
+    \param  pf              The printf-like function to print with.
+    \retval 0               On success.
+*/
+int slab_pslist(int (*pf)(const char *fmt, ...));
+
+__END_DECLS
+
+#endif  /* __KOS_SLAB_H */
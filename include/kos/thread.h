@@ -71,6 +71,21 @@ __BEGIN_DECLS
 */
 #define PRIO_DEFAULT 10
 
+/** \defgroup thd_slices  Time slice classes
+
+    In preemptive mode, a thread runs until it blocks, a thread of higher
+    priority becomes ready, or its time slice is up, at which point it goes
+    to the back of the threads of its own priority. Each of these classes
+    of priority has its own slice length (see thd_set_slice()); all of them
+    start off at 1000 / HZ milliseconds.
+    @{
+*/
+#define THD_SLICE_HIGH      0   /**< \brief Priorities above PRIO_DEFAULT */
+#define THD_SLICE_NORMAL    1   /**< \brief PRIO_DEFAULT */
+#define THD_SLICE_LOW       2   /**< \brief Priorities below PRIO_DEFAULT */
+#define THD_SLICE_CLASSES   3   /**< \brief Number of classes */
+/** @} */
+
 /* Pre-define list/queue types */
 struct kthread;
 
@@ -164,6 +179,21 @@ typedef struct kthread {
     /** \brief  Return value of the thread function.
         This is only used in joinable threads.  */
     void *rv;
+
+    /** \brief  Per-thread malloc cache, if enabled.
+        \see    malloc_tcache_enable() */
+    void *malloc_cache;
+
+    /** \brief  CPU time used, in microseconds.
+        This is only brought up to date when the thread is switched out; use
+        thd_get_cpu_time() for the running thread. */
+    uint64 cpu_time;
+
+    /** \brief  Number of times the thread has been switched to. */
+    uint32 run_count;
+
+    /** \brief  When the thread was last switched to, in microseconds. */
+    uint64 last_run;
 } kthread_t;
 
 /** \defgroup thd_flags             Thread flag values
@@ -177,6 +207,7 @@ typedef struct kthread {
 #define THD_USER        1       /**< \brief Thread runs in user mode */
 #define THD_QUEUED      2       /**< \brief Thread is in the run queue */
 #define THD_DETACHED    4       /**< \brief Thread is detached */
+#define THD_JOB         8       /**< \brief Thread is running a pool job (see kos/job.h) */
 /** @} */
 
 /** \defgroup thd_states            Thread states
@@ -214,6 +245,16 @@ extern int thd_mode;
 #define THD_MODE_PREEMPT    1   /**< \brief Preemptive threading mode */
 /** @} */
 
+/** \brief  Enable per-thread malloc caches.
+
+    This flag may be ORed into the mode passed to thd_init() to turn on the
+    per-thread small block cache in malloc. It is not a mode of its own and
+    will never appear in thd_mode.
+
+    \see    malloc_tcache_enable()
+*/
+#define THD_MALLOC_TCACHE   0x100
+
 /** \brief  The currently executing thread.
 
     Do not manipulate this variable directly!
@@ -384,6 +425,36 @@ void thd_sleep(int ms);
 */
 int thd_set_prio(kthread_t *thd, prio_t prio);
 
+/** \brief  Set the time slice for a class of priorities.
+
+    This takes effect from the next slice.
+
+    \param  cls             The class (see \ref thd_slices).
+    \param  ms              The slice length in milliseconds, from 1 to 1000.
+
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if either argument is
+                            out of range).
+*/
+int thd_set_slice(int cls, int ms);
+
+/** \brief  Retrieve the time slice for a class of priorities.
+    \param  cls             The class (see \ref thd_slices).
+    \return                 The slice length in milliseconds, or -1 if cls
+                            is out of range.
+*/
+int thd_get_slice(int cls);
+
+/** \brief  Retrieve how much CPU time a thread has used.
+
+    Unlike the cpu_time field, this includes the time the thread has been
+    running for if it's the current one.
+
+    \param  thd             The thread to look at.
+    \return                 CPU time used, in microseconds.
+*/
+uint64 thd_get_cpu_time(kthread_t *thd);
+
 /** \brief  Retrieve the current thread's kthread struct.
     \return                 The current thread's structure.
 */
@@ -496,6 +567,10 @@ int thd_detach(kthread_t *thd);
 
 /** \brief  Print a list of all threads using the given print function.
 
+    Along with each thread's state, this shows the CPU time it has used (in
+    milliseconds), how many times it has been switched to, and how long ago
+    (in milliseconds) that last happened.
+
     \param  pf              The printf-like function to print with.
 
     \retval 0               On success.
@@ -516,7 +591,8 @@ int thd_pslist_queue(int (*pf)(const char *fmt, ...));
     This is normally done for you by default when KOS starts. This will also
     initialize all the various synchronization primitives.
 
-    \param  mode            One of the \ref thd_modes values.
+    \param  mode            One of the \ref thd_modes values, optionally
+                            ORed with THD_MALLOC_TCACHE.
 
     \retval -1              If threads are already initialized.
     \retval 0               On success.
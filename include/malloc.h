@@ -153,6 +153,27 @@ void malloc_stats();
 */
 int malloc_irq_safe();
 
+/** \brief  Enable or disable the per-thread small block cache.
+
+    When enabled, each thread keeps a small cache of recently freed small
+    blocks and refills it from the global heap in batches, so most small
+    allocations never contend on the global heap lock. This is normally set up
+    by thd_init() when passed THD_MALLOC_TCACHE. mallinfo() and malloc_stats()
+    count cached blocks as free space.
+
+    \param enable           Non-zero to enable the cache, zero to disable it.
+*/
+void malloc_tcache_enable(int enable);
+
+/** \brief  Return a thread cache's blocks to the global heap.
+
+    This is called by the threading system when a thread is destroyed. You
+    should not need to call it yourself.
+
+    \param cache            The cache to release (may be NULL).
+*/
+void malloc_tcache_release(void *cache);
+
 /** \brief Only available with KM_DBG
 */
 int mem_check_block(void *p);
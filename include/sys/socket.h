@@ -23,9 +23,12 @@
 
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#include <kos/iovec.h>
 
 __BEGIN_DECLS
 
+struct timespec;
+
 /** \brief  Socket length type. */
 typedef __uint32_t socklen_t;
 
@@ -158,6 +161,31 @@ struct sockaddr_storage {
 #define MSG_DONTWAIT    0x80    /**< \brief Make this call non-blocking (non-standard) */
 /** @} */
 
+/** \brief  Message header structure.
+
+    This describes one datagram for recvmmsg() and sendmmsg(). Ancillary data
+    is not supported; msg_control is ignored and msg_controllen is set to 0 on
+    receive.
+*/
+struct msghdr {
+    void            *msg_name;      /**< \brief Peer address, or NULL */
+    socklen_t       msg_namelen;    /**< \brief Length of msg_name */
+    struct iovec    *msg_iov;       /**< \brief Buffers to scatter/gather */
+    int             msg_iovlen;     /**< \brief Number of buffers */
+    void            *msg_control;   /**< \brief Ancillary data (unused) */
+    socklen_t       msg_controllen; /**< \brief Length of msg_control */
+    int             msg_flags;      /**< \brief Flags on received message */
+};
+
+/** \brief  Multiple message header structure.
+
+    An array of these is passed to recvmmsg() and sendmmsg().
+*/
+struct mmsghdr {
+    struct msghdr   msg_hdr;        /**< \brief The message */
+    unsigned int    msg_len;        /**< \brief Bytes received or sent */
+};
+
 /** \brief  Unspecified address family. */
 #define AF_UNSPEC   0
 
@@ -312,6 +340,47 @@ ssize_t send(int socket, const void *message, size_t length, int flags);
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
                const struct sockaddr *dest_addr, socklen_t dest_len);
 
+/** \brief  Receive multiple messages on a socket.
+
+    This function receives up to vlen datagrams in one call. It waits (unless
+    the socket is non-blocking or MSG_DONTWAIT is given) for the first one
+    only, then returns along with any others that are already queued, as
+    with MSG_WAITFORONE on other systems. A datagram too large for its
+    buffers is truncated, and MSG_TRUNC set in its msg_flags. With MSG_PEEK,
+    only one datagram is returned.
+
+    \param  socket      The socket to receive on.
+    \param  msgvec      The messages to fill in. msg_len of each is set to the
+                        number of bytes received.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       MSG_DONTWAIT and/or MSG_PEEK.
+    \param  timeout     How long to wait for the first datagram, or NULL to
+                        wait for as long as it takes.
+    \return             On success, the number of messages received. If the
+                        socket has been shut down, 0. On error, -1, and sets
+                        errno as appropriate (EWOULDBLOCK if nothing arrived
+                        in time).
+*/
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
+
+/** \brief  Send multiple messages on a socket.
+
+    This function sends up to vlen datagrams in one call, each gathered from
+    its msg_iov and sent to its msg_name (which must be NULL on a connected
+    socket).
+
+    \param  socket      The socket to send on.
+    \param  msgvec      The messages to send. msg_len of each one sent is set
+                        to the number of bytes sent.
+    \param  vlen        The number of elements in msgvec.
+    \param  flags       The type of message transmission. Set to 0 for now.
+    \return             The number of messages sent, which is less than vlen
+                        if one failed. If the first one fails, -1, and sets
+                        errno as appropriate.
+*/
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+
 /** \brief  Shutdown socket send and receive operations.
 
     This function closes a specific socket for the set of specified operations.
@@ -196,8 +196,8 @@ static uint32 iso_733(const uint8 *from) {
    this cache. As the cache fills up, sectors are removed from the end
    of it. */
 typedef struct {
+    uint8   data[2048];     /* Sector data (first, so it can be DMAed into) */
     uint32  sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
 } cache_block_t;
 
 /* List of cache blocks (ordered least recently used to most recently) */
@@ -241,11 +241,10 @@ static void bgrad_cache(cache_block_t **cache, int block) {
    block index. Note that the sector in question may already be in the
    cache, in which case it just returns the containing block. */
 static void iso_break_all();
-static int bread_cache(cache_block_t **cache, uint32 sector) {
+static int bread_cache_locked(cache_block_t **cache, uint32 sector) {
     int i, j, rv;
 
     rv = -1;
-    mutex_lock(&cache_mutex);
 
     /* Look for a pre-existing cache block */
     for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
@@ -288,13 +287,19 @@ static int bread_cache(cache_block_t **cache, uint32 sector) {
 
     /* Return the new cache block index */
 bread_exit:
-    mutex_unlock(&cache_mutex);
     return rv;
 }
 
-/* read data block */
-static int bdread(uint32 sector) {
-    return bread_cache(dcache, sector);
+/* As above, taking the cache mutex. Note that the returned index is only good
+   until another thread touches the cache. */
+static int bread_cache(cache_block_t **cache, uint32 sector) {
+    int rv;
+
+    mutex_lock(&cache_mutex);
+    rv = bread_cache_locked(cache, sector);
+    mutex_unlock(&cache_mutex);
+
+    return rv;
 }
 
 /* read inode block */
@@ -574,8 +579,17 @@ static struct {
     uint32      size;       /* Length of file in bytes */
     dirent_t    dirent;     /* A static dirent to pass back to clients */
     int     broken;     /* >0 if the CD has been swapped out since open */
+    int     async;      /* >0 if opened with O_ASYNC */
+    ssize_t     async_rv;   /* Result of the DMA read in flight, if any */
+    int     closing;    /* >0 if closed with the DMA read still in flight */
 } fh[MAX_ISO_FILES];
 
+/* The handle with a DMA read in flight, or -1. The drive only does one at a
+   time. Only the thread that started the read can finish it (it holds the G1
+   mutex until then), so if another thread closes the file, the handle stays
+   in use until the owner next comes through here and reaps it. */
+static file_t async_fd = -1;
+
 /* Mutex for file handles */
 static mutex_t fh_mutex;
 
@@ -594,6 +608,54 @@ static void iso_break_all() {
     mutex_unlock(&fh_mutex);
 }
 
+/* Retire the DMA read on fd, sleeping until it's done if wait is set. Fails
+   with EBUSY if another thread started it, or EAGAIN if it isn't done and
+   wait isn't set. */
+static int iso_finish(file_t fd, ssize_t *rv, int wait) {
+    int res, n;
+
+    n = wait ? cdrom_read_async_wait(&res, 0) : cdrom_read_async_poll(&res);
+
+    if(n < 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    else if(n) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    async_fd = -1;
+
+    /* Closed while we were busy; the handle can go now */
+    if(fh[fd].closing) {
+        fh[fd].closing = 0;
+        fh[fd].first_extent = 0;
+    }
+
+    if(res == ERR_OK) {
+        *rv = fh[fd].async_rv;
+    }
+    else {
+        if(res == ERR_DISC_CHG || res == ERR_NO_DISC)
+            init_percd();
+
+        errno = EIO;
+        *rv = -1;
+    }
+
+    return 0;
+}
+
+/* Finish a DMA read whose file was closed by another thread, if this is the
+   thread that started it. */
+static void iso_reap(void) {
+    ssize_t rv;
+
+    if(async_fd != -1 && fh[async_fd].closing)
+        iso_finish(async_fd, &rv, 1);
+}
+
 /* Open a file or directory */
 static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     file_t      fd;
@@ -605,6 +667,8 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     if((mode & O_MODE_MASK) != O_RDONLY)
         return 0;
 
+    iso_reap();
+
     /* Do this only when we need to (this is still imperfect) */
     if(!percd_done && init_percd() < 0)
         return 0;
@@ -636,6 +700,8 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     fh[fd].ptr = 0;
     fh[fd].size = iso_733(de->size);
     fh[fd].broken = 0;
+    fh[fd].async = (mode & O_ASYNC) ? 1 : 0;
+    fh[fd].closing = 0;
 
     return (void *)fd;
 }
@@ -643,77 +709,59 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
 /* Close a file or directory */
 static int iso_close(void * h) {
     file_t fd = (file_t)h;
+    ssize_t rv;
 
     /* Check that the fd is valid */
     if(fd < MAX_ISO_FILES) {
+        iso_reap();
+
+        /* A DMA in flight has to be finished before the handle can go. If
+           this thread didn't start it, leave that to the one that did. */
+        if(async_fd == fd && iso_finish(fd, &rv, 1) < 0) {
+            fh[fd].closing = 1;
+            return 0;
+        }
+
         /* No need to lock the mutex: this is an atomic op */
         fh[fd].first_extent = 0;
     }
     return 0;
 }
 
-/* Read from a file */
-static ssize_t iso_read(void * h, void *buf, size_t bytes) {
+/* Read from a file at the given position. Each sector is copied out of the
+   data cache while the cache mutex is held, so other threads reading (and
+   reshuffling the cache) at the same time can't hand us the wrong block. */
+static ssize_t iso_read_at(file_t fd, void *buf, size_t bytes, uint32 pos) {
     int rv, toread, thissect, c;
     uint8 * outbuf;
-    file_t fd = (file_t)h;
-
-    /* Check that the fd is valid */
-    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
-        return -1;
 
     rv = 0;
     outbuf = (uint8 *)buf;
 
-    /* Read zero or more sectors into the buffer from the current pos */
-    while(bytes > 0) {
+    /* Read zero or more sectors into the buffer from pos */
+    while(bytes > 0 && pos < fh[fd].size) {
         /* Figure out how much we still need to read */
-        toread = (bytes > (fh[fd].size - fh[fd].ptr)) ?
-                 fh[fd].size - fh[fd].ptr : bytes;
-
-        if(toread == 0) break;
+        toread = (bytes > (fh[fd].size - pos)) ? fh[fd].size - pos : bytes;
 
         /* How much more can we read in the current sector? */
-        thissect = 2048 - (fh[fd].ptr % 2048);
-
-        /* If we're on a sector boundary and we have more than one
-           full sector to read, then short-circuit the cache here
-           and use the multi-sector reads from the CD unit (this
-           should theoretically be a lot faster) */
-        /* XXX This code isn't actually faster, but I'm leaving it
-           here commented out in case we could find a better use
-           for it later than speed (i.e., preventing thread context
-           switches). */
-        /* if (thissect == 2048 && toread >= 2048) {
-            // Round it off to an even sector count
-            thissect = toread / 2048;
-            toread = thissect * 2048;
-
-            printf("cdrom: short-circuit read for %d sectors\n",
-                thissect);
-
-            // Do the read
-            if (cdrom_read_sectors(outbuf,
-                fh[fd].first_extent + fh[fd].ptr/2048 + 150,
-                thissect) < 0)
-            {
-                // Something went wrong...
-                return -1;
-            }
-        } else { */
+        thissect = 2048 - (pos % 2048);
         toread = (toread > thissect) ? thissect : toread;
 
-        /* Do the read */
-        c = bdread(fh[fd].first_extent + fh[fd].ptr / 2048);
+        /* Do the read (data blocks come from dcache) */
+        mutex_lock(&cache_mutex);
+        c = bread_cache_locked(dcache, fh[fd].first_extent + pos / 2048);
 
-        if(c < 0) return -1;
+        if(c < 0) {
+            mutex_unlock(&cache_mutex);
+            return rv ? rv : -1;
+        }
 
-        memcpy(outbuf, dcache[c]->data + (fh[fd].ptr % 2048), toread);
-        /* } */
+        memcpy(outbuf, dcache[c]->data + (pos % 2048), toread);
+        mutex_unlock(&cache_mutex);
 
         /* Adjust pointers */
         outbuf += toread;
-        fh[fd].ptr += toread;
+        pos += toread;
         bytes -= toread;
         rv += toread;
     }
@@ -721,6 +769,197 @@ static ssize_t iso_read(void * h, void *buf, size_t bytes) {
     return rv;
 }
 
+/* Read from a file */
+static ssize_t iso_read(void * h, void *buf, size_t bytes) {
+    ssize_t rv;
+    file_t fd = (file_t)h;
+
+    /* Check that the fd is valid */
+    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
+        return -1;
+
+    if((rv = iso_read_at(fd, buf, bytes, fh[fd].ptr)) > 0)
+        fh[fd].ptr += rv;
+
+    return rv;
+}
+
+/* Start a DMA read of whole sectors straight into the caller's buffer. Only
+   sector-aligned reads into 32-byte aligned buffers qualify; the read stops at
+   the end of the buffer's last whole sector, so it may come up short. Returns
+   0 if the read was started. */
+static int iso_start_async(file_t fd, void *buf, size_t bytes, uint32 pos) {
+    uint32 avail, sects;
+    int rv;
+
+    if(async_fd != -1 || ((uint32)buf & 31) || (pos % 2048) ||
+       pos >= fh[fd].size)
+        return -1;
+
+    avail = fh[fd].size - pos;
+    sects = bytes / 2048;
+
+    if(sects > (avail + 2047) / 2048)
+        sects = (avail + 2047) / 2048;
+
+    if(!sects)
+        return -1;
+
+    /* Claim the drive before starting, so nobody else tries at once. */
+    mutex_lock(&fh_mutex);
+
+    if(async_fd != -1) {
+        mutex_unlock(&fh_mutex);
+        return -1;
+    }
+
+    async_fd = fd;
+    mutex_unlock(&fh_mutex);
+
+    rv = cdrom_read_sectors_async(buf, fh[fd].first_extent + pos / 2048 + 150,
+                                  sects);
+
+    if(rv != ERR_OK) {
+        async_fd = -1;
+
+        if(rv == ERR_DISC_CHG || rv == ERR_NO_DISC)
+            init_percd();
+
+        return -1;
+    }
+
+    fh[fd].async_rv = (sects * 2048 > avail) ? avail : sects * 2048;
+    return 0;
+}
+
+/* Read from a file at a given offset, leaving the file pointer alone. On a
+   file opened with O_ASYNC this starts a DMA read where it can, and the
+   result is collected with iso_complete(). */
+static ssize_t iso_pread(void * h, void *buf, size_t bytes, off_t offset) {
+    file_t fd = (file_t)h;
+
+    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    iso_reap();
+
+    if(fh[fd].async && !iso_start_async(fd, buf, bytes, (uint32)offset)) {
+        errno = EINPROGRESS;
+        return -1;
+    }
+
+    return iso_read_at(fd, buf, bytes, (uint32)offset);
+}
+
+/* Hand the file to fs_sendfile() a sector at a time. Each sector is copied
+   out of the data cache first, so that the cache mutex isn't held while the
+   sink runs: that may block on a socket, or take another filesystem's locks
+   while that one is waiting for ours. */
+static ssize_t iso_splice(void * h, off_t offset, size_t bytes,
+                          fs_splice_sink_t sink, void *ctx) {
+    file_t fd = (file_t)h;
+    uint32 pos = (uint32)offset;
+    ssize_t rv = 0, sent;
+    int toread, thissect, c;
+    uint8 *bounce;
+
+    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(!(bounce = (uint8 *)malloc(2048))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(bytes > 0 && pos < fh[fd].size) {
+        toread = (bytes > (fh[fd].size - pos)) ? fh[fd].size - pos : bytes;
+        thissect = 2048 - (pos % 2048);
+        toread = (toread > thissect) ? thissect : toread;
+
+        mutex_lock(&cache_mutex);
+        c = bread_cache_locked(dcache, fh[fd].first_extent + pos / 2048);
+
+        if(c < 0) {
+            mutex_unlock(&cache_mutex);
+            free(bounce);
+            return rv ? rv : -1;
+        }
+
+        memcpy(bounce, dcache[c]->data + (pos % 2048), toread);
+        mutex_unlock(&cache_mutex);
+
+        if((sent = sink(ctx, bounce, toread)) <= 0) {
+            free(bounce);
+            return rv ? rv : sent;
+        }
+
+        pos += sent;
+        bytes -= sent;
+        rv += sent;
+
+        if(sent < toread)
+            break;
+    }
+
+    free(bounce);
+    return rv;
+}
+
+/* Check on a DMA read started by iso_pread(). This has to be called from the
+   thread that started the read; anyone else gets EBUSY. */
+static int iso_complete(void * h, ssize_t *rv) {
+    file_t fd = (file_t)h;
+
+    if(fd >= MAX_ISO_FILES || async_fd != fd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return iso_finish(fd, rv, 0);
+}
+
+/* The same, but sleep until the read is done */
+static int iso_complete_wait(void * h, ssize_t *rv) {
+    file_t fd = (file_t)h;
+
+    if(fd >= MAX_ISO_FILES || async_fd != fd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return iso_finish(fd, rv, 1);
+}
+
+/* Scatter read from the current file pointer */
+static ssize_t iso_readv(void * h, const iovec_t *iov, int iovcnt) {
+    ssize_t rv = 0, n;
+    file_t fd = (file_t)h;
+    int i;
+
+    if(fd >= MAX_ISO_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        if((n = iso_read_at(fd, iov[i].iov_base, iov[i].iov_len,
+                            fh[fd].ptr)) < 0)
+            return rv ? rv : -1;
+
+        fh[fd].ptr += n;
+        rv += n;
+
+        if((size_t)n < iov[i].iov_len)
+            break;
+    }
+
+    return rv;
+}
+
 /* Seek elsewhere in a file */
 static off_t iso_seek(void * h, off_t offset, int whence) {
     file_t fd = (file_t)h;
@@ -1016,7 +1255,7 @@ static vfs_handler_t vh = {
     NULL,
     NULL,
     NULL,
-    NULL,
+    iso_complete,
     NULL,
     NULL,
     NULL,
@@ -1028,7 +1267,13 @@ static vfs_handler_t vh = {
     NULL,               /* tell64 */
     NULL,               /* total64 */
     NULL,               /* readlink */
-    iso_rewinddir
+    iso_rewinddir,
+    iso_pread,
+    NULL,               /* pwrite */
+    iso_readv,
+    NULL,               /* writev */
+    iso_splice,
+    iso_complete_wait
 };
 
 /* Initialize the file system */
@@ -1047,9 +1292,9 @@ int fs_iso9660_init() {
 
     /* Allocate cache block space */
     for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = malloc(sizeof(cache_block_t));
+        icache[i] = memalign(32, sizeof(cache_block_t));
         icache[i]->sector = -1;
-        dcache[i] = malloc(sizeof(cache_block_t));
+        dcache[i] = memalign(32, sizeof(cache_block_t));
         dcache[i]->sector = -1;
     }
 
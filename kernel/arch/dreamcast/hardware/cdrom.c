@@ -10,9 +10,15 @@
 
 #include <dc/cdrom.h>
 #include <dc/g1ata.h>
+#include <dc/asic.h>
+#include <arch/cache.h>
+#include <arch/timer.h>
+#include <arch/irq.h>
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/genwait.h>
+#include <kos/dbglog.h>
 
 /*
 
@@ -33,12 +39,14 @@ they require their parameters to be in certain registers, which is
 normally the case with the default options. If in doubt, decompile the
 output and look to make sure.
 
-XXX: This could all be done in a non-blocking way by taking advantage of
-command queuing. Every call to gdc_req_cmd returns a 'request id' which
-just needs to eventually be checked by cmd_stat. A non-blocking version
-of all functions would simply require manual calls to check the status.
-Doing this would probably allow data reading while cdda is playing without
-hiccups (by severely reducing the number of gd commands being sent).
+Every call to gdc_req_cmd returns a 'request id' which just needs to
+eventually be checked by cmd_stat, and the BIOS only makes progress when
+gdc_exec_server is called. Rather than spinning on those through the
+scheduler, a thread waiting on a command sleeps between polls: DMA reads
+are woken by the G1 DMA-end interrupt, and everything else backs off from
+a millisecond up to a few, starting over whenever more data has moved.
+The BIOS queues requests, so a second asynchronous read can be started
+while the first is still in flight.
 */
 
 
@@ -96,52 +104,165 @@ static void gdc_abort_cmd(int cmd) {
 /* The G1 ATA access mutex */
 mutex_t _g1_ata_mutex = RECURSIVE_MUTEX_INITIALIZER;
 
+/* Read parameters, as the BIOS wants them */
+typedef struct {
+    int sec, num;
+    void    *buffer;
+    int dunno;
+} read_params_t;
+
+/* The outstanding cdrom_read_sectors_async() requests, oldest first. The BIOS
+   may look at the parameters at any point until it's done, so they live
+   here. */
+static struct {
+    int req;
+    read_params_t params;
+} async_q[CDROM_ASYNC_MAX];
+static int async_head = 0, async_count = 0;
+
+/* The thread that started them, and so holds the G1 mutex for them. Nobody
+   else can retire them, since only it can let go of the mutex. */
+static kthread_t *async_owner = NULL;
+
+/* The size of the sectors we're reading, for keeping the cache out of the way
+   of DMA */
+static int sector_bytes = 2048;
+
+/* Set by the G1 DMA-end interrupt, and slept on while a command runs */
+static volatile int dma_ended = 0;
+
+/* Sleep between polls of the BIOS, in milliseconds */
+#define GD_WAIT_MIN     1
+#define GD_WAIT_MAX     8
+
+/* How long to give an aborted command to wind down, in milliseconds */
+#define GD_ABORT_WAIT   500
+
+/* Translate a finished command's BIOS status into one of our error codes */
+static int cmd_result(int n, int status[4]) {
+    if(n == COMPLETED)
+        return ERR_OK;
+    else if(n == ABORTED)
+        return ERR_ABORTED;
+    else if(n == NO_ACTIVE)
+        return ERR_NO_ACTIVE;
+    else {
+        switch(status[0]) {
+            case 2:
+                return ERR_NO_DISC;
+            case 6:
+                return ERR_DISC_CHG;
+            default:
+                return ERR_SYS;
+        }
+    }
+}
+
+/* The G1 DMA has finished; wake anyone waiting on a command. g1ata.c passes
+   these on when they aren't for its own transfers. */
+void _cdrom_dma_irq_hnd(uint32 code) {
+    (void)code;
+
+    dma_ended = 1;
+    genwait_wake_all((void *)&dma_ended);
+    thd_schedule(1, 0);
+}
+
+/* Drive request f until the BIOS is done with it, sleeping between polls.
+   Returns the BIOS status, which is still PROCESSING if timeout ms (if not 0)
+   went by first. */
+static int gd_wait(int f, int status[4], int timeout) {
+    uint64 start = timer_ms_gettime64();
+    int n, old, delay = GD_WAIT_MIN, moved = -1;
+
+    for(;;) {
+        gdc_exec_server();
+        n = gdc_get_cmd_stat(f, status);
+
+        if(n != PROCESSING)
+            return n;
+
+        if(timeout && timer_ms_gettime64() - start >= (uint64)timeout)
+            return n;
+
+        /* Data is still moving, so check back soon. */
+        if(status[2] != moved) {
+            moved = status[2];
+            delay = GD_WAIT_MIN;
+        }
+
+        old = irq_disable();
+
+        /* There's nothing to wake us up if interrupts were already off (as
+           they are for the first cdrom_init()), so just poll then. */
+        if((old & 0xf0) == 0xf0) {
+            irq_restore(old);
+            thd_pass();
+            continue;
+        }
+
+        if(!dma_ended)
+            genwait_wait((void *)&dma_ended, "cdrom_exec_cmd", delay, NULL);
+
+        dma_ended = 0;
+        irq_restore(old);
+
+        if(delay < GD_WAIT_MAX)
+            delay <<= 1;
+    }
+}
+
+/* Get the cache out of the way of a DMA into buffer. The ends are written
+   back first, in case they share a cache line with something else. */
+static void dma_prepare(void *buffer, int cnt) {
+    dcache_flush_range((uint32)buffer, cnt * sector_bytes);
+    dcache_inval_range((uint32)buffer, cnt * sector_bytes);
+}
+
 /* Shortcut to cdrom_reinit_ex. Typically this is the only thing changed. */
 int cdrom_set_sector_size(int size) {
     return cdrom_reinit_ex(-1, -1, size);
 }
 
 /* Command execution sequence */
-/* XXX: It might make sense to have a version of this that takes a timeout. */
 int cdrom_exec_cmd(int cmd, void *param) {
+    return cdrom_exec_cmd_timed(cmd, param, 0);
+}
+
+int cdrom_exec_cmd_timed(int cmd, void *param, int timeout) {
     int status[4] = {0};
     int f, n;
-    
+
     mutex_lock(&_g1_ata_mutex);
 
     /* Make sure to select the GD-ROM drive. */
     g1_ata_select_device(G1_ATA_MASTER);
 
     /* Submit the command and wait for it to finish */
-    f = gdc_req_cmd(cmd, param);
+    if((f = gdc_req_cmd(cmd, param)) <= 0) {
+        mutex_unlock(&_g1_ata_mutex);
+        return ERR_SYS;
+    }
 
-    do {
-        gdc_exec_server();
-        n = gdc_get_cmd_stat(f, status);
+    n = gd_wait(f, status, timeout);
 
-        if(n == PROCESSING)
-            thd_pass();
+    if(n == PROCESSING) {
+        /* The abort only takes effect as the BIOS gets to it, so keep it
+           running until the request is gone. The next command would be
+           refused (or worse) while this one is still live. */
+        gdc_abort_cmd(f);
+
+        if(gd_wait(f, status, GD_ABORT_WAIT) == PROCESSING)
+            dbglog(DBG_WARNING, "cdrom_exec_cmd: command %d didn't abort\n",
+                   cmd);
+
+        mutex_unlock(&_g1_ata_mutex);
+        return ERR_TIMEOUT;
     }
-    while(n == PROCESSING);
-    
+
     mutex_unlock(&_g1_ata_mutex);
 
-    if(n == COMPLETED)
-        return ERR_OK;
-    else if(n == ABORTED)
-        return ERR_ABORTED;
-    else if(n == NO_ACTIVE)
-        return ERR_NO_ACTIVE;
-    else {
-        switch(status[0]) {
-            case 2:
-                return ERR_NO_DISC;
-            case 6:
-                return ERR_DISC_CHG;
-            default:
-                return ERR_SYS;
-        }
-    }
+    return cmd_result(n, status);
 }
 
 /* Return the status of the drive as two integers (see constants) */
@@ -221,6 +342,7 @@ int cdrom_change_dataype(int sector_part, int cdxa, int sector_size) {
     params[2] = cdxa;           /* CD-XA mode 1/2 */
     params[3] = sector_size;    /* sector size */
     rv = gdc_change_data_type(params);
+    sector_bytes = sector_size;
     mutex_unlock(&_g1_ata_mutex);
     return rv;
 }
@@ -298,11 +420,7 @@ int cdrom_read_toc(CDROM_TOC *toc_buffer, int session) {
 
 /* Enhanced Sector reading: Choose mode to read in. */
 int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
-    struct {
-        int sec, num;
-        void    *buffer;
-        int dunno;
-    } params;
+    read_params_t params;
     int rv = ERR_OK;
 
     params.sec = sector;    /* Starting sector */
@@ -310,25 +428,130 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
     params.buffer = buffer; /* Output buffer */
     params.dunno = 0;       /* ? */
 
+    /* DMA goes around the cache, so the buffer has to start a cache line. */
+    if(mode == CDROM_READ_DMA && ((uint32)buffer & 0x1F))
+        return ERR_SYS;
+
     mutex_lock(&_g1_ata_mutex);
 
-    /* The DMA mode blocks the thread it is called in by the way we execute
-       gd syscalls. It does however allow for other threads to run. */
+    /* Either way the calling thread sleeps until the read is done, and other
+       threads run in the meantime. */
     /* XXX: DMA Mode may conflict with using a second G1ATA device. More 
        testing is needed from someone with such a device.
     */
-    if(mode == CDROM_READ_DMA)
+    if(mode == CDROM_READ_DMA) {
+        dma_prepare(buffer, cnt);
         rv = cdrom_exec_cmd(CMD_DMAREAD, &params);
-    else if (mode == CDROM_READ_PIO)
+    }
+    else if (mode == CDROM_READ_PIO) {
         rv = cdrom_exec_cmd(CMD_PIOREAD, &params);
+    }
 
     mutex_unlock(&_g1_ata_mutex);
     return rv;
 }
 
-/* Basic old sector read */
+/* Start a DMA read and return without waiting for it. The G1 mutex stays
+   locked (once per request) until the request is seen to finish, which keeps
+   everyone else off the bus in the meantime. */
+int cdrom_read_sectors_async(void *buffer, int sector, int cnt) {
+    read_params_t *params;
+    int slot;
+
+    if(((uint32)buffer) & 0x1F)
+        return ERR_SYS;
+
+    mutex_lock(&_g1_ata_mutex);
+
+    if(async_count == CDROM_ASYNC_MAX) {
+        mutex_unlock(&_g1_ata_mutex);
+        return ERR_SYS;
+    }
+
+    g1_ata_select_device(G1_ATA_MASTER);
+
+    /* Don't let anything stale in the cache get written over the data. */
+    dma_prepare(buffer, cnt);
+
+    slot = (async_head + async_count) % CDROM_ASYNC_MAX;
+    params = &async_q[slot].params;
+    params->sec = sector;
+    params->num = cnt;
+    params->buffer = buffer;
+    params->dunno = 0;
+
+    if((async_q[slot].req = gdc_req_cmd(CMD_DMAREAD, params)) <= 0) {
+        mutex_unlock(&_g1_ata_mutex);
+        return ERR_SYS;
+    }
+
+    /* Anyone else would have been stopped by the mutex above */
+    async_owner = thd_current;
+    ++async_count;
+    return ERR_OK;
+}
+
+/* Retire the oldest asynchronous read, given its final BIOS status. */
+static int async_finish(int n, int status[4]) {
+    async_head = (async_head + 1) % CDROM_ASYNC_MAX;
+
+    if(!--async_count)
+        async_owner = NULL;
+
+    mutex_unlock(&_g1_ata_mutex);
+
+    return cmd_result(n, status);
+}
+
+int cdrom_read_async_poll(int *result) {
+    int status[4] = {0};
+    int n;
+
+    if(!async_count) {
+        *result = ERR_NO_ACTIVE;
+        return 0;
+    }
+
+    if(async_owner != thd_current)
+        return -1;
+
+    gdc_exec_server();
+    n = gdc_get_cmd_stat(async_q[async_head].req, status);
+
+    if(n == PROCESSING)
+        return 1;
+
+    *result = async_finish(n, status);
+    return 0;
+}
+
+int cdrom_read_async_wait(int *result, int timeout) {
+    int status[4] = {0};
+    int n;
+
+    if(!async_count) {
+        *result = ERR_NO_ACTIVE;
+        return 0;
+    }
+
+    if(async_owner != thd_current)
+        return -1;
+
+    n = gd_wait(async_q[async_head].req, status, timeout);
+
+    if(n == PROCESSING)
+        return 1;
+
+    *result = async_finish(n, status);
+    return 0;
+}
+
+/* Basic old sector read. DMA is quicker and leaves the CPU free, so use it
+   whenever the buffer allows. */
 int cdrom_read_sectors(void *buffer, int sector, int cnt) {
-    return cdrom_read_sectors_ex(buffer, sector, cnt, CDROM_READ_PIO);
+    return cdrom_read_sectors_ex(buffer, sector, cnt,
+                                 ((uint32)buffer & 0x1F) ? CDROM_READ_PIO :
+                                 CDROM_READ_DMA);
 }
 
 
@@ -462,6 +685,11 @@ int cdrom_init() {
     gdc_init_system();
     mutex_unlock(&_g1_ata_mutex);
 
+    /* Hook the G1 DMA-end event, so DMA reads can sleep until they're done.
+       g1ata.c takes this over while it's running, and passes ours on. */
+    asic_evt_set_handler(ASIC_EVT_GD_DMA, _cdrom_dma_irq_hnd);
+    asic_evt_enable(ASIC_EVT_GD_DMA, ASIC_IRQ_DEFAULT);
+
     /* Do an initial initialization */
     cdrom_reinit();
 
@@ -469,6 +697,6 @@ int cdrom_init() {
 }
 
 void cdrom_shutdown() {
-
-    /* What would you want done here? */
+    asic_evt_disable(ASIC_EVT_GD_DMA, ASIC_IRQ_DEFAULT);
+    asic_evt_set_handler(ASIC_EVT_GD_DMA, NULL);
 }
@@ -163,6 +163,7 @@ static semaphore_t dma_done = SEM_INITIALIZER(0);
 
 /* From cdrom.c */
 extern mutex_t _g1_ata_mutex;
+extern void _cdrom_dma_irq_hnd(uint32 code);
 
 #define g1_ata_wait_status(n) \
     do {} while((IN8(G1_ATA_ALTSTATUS) & (n)))
@@ -212,6 +213,10 @@ static void g1_dma_irq_hnd(uint32 code) {
         dma_in_progress = 0;
         g1_ata_mutex_unlock();
     }
+    else {
+        /* It must have been a GD-ROM read, so let cdrom.c know. */
+        _cdrom_dma_irq_hnd(code);
+    }
 }
 
 /* Set the device select register to select a particular device. */
@@ -1109,6 +1114,35 @@ static int atab_write_blocks_dma(kos_blockdev_t *d, uint64_t block,
                                 (const uint16_t *)buf, 1);
 }
 
+static int atab_read_blocks_async(kos_blockdev_t *d, uint64_t block,
+                                  size_t count, void *buf) {
+    ata_devdata_t *data = (ata_devdata_t *)d->dev_data;
+
+    if(block + count > data->end_block) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    return g1_ata_read_lba_dma(block + data->start_block, count,
+                               (uint16_t *)buf, 0);
+}
+
+static int atab_async_status(kos_blockdev_t *d) {
+    (void)d;
+
+    /* The IRQ handler clears dma_in_progress once the transfer is done. */
+    if(dma_in_progress || g1_dma_in_progress())
+        return 1;
+
+    /* Ack the IRQ and see how it went. */
+    if(IN8(G1_ATA_STATUS_REG) & G1_ATA_SR_ERR) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
 static int atab_read_blocks_chs(kos_blockdev_t *d, uint64_t block, size_t count,
                                 void *buf) {
     ata_devdata_t *data = (ata_devdata_t *)d->dev_data;
@@ -1179,7 +1213,9 @@ static kos_blockdev_t ata_blockdev_dma = {
     &atab_read_blocks_dma,  /* read_blocks */
     &atab_write_blocks_dma, /* write_blocks */
     &atab_count_blocks,     /* count_blocks */
-    &atab_flush             /* flush */
+    &atab_flush,            /* flush */
+    &atab_read_blocks_async,    /* read_blocks_async */
+    &atab_async_status      /* async_status */
 };
 
 static kos_blockdev_t ata_blockdev_chs = {
@@ -1314,9 +1350,9 @@ void g1_ata_shutdown(void) {
 
     memset(&device, 0, sizeof(device));
 
-    /* Unhook the events and disable the IRQs. */
-    asic_evt_disable(ASIC_EVT_GD_DMA, ASIC_IRQ_DEFAULT);
-    asic_evt_set_handler(ASIC_EVT_GD_DMA, NULL);
+    /* Unhook the events and disable the IRQs, handing the DMA-end event back
+       to the GD-ROM code. */
+    asic_evt_set_handler(ASIC_EVT_GD_DMA, _cdrom_dma_irq_hnd);
     asic_evt_disable(ASIC_EVT_GD_DMA_OVERRUN, ASIC_IRQ_DEFAULT);
     asic_evt_set_handler(ASIC_EVT_GD_DMA_OVERRUN, NULL);
     asic_evt_disable(ASIC_EVT_GD_DMA_ILLADDR, ASIC_IRQ_DEFAULT);
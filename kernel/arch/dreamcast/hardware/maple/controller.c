@@ -26,7 +26,7 @@ static void cont_reply(maple_frame_t *frm) {
     maple_response_t    *resp;
     uint32          *respbuf;
     cont_cond_t     *raw;
-    cont_state_t        *cooked;
+    cont_state_t        *cooked, next;
 
     /* Unlock the frame now (it's ok, we're in an IRQ) */
     maple_frame_unlock(frm);
@@ -50,13 +50,19 @@ static void cont_reply(maple_frame_t *frm) {
 
         /* Fill the "nice" struct from the raw data */
         cooked = (cont_state_t *)(frm->dev->status);
-        cooked->buttons = (~raw->buttons) & 0xffff;
-        cooked->ltrig = raw->ltrig;
-        cooked->rtrig = raw->rtrig;
-        cooked->joyx = ((int)raw->joyx) - 128;
-        cooked->joyy = ((int)raw->joyy) - 128;
-        cooked->joy2x = ((int)raw->joy2x) - 128;
-        cooked->joy2y = ((int)raw->joy2y) - 128;
+        next.buttons = (~raw->buttons) & 0xffff;
+        next.ltrig = raw->ltrig;
+        next.rtrig = raw->rtrig;
+        next.joyx = ((int)raw->joyx) - 128;
+        next.joyy = ((int)raw->joyy) - 128;
+        next.joy2x = ((int)raw->joy2x) - 128;
+        next.joy2y = ((int)raw->joy2y) - 128;
+
+        /* Record it if anything changed */
+        if(!frm->dev->status_valid || memcmp(cooked, &next, sizeof(next)))
+            maple_event_push(frm->dev, &next, sizeof(next));
+
+        *cooked = next;
         frm->dev->status_valid = 1;
 
         /* Check for magic button sequences */
@@ -108,7 +114,9 @@ periodic:
 attach:
     NULL,
 detach:
-    NULL
+    NULL,
+flags:
+    MAPLE_DRV_INPUT
 };
 
 /* Add the controller to the driver chain */
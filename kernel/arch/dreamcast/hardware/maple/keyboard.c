@@ -300,6 +300,12 @@ static void kbd_reply(maple_frame_t *frm) {
     if(frm->dev) {
         state = (kbd_state_t *)frm->dev->status;
         cond = (kbd_cond_t *)&state->cond;
+
+        /* Record it if any keys or modifiers changed */
+        if(!frm->dev->status_valid ||
+                memcmp(cond, respbuf + 1, sizeof(kbd_cond_t)))
+            maple_event_push(frm->dev, respbuf + 1, sizeof(kbd_cond_t));
+
         memcpy(cond, respbuf + 1, (resp->data_len - 1) * 4);
         frm->dev->status_valid = 1;
         kbd_check_poll(frm);
@@ -366,7 +372,8 @@ static maple_driver_t kbd_drv = {
     name:       "Keyboard Driver",
     periodic:   kbd_periodic,
     attach:     kbd_attach,
-    detach:     NULL
+    detach:     NULL,
+    flags:      MAPLE_DRV_INPUT
 };
 
 /* Add the keyboard to the driver chain */
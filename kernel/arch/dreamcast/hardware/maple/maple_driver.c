@@ -39,6 +39,7 @@ int maple_driver_attach(maple_frame_t *det) {
     dev->info.product_name[29] = 0;
     dev->info.product_license[59] = 0;
     memset(dev->status, 0, sizeof(dev->status));
+    memset(&dev->events, 0, sizeof(dev->events));
     dev->drv = NULL;
 
     /* Go through the list and look for a matching driver */
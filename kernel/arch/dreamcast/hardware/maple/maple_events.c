@@ -0,0 +1,89 @@
+/* KallistiOS ##version##
+
+   maple_events.c
+
+*/
+
+/* Per-device rings of timestamped input state changes. The input drivers
+   push from their response callbacks in the DMA interrupt, and one thread
+   pops, so the ring needs no lock: the producer only writes head and the
+   consumer only writes tail, and each copies the event before moving its
+   index along. The SH4 doesn't reorder stores, so all that's needed is to
+   keep the compiler from doing it. */
+
+#include <string.h>
+#include <dc/maple.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
+
+#define barrier() __asm__ __volatile__("" : : : "memory")
+
+#define RING_MASK   (MAPLE_EVENT_QUEUE_SIZE - 1)
+
+void maple_event_push(maple_device_t *dev, const void *state, int size) {
+    maple_event_ring_t *r = &dev->events;
+    maple_event_t *ev;
+    uint32 head = r->head;
+
+    /* Number each change even if it's dropped, so the gap shows */
+    if(head - r->tail >= MAPLE_EVENT_QUEUE_SIZE) {
+        r->seq++;
+        r->stats.dropped++;
+        return;
+    }
+
+    if(size > (int)sizeof(ev->state))
+        size = sizeof(ev->state);
+
+    ev = &r->ev[head & RING_MASK];
+    ev->time = timer_us_gettime64();
+    ev->seq = r->seq++;
+    memcpy(ev->state, state, size);
+    memset((uint8 *)ev->state + size, 0, sizeof(ev->state) - size);
+
+    barrier();
+    r->head = head + 1;
+    r->stats.events++;
+}
+
+int maple_event_pop(maple_device_t *dev, maple_event_t *ev) {
+    maple_event_ring_t *r = &dev->events;
+    uint32 tail = r->tail, lat;
+
+    if(tail == r->head)
+        return -1;
+
+    barrier();
+    *ev = r->ev[tail & RING_MASK];
+    barrier();
+    r->tail = tail + 1;
+
+    lat = (uint32)(timer_us_gettime64() - ev->time);
+    r->stats.popped++;
+    r->stats.latency_total += lat;
+
+    if(lat > r->stats.latency_max)
+        r->stats.latency_max = lat;
+
+    return 0;
+}
+
+int maple_event_count(maple_device_t *dev) {
+    return (int)(dev->events.head - dev->events.tail);
+}
+
+void maple_event_clear(maple_device_t *dev) {
+    dev->events.tail = dev->events.head;
+}
+
+void maple_event_get_stats(maple_device_t *dev, maple_event_stats_t *stats) {
+    int old = irq_disable();
+    *stats = dev->events.stats;
+    irq_restore(old);
+}
+
+void maple_event_reset_stats(maple_device_t *dev) {
+    int old = irq_disable();
+    memset(&dev->events.stats, 0, sizeof(maple_event_stats_t));
+    irq_restore(old);
+}
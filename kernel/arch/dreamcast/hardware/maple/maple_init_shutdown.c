@@ -78,6 +78,8 @@ int maple_hw_init() {
 
     /* Initialize other misc stuff */
     maple_state.vbl_cntr = maple_state.dma_cntr = 0;
+    maple_state.subframe_cntr = 0;
+    maple_state.flush_pending = 0;
     maple_state.detect_port_next = 0;
     maple_state.detect_unit_next = 0;
     maple_state.detect_wrapped = 0;
@@ -102,7 +104,8 @@ void maple_hw_shutdown() {
     int p, u, cnt;
     uint32  ptr;
 
-    /* Unhook interrupts */
+    /* Stop any sub-frame polling, then unhook interrupts */
+    maple_subframe_poll(0);
     vblank_handler_remove(maple_state.vbl_handle);
     asic_evt_set_handler(ASIC_EVT_MAPLE_DMA, NULL);
     asic_evt_disable(ASIC_EVT_MAPLE_DMA, ASIC_IRQ_DEFAULT);
@@ -8,9 +8,13 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
 #include <dc/maple.h>
 #include <dc/asic.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
 #include <kos/thread.h>
+#include <kos/ktimer.h>
 
 /*********************************************************************/
 /* VBlank IRQ handler */
@@ -165,6 +169,93 @@ static void vbl_autodetect() {
     vbl_ad_advance();
 }
 
+/*********************************************************************/
+/* Sub-frame input polling */
+
+static ktimer_t subframe_timer;
+static int subframe_ready;
+static int subframe_left;
+static uint64 last_vbl;
+static uint32 frame_us = 16667;
+
+/* Run one extra round: have the input drivers queue their GETCONDs and
+   send them now, or as soon as the DMA that's running completes. */
+static void subframe_cb(ktimer_t *t, void *data) {
+    maple_driver_t *drv;
+    int old;
+
+    (void)data;
+
+    old = irq_disable();
+
+    /* The vblank handler arms us again for the next frame */
+    if(--subframe_left <= 0)
+        ktimer_cancel(t);
+
+    if(maple_state.subframe_rounds) {
+        maple_state.subframe_cntr++;
+
+        LIST_FOREACH(drv, &maple_state.driver_list, drv_list) {
+            if((drv->flags & MAPLE_DRV_INPUT) && drv->periodic != NULL)
+                drv->periodic(drv);
+        }
+
+        if(!maple_state.dma_in_progress)
+            maple_queue_flush();
+        else
+            maple_state.flush_pending = 1;
+    }
+
+    irq_restore(old);
+}
+
+/* Measure the frame, and spread this frame's extra rounds over it */
+static void vbl_subframe(void) {
+    uint64 now = timer_us_gettime64();
+    uint32 period;
+
+    /* Ignore gaps from when vblanks were held off */
+    if(last_vbl && now - last_vbl < 40000)
+        frame_us = (uint32)(now - last_vbl);
+
+    last_vbl = now;
+
+    if(!maple_state.subframe_rounds)
+        return;
+
+    period = frame_us / (maple_state.subframe_rounds + 1) / 1000;
+
+    if(!period)
+        period = 1;
+
+    subframe_left = maple_state.subframe_rounds;
+    ktimer_arm(&subframe_timer, period, period);
+}
+
+int maple_subframe_poll(int rounds) {
+    int old;
+
+    if(rounds < 0 || rounds > MAPLE_SUBFRAME_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    old = irq_disable();
+
+    if(!subframe_ready) {
+        ktimer_setup(&subframe_timer, subframe_cb, NULL);
+        subframe_ready = 1;
+    }
+
+    maple_state.subframe_rounds = rounds;
+    irq_restore(old);
+
+    if(!rounds)
+        ktimer_cancel(&subframe_timer);
+
+    return 0;
+}
+
 /* Called on every VBL (~60fps) */
 void maple_vbl_irq_hnd(uint32 code) {
     maple_driver_t *drv;
@@ -189,6 +280,9 @@ void maple_vbl_irq_hnd(uint32 code) {
     if(!maple_state.dma_in_progress)
         maple_queue_flush();
 
+    /* Schedule any extra input polling for this frame */
+    vbl_subframe();
+
     /* dbgio_write_str("finish vbl_irq_hnd\n"); */
 }
 
@@ -240,6 +334,9 @@ void maple_dma_irq_hnd(uint32 code) {
            this isn't a good practice for non-TAILQ types =) */
         maple_queue_remove(i);
 
+        if(i->dev && i->cmd == MAPLE_COMMAND_GETCOND)
+            i->dev->events.stats.polls++;
+
         /* If it's got a callback, call it; otherwise unlock
            it manually (or it'll never get used again) */
         if(i->callback != NULL)
@@ -248,6 +345,12 @@ void maple_dma_irq_hnd(uint32 code) {
             maple_frame_unlock(i);
     }
 
+    /* Send a sub-frame round that came in while that DMA was running */
+    if(maple_state.flush_pending) {
+        maple_state.flush_pending = 0;
+        maple_queue_flush();
+    }
+
     /* dbgio_write_str("finish dma_irq_hnd\n"); */
 }
 
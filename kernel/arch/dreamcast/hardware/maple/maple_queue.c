@@ -7,56 +7,155 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <dc/maple.h>
 #include <arch/irq.h>
+#include <arch/timer.h>
+
+/* Per-class budgets, in words of bus traffic per round (0 is no limit) */
+static int sched_budget[MAPLE_CLASS_COUNT] = {
+    0, MAPLE_STORAGE_BUDGET, MAPLE_BULK_BUDGET
+};
+
+/* Port that goes first next round */
+static int sched_port;
+
+static maple_sched_stats_t sched_stats;
+
+/* Pick a scheduling class for a frame from its command */
+static int frame_class(maple_frame_t *frame) {
+    switch(frame->cmd) {
+        case MAPLE_COMMAND_DEVINFO:
+        case MAPLE_COMMAND_ALLINFO:
+        case MAPLE_COMMAND_RESET:
+        case MAPLE_COMMAND_KILL:
+            return MAPLE_CLASS_INPUT;
+
+        case MAPLE_COMMAND_GETCOND:
+            /* The microphone and camera poll for big chunks of data */
+            if(frame->dev && frame->dev->drv &&
+                    (frame->dev->drv->flags & MAPLE_DRV_INPUT))
+                return MAPLE_CLASS_INPUT;
+
+            return MAPLE_CLASS_BULK;
+
+        case MAPLE_COMMAND_GETMINFO:
+        case MAPLE_COMMAND_BREAD:
+        case MAPLE_COMMAND_BWRITE:
+        case MAPLE_COMMAND_BSYNC:
+            return MAPLE_CLASS_STORAGE;
+
+        default:
+            return MAPLE_CLASS_BULK;
+    }
+}
+
+/* Guess at the bus traffic of a frame, in words: the request and its
+   reply. Only block reads and device info have big replies. */
+static int frame_cost(maple_frame_t *frame) {
+    int cost = 2 + frame->length;
+
+    switch(frame->cmd) {
+        case MAPLE_COMMAND_BREAD:
+            return cost + 3 + 128;
+
+        case MAPLE_COMMAND_DEVINFO:
+            return cost + 1 + sizeof(maple_devinfo_t) / 4;
+
+        default:
+            return cost + 8;
+    }
+}
+
+/* Write a frame's descriptor into the DMA buffer */
+static uint32 *frame_emit(uint32 *out, maple_frame_t *i) {
+    /* First word: message length and destination port */
+    *out++ = i->length | (i->dst_port << 16);
+
+    /* Second word: receive buffer physical address */
+    *out++ = ((uint32)i->recv_buf) & 0x1fffffff;
+
+    /* Third word: command, addressing, packet length */
+    *out++ = (i->cmd & 0xff) | (maple_addr(i->dst_port, i->dst_unit) << 8)
+             | ((i->dst_port << 6) << 16)
+             | ((i->length & 0xff) << 24);
 
-/* Send all queued frames */
+    /* Finally, parameter words, if any */
+    if(i->length > 0) {
+        assert(i->send_buf != NULL);
+        memcpy(out, i->send_buf, i->length * 4);
+        out += i->length;
+    }
+
+    return out;
+}
+
+/* Send queued frames, a class at a time, going round the ports taking one
+   frame from each until the class runs dry or out of budget. */
 void maple_queue_flush() {
-    int     cnt, amt;
+    int     cnt, amt, c, n, p, used, cost, more, stop;
     uint32      *out, *last;
     maple_frame_t   *i;
 
-    cnt = amt = 0;
+    cnt = amt = stop = 0;
     out = (uint32 *)maple_state.dma_buffer;
     last = NULL;
 
-    /* Go through and process each frame... */
-    TAILQ_FOREACH(i, &maple_state.frame_queue, frameq) {
-        /* Are we running out of space? */
-        if((i->length * 4 + amt) > MAPLE_DMA_SIZE)
-            break;
+    for(c = 0; c < MAPLE_CLASS_COUNT && stop < 2; c++) {
+        used = stop = 0;
+
+        do {
+            more = 0;
 
-        /* Is this frame stale? */
-        if(i->state != MAPLE_FRAME_UNSENT)
-            continue;
+            for(n = 0; n < MAPLE_PORT_COUNT && !stop; n++) {
+                p = (sched_port + n) % MAPLE_PORT_COUNT;
 
-        i->state = MAPLE_FRAME_SENT;
+                TAILQ_FOREACH(i, &maple_state.frame_queue, frameq) {
+                    if(i->state == MAPLE_FRAME_UNSENT &&
+                            i->sched_class == c && i->dst_port == p)
+                        break;
+                }
 
-        /* Save the last descriptor head for the "last" flag */
-        last = out;
+                if(i == NULL)
+                    continue;
 
-        /* First word: message length and destination port */
-        *out++ = i->length | (i->dst_port << 16);
+                /* Are we running out of space? That's it for this round. */
+                if((i->length + 3) * 4 + amt > MAPLE_DMA_SIZE) {
+                    stop = 2;
+                    break;
+                }
 
-        /* Second word: receive buffer physical address */
-        *out++ = ((uint32)i->recv_buf) & 0x1fffffff;
+                /* Out of budget? Always send one, so nothing starves. */
+                cost = frame_cost(i);
 
-        /* Third word: command, addressing, packet length */
-        *out++ = (i->cmd & 0xff) | (maple_addr(i->dst_port, i->dst_unit) << 8)
-                 | ((i->dst_port << 6) << 16)
-                 | ((i->length & 0xff) << 24);
+                if(used && sched_budget[c] && used + cost > sched_budget[c]) {
+                    stop = 1;
+                    break;
+                }
 
-        /* Finally, parameter words, if any */
-        if(i->length > 0) {
-            assert(i->send_buf != NULL);
-            memcpy(out, i->send_buf, i->length * 4);
-            out += i->length;
-        }
+                i->state = MAPLE_FRAME_SENT;
 
-        cnt++;
-        amt += i->length * 4;
+                /* Save the last descriptor head for the "last" flag */
+                last = out;
+                out = frame_emit(out, i);
+
+                used += cost;
+                cnt++;
+                amt += (i->length + 3) * 4;
+                sched_stats.cls[c].sent++;
+                more = 1;
+            }
+        } while(more && !stop);
     }
 
+    /* Count whatever has to wait for another round */
+    TAILQ_FOREACH(i, &maple_state.frame_queue, frameq) {
+        if(i->state == MAPLE_FRAME_UNSENT)
+            sched_stats.cls[i->sched_class].deferred++;
+    }
+
+    sched_port = (sched_port + 1) % MAPLE_PORT_COUNT;
+
     /* Did we actually do anything...? */
     if(cnt > 0) {
         /* Tack on the "last" bit to the last one */
@@ -67,11 +166,13 @@ void maple_queue_flush() {
         maple_dma_addr(maple_state.dma_buffer);
         maple_dma_start();
         maple_state.dma_in_progress = 1;
+        sched_stats.rounds++;
     }
 }
 
 /* Submit a frame for queueing; see header for notes */
 int maple_queue_frame(maple_frame_t *frame) {
+    maple_class_stats_t *st;
     uint32 save = 0;
 
     /* Don't add it twice */
@@ -86,9 +187,19 @@ int maple_queue_frame(maple_frame_t *frame) {
     /* Assign it a device, if applicable */
     frame->dev = &maple_state.ports[frame->dst_port].units[frame->dst_unit];
 
+    /* And a class, if the driver didn't */
+    if(frame->sched_class < 0 || frame->sched_class >= MAPLE_CLASS_COUNT)
+        frame->sched_class = frame_class(frame);
+
     /* Put it on the queue */
     TAILQ_INSERT_TAIL(&maple_state.frame_queue, frame, frameq);
     frame->queued = 1;
+    frame->queue_time = timer_us_gettime64();
+
+    st = &sched_stats.cls[frame->sched_class];
+
+    if(++st->queued > st->queued_max)
+        st->queued_max = st->queued;
 
     /* Restore interrupts */
     if(!irq_inside_int())
@@ -99,7 +210,8 @@ int maple_queue_frame(maple_frame_t *frame) {
 
 /* Remove a used frame from the queue */
 int maple_queue_remove(maple_frame_t *frame) {
-    uint32 save = 0;
+    maple_class_stats_t *st;
+    uint32 save = 0, lat;
 
     /* Don't remove twice */
     if(!frame->queued)
@@ -114,6 +226,18 @@ int maple_queue_remove(maple_frame_t *frame) {
     TAILQ_REMOVE(&maple_state.frame_queue, frame, frameq);
     frame->queued = 0;
 
+    st = &sched_stats.cls[frame->sched_class];
+    st->queued--;
+
+    if(frame->state == MAPLE_FRAME_RESPONDED) {
+        lat = (uint32)(timer_us_gettime64() - frame->queue_time);
+        st->completed++;
+        st->latency_total += lat;
+
+        if(lat > st->latency_max)
+            st->latency_max = lat;
+    }
+
     /* Restore interrupts */
     if(!irq_inside_int())
         irq_restore(save);
@@ -159,6 +283,7 @@ void maple_frame_init(maple_frame_t *frame) {
     frame->length = 0;
     frame->queued = 0;
     frame->dev = NULL;
+    frame->sched_class = -1;
     frame->send_buf = NULL;
     frame->callback = NULL;
 }
@@ -191,3 +316,36 @@ void maple_frame_unlock(maple_frame_t *frame) {
     frame->state = MAPLE_FRAME_VACANT;
 }
 
+int maple_sched_set_budget(int cls, int words) {
+    if(cls < 0 || cls >= MAPLE_CLASS_COUNT || words < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_budget[cls] = words;
+    return 0;
+}
+
+void maple_sched_get_stats(maple_sched_stats_t *stats) {
+    int old = irq_disable();
+    *stats = sched_stats;
+    irq_restore(old);
+}
+
+void maple_sched_reset_stats(void) {
+    int old = irq_disable();
+    int c;
+
+    sched_stats.rounds = 0;
+
+    for(c = 0; c < MAPLE_CLASS_COUNT; c++) {
+        sched_stats.cls[c].queued_max = sched_stats.cls[c].queued;
+        sched_stats.cls[c].sent = 0;
+        sched_stats.cls[c].deferred = 0;
+        sched_stats.cls[c].completed = 0;
+        sched_stats.cls[c].latency_total = 0;
+        sched_stats.cls[c].latency_max = 0;
+    }
+
+    irq_restore(old);
+}
@@ -14,6 +14,7 @@ static void mouse_reply(maple_frame_t *frm) {
     uint32          *respbuf;
     mouse_cond_t        *raw;
     mouse_state_t       *cooked;
+    uint32          buttons;
 
     /* Unlock the frame now (it's ok, we're in an IRQ) */
     maple_frame_unlock(frm);
@@ -37,10 +38,17 @@ static void mouse_reply(maple_frame_t *frm) {
 
         /* Fill the "nice" struct from the raw data */
         cooked = (mouse_state_t *)(frm->dev->status);
+        buttons = cooked->buttons;
         cooked->buttons = (~raw->buttons) & 14;
         cooked->dx = raw->dx - MOUSE_DELTA_CENTER;
         cooked->dy = raw->dy - MOUSE_DELTA_CENTER;
         cooked->dz = raw->dz - MOUSE_DELTA_CENTER;
+
+        /* Record it if the buttons changed or the mouse moved */
+        if(!frm->dev->status_valid || buttons != cooked->buttons ||
+                cooked->dx || cooked->dy || cooked->dz)
+            maple_event_push(frm->dev, cooked, sizeof(mouse_state_t));
+
         frm->dev->status_valid = 1;
     }
 }
@@ -80,7 +88,9 @@ periodic:
 attach:
     NULL,
 detach:
-    NULL
+    NULL,
+flags:
+    MAPLE_DRV_INPUT
 };
 
 /* Add the mouse to the driver chain */
@@ -0,0 +1,138 @@
+/* KallistiOS ##version##
+
+   pvr_batch.c
+
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <dc/pvr.h>
+#include <dc/sq.h>
+#include <dc/matrix.h>
+#include "pvr_internal.h"
+
+/*
+
+   Batched primitive submission
+
+   pvr_prim_batch() ties the matrix code and primitive submission together:
+   one pass over the input transforms, clips and packs each vertex, writing
+   it either straight into the DMA vertex buffer or into a small staging
+   area that is pushed to the TA with the store queues. The actual work is
+   in pvr_batch_core.h, which is also built on the host.
+
+*/
+
+#define PVRB_TRANSFORM(x, y, z, w) mat_trans_nodiv(x, y, z, w)
+#include "pvr_batch_core.h"
+
+/* Number of vertices staged before each store queue burst. */
+#define SQ_STAGE_VERTS  64
+
+static pvr_vertex_t sq_stage[SQ_STAGE_VERTS] __attribute__((aligned(32)));
+
+static float batch_near = 0.0001f;
+
+static int sq_flush(pvrb_sink_t *s) {
+    int n = s->ptr - sq_stage;
+
+    if(n)
+        sq_cpy((void *)PVR_TA_INPUT, sq_stage, n * sizeof(pvr_vertex_t));
+
+    s->ptr = sq_stage;
+    s->end = sq_stage + SQ_STAGE_VERTS;
+
+    return 0;
+}
+
+/* DMA output goes straight into the list's vertex buffer. The buffer's
+   write pointer is only advanced once the whole batch is in, so a batch
+   that doesn't fit leaves nothing behind. */
+typedef struct {
+    pvrb_sink_t s;
+    int         list;
+} dma_sink_t;
+
+static void dma_window(dma_sink_t *d, uint32 off) {
+    volatile pvr_dma_buffers_t * b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    /* Leave room for the end-of-list marker added by pvr_scene_finish(). */
+    d->s.ptr = (pvr_vertex_t *)(b->base[d->list] + off);
+    d->s.end = (pvr_vertex_t *)(b->base[d->list] + b->size[d->list]) - 1;
+}
+
+static int dma_flush(pvrb_sink_t *s) {
+    dma_sink_t *d = (dma_sink_t *)s;
+    volatile pvr_dma_buffers_t * b = pvr_state.dma_buffers + pvr_state.ram_target;
+    uint32 off = (uint8 *)s->ptr - b->base[d->list];
+
+    /* The committed write pointer doesn't include this batch yet, so room
+       is counted from where the batch has got to. This may move the buffer,
+       taking the batch so far with it. */
+    if(pvr_vertbuf_room_at(d->list, off,
+                           PVRB_MAX_TRI_VERTS * sizeof(pvr_vertex_t),
+                           PVR_ROOM_GROW | PVR_ROOM_NOASSERT) < 0)
+        return -1;
+
+    dma_window(d, off);
+    return 0;
+}
+
+void pvr_batch_set_near(float w) {
+    assert(w > 0.0f);
+    batch_near = w;
+}
+
+int pvr_prim_batch(pvr_list_t list, const pvr_poly_hdr_t *hdr,
+                   const pvr_batch_vtx_t *verts, int count, int mode) {
+    volatile pvr_dma_buffers_t * b;
+    pvrb_sink_t s;
+    dma_sink_t d;
+
+    if(count < 3 || (mode == PVR_BATCH_TRIS && count % 3)) {
+        dbglog(DBG_WARNING, "pvr_prim_batch: bad vertex count %d\n", count);
+        return -1;
+    }
+
+    if(pvr_state.dma_mode) {
+        /* Overflows are counted in the stats and handled according to the
+           policy set with pvr_set_vertbuf_policy(), except that they're
+           returned rather than asserted on. */
+        if(pvr_vertbuf_room(list, sizeof(pvr_poly_hdr_t),
+                            PVR_ROOM_GROW | PVR_ROOM_NOASSERT) < 0)
+            return -1;
+
+        b = pvr_state.dma_buffers + pvr_state.ram_target;
+        assert(b->base[list]);
+
+        d.list = list;
+        d.s.flush = dma_flush;
+        dma_window(&d, b->ptr[list]);
+
+        memcpy(d.s.ptr++, hdr, sizeof(pvr_poly_hdr_t));
+
+        if(pvrb_submit(verts, count, mode, batch_near, &d.s) < 0)
+            return -1;
+
+        /* Only commit once the whole batch is in. */
+        b->ptr[list] = (uint8 *)d.s.ptr - b->base[list];
+    }
+    else {
+        if(pvr_state.list_reg_open != (int)list) {
+            dbglog(DBG_WARNING, "pvr_prim_batch: list %d is not open\n",
+                   (int)list);
+            return -1;
+        }
+
+        sq_cpy((void *)PVR_TA_INPUT, (void *)hdr, sizeof(pvr_poly_hdr_t));
+
+        s.ptr = sq_stage;
+        s.end = sq_stage + SQ_STAGE_VERTS;
+        s.flush = sq_flush;
+
+        pvrb_submit(verts, count, mode, batch_near, &s);
+        sq_flush(&s);
+    }
+
+    return 0;
+}
@@ -0,0 +1,251 @@
+/* KallistiOS ##version##
+
+   pvr_batch_core.h
+
+ */
+
+#ifndef __PVR_BATCH_CORE_H
+#define __PVR_BATCH_CORE_H
+
+/* The transform / near clip / pack stage of pvr_prim_batch().
+
+   This is kept free of any hardware access so that the same code can be
+   built on the host for benchmarking and checking the clipper. Before
+   including this file, the includer must provide:
+
+     - uint32, pvr_vertex_t, pvr_batch_vtx_t, PVR_CMD_VERTEX,
+       PVR_CMD_VERTEX_EOL, PVR_BATCH_TRIS and PVR_BATCH_STRIP (normally from
+       dc/pvr.h)
+     - PVRB_TRANSFORM(x, y, z, w), which transforms a point in place without
+       the perspective divide (mat_trans_nodiv() on the Dreamcast)
+
+   Everything in here is static, so each includer gets its own copy.
+
+   Vertices are transformed once each. Anything with w at or beyond the near
+   plane is packed straight out; triangles that cross the plane are clipped
+   in clip space (before the divide) into a triangle or a quad, which is
+   emitted as its own strip. Strips that are entirely in front of the near
+   plane are passed through as strips. */
+
+/* A vertex after transformation, before the perspective divide. */
+typedef struct pvrb_cvtx {
+    float   x, y, z, w;
+    float   u, v;
+    uint32  argb, oargb;
+} pvrb_cvtx_t;
+
+/* Where packed vertices go. The packer writes from ptr up to end, and calls
+   flush() whenever there is less than PVRB_MAX_TRI_VERTS of room left. A
+   flush must either make room and return 0, or return -1 to abort. */
+typedef struct pvrb_sink {
+    pvr_vertex_t    *ptr;
+    pvr_vertex_t    *end;
+    int (*flush)(struct pvrb_sink *s);
+} pvrb_sink_t;
+
+/* A clipped triangle becomes at most a quad. */
+#define PVRB_MAX_TRI_VERTS  4
+
+static inline void pvrb_xform(const pvr_batch_vtx_t *in, pvrb_cvtx_t *out) {
+    float x = in->x, y = in->y, z = in->z, w = 1.0f;
+
+    PVRB_TRANSFORM(x, y, z, w);
+
+    out->x = x;
+    out->y = y;
+    out->z = z;
+    out->w = w;
+    out->u = in->u;
+    out->v = in->v;
+    out->argb = in->argb;
+    out->oargb = in->oargb;
+}
+
+static inline void pvrb_put(pvrb_sink_t *s, const pvrb_cvtx_t *c,
+                            uint32 flags) {
+    pvr_vertex_t *d = s->ptr++;
+    float iw = 1.0f / c->w;
+
+    d->flags = flags;
+    d->x = c->x * iw;
+    d->y = c->y * iw;
+    d->z = iw;
+    d->u = c->u;
+    d->v = c->v;
+    d->argb = c->argb;
+    d->oargb = c->oargb;
+}
+
+/* Blend two packed colors, t in [0, 256]. Each channel sum stays below
+   65536, so the two channel pairs never carry into each other. */
+static inline uint32 pvrb_lerp_argb(uint32 a, uint32 b, uint32 t) {
+    uint32 rb, ag;
+
+    rb = (a & 0x00ff00ff) * (256 - t) + (b & 0x00ff00ff) * t;
+    ag = ((a >> 8) & 0x00ff00ff) * (256 - t) + ((b >> 8) & 0x00ff00ff) * t;
+
+    return ((rb >> 8) & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+/* The point where the edge a->b crosses w == near. */
+static inline void pvrb_lerp(pvrb_cvtx_t *o, const pvrb_cvtx_t *a,
+                             const pvrb_cvtx_t *b, float near) {
+    float t = (near - a->w) / (b->w - a->w);
+    uint32 ti = (uint32)(t * 256.0f);
+
+    o->x = a->x + t * (b->x - a->x);
+    o->y = a->y + t * (b->y - a->y);
+    o->z = a->z + t * (b->z - a->z);
+    o->w = near;
+    o->u = a->u + t * (b->u - a->u);
+    o->v = a->v + t * (b->v - a->v);
+    o->argb = pvrb_lerp_argb(a->argb, b->argb, ti);
+    o->oargb = pvrb_lerp_argb(a->oargb, b->oargb, ti);
+}
+
+/* Clip a triangle that is partly behind the near plane and emit what's
+   left as a standalone strip. Winding is preserved: a quad p0 p1 p2 p3 goes
+   out as p0 p1 p3 p2. */
+static inline void pvrb_clip_tri(pvrb_sink_t *s, const pvrb_cvtx_t *a,
+                                 const pvrb_cvtx_t *b, const pvrb_cvtx_t *c,
+                                 float near) {
+    const pvrb_cvtx_t *in[3] = { a, b, c };
+    pvrb_cvtx_t out[4];
+    int i, n = 0, ain, bin;
+
+    for(i = 0; i < 3; i++) {
+        a = in[i];
+        b = in[i == 2 ? 0 : i + 1];
+        ain = a->w >= near;
+        bin = b->w >= near;
+
+        if(ain)
+            out[n++] = *a;
+
+        if(ain != bin)
+            pvrb_lerp(out + n++, a, b, near);
+    }
+
+    if(n == 3) {
+        pvrb_put(s, out + 0, PVR_CMD_VERTEX);
+        pvrb_put(s, out + 1, PVR_CMD_VERTEX);
+        pvrb_put(s, out + 2, PVR_CMD_VERTEX_EOL);
+    }
+    else if(n == 4) {
+        pvrb_put(s, out + 0, PVR_CMD_VERTEX);
+        pvrb_put(s, out + 1, PVR_CMD_VERTEX);
+        pvrb_put(s, out + 3, PVR_CMD_VERTEX);
+        pvrb_put(s, out + 2, PVR_CMD_VERTEX_EOL);
+    }
+}
+
+static inline int pvrb_room(pvrb_sink_t *s) {
+    if(s->end - s->ptr >= PVRB_MAX_TRI_VERTS)
+        return 0;
+
+    return s->flush(s);
+}
+
+static int pvrb_submit_tris(const pvr_batch_vtx_t *v, int count, float near,
+                            pvrb_sink_t *s) {
+    pvrb_cvtx_t c[3];
+    int i, in;
+
+    for(i = 0; i + 2 < count; i += 3) {
+        if(pvrb_room(s) < 0)
+            return -1;
+
+        pvrb_xform(v + i, c + 0);
+        pvrb_xform(v + i + 1, c + 1);
+        pvrb_xform(v + i + 2, c + 2);
+
+        in = (c[0].w >= near) + (c[1].w >= near) + (c[2].w >= near);
+
+        if(in == 3) {
+            pvrb_put(s, c + 0, PVR_CMD_VERTEX);
+            pvrb_put(s, c + 1, PVR_CMD_VERTEX);
+            pvrb_put(s, c + 2, PVR_CMD_VERTEX_EOL);
+        }
+        else if(in) {
+            pvrb_clip_tri(s, c + 0, c + 1, c + 2, near);
+        }
+    }
+
+    return 0;
+}
+
+/* Strips keep a window of four transformed vertices: the three of the
+   current triangle plus one of lookahead, which tells us whether the strip
+   carries on past this triangle or the vertex we're about to write needs
+   the end-of-strip flag. */
+static int pvrb_submit_strip(const pvr_batch_vtx_t *v, int count, float near,
+                             pvrb_sink_t *s) {
+    pvrb_cvtx_t c[4];
+    const pvrb_cvtx_t *p0, *p1, *p2;
+    int t, open = 0, next;
+
+    pvrb_xform(v + 0, c + 0);
+    pvrb_xform(v + 1, c + 1);
+    pvrb_xform(v + 2, c + 2);
+
+    for(t = 0; t + 2 < count; t++) {
+        if(pvrb_room(s) < 0)
+            return -1;
+
+        if(t + 3 < count)
+            pvrb_xform(v + t + 3, c + ((t + 3) & 3));
+
+        p0 = c + (t & 3);
+        p1 = c + ((t + 1) & 3);
+        p2 = c + ((t + 2) & 3);
+
+        if(p0->w >= near && p1->w >= near && p2->w >= near) {
+            /* The next triangle shares p1 and p2, so it continues the strip
+               if its new vertex is also in front. */
+            next = t + 3 < count && c[(t + 3) & 3].w >= near;
+
+            if(open) {
+                pvrb_put(s, p2, next ? PVR_CMD_VERTEX : PVR_CMD_VERTEX_EOL);
+            }
+            else if(!(t & 1)) {
+                pvrb_put(s, p0, PVR_CMD_VERTEX);
+                pvrb_put(s, p1, PVR_CMD_VERTEX);
+                pvrb_put(s, p2, next ? PVR_CMD_VERTEX : PVR_CMD_VERTEX_EOL);
+            }
+            else {
+                /* A strip can only be restarted on an even triangle without
+                   flipping the winding of the rest; send this one alone. */
+                pvrb_put(s, p1, PVR_CMD_VERTEX);
+                pvrb_put(s, p0, PVR_CMD_VERTEX);
+                pvrb_put(s, p2, PVR_CMD_VERTEX_EOL);
+                next = 0;
+            }
+
+            open = next;
+        }
+        else {
+            if(p0->w >= near || p1->w >= near || p2->w >= near) {
+                if(t & 1)
+                    pvrb_clip_tri(s, p1, p0, p2, near);
+                else
+                    pvrb_clip_tri(s, p0, p1, p2, near);
+            }
+
+            open = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* Transform, clip and pack a batch into the sink. Returns 0, or -1 if the
+   sink ran out of room. */
+static int pvrb_submit(const pvr_batch_vtx_t *v, int count, int mode,
+                       float near, pvrb_sink_t *s) {
+    if(mode == PVR_BATCH_STRIP)
+        return pvrb_submit_strip(v, count, near, s);
+    else
+        return pvrb_submit_tris(v, count, near, s);
+}
+
+#endif  /* __PVR_BATCH_CORE_H */
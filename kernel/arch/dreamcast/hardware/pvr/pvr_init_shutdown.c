@@ -149,6 +149,10 @@ int pvr_init(pvr_init_params_t *params) {
     asic_evt_enable(ASIC_EVT_PVR_PTDONE, ASIC_IRQ_DEFAULT);
     asic_evt_set_handler(ASIC_EVT_PVR_RENDERDONE, pvr_int_handler);
     asic_evt_enable(ASIC_EVT_PVR_RENDERDONE, ASIC_IRQ_DEFAULT);
+    asic_evt_set_handler(ASIC_EVT_PVR_PRIMOUTOFMEM, pvr_int_handler);
+    asic_evt_enable(ASIC_EVT_PVR_PRIMOUTOFMEM, ASIC_IRQ_DEFAULT);
+    asic_evt_set_handler(ASIC_EVT_PVR_MATOUTOFMEM, pvr_int_handler);
+    asic_evt_enable(ASIC_EVT_PVR_MATOUTOFMEM, ASIC_IRQ_DEFAULT);
 
     /* 3d-specific parameters; these are all about rendering and
        nothing to do with setting up the video; some stuff in here
@@ -220,10 +224,17 @@ int pvr_shutdown() {
     asic_evt_disable(ASIC_EVT_PVR_PTDONE, ASIC_IRQ_DEFAULT);
     asic_evt_set_handler(ASIC_EVT_PVR_RENDERDONE, NULL);
     asic_evt_disable(ASIC_EVT_PVR_RENDERDONE, ASIC_IRQ_DEFAULT);
+    asic_evt_set_handler(ASIC_EVT_PVR_PRIMOUTOFMEM, NULL);
+    asic_evt_disable(ASIC_EVT_PVR_PRIMOUTOFMEM, ASIC_IRQ_DEFAULT);
+    asic_evt_set_handler(ASIC_EVT_PVR_MATOUTOFMEM, NULL);
+    asic_evt_disable(ASIC_EVT_PVR_MATOUTOFMEM, ASIC_IRQ_DEFAULT);
 
     /* Shut down PVR DMA */
     pvr_dma_shutdown();
 
+    /* Free any vertex buffers we allocated */
+    pvr_vertbuf_auto_free();
+
     /* Invalidate our memory pool */
     pvr_mem_reset();
 
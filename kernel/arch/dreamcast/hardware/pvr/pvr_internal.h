@@ -118,7 +118,6 @@
 #define PVR_OPB_TP      2
 #define PVR_OPB_TM      3
 #define PVR_OPB_PT      4
-#define PVR_OPB_COUNT   5
 
 // TA buffers structure: we have two sets of these
 typedef struct {
@@ -203,6 +202,19 @@ typedef struct {
     int     rnd_last_len;               // Render time for the last frame
     uint32  vtx_buf_used;               // Vertex buffer used size for the last frame
     uint32  vtx_buf_used_max;           // Maximum used vertex buffer size
+    uint32  ta_overflows;               // TA out-of-memory events (OPB or vertex buffer)
+
+    /* Vertex DMA buffer bookkeeping (DMA mode only). Sizes are per frame,
+       i.e. one half of what was passed to pvr_set_vertbuf(). */
+    uint32  dma_auto;                       // (1 << idx) for lists whose buffers we own and resize
+    uint32  dma_auto_min[PVR_OPB_COUNT];    // Size limits for those buffers
+    uint32  dma_auto_max[PVR_OPB_COUNT];
+    uint32  dma_hwm[PVR_OPB_COUNT];         // Slowly decaying high-water mark, for sizing
+    uint32  dma_stopped;                    // (1 << idx) for lists that overflowed this frame
+    int     dma_policy;                     // What to do on overflow (PVR_VERTBUF_*)
+    uint32  dma_used[PVR_OPB_COUNT];        // Bytes used by each list in the last frame
+    uint32  dma_used_max[PVR_OPB_COUNT];    // Most bytes used by each list in any frame
+    uint32  dma_overflows[PVR_OPB_COUNT];   // Number of overflows for each list
 
     /* Wait-ready semaphore: this will be signaled whenever the pvr_wait_ready()
        call should be ready to return. */
@@ -287,6 +299,26 @@ void pvr_blank_polyhdr(int type);
 void pvr_blank_polyhdr_buf(int type, pvr_poly_hdr_t * buf);
 
 
+/**** pvr_scene.c *****************************************************/
+
+/* Make sure amt more bytes fit in the current DMA buffer for the list (plus
+   the end-of-list marker). Returns 0 if so. Otherwise the overflow policy is
+   applied, the list stops accepting data for the rest of the frame, and -1
+   is returned. */
+#define PVR_ROOM_GROW       1   /* Grow the buffer if it's automatically sized */
+#define PVR_ROOM_NOASSERT   2   /* The caller reports the overflow, so the
+                                   assert policy just stops the list */
+int pvr_vertbuf_room(int list, uint32 amt, int flags);
+
+/* The same, for a caller that has already written past the committed write
+   pointer: room is counted from off, and if the buffer grows, everything
+   before off comes along. */
+int pvr_vertbuf_room_at(int list, uint32 off, uint32 amt, int flags);
+
+/* Free any automatically sized vertex buffers. */
+void pvr_vertbuf_auto_free(void);
+
+
 /**** pvr_irq.c *******************************************************/
 
 /* Interrupt handler for PVR events */
@@ -105,6 +105,11 @@ void pvr_int_handler(uint32 code) {
         case ASIC_EVT_PVR_VBLINT:
             pvr_sync_stats(PVR_SYNC_VBLANK);
             break;
+        case ASIC_EVT_PVR_PRIMOUTOFMEM:
+        case ASIC_EVT_PVR_MATOUTOFMEM:
+            // Nothing we can do about it now, but the stats will show it.
+            pvr_state.ta_overflows++;
+            return;
     }
 
     /* Update our stats if we finished all registration */
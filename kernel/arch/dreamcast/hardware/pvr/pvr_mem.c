@@ -6,36 +6,88 @@
  */
 
 #include <assert.h>
+#include <string.h>
+#include <stdio.h>
 #include <dc/pvr.h>
+#include <arch/cache.h>
+#include <kos/mutex.h>
+#include <kos/slab.h>
 #include "pvr_internal.h"
-#include <stdio.h>
-
-#include <malloc.h> /* For the struct mallinfo defs */
 
 #include <kos/opts.h>
 
 /*
 
-This module basically serves as a KOS-friendly front end and support routines
-for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
+This module manages texture memory: the part of PVR RAM above the frame and
+vertex buffers.
+
+Free space is kept in power-of-two size classes, which line up with the sizes
+of PVR textures (class n holds free blocks of 2^(n + 5) up to 2^(n + 6) - 1
+bytes). An allocation takes the first free block that fits from its own class,
+or any block from a bigger one, and splits off what it doesn't need. Freed
+blocks are merged with their free neighbours straight away.
+
+All of the bookkeeping lives in main RAM, not in PVR RAM: every block, used or
+free, has a descriptor on an address-ordered list. That means writing to texture
+memory can never corrupt the allocator, and blocks can be moved around.
 
-I was originally going to make a totally seperate thing that could be used
-to generically manage any memory pool, but then I realized what a gruelling
-and thankless task that would be when starting with dlmalloc, so we have this
-instead. ^_^;
+Blocks from pvr_mem_malloc() stay where they are. Blocks from
+pvr_mem_malloc_handle() are movable: pvr_mem_defrag() slides them down over the
+free space below them (or into a gap in front of a block that can't move),
+copying the data through a bounce buffer in main RAM and back with PVR DMA, and
+tells the owner through its callback.
 
 */
 
-/* Bring in some prototypes from pvr_mem_core.c */
-/* We can't directly include its header because of name clashes with
-   the real malloc header */
-extern void * pvr_int_malloc(size_t bytes);
-extern void pvr_int_free(void *ptr);
-extern struct mallinfo pvr_int_mallinfo();
-extern void pvr_int_mem_reset();
-extern void pvr_int_malloc_stats();
+/* Allocation granularity, and the size of the smallest size class */
+#define MEM_ALIGN       32
+#define MEM_ALIGN_SHIFT 5
+
+/* Number of size classes; the last one covers all of PVR RAM. */
+#define MEM_CLASSES     24
+
+/* Buckets in the table used to find the used block at a given address */
+#define MEM_HASH_SIZE   256
+
+/* How much pvr_mem_defrag() copies at a time */
+#define MEM_MOVE_CHUNK  8192
+
+/* A block of texture memory, used or free */
+struct pvr_mem_block {
+    uint32              base;       /* Address of the block */
+    uint32              size;       /* Size in bytes (a multiple of 32) */
+    int                 free;       /* Non-zero if the block is free */
+    int                 movable;    /* Non-zero if defrag may move it */
+    pvr_mem_move_cb_t   cb;         /* Called after a move (may be NULL) */
+    void                *cbdata;    /* Passed to cb */
+
+    TAILQ_ENTRY(pvr_mem_block)  addr;   /* All blocks, in address order */
+    LIST_ENTRY(pvr_mem_block)   list;   /* Size class or hash bucket */
+};
 
+typedef struct pvr_mem_block mblock_t;
+
+TAILQ_HEAD(mblock_queue, pvr_mem_block);
+LIST_HEAD(mblock_list, pvr_mem_block);
+
+static struct mblock_queue blocks;
+static struct mblock_list free_class[MEM_CLASSES];
+static struct mblock_list used_hash[MEM_HASH_SIZE];
+
+static slab_cache_t *mblock_slab = NULL;
+static mutex_t mem_mutex = MUTEX_INITIALIZER;
+
+/* Start and end of texture memory; a base of 0 means we aren't set up. */
+static uint32 mem_base = 0;
+static uint32 mem_top = 0;
+
+static pvr_mem_stats_t stats;
+
+/* Bounce buffer used to move blocks */
+static uint8 move_buf[MEM_MOVE_CHUNK] __attribute__((aligned(32)));
+
+#define CHECK_MEM_BASE assert_msg(mem_base != 0, \
+                                  "pvr_mem_* used, but PVR hasn't been initialized yet")
 
 #ifdef PVR_KM_DBG
 
@@ -55,35 +107,143 @@ static LIST_HEAD(memctl_list, memctl) block_list;
 
 #endif  /* PVR_KM_DBG */
 
+static int size_class(uint32 size) {
+    int c = 31 - __builtin_clz(size) - MEM_ALIGN_SHIFT;
 
-/* PVR RAM base; NULL is considered invalid */
-static pvr_ptr_t pvr_mem_base = NULL;
-#define CHECK_MEM_BASE assert_msg(pvr_mem_base != NULL, \
-                                  "pvr_mem_* used, but PVR hasn't been initialized yet")
+    return c < MEM_CLASSES ? c : MEM_CLASSES - 1;
+}
 
-/* Used in pvr_mem_core.c */
-void * pvr_int_sbrk(size_t amt) {
-    uint32 old, n;
+static inline int hash_of(uint32 base) {
+    return (base >> MEM_ALIGN_SHIFT) & (MEM_HASH_SIZE - 1);
+}
 
-    /* Are we valid? */
-    CHECK_MEM_BASE;
+static void free_insert(mblock_t *b) {
+    b->free = 1;
+    LIST_INSERT_HEAD(&free_class[size_class(b->size)], b, list);
+    stats.free_blocks++;
+}
+
+static void free_remove(mblock_t *b) {
+    LIST_REMOVE(b, list);
+    stats.free_blocks--;
+}
+
+static void used_insert(mblock_t *b) {
+    b->free = 0;
+    LIST_INSERT_HEAD(&used_hash[hash_of(b->base)], b, list);
+}
+
+static mblock_t *used_find(uint32 base) {
+    mblock_t *b;
+
+    LIST_FOREACH(b, &used_hash[hash_of(base)], list) {
+        if(b->base == base)
+            return b;
+    }
 
-    /* Try to increment it */
-    old = (uint32)pvr_mem_base;
-    n = old + amt;
+    return NULL;
+}
 
-    /* Did we run over? */
-    if(n > PVR_RAM_INT_TOP)
-        return (void *) - 1;
+/* Merge a free block (not on a free list) with any free neighbours, and put
+   the result on the right free list. */
+static void free_coalesce(mblock_t *b) {
+    mblock_t *n;
+
+    if((n = TAILQ_PREV(b, mblock_queue, addr)) && n->free) {
+        free_remove(n);
+        n->size += b->size;
+        TAILQ_REMOVE(&blocks, b, addr);
+        slab_free(mblock_slab, b);
+        b = n;
+    }
 
-    /* Nope, everything's cool */
-    pvr_mem_base = (pvr_ptr_t)n;
-    return (pvr_ptr_t)old;
+    if((n = TAILQ_NEXT(b, addr)) && n->free) {
+        free_remove(n);
+        b->size += n->size;
+        TAILQ_REMOVE(&blocks, n, addr);
+        slab_free(mblock_slab, n);
+    }
+
+    free_insert(b);
+}
+
+/* Find and claim a free block of at least size bytes, splitting off the
+   rest. */
+static mblock_t *block_alloc(uint32 size) {
+    mblock_t *b = NULL, *r;
+    int c;
+
+    /* The first block that fits in our own class, or any block at all from a
+       bigger one. */
+    c = size_class(size);
+
+    LIST_FOREACH(b, &free_class[c], list) {
+        if(b->size >= size)
+            break;
+    }
+
+    while(!b && ++c < MEM_CLASSES)
+        b = LIST_FIRST(&free_class[c]);
+
+    if(!b)
+        return NULL;
+
+    free_remove(b);
+
+    /* Give back what we don't need. */
+    if(b->size > size) {
+        if((r = (mblock_t *)slab_alloc(mblock_slab))) {
+            r->base = b->base + size;
+            r->size = b->size - size;
+            r->cb = NULL;
+            r->movable = 0;
+            TAILQ_INSERT_AFTER(&blocks, b, r, addr);
+            free_insert(r);
+            b->size = size;
+        }
+    }
+
+    used_insert(b);
+    stats.used_blocks++;
+    stats.used += b->size;
+
+    return b;
+}
+
+static void block_free(mblock_t *b) {
+    LIST_REMOVE(b, list);
+    stats.used_blocks--;
+    stats.used -= b->size;
+
+    if(b->movable)
+        stats.movable_blocks--;
+
+    b->cb = NULL;
+    b->movable = 0;
+    free_coalesce(b);
+}
+
+static mblock_t *mem_alloc(size_t size) {
+    mblock_t *b;
+
+    if(!size)
+        size = 1;
+
+    if(size > mem_top - mem_base)
+        b = NULL;
+    else
+        b = block_alloc((size + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1));
+
+    if(!b)
+        stats.failures++;
+
+    return b;
 }
 
 /* Allocate a chunk of memory from texture space; the returned value
    will be relative to the base of texture memory (zero-based) */
 pvr_ptr_t pvr_mem_malloc(size_t size) {
+    mblock_t *b;
     uint32 rv32;
 #ifdef PVR_KM_DBG
     uint32      ra = arch_get_ret_addr();
@@ -92,9 +252,10 @@ pvr_ptr_t pvr_mem_malloc(size_t size) {
 
     CHECK_MEM_BASE;
 
-    rv32 = (uint32)pvr_int_malloc(size);
-    assert_msg((rv32 & 0x1f) == 0,
-               "dlmalloc's alignment is broken; please make a bug report");
+    mutex_lock(&mem_mutex);
+    b = mem_alloc(size);
+    rv32 = b ? b->base : 0;
+    mutex_unlock(&mem_mutex);
 
 #ifdef PVR_KM_DBG
     ctl = malloc(sizeof(memctl_t));
@@ -115,6 +276,7 @@ pvr_ptr_t pvr_mem_malloc(size_t size) {
 
 /* Free a previously allocated chunk of memory */
 void pvr_mem_free(pvr_ptr_t chunk) {
+    mblock_t *b;
 #ifdef PVR_KM_DBG
     uint32      ra = arch_get_ret_addr();
     memctl_t    * ctl;
@@ -123,6 +285,9 @@ void pvr_mem_free(pvr_ptr_t chunk) {
 
     CHECK_MEM_BASE;
 
+    if(!chunk)
+        return;
+
 #ifdef PVR_KM_DBG_VERBOSE
     printf("Thread %d/%08lx freeing block @ %08lx\n",
            thd_current->tid, ra, (uint32)chunk);
@@ -147,7 +312,219 @@ void pvr_mem_free(pvr_ptr_t chunk) {
 
 #endif  /* PVR_KM_DBG */
 
-    pvr_int_free((void *)chunk);
+    mutex_lock(&mem_mutex);
+
+    if((b = used_find((uint32)chunk)))
+        block_free(b);
+    else
+        dbglog(DBG_ERROR, "pvr_mem_free: %08lx is not an allocated block\n",
+               (uint32)chunk);
+
+    mutex_unlock(&mem_mutex);
+}
+
+pvr_mem_handle_t pvr_mem_malloc_handle(size_t size, pvr_mem_move_cb_t cb,
+                                       void *data) {
+    mblock_t *b;
+
+    CHECK_MEM_BASE;
+
+    mutex_lock(&mem_mutex);
+
+    if((b = mem_alloc(size))) {
+        b->movable = 1;
+        b->cb = cb;
+        b->cbdata = data;
+        stats.movable_blocks++;
+    }
+
+    mutex_unlock(&mem_mutex);
+
+    return b;
+}
+
+void pvr_mem_free_handle(pvr_mem_handle_t h) {
+    CHECK_MEM_BASE;
+
+    if(!h)
+        return;
+
+    mutex_lock(&mem_mutex);
+    assert(!h->free);
+    block_free(h);
+    mutex_unlock(&mem_mutex);
+}
+
+pvr_ptr_t pvr_mem_handle_ptr(pvr_mem_handle_t h) {
+    return (pvr_ptr_t)h->base;
+}
+
+/* Copy a block's data down to a lower address. Going through the bounce
+   buffer from the start is safe even if the two overlap, since each chunk is
+   read before anything above it is written. */
+static void mem_move(uint32 dst, uint32 src, uint32 size) {
+    uint32 n;
+    int rv;
+
+    while(size) {
+        n = size > MEM_MOVE_CHUNK ? MEM_MOVE_CHUNK : size;
+
+        memcpy(move_buf, (void *)src, n);
+        dcache_flush_range((uint32)move_buf, n);
+
+        /* Keep the vertex DMA off the channel while we use it. If the DMA is
+           busy with something else anyway, the store queues will do. */
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+        rv = pvr_txr_load_dma(move_buf, (pvr_ptr_t)dst, n, 1, NULL, 0);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+
+        if(rv < 0)
+            pvr_txr_load(move_buf, (pvr_ptr_t)dst, n);
+
+        dst += n;
+        src += n;
+        size -= n;
+    }
+}
+
+/* Account for a block that has been moved and tell its owner. */
+static void block_moved(mblock_t *u, uint32 old) {
+    stats.moves++;
+    stats.moved_bytes += u->size;
+
+    if(u->cb)
+        u->cb(u, (pvr_ptr_t)old, (pvr_ptr_t)u->base, u->cbdata);
+}
+
+/* Slide movable block u down over the free block f right in front of it. The
+   two just trade places, then the free space is merged with whatever follows
+   it. */
+static void block_slide(mblock_t *f, mblock_t *u) {
+    uint32 old = u->base;
+
+    mem_move(f->base, old, u->size);
+
+    free_remove(f);
+    LIST_REMOVE(u, list);
+    TAILQ_REMOVE(&blocks, u, addr);
+    TAILQ_INSERT_BEFORE(f, u, addr);
+
+    u->base = f->base;
+    f->base += u->size;
+    used_insert(u);
+    free_coalesce(f);
+
+    block_moved(u, old);
+}
+
+/* Move movable block u, from somewhere further up, into the start of free
+   block f, which must be at least as big. If u doesn't fill it, f keeps the
+   rest; if it does, f's descriptor is reused for u's old spot. Returns -1 if
+   there's no memory to do the move. */
+static int block_fill(mblock_t *f, mblock_t *u) {
+    uint32 old = u->base, size = u->size;
+    mblock_t *r, *p;
+
+    if(f->size == size) {
+        /* An exact fit: u and f just trade places. */
+        mem_move(f->base, old, size);
+
+        free_remove(f);
+        LIST_REMOVE(u, list);
+
+        p = TAILQ_PREV(u, mblock_queue, addr);
+        TAILQ_REMOVE(&blocks, u, addr);
+        TAILQ_INSERT_BEFORE(f, u, addr);
+        TAILQ_REMOVE(&blocks, f, addr);
+        TAILQ_INSERT_AFTER(&blocks, p, f, addr);
+
+        u->base = f->base;
+        f->base = old;
+        r = f;
+    }
+    else {
+        /* u's old spot needs a new descriptor. */
+        if(!(r = (mblock_t *)slab_alloc(mblock_slab)))
+            return -1;
+
+        mem_move(f->base, old, size);
+
+        r->base = old;
+        r->size = size;
+        r->cb = NULL;
+        r->movable = 0;
+
+        free_remove(f);
+        LIST_REMOVE(u, list);
+
+        TAILQ_INSERT_AFTER(&blocks, u, r, addr);
+        TAILQ_REMOVE(&blocks, u, addr);
+        TAILQ_INSERT_BEFORE(f, u, addr);
+
+        u->base = f->base;
+        f->base += size;
+        f->size -= size;
+        free_insert(f);
+    }
+
+    used_insert(u);
+    free_coalesce(r);
+
+    block_moved(u, old);
+
+    return 0;
+}
+
+size_t pvr_mem_defrag(size_t budget) {
+    mblock_t *f, *n, *m, *best;
+    size_t moved = 0;
+
+    CHECK_MEM_BASE;
+
+    mutex_lock(&mem_mutex);
+
+    f = TAILQ_FIRST(&blocks);
+
+    while(f && (!budget || moved < budget)) {
+        if(!f->free || !(n = TAILQ_NEXT(f, addr))) {
+            f = TAILQ_NEXT(f, addr);
+            continue;
+        }
+
+        if(n->movable) {
+            /* Slide the next block down over this free space. */
+            moved += n->size;
+            block_slide(f, n);
+            continue;
+        }
+
+        /* The next block is stuck. See if something further up fits in
+           front of it, taking the biggest that does. */
+        best = NULL;
+
+        for(m = TAILQ_NEXT(n, addr); m; m = TAILQ_NEXT(m, addr)) {
+            if(!m->free && m->movable && m->size <= f->size &&
+               (!best || m->size > best->size))
+                best = m;
+        }
+
+        if(!best) {
+            f = n;
+            continue;
+        }
+
+        m = f->size == best->size ? n : f;
+
+        if(block_fill(f, best) < 0)
+            break;
+
+        moved += best->size;
+        f = m;
+    }
+
+    mutex_unlock(&mem_mutex);
+
+    return moved;
 }
 
 /* Check the memory block list to see what's allocated */
@@ -164,37 +541,136 @@ void pvr_mem_print_list() {
 #endif  /* PVR_KM_DBG */
 }
 
-/* Return the number of bytes available still in the memory pool */
-static uint32 pvr_mem_available_int() {
-    struct mallinfo mi = pvr_int_mallinfo();
+uint32 pvr_mem_available() {
+    CHECK_MEM_BASE;
 
-    /* This magic formula is modeled after mstats() */
-    return mi.arena - mi.uordblks;
+    return (mem_top - mem_base) - stats.used;
 }
 
-uint32 pvr_mem_available() {
+/* Size of the biggest free block. Everything in the highest non-empty class
+   is bigger than anything below it, so that's the only list to look at. */
+static uint32 largest_free(void) {
+    mblock_t *b;
+    uint32 rv = 0;
+    int c;
+
+    for(c = MEM_CLASSES - 1; c >= 0 && !rv; c--) {
+        LIST_FOREACH(b, &free_class[c], list) {
+            if(b->size > rv)
+                rv = b->size;
+        }
+    }
+
+    return rv;
+}
+
+void pvr_mem_get_stats(pvr_mem_stats_t *st) {
+    uint32 avail;
+
     CHECK_MEM_BASE;
 
-    return pvr_mem_available_int() + (PVR_RAM_INT_TOP - (uint32)pvr_mem_base);
+    mutex_lock(&mem_mutex);
+
+    *st = stats;
+    st->total = mem_top - mem_base;
+    st->free = avail = st->total - stats.used;
+    st->largest_free = largest_free();
+    st->fragmentation = avail ? 100 - (st->largest_free * 100ULL / avail) : 0;
+
+    mutex_unlock(&mem_mutex);
 }
 
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
 void pvr_mem_reset() {
-    if(!pvr_state.valid)
-        pvr_mem_base = NULL;
+    mblock_t *b;
+    int i;
+
+    mutex_lock(&mem_mutex);
+
+    /* Throw away every descriptor we have. */
+    if(mblock_slab) {
+        while((b = TAILQ_FIRST(&blocks))) {
+            TAILQ_REMOVE(&blocks, b, addr);
+            slab_free(mblock_slab, b);
+        }
+    }
+
+    TAILQ_INIT(&blocks);
+
+    for(i = 0; i < MEM_CLASSES; i++)
+        LIST_INIT(&free_class[i]);
+
+    for(i = 0; i < MEM_HASH_SIZE; i++)
+        LIST_INIT(&used_hash[i]);
+
+    memset(&stats, 0, sizeof(stats));
+
+    if(!pvr_state.valid) {
+        mem_base = mem_top = 0;
+
+        if(mblock_slab) {
+            slab_cache_destroy(mblock_slab);
+            mblock_slab = NULL;
+        }
+    }
     else {
-        pvr_mem_base = (pvr_ptr_t)(PVR_RAM_INT_BASE + pvr_state.texture_base);
-        pvr_int_mem_reset();
+        mem_base = PVR_RAM_INT_BASE + pvr_state.texture_base;
+        mem_top = PVR_RAM_INT_TOP;
+
+        if(!mblock_slab)
+            mblock_slab = slab_cache_create("pvr_mem", sizeof(mblock_t),
+                                            SLAB_DEFAULTS, NULL);
+
+        /* One free block covering all of texture memory */
+        assert_msg(mblock_slab, "pvr_mem_reset: out of memory");
+        b = (mblock_t *)slab_alloc(mblock_slab);
+        assert_msg(b, "pvr_mem_reset: out of memory");
+        b->base = mem_base;
+        b->size = mem_top - mem_base;
+        b->cb = NULL;
+        b->movable = 0;
+        TAILQ_INSERT_HEAD(&blocks, b, addr);
+        free_insert(b);
     }
+
+    mutex_unlock(&mem_mutex);
 }
 
 /* Print some statistics (like mallocstats) */
 void pvr_mem_stats() {
+    pvr_mem_stats_t st;
+    mblock_t *b;
+    int c, n;
+
+    pvr_mem_get_stats(&st);
+
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32)pvr_mem_base);
+    printf("texture RAM:   %08lx - %08lx (%lu bytes)\n", mem_base, mem_top,
+           st.total);
+    printf("in use:        %lu bytes in %lu blocks (%lu movable)\n", st.used,
+           st.used_blocks, st.movable_blocks);
+    printf("free:          %lu bytes in %lu blocks, largest %lu\n", st.free,
+           st.free_blocks, st.largest_free);
+    printf("fragmentation: %lu%%\n", st.fragmentation);
+    printf("defrag:        %lu moves, %lu bytes\n", st.moves, st.moved_bytes);
+    printf("failures:      %lu\n", st.failures);
+
+    mutex_lock(&mem_mutex);
+
+    for(c = 0; c < MEM_CLASSES; c++) {
+        n = 0;
+
+        LIST_FOREACH(b, &free_class[c], list)
+            ++n;
+
+        if(n)
+            printf("  %8lu+ bytes: %d free\n", 1UL << (c + MEM_ALIGN_SHIFT), n);
+    }
+
+    mutex_unlock(&mem_mutex);
+
 #ifdef PVR_KM_DBG
     pvr_mem_print_list();
 #endif
@@ -45,6 +45,8 @@ int pvr_get_vbl_count() {
 /* Fill in a statistics structure (above) from current data. This
    is a super-set of frame count. */
 int pvr_get_stats(pvr_stats_t *stat) {
+    int i;
+
     if(!pvr_state.valid)
         return -1;
 
@@ -65,6 +67,15 @@ int pvr_get_stats(pvr_stats_t *stat) {
     stat->vtx_buffer_used_max = pvr_state.vtx_buf_used_max;
     stat->buf_last_time = pvr_state.buf_last_len;
     stat->frame_count = pvr_state.frame_count;
+    stat->vtx_buffer_size = pvr_state.ta_buffers[0].vertex_size;
+    stat->ta_overflows = pvr_state.ta_overflows;
+
+    for(i = 0; i < PVR_OPB_COUNT; i++) {
+        stat->list_used[i] = pvr_state.dma_used[i];
+        stat->list_used_max[i] = pvr_state.dma_used_max[i];
+        stat->list_size[i] = pvr_state.dma_buffers[pvr_state.ram_target].size[i];
+        stat->list_overflows[i] = pvr_state.dma_overflows[i];
+    }
 
     return 0;
 }
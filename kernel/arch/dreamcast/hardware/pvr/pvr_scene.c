@@ -7,8 +7,11 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <malloc.h>
 #include <kos/thread.h>
+#include <arch/irq.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
 #include "pvr_internal.h"
@@ -21,6 +24,57 @@
 
 */
 
+/* Wait until the vertex DMA isn't reading from either half of the buffers,
+   so they can be replaced. */
+static void vertbuf_wait_idle(void) {
+    while(pvr_state.dma_buffers[pvr_state.ram_target ^ 1].ready)
+        thd_pass();
+}
+
+/* Free both halves of an automatically sized vertex buffer. */
+static void vertbuf_auto_release(int list) {
+    int i;
+
+    for(i = 0; i < 2; i++) {
+        free(pvr_state.dma_buffers[i].base[list]);
+        pvr_state.dma_buffers[i].base[list] = NULL;
+        pvr_state.dma_buffers[i].size[list] = 0;
+    }
+
+    pvr_state.dma_auto &= ~(1 << list);
+}
+
+void pvr_vertbuf_auto_free(void) {
+    int i;
+
+    for(i = 0; i < PVR_OPB_COUNT; i++) {
+        if(pvr_state.dma_auto & (1 << i))
+            vertbuf_auto_release(i);
+    }
+}
+
+/* Replace one half of an automatically sized buffer with one of sz bytes,
+   keeping the first keep bytes of what's been written. */
+static int vertbuf_resize(int which, int list, uint32 sz, uint32 keep) {
+    volatile pvr_dma_buffers_t * b = pvr_state.dma_buffers + which;
+    uint8 * nb;
+
+    if(irq_inside_int() && !malloc_irq_safe())
+        return -1;
+
+    if(!(nb = (uint8 *)memalign(32, sz)))
+        return -1;
+
+    if(keep)
+        memcpy(nb, b->base[list], keep);
+
+    free(b->base[list]);
+    b->base[list] = nb;
+    b->size[list] = sz;
+
+    return 0;
+}
+
 void * pvr_set_vertbuf(pvr_list_t list, void * buffer, int len) {
     void * oldbuf;
 
@@ -39,9 +93,15 @@ void * pvr_set_vertbuf(pvr_list_t list, void * buffer, int len) {
     assert(!(((ptr_t)buffer) & 31));
     assert(!(len & 63));
 
-    // Save the old value.
+    // Save the old value. If we allocated it ourselves, it's gone now.
+    vertbuf_wait_idle();
     oldbuf = pvr_state.dma_buffers[0].base[list];
 
+    if(pvr_state.dma_auto & (1 << list)) {
+        vertbuf_auto_release(list);
+        oldbuf = NULL;
+    }
+
     // Write new values.
     pvr_state.dma_buffers[0].base[list] = (uint8 *)buffer;
     pvr_state.dma_buffers[0].ptr[list] = 0;
@@ -55,6 +115,129 @@ void * pvr_set_vertbuf(pvr_list_t list, void * buffer, int len) {
     return oldbuf;
 }
 
+int pvr_set_vertbuf_auto(pvr_list_t list, int min_len, int max_len,
+                         void **oldbuf) {
+    int i;
+
+    assert(pvr_state.dma_mode);
+    assert(list < PVR_OPB_COUNT);
+    assert(pvr_state.lists_enabled & (1 << list));
+
+    // Sizes are per frame here, and have the same rules as a half buffer.
+    min_len = (min_len + 63) & ~63;
+
+    if(min_len < 64)
+        min_len = 64;
+
+    max_len = (max_len + 63) & ~63;
+
+    if(max_len < min_len)
+        max_len = min_len;
+
+    // Hand back a buffer from pvr_set_vertbuf(), or free our own.
+    vertbuf_wait_idle();
+
+    if(pvr_state.dma_auto & (1 << list)) {
+        vertbuf_auto_release(list);
+
+        if(oldbuf)
+            *oldbuf = NULL;
+    }
+    else if(oldbuf) {
+        *oldbuf = pvr_state.dma_buffers[0].base[list];
+    }
+
+    for(i = 0; i < 2; i++) {
+        pvr_state.dma_buffers[i].base[list] = (uint8 *)memalign(32, min_len);
+        pvr_state.dma_buffers[i].ptr[list] = 0;
+        pvr_state.dma_buffers[i].size[list] = min_len;
+        pvr_state.dma_buffers[i].ready = 0;
+    }
+
+    pvr_state.dma_auto |= 1 << list;
+
+    if(!pvr_state.dma_buffers[0].base[list] ||
+            !pvr_state.dma_buffers[1].base[list]) {
+        vertbuf_auto_release(list);
+        return -1;
+    }
+
+    pvr_state.dma_auto_min[list] = min_len;
+    pvr_state.dma_auto_max[list] = max_len;
+    pvr_state.dma_hwm[list] = 0;
+
+    return 0;
+}
+
+void pvr_set_vertbuf_policy(int policy) {
+    assert(policy >= PVR_VERTBUF_ASSERT && policy <= PVR_VERTBUF_DROP);
+    pvr_state.dma_policy = policy;
+}
+
+int pvr_vertbuf_room(int list, uint32 amt, int flags) {
+    volatile pvr_dma_buffers_t * b = pvr_state.dma_buffers + pvr_state.ram_target;
+
+    return pvr_vertbuf_room_at(list, b->ptr[list], amt, flags);
+}
+
+int pvr_vertbuf_room_at(int list, uint32 off, uint32 amt, int flags) {
+    volatile pvr_dma_buffers_t * b;
+    uint32 need, sz;
+
+    if(pvr_state.dma_stopped & (1 << list))
+        return -1;
+
+    b = pvr_state.dma_buffers + pvr_state.ram_target;
+    need = off + amt + 32;
+
+    if(need <= b->size[list])
+        return 0;
+
+    // Buffers we own can grow mid-frame: the DMA only ever reads the other
+    // half, so nobody else is looking at this one. Everything before off is
+    // kept, whether it's been committed to ptr yet or not.
+    if((flags & PVR_ROOM_GROW) && (pvr_state.dma_auto & (1 << list))) {
+        sz = b->size[list] * 2;
+
+        if(sz < need)
+            sz = (need + 63) & ~63;
+
+        if(sz > pvr_state.dma_auto_max[list])
+            sz = pvr_state.dma_auto_max[list];
+
+        if(sz >= need && !vertbuf_resize(pvr_state.ram_target, list, sz, off))
+            return 0;
+    }
+
+    pvr_state.dma_overflows[list]++;
+    pvr_state.dma_stopped |= 1 << list;
+
+    switch(pvr_state.dma_policy) {
+        case PVR_VERTBUF_DROP:
+            b->ptr[list] = 0;
+            break;
+
+        case PVR_VERTBUF_TRUNCATE:
+            break;
+
+        default:
+            // With asserts compiled out, this acts like TRUNCATE.
+            if(!(flags & PVR_ROOM_NOASSERT))
+                assert_msg(0, "vertex buffer overflow");
+
+            break;
+    }
+
+    return -1;
+}
+
+int pvr_vertbuf_reserve(pvr_list_t list, uint32 amt) {
+    assert(list < PVR_OPB_COUNT);
+    assert(pvr_state.dma_mode);
+
+    return pvr_vertbuf_room(list, amt, PVR_ROOM_GROW);
+}
+
 void * pvr_vertbuf_tail(pvr_list_t list) {
     uint8 * bufbase;
 
@@ -77,10 +260,13 @@ void pvr_vertbuf_written(pvr_list_t list, uint32 amt) {
     assert(list < PVR_OPB_COUNT);
     assert(pvr_state.dma_mode);
 
+    // The data is already there, so it's too late to grow the buffer.
+    if(pvr_vertbuf_room(list, amt, 0) < 0)
+        return;
+
     // Change the current end of the buffer.
     val = pvr_state.dma_buffers[pvr_state.ram_target].ptr[list];
     val += amt;
-    assert(val < pvr_state.dma_buffers[pvr_state.ram_target].size[list]);
     pvr_state.dma_buffers[pvr_state.ram_target].ptr[list] = val;
 }
 
@@ -88,14 +274,36 @@ void pvr_vertbuf_written(pvr_list_t list, uint32 amt) {
    frame buffer */
 void pvr_scene_begin() {
     int i;
+    uint32 want, sz;
 
     // Get general stuff ready.
     pvr_state.list_reg_open = -1;
 
     // Clear these out in case we're using DMA.
     if(pvr_state.dma_mode) {
+        pvr_state.dma_stopped = 0;
+
         for(i = 0; i < PVR_OPB_COUNT; i++) {
             pvr_state.dma_buffers[pvr_state.ram_target].ptr[i] = 0;
+
+            // Resize our own buffers between frames, while this half is
+            // guaranteed to be idle.
+            if(pvr_state.dma_auto & (1 << i)) {
+                want = pvr_state.dma_hwm[i] + pvr_state.dma_hwm[i] / 2;
+                want = (want + 64 + 63) & ~63;
+
+                if(want < pvr_state.dma_auto_min[i])
+                    want = pvr_state.dma_auto_min[i];
+
+                if(want > pvr_state.dma_auto_max[i])
+                    want = pvr_state.dma_auto_max[i];
+
+                sz = pvr_state.dma_buffers[pvr_state.ram_target].size[i];
+
+                // Failing here is fine; we just keep the old buffer.
+                if(want > sz || want < sz / 2)
+                    vertbuf_resize(pvr_state.ram_target, i, want, 0);
+            }
         }
 
         pvr_sync_stats(PVR_SYNC_BUFSTART);
@@ -215,14 +423,16 @@ int pvr_prim(void * data, int size) {
 int pvr_list_prim(pvr_list_t list, void * data, int size) {
     volatile pvr_dma_buffers_t * b;
 
+    assert(!(size & 31));
+
+    if(pvr_vertbuf_room(list, size, PVR_ROOM_GROW) < 0)
+        return -1;
+
     b = pvr_state.dma_buffers + pvr_state.ram_target;
     assert(b->base[list]);
 
-    assert(!(size & 31));
-
     memcpy(b->base[list] + b->ptr[list], data, size);
     b->ptr[list] += size;
-    assert(b->ptr[list] <= b->size[list]);
 
     return 0;
 }
@@ -266,6 +476,17 @@ int pvr_scene_finish() {
 
             // Verify that there is no overrun.
             assert(b->ptr[i] <= b->size[i]);
+
+            // Keep track of usage, both for the stats and for sizing.
+            pvr_state.dma_used[i] = b->ptr[i];
+
+            if(b->ptr[i] > pvr_state.dma_used_max[i])
+                pvr_state.dma_used_max[i] = b->ptr[i];
+
+            pvr_state.dma_hwm[i] -= pvr_state.dma_hwm[i] >> 6;
+
+            if(b->ptr[i] > pvr_state.dma_hwm[i])
+                pvr_state.dma_hwm[i] = b->ptr[i];
         }
 
         // Flip buffers and mark them complete.
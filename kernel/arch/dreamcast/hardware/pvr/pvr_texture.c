@@ -6,9 +6,13 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
 #include <kos/string.h>
 #include <dc/pvr.h>
 #include <dc/sq.h>
+#include <arch/cache.h>
 #include "pvr_internal.h"
 
 /*
@@ -27,33 +31,115 @@ void pvr_txr_load(void * src, pvr_ptr_t dst, uint32 count) {
     sq_cpy((uint32 *)dst, (uint32 *)src, count);
 }
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+/* Store queue write for the twiddlers: the eight words go into the queue
+   that matches bit 5 of the address, and out in one burst. */
+#define PVRT_SQ_STORE(dst, w) do { \
+        uint32 *_d = (uint32 *)(0xe0000000 | ((uint32)(dst) & 0x03ffffe0)); \
+        _d[0] = (w)[0]; \
+        _d[1] = (w)[1]; \
+        _d[2] = (w)[2]; \
+        _d[3] = (w)[3]; \
+        _d[4] = (w)[4]; \
+        _d[5] = (w)[5]; \
+        _d[6] = (w)[6]; \
+        _d[7] = (w)[7]; \
+        __asm__("pref @%0" : : "r"(_d)); \
+    } while(0)
 
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
+#include "pvr_twiddle_core.h"
+
+/* Copy a finished (twiddled or VQ) texture from main RAM into PVR RAM, by
+   DMA if asked and it's free, else through the store queues. */
+static void txr_copy(void *src, pvr_ptr_t dst, uint32 size, uint32 flags) {
+    int rv = -1;
+
+    if(flags & PVR_TXRLOAD_DMA) {
+        dcache_flush_range((uint32)src, size);
+        mutex_lock((mutex_t *)&pvr_state.dma_lock);
+        rv = pvr_txr_load_dma(src, dst, size, 1, NULL, 0);
+        mutex_unlock((mutex_t *)&pvr_state.dma_lock);
+    }
+
+    if(rv < 0)
+        pvr_txr_load(src, dst, size);
+}
+
+int pvr_txr_vq_encode(const void *src, void *dst, uint32 w, uint32 h,
+                      uint32 flags) {
+    void *scratch;
+    int fmt, rv;
+
+    if(w < 8 || h < 8 || w > PVRT_MAX_SIZE || h > PVRT_MAX_SIZE ||
+       (w & (w - 1)) || (h & (h - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch(flags & PVR_TXRLOAD_VQ_FMT_MASK) {
+        case PVR_TXRLOAD_VQ_ARGB1555:
+            fmt = PVRT_ARGB1555;
+            break;
+        case PVR_TXRLOAD_VQ_ARGB4444:
+            fmt = PVRT_ARGB4444;
+            break;
+        default:
+            fmt = PVRT_RGB565;
+            break;
+    }
+
+    if(!(scratch = malloc(pvrt_vq_scratch(w, h)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rv = pvrt_vq_encode((const uint16 *)src, (uint8 *)dst, w, h, fmt,
+                        !!(flags & PVR_TXRLOAD_INVERT_Y), scratch);
+    free(scratch);
+
+    return rv;
+}
+
+/* VQ encode a 16bpp texture into a buffer and load that. */
+static void txr_load_vq(void *src, pvr_ptr_t dst, uint32 w, uint32 h,
+                        uint32 flags) {
+    uint32 size = PVRT_VQ_CODEBOOK + w * h / 4;
+    void *buf;
+
+    if(!(buf = memalign(32, size))) {
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: out of memory for VQ\n");
+        return;
+    }
+
+    if(pvr_txr_vq_encode(src, buf, w, h, flags) < 0)
+        dbglog(DBG_ERROR, "pvr_txr_load_ex: can't VQ encode a %lux%lu "
+               "texture\n", w, h);
+    else
+        txr_copy(buf, dst, size, flags);
+
+    free(buf);
+}
 
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
    in the process.
 
-   This is a modified version of Vincent Penne's general twiddling
-   function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
-   The rectangle does not need to be a square (not tested with h>w, but
-   this is just a matter of a rotation by PI/2 and UV swapping).
+   The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted), and need not be
+   square. The twiddling itself is in pvr_twiddle_core.h.
 
    - w and h must be a power of 2
    - flags must be a logical OR of the various texture loading
      flags available:
-       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
-       PVR_TXRLOAD_VQ (not supported yet)
-       PVR_TXRLOAD_INVERT
+       PVR_TXRLOAD_4BPP, _8BPP, _16BPP
+       PVR_TXRLOAD_VQ_LOAD (16bpp only; see PVR_TXRLOAD_VQ_FMT_MASK)
+       PVR_TXRLOAD_INVERT_Y
+       PVR_TXRLOAD_SQ, PVR_TXRLOAD_DMA
 
 */
 void pvr_txr_load_ex(void * src, pvr_ptr_t dst, uint32 w, uint32 h,
                      uint32 flags) {
-    uint32 x, y, yout, min, mask, bpp, invert;
+    uint32 bpp, size;
+    int invert;
+    void *buf;
 
     /* Make sure we're attempting something we can do */
     switch(flags & PVR_TXRLOAD_FMT_MASK) {
@@ -71,73 +157,38 @@ void pvr_txr_load_ex(void * src, pvr_ptr_t dst, uint32 w, uint32 h,
             bpp = 8;
     }
 
-    assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
+    if(flags & PVR_TXRLOAD_VQ_LOAD) {
+        assert_msg(bpp == 16, "VQ compression is only supported for 16bpp");
+        txr_load_vq(src, dst, w, h, flags);
+        return;
+    }
+
     invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
 
-    min = MIN(w, h);
-    mask = min - 1;
-
-    switch(bpp) {
-        case 4: {
-            uint8 * pixels;
-            uint16 * vtex;
-            pixels = (uint8 *) src;
-            vtex = (uint16*)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x += 2) {
-                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
-                         (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
-                }
-            }
-        }
-        break;
-        case 8: {
-            uint8 * pixels;
-            uint16 * vtex;
-            pixels = (uint8 *) src;
-            vtex = (uint16*)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
-                         (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
-                }
-            }
-        }
-        break;
-        case 16: {
-            uint16 * pixels;
-            uint16 * vtex;
-            pixels = (uint16 *) src;
-            vtex = (uint16*)dst;
-
-            for(y = 0; y < h; y++) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT(x & mask, yout & mask) +
-                         (x / min + yout / min)*min * min] = pixels[y * w + x];
-                }
-            }
+    /* For DMA, twiddle into a buffer first. */
+    if(flags & PVR_TXRLOAD_DMA) {
+        size = w * h * bpp / 8;
+
+        if((buf = memalign(32, size))) {
+            pvrt_twiddle(src, buf, w, h, bpp, invert, 0);
+            txr_copy(buf, dst, size, flags);
+            free(buf);
+            return;
         }
-        break;
+    }
+
+    if(flags & PVR_TXRLOAD_SQ) {
+        QACR0 = ((((uint32)dst) >> 26) << 2) & 0x1c;
+        QACR1 = ((((uint32)dst) >> 26) << 2) & 0x1c;
+
+        pvrt_twiddle(src, dst, w, h, bpp, invert, 1);
+
+        /* Wait for both store queues to complete */
+        ((volatile uint32 *)0xe0000000)[0] = 0;
+        ((volatile uint32 *)0xe0000000)[8] = 0;
+    }
+    else {
+        pvrt_twiddle(src, dst, w, h, bpp, invert, 0);
     }
 }
 
@@ -160,6 +211,14 @@ void pvr_txr_load_kimg(kos_img_t *img, pvr_ptr_t dst, uint32 flags) {
     assert_msg(h == 8 || h == 16 || h == 32 || h == 64 || h == 128
                || h == 256 || h == 512 || h == 1024, "Non power-of-2 image height in input kos_img_t");
 
+    /* Tell the VQ encoder what the pixels look like */
+    flags &= ~PVR_TXRLOAD_VQ_FMT_MASK;
+
+    if(fmt == KOS_IMG_FMT_ARGB4444)
+        flags |= PVR_TXRLOAD_VQ_ARGB4444;
+    else if(fmt == KOS_IMG_FMT_ARGB1555)
+        flags |= PVR_TXRLOAD_VQ_ARGB1555;
+
     /* Convert it to a PVR image type */
     switch(fmt) {
         case KOS_IMG_FMT_RGB565:
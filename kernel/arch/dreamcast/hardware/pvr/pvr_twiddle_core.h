@@ -0,0 +1,521 @@
+/* KallistiOS ##version##
+
+   pvr_twiddle_core.h
+
+ */
+
+#ifndef __PVR_TWIDDLE_CORE_H
+#define __PVR_TWIDDLE_CORE_H
+
+/* The twiddling and VQ encoding behind pvr_txr_load_ex().
+
+   Like pvr_batch_core.h, this is kept free of any hardware access so that
+   the same code can be built on the host, where it is timed and checked
+   against the old per-texel loader. Before including this file, the includer
+   must provide:
+
+     - uint8, uint16 and uint32, and memset()
+     - PVRT_SQ_STORE(dst, w), which writes the eight words w[0..7] to the
+       32-byte aligned address dst through the store queues (QACR0/1 having
+       been set up for it already)
+
+   Everything in here is static, so each includer gets its own copy.
+
+   A twiddled texture is stored in Morton order: the texel at (x, y) of a
+   square texture lives at index spread(y) | spread(x) << 1, where spread()
+   moves bit n to bit 2n. A rectangular texture is a row (or column) of
+   squares the size of its shorter side, one after another.
+
+   Every 32 bytes of a twiddled texture is therefore one small tile of the
+   source: 4x4 texels at 16bpp, 4 wide by 8 high at 8bpp and 8x8 at 4bpp.
+   The loaders here walk the source a tile at a time, gather each tile into
+   eight words and write it out in one go, either with plain stores or
+   through a store queue. Textures too narrow for a whole tile (less than 8
+   texels on a side) go through pvrt_twiddle_slow() instead. */
+
+/* spread() for 8 bits */
+#define PVRT_S1(x)  ( ((x) & 1) | (((x) & 2) << 1) | (((x) & 4) << 2) | \
+                      (((x) & 8) << 3) | (((x) & 16) << 4) | (((x) & 32) << 5) | \
+                      (((x) & 64) << 6) | (((x) & 128) << 7) )
+#define PVRT_S4(x)  PVRT_S1(x), PVRT_S1(x + 1), PVRT_S1(x + 2), PVRT_S1(x + 3)
+#define PVRT_S16(x) PVRT_S4(x), PVRT_S4(x + 4), PVRT_S4(x + 8), PVRT_S4(x + 12)
+#define PVRT_S64(x) PVRT_S16(x), PVRT_S16(x + 16), PVRT_S16(x + 32), \
+                    PVRT_S16(x + 48)
+
+static const uint16 pvrt_spread_tab[256] = {
+    PVRT_S64(0), PVRT_S64(64), PVRT_S64(128), PVRT_S64(192)
+};
+
+/* Largest texture side we handle */
+#define PVRT_MAX_SIZE   1024
+
+/* Size of the codebook at the start of a VQ texture, in bytes */
+#define PVRT_VQ_CODEBOOK    2048
+
+/* Pixel formats the VQ encoder understands */
+#define PVRT_RGB565     0
+#define PVRT_ARGB1555   1
+#define PVRT_ARGB4444   2
+
+static inline uint32 pvrt_spread(uint32 v) {
+    return pvrt_spread_tab[v & 0xff] | (pvrt_spread_tab[v >> 8] << 16);
+}
+
+/* Undo spread() on the even bits of v. */
+static inline uint32 pvrt_compact(uint32 v) {
+    uint32 rv = 0, b;
+
+    for(b = 0; v; b++, v >>= 2)
+        rv |= (v & 1) << b;
+
+    return rv;
+}
+
+/* Index of texel (x, y) in a twiddled w x h texture. */
+static inline uint32 pvrt_index(uint32 x, uint32 y, uint32 w, uint32 h) {
+    uint32 min = w < h ? w : h, mask = min - 1;
+
+    return (pvrt_spread(y & mask) | (pvrt_spread(x & mask) << 1)) +
+           (x / min + y / min) * min * min;
+}
+
+/* Write one 32-byte tile. */
+static inline void pvrt_store(uint32 *dst, const uint32 *w, int sq) {
+    if(sq) {
+        PVRT_SQ_STORE(dst, w);
+    }
+    else {
+        dst[0] = w[0];
+        dst[1] = w[1];
+        dst[2] = w[2];
+        dst[3] = w[3];
+        dst[4] = w[4];
+        dst[5] = w[5];
+        dst[6] = w[6];
+        dst[7] = w[7];
+    }
+}
+
+/* The first source row of a tile, and the step to the next. With invert,
+   output row y comes from source row h - 1 - y. */
+#define PVRT_ROWS(type, src, stride, y, h, invert, row, step) do { \
+        if(invert) { \
+            row = (const type *)(src) + ((h) - 1 - (y)) * (stride); \
+            step = -(int)(stride); \
+        } \
+        else { \
+            row = (const type *)(src) + (y) * (stride); \
+            step = (int)(stride); \
+        } \
+    } while(0)
+
+static void pvrt_twiddle16(const uint16 *src, uint16 *dst, uint32 w, uint32 h,
+                           int invert, int sq) {
+    const uint16 *r0, *r1, *r2, *r3;
+    uint32 x, y, t[8];
+    int step;
+
+    for(y = 0; y < h; y += 4) {
+        PVRT_ROWS(uint16, src, w, y, h, invert, r0, step);
+        r1 = r0 + step;
+        r2 = r1 + step;
+        r3 = r2 + step;
+
+        for(x = 0; x < w; x += 4) {
+            t[0] = r0[x + 0] | (r1[x + 0] << 16);
+            t[1] = r0[x + 1] | (r1[x + 1] << 16);
+            t[2] = r2[x + 0] | (r3[x + 0] << 16);
+            t[3] = r2[x + 1] | (r3[x + 1] << 16);
+            t[4] = r0[x + 2] | (r1[x + 2] << 16);
+            t[5] = r0[x + 3] | (r1[x + 3] << 16);
+            t[6] = r2[x + 2] | (r3[x + 2] << 16);
+            t[7] = r2[x + 3] | (r3[x + 3] << 16);
+            pvrt_store((uint32 *)(dst + pvrt_index(x, y, w, h)), t, sq);
+        }
+    }
+}
+
+/* Four 8-bit texels, two wide and two high, as they sit in a twiddled
+   word. */
+#define PVRT_QUAD8(a, b, x) \
+    ( (a)[x] | ((b)[x] << 8) | ((a)[(x) + 1] << 16) | ((b)[(x) + 1] << 24) )
+
+static void pvrt_twiddle8(const uint8 *src, uint8 *dst, uint32 w, uint32 h,
+                          int invert, int sq) {
+    const uint8 *r[8];
+    uint32 x, y, i, t[8];
+    int step;
+
+    for(y = 0; y < h; y += 8) {
+        PVRT_ROWS(uint8, src, w, y, h, invert, r[0], step);
+
+        for(i = 1; i < 8; i++)
+            r[i] = r[i - 1] + step;
+
+        for(x = 0; x < w; x += 4) {
+            t[0] = PVRT_QUAD8(r[0], r[1], x);
+            t[1] = PVRT_QUAD8(r[2], r[3], x);
+            t[2] = PVRT_QUAD8(r[0], r[1], x + 2);
+            t[3] = PVRT_QUAD8(r[2], r[3], x + 2);
+            t[4] = PVRT_QUAD8(r[4], r[5], x);
+            t[5] = PVRT_QUAD8(r[6], r[7], x);
+            t[6] = PVRT_QUAD8(r[4], r[5], x + 2);
+            t[7] = PVRT_QUAD8(r[6], r[7], x + 2);
+            pvrt_store((uint32 *)(dst + pvrt_index(x, y, w, h)), t, sq);
+        }
+    }
+}
+
+/* Eight 4-bit texels, two wide and four high, from one byte of each of four
+   rows. */
+#define PVRT_OCT4(a, b, c, d, x) \
+    ( ((a)[x] & 15) | (((b)[x] & 15) << 4) | \
+      (((a)[x] >> 4) << 8) | (((b)[x] >> 4) << 12) | \
+      (((c)[x] & 15) << 16) | (((d)[x] & 15) << 20) | \
+      (((c)[x] >> 4) << 24) | (((d)[x] >> 4) << 28) )
+
+static void pvrt_twiddle4(const uint8 *src, uint8 *dst, uint32 w, uint32 h,
+                          int invert, int sq) {
+    const uint8 *r[8];
+    uint32 x, y, i, t[8];
+    int step;
+
+    for(y = 0; y < h; y += 8) {
+        PVRT_ROWS(uint8, src, w / 2, y, h, invert, r[0], step);
+
+        for(i = 1; i < 8; i++)
+            r[i] = r[i - 1] + step;
+
+        /* x counts bytes here: two texels each. */
+        for(x = 0; x < w / 2; x += 4) {
+            t[0] = PVRT_OCT4(r[0], r[1], r[2], r[3], x);
+            t[1] = PVRT_OCT4(r[0], r[1], r[2], r[3], x + 1);
+            t[2] = PVRT_OCT4(r[4], r[5], r[6], r[7], x);
+            t[3] = PVRT_OCT4(r[4], r[5], r[6], r[7], x + 1);
+            t[4] = PVRT_OCT4(r[0], r[1], r[2], r[3], x + 2);
+            t[5] = PVRT_OCT4(r[0], r[1], r[2], r[3], x + 3);
+            t[6] = PVRT_OCT4(r[4], r[5], r[6], r[7], x + 2);
+            t[7] = PVRT_OCT4(r[4], r[5], r[6], r[7], x + 3);
+            pvrt_store((uint32 *)(dst + pvrt_index(x * 2, y, w, h) / 2), t,
+                       sq);
+        }
+    }
+}
+
+/* One texel of a bpp-bit source image. */
+static inline uint32 pvrt_texel(const uint8 *src, uint32 x, uint32 y,
+                                uint32 w, uint32 bpp) {
+    uint32 i = y * w + x;
+
+    switch(bpp) {
+        case 4:
+            return (src[i >> 1] >> ((i & 1) * 4)) & 15;
+        case 8:
+            return src[i];
+        default:
+            return ((const uint16 *)src)[i];
+    }
+}
+
+/* Twiddle a texture of any size a 16-bit word at a time, working out where
+   each texel comes from. Only 16-bit stores are made, so dst may be in PVR
+   RAM. */
+static void pvrt_twiddle_slow(const uint8 *src, uint16 *dst, uint32 w,
+                              uint32 h, uint32 bpp, int invert) {
+    uint32 min = w < h ? w : h, per = 16 / bpp, n = w * h / per;
+    uint32 u, i, t, x, y, in, blk, v;
+
+    for(u = 0; u < n; u++) {
+        v = 0;
+
+        for(i = 0; i < per; i++) {
+            t = u * per + i;
+            blk = t / (min * min);
+            in = t % (min * min);
+            x = pvrt_compact(in >> 1);
+            y = pvrt_compact(in);
+
+            if(w > h)
+                x += blk * min;
+            else
+                y += blk * min;
+
+            if(invert)
+                y = h - 1 - y;
+
+            v |= pvrt_texel(src, x, y, w, bpp) << (i * bpp);
+        }
+
+        dst[u] = v;
+    }
+}
+
+/* Twiddle a w x h texture of bpp bits per texel (4, 8 or 16) from src into
+   dst. sq selects store queue writes, which need dst 32-byte aligned. */
+static void pvrt_twiddle(const void *src, void *dst, uint32 w, uint32 h,
+                         uint32 bpp, int invert, int sq) {
+    if(w < 8 || h < 8 || ((unsigned long)dst & (sq ? 31 : 3))) {
+        pvrt_twiddle_slow((const uint8 *)src, (uint16 *)dst, w, h, bpp,
+                          invert);
+        return;
+    }
+
+    switch(bpp) {
+        case 4:
+            pvrt_twiddle4((const uint8 *)src, (uint8 *)dst, w, h, invert, sq);
+            break;
+        case 8:
+            pvrt_twiddle8((const uint8 *)src, (uint8 *)dst, w, h, invert, sq);
+            break;
+        default:
+            pvrt_twiddle16((const uint16 *)src, (uint16 *)dst, w, h, invert,
+                           sq);
+            break;
+    }
+}
+
+/* VQ encoding
+
+   A VQ texture is a codebook of 256 entries, each a 2x2 block of 16-bit
+   texels in twiddled order, followed by one byte per 2x2 block of the image
+   saying which entry to use, twiddled like a (w / 2) x (h / 2) 8bpp
+   texture.
+
+   The codebook is built by median cut: every 2x2 block becomes a vector of
+   sixteen 8-bit channels, and the group of blocks with the most squared error
+   along one channel is split at its mean along that channel, until there are
+   256 groups (or nothing left worth splitting). Each entry is the mean of its
+   group. That takes a few passes over the image instead of the hundreds of
+   distance calculations per block that k-means would need, which is what
+   makes it usable at load time. */
+
+#define PVRT_VQ_DIMS    16
+
+typedef struct pvrt_vq_group {
+    uint32  start, count;   /* Range of the order array */
+    unsigned long long score;   /* Squared error along dim */
+    int     dim;            /* Channel to split on */
+} pvrt_vq_group_t;
+
+/* Expand a texel to four 8-bit channels (A, R, G, B). */
+static inline void pvrt_unpack(uint32 p, int fmt, uint8 *c) {
+    uint32 r, g, b, a;
+
+    switch(fmt) {
+        case PVRT_ARGB1555:
+            a = (p & 0x8000) ? 255 : 0;
+            r = (p >> 10) & 31;
+            g = (p >> 5) & 31;
+            b = p & 31;
+            r = (r << 3) | (r >> 2);
+            g = (g << 3) | (g >> 2);
+            b = (b << 3) | (b >> 2);
+            break;
+        case PVRT_ARGB4444:
+            a = ((p >> 12) & 15) * 17;
+            r = ((p >> 8) & 15) * 17;
+            g = ((p >> 4) & 15) * 17;
+            b = (p & 15) * 17;
+            break;
+        default:
+            a = 255;
+            r = (p >> 11) & 31;
+            g = (p >> 5) & 63;
+            b = p & 31;
+            r = (r << 3) | (r >> 2);
+            g = (g << 2) | (g >> 4);
+            b = (b << 3) | (b >> 2);
+            break;
+    }
+
+    c[0] = a;
+    c[1] = r;
+    c[2] = g;
+    c[3] = b;
+}
+
+/* Scale an 8-bit channel down to bits bits, rounding. */
+#define PVRT_NARROW(v, bits) ( ((v) * ((1 << (bits)) - 1) + 127) / 255 )
+
+static inline uint32 pvrt_pack(const uint8 *c, int fmt) {
+    switch(fmt) {
+        case PVRT_ARGB1555:
+            return ((c[0] >= 128) << 15) | (PVRT_NARROW(c[1], 5) << 10) |
+                   (PVRT_NARROW(c[2], 5) << 5) | PVRT_NARROW(c[3], 5);
+        case PVRT_ARGB4444:
+            return (PVRT_NARROW(c[0], 4) << 12) | (PVRT_NARROW(c[1], 4) << 8) |
+                   (PVRT_NARROW(c[2], 4) << 4) | PVRT_NARROW(c[3], 4);
+        default:
+            return (PVRT_NARROW(c[1], 5) << 11) | (PVRT_NARROW(c[2], 6) << 5) |
+                   PVRT_NARROW(c[3], 5);
+    }
+}
+
+/* Work out which channel of a group to split on next. */
+static void pvrt_vq_measure(const uint8 *vecs, const uint32 *order,
+                            pvrt_vq_group_t *g) {
+    unsigned long long sq[PVRT_VQ_DIMS] = { 0 }, err;
+    uint32 sum[PVRT_VQ_DIMS] = { 0 };
+    uint32 i, d, v;
+    const uint8 *p;
+
+    g->score = 0;
+    g->dim = 0;
+
+    if(g->count < 2)
+        return;
+
+    for(i = 0; i < g->count; i++) {
+        p = vecs + order[g->start + i] * PVRT_VQ_DIMS;
+
+        for(d = 0; d < PVRT_VQ_DIMS; d++) {
+            v = p[d];
+            sum[d] += v;
+            sq[d] += v * v;
+        }
+    }
+
+    /* sum(x^2) - sum(x)^2 / n. A 1024x1024 texture has 2^18 blocks, so
+       these need 64 bits. */
+    for(d = 0; d < PVRT_VQ_DIMS; d++) {
+        err = sq[d] - (unsigned long long)sum[d] * sum[d] / g->count;
+
+        if(err > g->score) {
+            g->score = err;
+            g->dim = d;
+        }
+    }
+}
+
+/* Split a group in two at its mean along its chosen channel. Returns 0 if
+   every member is on one side, so there's nothing to split. */
+static int pvrt_vq_split(const uint8 *vecs, uint32 *order, pvrt_vq_group_t *g,
+                         pvrt_vq_group_t *ng) {
+    uint32 i, j, sum = 0, mean, t;
+    int d = g->dim;
+
+    for(i = 0; i < g->count; i++)
+        sum += vecs[order[g->start + i] * PVRT_VQ_DIMS + d];
+
+    mean = sum / g->count;
+
+    /* Everything at or below the mean to the front */
+    i = g->start;
+    j = g->start + g->count;
+
+    while(i < j) {
+        if(vecs[order[i] * PVRT_VQ_DIMS + d] <= mean) {
+            i++;
+        }
+        else {
+            t = order[--j];
+            order[j] = order[i];
+            order[i] = t;
+        }
+    }
+
+    if(i == g->start || i == g->start + g->count)
+        return 0;
+
+    ng->start = i;
+    ng->count = g->start + g->count - i;
+    g->count = i - g->start;
+    return 1;
+}
+
+/* Bytes of scratch memory pvrt_vq_encode() needs for a w x h texture */
+static inline uint32 pvrt_vq_scratch(uint32 w, uint32 h) {
+    uint32 n = w * h / 4;
+
+    return n * (PVRT_VQ_DIMS + sizeof(uint32) + 1) +
+           256 * sizeof(pvrt_vq_group_t);
+}
+
+/* Encode a w x h 16-bit texture in format fmt into a VQ texture at dst
+   (PVRT_VQ_CODEBOOK + w * h / 4 bytes, in normal RAM). scratch must be
+   pvrt_vq_scratch(w, h) bytes, 4-byte aligned. Returns the number of
+   codebook entries used. */
+static int pvrt_vq_encode(const uint16 *src, uint8 *dst, uint32 w, uint32 h,
+                          int fmt, int invert, void *scratch) {
+    uint32 n = w * h / 4, bw = w / 2, bh = h / 2;
+    pvrt_vq_group_t *groups = (pvrt_vq_group_t *)scratch;
+    uint32 *order = (uint32 *)(groups + 256);
+    uint8 *vecs = (uint8 *)(order + n), *idx = vecs + n * PVRT_VQ_DIMS;
+    uint32 i, j, k, d, bx, by, best, acc[PVRT_VQ_DIMS];
+    uint16 *book = (uint16 *)dst;
+    const uint16 *r0, *r1;
+    uint8 *v, c[4];
+    int ngroups, step;
+
+    /* Gather the blocks. Channels go in twiddled texel order, the way the
+       codebook stores them. */
+    for(by = 0, k = 0; by < bh; by++) {
+        PVRT_ROWS(uint16, src, w, by * 2, h, invert, r0, step);
+        r1 = r0 + step;
+
+        for(bx = 0; bx < bw; bx++, k++) {
+            v = vecs + k * PVRT_VQ_DIMS;
+            pvrt_unpack(r0[bx * 2], fmt, v);
+            pvrt_unpack(r1[bx * 2], fmt, v + 4);
+            pvrt_unpack(r0[bx * 2 + 1], fmt, v + 8);
+            pvrt_unpack(r1[bx * 2 + 1], fmt, v + 12);
+            order[k] = k;
+        }
+    }
+
+    /* Median cut */
+    groups[0].start = 0;
+    groups[0].count = n;
+    pvrt_vq_measure(vecs, order, groups);
+    ngroups = 1;
+
+    while(ngroups < 256) {
+        for(i = 1, best = 0; i < (uint32)ngroups; i++)
+            if(groups[i].score > groups[best].score)
+                best = i;
+
+        if(!groups[best].score ||
+           !pvrt_vq_split(vecs, order, groups + best, groups + ngroups)) {
+            /* Nothing left that can be split */
+            if(!groups[best].score)
+                break;
+
+            groups[best].score = 0;
+            continue;
+        }
+
+        pvrt_vq_measure(vecs, order, groups + best);
+        pvrt_vq_measure(vecs, order, groups + ngroups);
+        ngroups++;
+    }
+
+    /* The codebook, and which entry each block uses */
+    memset(dst, 0, PVRT_VQ_CODEBOOK);
+
+    for(i = 0; i < (uint32)ngroups; i++) {
+        memset(acc, 0, sizeof(acc));
+
+        for(j = 0; j < groups[i].count; j++) {
+            k = order[groups[i].start + j];
+            v = vecs + k * PVRT_VQ_DIMS;
+            idx[k] = i;
+
+            for(d = 0; d < PVRT_VQ_DIMS; d++)
+                acc[d] += v[d];
+        }
+
+        for(j = 0; j < 4; j++) {
+            for(d = 0; d < 4; d++)
+                c[d] = (acc[j * 4 + d] + groups[i].count / 2) /
+                       groups[i].count;
+
+            book[i * 4 + j] = pvrt_pack(c, fmt);
+        }
+    }
+
+    pvrt_twiddle(idx, dst + PVRT_VQ_CODEBOOK, bw, bh, 8, 0, 0);
+
+    return ngroups;
+}
+
+#endif  /* __PVR_TWIDDLE_CORE_H */
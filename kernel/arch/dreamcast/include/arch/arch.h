@@ -177,6 +177,7 @@ extern void * __kos_romdisk;
 #define INIT_NET            0x0004  /**< \brief Enable built-in networking */
 #define INIT_MALLOCSTATS    0x0008  /**< \brief Enable malloc statistics */
 #define INIT_QUIET          0x0010  /**< \brief Disable dbgio */
+#define INIT_MALLOC_TCACHE  0x0020  /**< \brief Per-thread malloc caches */
 
 /* DC-specific stuff */
 #define INIT_OCRAM          0x10000 /**< \brief Use half of the dcache as RAM */
@@ -22,6 +22,9 @@ __BEGIN_DECLS
 
 #include <arch/types.h>
 
+/** \brief  Size of a line in the SH4's caches, in bytes. */
+#define CPU_CACHE_BLOCK_SIZE    32
+
 /** \brief  Flush the instruction cache.
 
     This function flushes a range of the instruction cache.
@@ -67,6 +67,7 @@ __BEGIN_DECLS
 #define ERR_SYS         3   /**< \brief System error */
 #define ERR_ABORTED     4   /**< \brief Command aborted */
 #define ERR_NO_ACTIVE   5   /**< \brief System inactive? */
+#define ERR_TIMEOUT     6   /**< \brief Timed out waiting for the command */
 /** @} */
 
 /** \defgroup cd_cmd_status         CD-ROM Command Status responses
@@ -213,6 +214,9 @@ int cdrom_set_sector_size(int size);
 
     This function executes the specified command using the BIOS syscall for
     executing GD-ROM commands. This is now thread-safe to be called by users.
+    The calling thread sleeps until the command is done, waking when a DMA
+    transfer ends or every few milliseconds otherwise to let the BIOS move
+    things along, so other threads get the CPU in the meantime.
 
     \param  cmd             The command number to execute.
     \param  param           Data to pass to the syscall.
@@ -221,6 +225,21 @@ int cdrom_set_sector_size(int size);
 */
 int cdrom_exec_cmd(int cmd, void *param);
 
+/** \brief  Execute a CD-ROM command, giving up after a while.
+
+    This works like cdrom_exec_cmd(), except that the command is aborted if it
+    hasn't finished in the given time.
+
+    \param  cmd             The command number to execute.
+    \param  param           Data to pass to the syscall.
+    \param  timeout         How long to wait, in milliseconds (0 for
+                            forever).
+
+    \return                 \ref cd_cmd_response (ERR_TIMEOUT if the time ran
+                            out)
+*/
+int cdrom_exec_cmd_timed(int cmd, void *param, int timeout);
+
 /** \brief  Get the status of the GD-ROM drive.
 
     \param  status          Space to return the drive's status.
@@ -289,20 +308,23 @@ int cdrom_read_toc(CDROM_TOC *toc_buffer, int session);
     This function reads the specified number of sectors from the disc, starting
     where requested. This will respect the size of the sectors set with
     cdrom_change_dataype(). The buffer must have enough space to store the
-    specified number of sectors.
+    specified number of sectors. For a DMA read, it must also be 32-byte
+    aligned, and shouldn't be touched by anything else until the read is done.
 
     \param  buffer          Space to store the read sectors.
     \param  sector          The sector to start reading from.
     \param  cnt             The number of sectors to read.
     \param  mode            DMA or PIO
-    \return                 \ref cd_cmd_response
+    \return                 \ref cd_cmd_response (ERR_SYS for a DMA read into
+                            a misaligned buffer)
     \see    cd_read_sector_mode
 */
 int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode);
 
-/** \brief  Read one or more sector from a CD-ROM in PIO mode.
+/** \brief  Read one or more sector from a CD-ROM.
 
-    Default version of cdrom_read_sectors_ex, which forces PIO mode.
+    Default version of cdrom_read_sectors_ex, which uses DMA if the buffer is
+    32-byte aligned, and PIO otherwise.
 
     \param  buffer          Space to store the read sectors.
     \param  sector          The sector to start reading from.
@@ -312,6 +334,60 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode);
 */
 int cdrom_read_sectors(void *buffer, int sector, int cnt);
 
+/** \brief  The number of asynchronous reads that can be outstanding. */
+#define CDROM_ASYNC_MAX 2
+
+/** \brief  Start reading sectors from a CD-ROM with DMA, without waiting.
+
+    This function queues a DMA read with the GD-ROM BIOS and returns right
+    away. Use cdrom_read_async_poll() or cdrom_read_async_wait() to drive the
+    transfer and find out when it is done. Up to \ref CDROM_ASYNC_MAX reads
+    may be outstanding at a time, so the next read can be queued while one
+    completes; they finish in the order they were started.
+
+    The G1 bus is held for the whole transfer, so other GD-ROM and G1 ATA
+    accesses from other threads wait until it finishes. The read must be
+    polled to completion from the thread that started it; the functions
+    below refuse to do it from any other.
+
+    \param  buffer          Space to store the read sectors. This must be
+                            32-byte aligned.
+    \param  sector          The sector to start reading from.
+    \param  cnt             The number of sectors to read.
+    \return                 \ref cd_cmd_response (ERR_SYS if too many reads
+                            are outstanding or the buffer is misaligned)
+*/
+int cdrom_read_sectors_async(void *buffer, int sector, int cnt);
+
+/** \brief  Check on a read started with cdrom_read_sectors_async().
+
+    This checks the oldest outstanding read.
+
+    \param  result          Set to the \ref cd_cmd_response of the read once
+                            it has finished.
+    \retval 1               The read is still in progress.
+    \retval 0               The read is done (or none was outstanding), and
+                            *result has been filled in.
+    \retval -1              The read was started by another thread.
+*/
+int cdrom_read_async_poll(int *result);
+
+/** \brief  Wait for a read started with cdrom_read_sectors_async().
+
+    This sleeps until the oldest outstanding read finishes, in the same way
+    as cdrom_exec_cmd() does.
+
+    \param  result          Set to the \ref cd_cmd_response of the read once
+                            it has finished.
+    \param  timeout         How long to wait, in milliseconds (0 for
+                            forever).
+    \retval 1               The read is still in progress (timed out).
+    \retval 0               The read is done (or none was outstanding), and
+                            *result has been filled in.
+    \retval -1              The read was started by another thread.
+*/
+int cdrom_read_async_wait(int *result, int timeout);
+
 /** \brief    Read subcode data from the most recently read sectors.
 
     After reading sectors, this can pull subcode data regarding the sectors 
@@ -176,6 +176,9 @@ typedef struct maple_frame {
 
     struct maple_device *dev;       /**< \brief Does this belong to a device? */
 
+    int                 sched_class;    /**< \brief Scheduling class (see \ref maple_classes), or -1 to pick one from the command */
+    uint64              queue_time;     /**< \brief When it was queued, in microseconds */
+
     void (*callback)(struct maple_frame *);     /**< \brief Response callback */
 
 #if MAPLE_DMA_DEBUG
@@ -194,6 +197,60 @@ typedef struct maple_frame {
 #define MAPLE_FRAME_RESPONDED   3   /**< \brief Frame has a response */
 /** @} */
 
+/** \defgroup maple_classes         Maple frame scheduling classes
+
+    Each round, maple_queue_flush() sends the waiting frames of each class in
+    this order, taking one frame per port in turn so that a busy port can't
+    hold up the others. Each class can be limited to a budget of bus traffic
+    per round (see maple_sched_set_budget()); whatever doesn't fit waits for
+    the next round, which spreads a run of block transfers out rather than
+    letting it crowd the controller polls out of the frame.
+
+    Unless the driver sets one after maple_frame_init(), a frame's class is
+    picked from its command: bus management commands and the condition
+    polls of input drivers are input, block commands are storage, and
+    anything else (rumble, LCD, microphone and camera traffic) is bulk.
+    @{
+*/
+#define MAPLE_CLASS_INPUT       0   /**< \brief Input polls and bus management */
+#define MAPLE_CLASS_STORAGE     1   /**< \brief Memory card block access */
+#define MAPLE_CLASS_BULK        2   /**< \brief Everything else */
+#define MAPLE_CLASS_COUNT       3   /**< \brief Number of classes */
+/** @} */
+
+/** \brief  Default storage budget, in 32-bit words of bus traffic per round.
+
+    Enough for a block read along with a few smaller commands.
+*/
+#define MAPLE_STORAGE_BUDGET    192
+
+/** \brief  Default bulk budget, in 32-bit words of bus traffic per round. */
+#define MAPLE_BULK_BUDGET       256
+
+/** \brief  Statistics for one maple scheduling class.
+
+    Latency is measured from a frame being queued to its response arriving.
+
+    \headerfile dc/maple.h
+*/
+typedef struct maple_class_stats {
+    uint32  queued;         /**< \brief Frames on the queue now */
+    uint32  queued_max;     /**< \brief Most frames on the queue at once */
+    uint32  sent;           /**< \brief Frames sent (including resends) */
+    uint32  deferred;       /**< \brief Rounds frames were held over for */
+    uint32  completed;      /**< \brief Frames that got a response */
+    uint64  latency_total;  /**< \brief Total latency, in microseconds */
+    uint32  latency_max;    /**< \brief Worst latency, in microseconds */
+} maple_class_stats_t;
+
+/** \brief  Maple scheduler statistics.
+    \headerfile dc/maple.h
+*/
+typedef struct maple_sched_stats {
+    uint32              rounds;                     /**< \brief DMA rounds started */
+    maple_class_stats_t cls[MAPLE_CLASS_COUNT];     /**< \brief Per-class statistics */
+} maple_sched_stats_t;
+
 /** \brief  Maple device info structure.
 
     This structure is used by the hardware to deliver the response to the device
@@ -227,6 +284,61 @@ typedef struct maple_response {
     uint8   data[0];    /**< \brief Data (if any) */
 } maple_response_t;
 
+/** \brief  Number of events each device's event ring holds.
+
+    This must be a power of two.
+*/
+#define MAPLE_EVENT_QUEUE_SIZE  32
+
+/** \brief  A timestamped input state change.
+
+    Input drivers record one of these whenever a poll finds that the device's
+    state has changed. What the state holds depends on the driver; see
+    maple_event_pop().
+
+    \headerfile dc/maple.h
+*/
+typedef struct maple_event {
+    uint64  time;       /**< \brief When the response arrived, in microseconds
+                                    (see timer_us_gettime64()) */
+    uint32  seq;        /**< \brief Sequence number; a gap means events were
+                                    dropped */
+    uint32  state[7];   /**< \brief The driver's state at that time */
+} maple_event_t;
+
+/** \brief  Maple input event statistics for one device.
+
+    Latency is measured from the response arriving to the event being popped
+    off the ring.
+
+    \headerfile dc/maple.h
+*/
+typedef struct maple_event_stats {
+    uint32  polls;          /**< \brief Condition responses received */
+    uint32  events;         /**< \brief Events added to the ring */
+    uint32  dropped;        /**< \brief Events lost because the ring was full */
+    uint32  popped;         /**< \brief Events taken off the ring */
+    uint64  latency_total;  /**< \brief Total latency, in microseconds */
+    uint32  latency_max;    /**< \brief Worst latency, in microseconds */
+} maple_event_stats_t;
+
+/** \brief  A device's input event ring.
+
+    The DMA interrupt is the only producer and there should only be one
+    consumer, so no locking is needed: head is only written by the producer
+    and tail only by the consumer. Both count up forever, and are masked to
+    index the ring.
+
+    \headerfile dc/maple.h
+*/
+typedef struct maple_event_ring {
+    volatile uint32     head;   /**< \brief Next event to write */
+    volatile uint32     tail;   /**< \brief Next event to read */
+    uint32              seq;    /**< \brief Next sequence number */
+    maple_event_stats_t stats;  /**< \brief Statistics */
+    maple_event_t       ev[MAPLE_EVENT_QUEUE_SIZE]; /**< \brief The events */
+} maple_event_ring_t;
+
 /** \brief  One maple device.
 
     Note that we duplicate the port/unit info which is normally somewhat
@@ -248,6 +360,7 @@ typedef struct maple_device {
 
     volatile int            status_valid;   /**< \brief Have we got our first status update? */
     uint8                   status[1024];   /**< \brief Status buffer (for pollable devices) */
+    maple_event_ring_t      events;         /**< \brief State changes (for input devices) */
 } maple_device_t;
 
 #define MAPLE_PORT_COUNT    4   /**< \brief Number of ports on the bus */
@@ -313,8 +426,22 @@ typedef struct maple_driver {
         \param  dev         The device that was detached.
     */
     void (*detach)(struct maple_driver *drv, maple_device_t *dev);
+
+    uint32      flags;      /**< \brief Driver flags (see \ref maple_drv_flags) */
 } maple_driver_t;
 
+/** \defgroup maple_drv_flags       Maple driver flags
+    @{
+*/
+/** \brief  An input device driver.
+
+    Drivers with this flag have their periodic callback run for the extra
+    sub-frame polling rounds as well as on every vblank, so it should do no
+    more than queue a GETCOND for each device. See maple_subframe_poll().
+*/
+#define MAPLE_DRV_INPUT     0x00000001
+/** @} */
+
 /** \brief  Maple state structure.
 
     We put everything in here to keep from polluting the global namespace too
@@ -355,6 +482,15 @@ typedef struct maple_state_str {
 
     /** \brief  Our vblank handler handle */
     int                         vbl_handle;
+
+    /** \brief  Extra input polling rounds run per frame */
+    int                         subframe_rounds;
+
+    /** \brief  Sub-frame round counter */
+    volatile int                subframe_cntr;
+
+    /** \brief  Flush the queue when the running DMA completes */
+    volatile int                flush_pending;
 } maple_state_t;
 
 /** \brief  Maple DMA buffer size.
@@ -497,7 +633,12 @@ void maple_sentinel_verify(const char * bufname, void * buffer, int bufsize);
 /**************************************************************************/
 /* maple_queue.c */
 
-/** \brief  Send all queued frames. */
+/** \brief  Send queued frames.
+
+    This starts a DMA round with as many of the waiting frames as fit in the
+    DMA buffer and their classes' budgets, highest priority class first. See
+    \ref maple_classes.
+*/
 void maple_queue_flush();
 
 /** \brief  Submit a frame for queueing.
@@ -541,6 +682,28 @@ int maple_frame_lock(maple_frame_t *frame);
 /** \brief  Unlock a frame. */
 void maple_frame_unlock(maple_frame_t *frame);
 
+/** \brief  Set how much bus traffic a scheduling class may use per round.
+
+    Costs are estimated from each frame's command and length, counting both
+    the request and the expected response. The first frame of a class in a
+    round is always sent, however big it is, so nothing waits forever.
+
+    \param  cls             The class (see \ref maple_classes).
+    \param  words           Budget in 32-bit words, or 0 for no limit.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if cls or words is
+                            out of range).
+*/
+int maple_sched_set_budget(int cls, int words);
+
+/** \brief  Retrieve the scheduler statistics.
+    \param  stats           Where to store the statistics.
+*/
+void maple_sched_get_stats(maple_sched_stats_t *stats);
+
+/** \brief  Reset the scheduler statistics (apart from the queue depths). */
+void maple_sched_reset_stats(void);
+
 /**************************************************************************/
 /* maple_driver.c */
 
@@ -595,6 +758,29 @@ void maple_vbl_irq_hnd(uint32 code);
 */
 void maple_dma_irq_hnd(uint32 code);
 
+/** \brief  Maximum number of extra polling rounds per frame. */
+#define MAPLE_SUBFRAME_MAX  3
+
+/** \brief  Poll input devices more than once a frame.
+
+    Normally input devices are polled once per vblank, so a button press can
+    wait most of a frame before it is even seen. With this set, the input
+    drivers (those with \ref MAPLE_DRV_INPUT) also queue their GETCOND
+    frames rounds times between vblanks, evenly spaced over the measured
+    frame time, which cuts that wait down accordingly at the cost of some
+    extra bus traffic. The rounds are run from a kernel timer, so they are
+    only as even as the timer thread gets to run.
+
+    Combine this with maple_event_pop() to see the states in between
+    frames; maple_dev_status() only ever has the latest one.
+
+    \param  rounds          Extra rounds per frame, or 0 to turn this off.
+    \retval 0               On success.
+    \retval -1              On error (errno is EINVAL if rounds is out of
+                            range).
+*/
+int maple_subframe_poll(int rounds);
+
 /**************************************************************************/
 /* maple_enum.c */
 
@@ -643,6 +829,61 @@ maple_device_t * maple_enum_type_ex(int n, uint32 func, uint32 cap);
 */
 void * maple_dev_status(maple_device_t *dev);
 
+/**************************************************************************/
+/* maple_events.c */
+
+/** \brief  Record an input state change.
+
+    This is for input drivers to call from their response callbacks (which
+    run in the DMA interrupt) when the device's state has changed. If the
+    ring is full, the event is dropped and counted.
+
+    \param  dev             The device.
+    \param  state           The new state.
+    \param  size            Size of state in bytes; anything past
+                            sizeof(maple_event_t.state) is ignored.
+*/
+void maple_event_push(maple_device_t *dev, const void *state, int size);
+
+/** \brief  Take the oldest state change off a device's event ring.
+
+    Each input driver records a copy of its state whenever a poll finds that
+    it changed, stamped with when the response arrived, so that a press and
+    release within one frame are not lost. The controller driver records
+    cont_state_t, the mouse driver mouse_state_t, and the keyboard driver
+    kbd_cond_t.
+
+    Only one thread should pop events from any one device.
+
+    \param  dev             The device.
+    \param  ev              Where to store the event.
+    \retval 0               On success.
+    \retval -1              If there were no events waiting.
+*/
+int maple_event_pop(maple_device_t *dev, maple_event_t *ev);
+
+/** \brief  Count the events waiting on a device's event ring.
+    \param  dev             The device.
+    \return                 The number of events that can be popped.
+*/
+int maple_event_count(maple_device_t *dev);
+
+/** \brief  Throw away any events waiting on a device's event ring.
+    \param  dev             The device.
+*/
+void maple_event_clear(maple_device_t *dev);
+
+/** \brief  Retrieve a device's event statistics.
+    \param  dev             The device.
+    \param  stats           Where to store the statistics.
+*/
+void maple_event_get_stats(maple_device_t *dev, maple_event_stats_t *stats);
+
+/** \brief  Reset a device's event statistics.
+    \param  dev             The device.
+*/
+void maple_event_reset_stats(maple_device_t *dev);
+
 /**************************************************************************/
 /* maple_init.c */
 
@@ -265,6 +265,9 @@ typedef struct {
 #define PVR_LIST_PT_POLY        4   /**< \brief Punch-thru polygon list */
 /** @} */
 
+/** \brief  The number of primitive lists. */
+#define PVR_OPB_COUNT           5
+
 /** \defgroup pvr_shading_types     PVR shading modes
 
     Each polygon can define how it wants to be shaded, be it with flat or
@@ -1208,6 +1211,12 @@ typedef struct pvr_stats {
     int     vtx_buffer_used_max;/**< \brief Number of bytes used in the vertex buffer for the largest frame */
     int     buf_last_time;      /**< \brief DMA buffer file time for the last frame in milliseconds */
     uint32  frame_count;        /**< \brief Total number of rendered/viewed frames */
+    int     vtx_buffer_size;    /**< \brief Size of the vertex buffer in bytes */
+    uint32  ta_overflows;       /**< \brief Number of times the TA ran out of vertex or object pointer buffer space */
+    uint32  list_used[PVR_OPB_COUNT];       /**< \brief Bytes of each list's DMA buffer used in the last frame (DMA mode only) */
+    uint32  list_used_max[PVR_OPB_COUNT];   /**< \brief Most bytes of each list's DMA buffer used in any frame */
+    uint32  list_size[PVR_OPB_COUNT];       /**< \brief Current size of each list's DMA buffer, per frame */
+    uint32  list_overflows[PVR_OPB_COUNT];  /**< \brief Number of times each list's DMA buffer overflowed */
     /* ... more later as it's implemented ... */
 } pvr_stats_t;
 
@@ -1356,8 +1365,9 @@ void pvr_fog_table_custom(float tbl1[]);
 
 /* Memory management *************************************************/
 
-/* PVR memory management in KOS uses a modified dlmalloc; see the
-   source file pvr_mem_core.c for more info. */
+/* PVR memory management in KOS keeps free texture memory in power-of-two
+   size classes, with all of its bookkeeping in main RAM; see the source file
+   pvr_mem.c for more info. */
 
 /** \brief  Allocate a chunk of memory from texture space.
 
@@ -1399,11 +1409,104 @@ void pvr_mem_print_list();
 
 /** \brief  Print statistics about the PVR RAM pool.
 
-    This prints out statistics like what malloc_stats() provides. Also, if
+    This prints out the numbers from pvr_mem_get_stats() and how many free
+    blocks there are of each size. Also, if
     KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
 */
 void pvr_mem_stats();
 
+/** \brief  Handle to a movable block of PVR RAM.
+
+    Blocks allocated with pvr_mem_malloc_handle() can be moved by
+    pvr_mem_defrag(), so they are referred to by handle rather than by
+    address. Use pvr_mem_handle_ptr() to find out where one currently is.
+*/
+typedef struct pvr_mem_block *pvr_mem_handle_t;
+
+/** \brief  Movable block callback.
+
+    Called by pvr_mem_defrag() after it moves a block, so that its owner can
+    update anything that refers to the old address (texture contexts, for
+    instance). This is called with the allocator locked, so it must not call
+    any of the pvr_mem_* functions.
+
+    \param  h               The block that was moved
+    \param  old_ptr         Where it used to be
+    \param  new_ptr         Where it is now
+    \param  data            The data passed to pvr_mem_malloc_handle()
+*/
+typedef void (*pvr_mem_move_cb_t)(pvr_mem_handle_t h, pvr_ptr_t old_ptr,
+                                  pvr_ptr_t new_ptr, void *data);
+
+/** \brief  Allocate a movable chunk of memory from texture space.
+
+    This works like pvr_mem_malloc(), except that pvr_mem_defrag() is allowed to
+    move the block to close up free space. Blocks from pvr_mem_malloc() are
+    never moved.
+
+    \param  size            The amount of memory to allocate
+    \param  cb              Called whenever the block is moved (may be NULL)
+    \param  data            Passed to cb
+    \return                 A handle to the block on success, NULL on error
+*/
+pvr_mem_handle_t pvr_mem_malloc_handle(size_t size, pvr_mem_move_cb_t cb,
+                                       void *data);
+
+/** \brief  Free a movable block of memory in the PVR RAM pool.
+    \param  h               The block to free (may be NULL)
+*/
+void pvr_mem_free_handle(pvr_mem_handle_t h);
+
+/** \brief  Find where a movable block currently is.
+
+    The address stays valid until the next call to pvr_mem_defrag().
+
+    \param  h               The block to look up
+    \return                 The address of the block in PVR RAM
+*/
+pvr_ptr_t pvr_mem_handle_ptr(pvr_mem_handle_t h);
+
+/** \brief  Close up free space in the PVR RAM pool.
+
+    This moves blocks allocated with pvr_mem_malloc_handle() down over the
+    free space below them, or into a gap in front of a block that can't move,
+    calling their callbacks as it goes. The data is copied through a buffer in
+    main RAM and back with PVR DMA, since the DMA can't read PVR RAM.
+
+    The PVR must not be using any of the movable blocks while this runs, so
+    call it between frames (after pvr_wait_ready()), not during a render.
+
+    \param  budget          Stop after moving about this many bytes, or 0 to
+                            go until there's nothing left to do. This lets a
+                            program spread the work over several frames.
+    \return                 The number of bytes moved
+*/
+size_t pvr_mem_defrag(size_t budget);
+
+/** \brief  PVR RAM pool statistics.
+
+    \headerfile dc/pvr.h
+*/
+typedef struct pvr_mem_stats {
+    uint32  total;          /**< \brief Size of texture memory in bytes */
+    uint32  used;           /**< \brief Bytes allocated */
+    uint32  free;           /**< \brief Bytes free */
+    uint32  largest_free;   /**< \brief Size of the biggest free block */
+    uint32  free_blocks;    /**< \brief Number of free blocks */
+    uint32  used_blocks;    /**< \brief Number of allocated blocks */
+    uint32  movable_blocks; /**< \brief How many of those are movable */
+    uint32  fragmentation;  /**< \brief Percentage of free memory that isn't
+                                 in the biggest free block */
+    uint32  moves;          /**< \brief Blocks moved by pvr_mem_defrag() */
+    uint32  moved_bytes;    /**< \brief Bytes moved by pvr_mem_defrag() */
+    uint32  failures;       /**< \brief Allocations that failed */
+} pvr_mem_stats_t;
+
+/** \brief  Get statistics about the PVR RAM pool.
+    \param  st              The structure to fill in
+*/
+void pvr_mem_get_stats(pvr_mem_stats_t *st);
+
 /* Scene rendering ***************************************************/
 
 /* This API is used to submit triangle strips to the PVR via the TA
@@ -1491,6 +1594,74 @@ void * pvr_vertbuf_tail(pvr_list_t list);
 */
 void pvr_vertbuf_written(pvr_list_t list, uint32 amt);
 
+/** \defgroup pvr_vertbuf_policies Vertex buffer overflow policies
+
+    These control what happens when a list's DMA vertex buffer runs out of
+    room. Whatever the policy, the overflow is counted in the list_overflows
+    field of pvr_stats_t, and the list accepts no more data until the next
+    frame.
+
+    @{
+*/
+#define PVR_VERTBUF_ASSERT      0   /**< \brief Assert (default). Acts like truncate if asserts are disabled. */
+#define PVR_VERTBUF_TRUNCATE    1   /**< \brief Keep what fit, drop the rest */
+#define PVR_VERTBUF_DROP        2   /**< \brief Drop the whole list for the frame */
+/** @} */
+
+/** \brief  Set what happens when a DMA vertex buffer overflows.
+
+    Note that truncating a list may cut off a triangle strip in the middle if
+    it was submitted in pieces. Primitives submitted with pvr_prim_batch() are
+    always either entirely in or entirely out.
+
+    \param  policy          The policy (see \ref pvr_vertbuf_policies).
+*/
+void pvr_set_vertbuf_policy(int policy);
+
+/** \brief  Let the PVR system allocate and size a list's vertex buffer.
+
+    This replaces any buffer set with pvr_set_vertbuf() with a pair of
+    buffers allocated from the heap. At the start of each frame, the buffer
+    about to be written is resized according to recent usage. A buffer that
+    fills up in the middle of a frame is grown on the spot, as long as it
+    stays within max_len; only past that does the overflow policy kick in.
+
+    Unlike pvr_set_vertbuf(), the sizes here are for one frame, not for both
+    halves together. Calling pvr_set_vertbuf() on the list afterwards frees
+    the automatic buffers.
+
+    If a vertex DMA is in progress, this waits for it to finish with the old
+    buffers before replacing them.
+
+    \param  list            The primitive list to set the buffer for.
+    \param  min_len         The smallest the buffer may get, in bytes.
+    \param  max_len         The largest the buffer may get, in bytes.
+    \param  oldbuf          If not NULL, set to the buffer previously given
+                            to pvr_set_vertbuf() (which the caller should
+                            free), or NULL if there wasn't one. This is set
+                            even if the new buffers can't be allocated, as
+                            the old one is no longer in use either way.
+    \retval 0               On success.
+    \retval -1              If out of memory.
+*/
+int pvr_set_vertbuf_auto(pvr_list_t list, int min_len, int max_len,
+                         void **oldbuf);
+
+/** \brief  Make sure there's room to write data directly into a list's
+            vertex buffer.
+
+    Call this before writing to the address returned by pvr_vertbuf_tail().
+    It grows automatically sized buffers if needed, which may move them, so
+    call pvr_vertbuf_tail() afterwards.
+
+    \param  list            The primitive list to write to.
+    \param  amt             The number of bytes that are going to be written.
+    \retval 0               If there is room.
+    \retval -1              If not. The overflow policy has been applied, and
+                            the list won't accept more data this frame.
+*/
+int pvr_vertbuf_reserve(pvr_list_t list, uint32 amt);
+
 /** \brief  Set the translucent polygon sort mode for the next frame.
 
     This function sets the translucent polygon sort mode for the next frame of
@@ -1638,6 +1809,76 @@ int pvr_list_prim(pvr_list_t list, void * data, int size);
 */
 int pvr_list_flush(pvr_list_t list);
 
+/** \defgroup pvr_batch_modes       Batched primitive types
+
+    These are the values that can be passed as the mode to pvr_prim_batch().
+
+    @{
+*/
+#define PVR_BATCH_TRIS      0   /**< \brief Separate triangles, 3 vertices each */
+#define PVR_BATCH_STRIP     1   /**< \brief One triangle strip */
+/** @} */
+
+/** \brief  Untransformed vertex for batched submission.
+
+    This is the input format for pvr_prim_batch(). The position is given in
+    object space and is run through the current matrix; everything else is
+    passed through to the resulting pvr_vertex_t.
+
+    \headerfile dc/pvr.h
+*/
+typedef struct pvr_batch_vtx {
+    float   x;                  /**< \brief X coordinate */
+    float   y;                  /**< \brief Y coordinate */
+    float   z;                  /**< \brief Z coordinate */
+    float   u;                  /**< \brief Texture U coordinate */
+    float   v;                  /**< \brief Texture V coordinate */
+    uint32  argb;               /**< \brief Vertex color */
+    uint32  oargb;              /**< \brief Vertex offset color */
+} pvr_batch_vtx_t;
+
+/** \brief  Transform, clip and submit a batch of vertices.
+
+    This function submits a polygon header followed by a whole array of
+    vertices in one go. Each vertex is transformed by the current matrix (see
+    dc/matrix.h) without the perspective divide, clipped against the near
+    plane (see pvr_batch_set_near()), divided through and packed as a
+    pvr_vertex_t. The matrix should thus include the projection and the
+    mapping to screen coordinates, with w ending up as the distance in front
+    of the viewer.
+
+    If vertex DMA is enabled, the data is written straight into the vertex
+    buffer for the list, and nothing at all is written if it doesn't fit.
+    Otherwise, the list must be the one currently open, and the data is sent
+    to the TA through the store queues.
+
+    Triangles that are entirely behind the near plane are dropped. Ones that
+    cross it are cut down to a triangle or quad and sent as their own strip.
+
+    \param  list            The list to submit to.
+    \param  hdr             The polygon header to send before the vertices.
+                            This must use the PVR_CLRFMT_ARGBPACKED color
+                            format to match pvr_vertex_t.
+    \param  verts           The vertices to submit.
+    \param  count           The number of vertices. For PVR_BATCH_TRIS this
+                            must be a multiple of 3.
+    \param  mode            The primitive type (see \ref pvr_batch_modes).
+    \retval 0               On success.
+    \retval -1              On error (bad parameters, list not open, or the
+                            vertex buffer is full).
+*/
+int pvr_prim_batch(pvr_list_t list, const pvr_poly_hdr_t *hdr,
+                   const pvr_batch_vtx_t *verts, int count, int mode);
+
+/** \brief  Set the near clipping distance for pvr_prim_batch().
+
+    Anything with a transformed w smaller than this is clipped away. The
+    default is 0.0001.
+
+    \param  w               The new near plane distance (must be > 0).
+*/
+void pvr_batch_set_near(float w);
+
 /** \brief  Call this after you have finished submitting all data for a frame.
 
     Once this has been called, you can not submit any more data until one of the
@@ -1859,7 +2100,7 @@ void pvr_txr_load(void * src, pvr_ptr_t dst, uint32 count);
 #define PVR_TXRLOAD_16BPP           0x03    /**< \brief 16BPP format */
 #define PVR_TXRLOAD_FMT_MASK        0x0f    /**< \brief Bits used for basic formats */
 
-#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (not supported yet, if ever) */
+#define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (16BPP only) */
 #define PVR_TXRLOAD_INVERT_Y        0x20    /**< \brief Invert the Y axis while loading */
 #define PVR_TXRLOAD_FMT_VQ          0x40    /**< \brief Texture is already VQ encoded */
 #define PVR_TXRLOAD_FMT_TWIDDLED    0x80    /**< \brief Texture is already twiddled */
@@ -1867,19 +2108,30 @@ void pvr_txr_load(void * src, pvr_ptr_t dst, uint32 count);
 #define PVR_TXRLOAD_DMA             0x8000  /**< \brief Use DMA to load the texture */
 #define PVR_TXRLOAD_NONBLOCK        0x4000  /**< \brief Use non-blocking loads (only for DMA) */
 #define PVR_TXRLOAD_SQ              0x2000  /**< \brief Use store queues to load */
+
+#define PVR_TXRLOAD_VQ_RGB565       0x0000  /**< \brief VQ encode as RGB565 */
+#define PVR_TXRLOAD_VQ_ARGB1555     0x0100  /**< \brief VQ encode as ARGB1555 */
+#define PVR_TXRLOAD_VQ_ARGB4444     0x0200  /**< \brief VQ encode as ARGB4444 */
+#define PVR_TXRLOAD_VQ_FMT_MASK     0x0300  /**< \brief Bits used for the VQ pixel format */
 /** @} */
 
 /** \brief  Load texture data from an SH-4 buffer into PVR RAM, twiddling it in
             the process.
 
     This function loads a texture to the PVR's RAM with the specified set of
-    flags. It will currently always twiddle the data, whether you ask it to or
-    not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
+    flags. It will always twiddle the data, whether you ask it to or not. Along
+    with the format flags, it supports PVR_TXRLOAD_INVERT_Y, PVR_TXRLOAD_SQ to
+    write through the store queues, and PVR_TXRLOAD_DMA to twiddle into a
+    buffer in main RAM and DMA that across (blocking until it's done).
 
-    This will be slower than using pvr_txr_load() in pretty much all cases, so
-    unless you need to twiddle your texture, just use that instead.
+    With PVR_TXRLOAD_VQ_LOAD, a 16bpp texture is VQ compressed on the way in
+    (see pvr_txr_vq_encode()), and dst must have room for the VQ texture
+    rather than the original. Set one of the PVR_TXRLOAD_VQ_* formats so the
+    encoder knows what the pixels look like.
+
+    The data is twiddled 32 bytes at a time, so this is not much slower than
+    pvr_txr_load(); that said, unless you need to twiddle your texture, just
+    use that instead.
 
     \param  src             The location to copy from.
     \param  dst             The location to copy to.
@@ -1891,6 +2143,32 @@ void pvr_txr_load(void * src, pvr_ptr_t dst, uint32 count);
 */
 void pvr_txr_load_ex(void * src, pvr_ptr_t dst, uint32 w, uint32 h, uint32 flags);
 
+/** \brief  VQ compress a texture.
+
+    This builds a VQ texture (a 2048-byte codebook of 2x2 texel blocks,
+    followed by a twiddled index map of one byte per block) from a 16bpp
+    image. The codebook is built by median cut, which is fast enough to use at
+    load time but won't match the quality of an offline encoder like vqenc.
+
+    \param  src             The image, in the format given in flags.
+    \param  dst             Where to put the VQ texture, in main RAM. Must
+                            have room for 2048 + w * h / 4 bytes.
+    \param  w               The width of the image (a power of 2, 8 to
+                            1024).
+    \param  h               The height of the image (a power of 2, 8 to
+                            1024).
+    \param  flags           One of the PVR_TXRLOAD_VQ_* formats, optionally
+                            ORed with PVR_TXRLOAD_INVERT_Y.
+    \return                 The number of codebook entries used, or -1 on
+                            error.
+
+    \par    Error Conditions:
+    \em     EINVAL - w or h is not a power of 2 between 8 and 1024 \n
+    \em     ENOMEM - out of memory for the encoder's working space
+*/
+int pvr_txr_vq_encode(const void *src, void *dst, uint32 w, uint32 h,
+                      uint32 flags);
+
 /** \brief  Load a KOS Platform Independent Image (subject to constraint
             checking).
 
@@ -1915,9 +2193,9 @@ void pvr_txr_load_ex(void * src, pvr_ptr_t dst, uint32 w, uint32 h, uint32 flags
                             \ref PVR_TXRLOAD_FMT_NOTWIDDLE (or equivalently
                             \ref PVR_TXRLOAD_FMT_TWIDDLED) and
                             \ref PVR_TXRLOAD_INVERT_Y in the flags.
-    \note                   DMA and Store Queue based loading is not available
-                            from this function if it twiddles the texture while
-                            loading.
+    \note                   If this function twiddles the texture while
+                            loading, DMA loading twiddles into a temporary
+                            buffer in main RAM first.
 */
 void pvr_txr_load_kimg(kos_img_t *img, pvr_ptr_t dst, uint32 flags);
 
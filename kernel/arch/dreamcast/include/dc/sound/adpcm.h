@@ -0,0 +1,105 @@
+/* KallistiOS ##version##
+
+   dc/sound/adpcm.h
+
+*/
+
+/** \file   dc/sound/adpcm.h
+    \brief  Yamaha ADPCM encoding.
+
+    This file contains an encoder for the 4-bit Yamaha ADPCM format the AICA
+    plays (the same one utils/wav2adpcm makes, and snd_sfx_load() accepts).
+    ADPCM takes a quarter of the sound RAM and bus bandwidth of 16-bit PCM,
+    so it can be worth converting sound that is generated or decoded at
+    runtime.
+
+    The encoder works on a block at a time, carrying its state from one call
+    to the next, so a long sound can be encoded in pieces as it is produced.
+    Each channel needs its own encoder; the AICA wants the channels of a
+    stereo sound stored separately.
+*/
+
+#ifndef __DC_SOUND_ADPCM_H
+#define __DC_SOUND_ADPCM_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+
+/** \defgroup snd_adpcm_quality   ADPCM encoding quality levels
+    @{
+*/
+#define SND_ADPCM_FAST      0   /**< \brief Nearest step per sample */
+#define SND_ADPCM_GOOD      1   /**< \brief Trellis, 4 paths */
+#define SND_ADPCM_BETTER    2   /**< \brief Trellis, 8 paths */
+#define SND_ADPCM_BEST      3   /**< \brief Trellis, 16 paths */
+/** @} */
+
+/** \brief  ADPCM encoder state.
+
+    The fields are private; set the encoder up with snd_adpcm_enc_init().
+*/
+typedef struct snd_adpcm_enc {
+    int signal;
+    int step;
+    int beam;
+    int odd;
+    uint8 byte;
+} snd_adpcm_enc_t;
+
+/** \brief  Set up an ADPCM encoder.
+
+    SND_ADPCM_FAST picks the nearest step for each sample on its own. The
+    other levels search for the sequence of steps with the least error over
+    short windows, which keeps transients much cleaner at several times the
+    cost per level.
+
+    \param  enc             The encoder to set up.
+    \param  quality         One of the \ref snd_adpcm_quality values.
+*/
+void snd_adpcm_enc_init(snd_adpcm_enc_t *enc, int quality);
+
+/** \brief  Encode a block of samples.
+
+    Each sample becomes one nibble, low nibble first. If samples is odd, the
+    last nibble is held in the encoder for the next call or
+    snd_adpcm_enc_flush().
+
+    \param  enc             The encoder.
+    \param  dst             Where to write the ADPCM data; room for
+                            (samples + 1) / 2 bytes is needed.
+    \param  src             The 16-bit samples.
+    \param  samples         The number of samples to encode.
+    \param  stride          The distance between samples in src: 1 for mono,
+                            or 2 to encode one channel of interleaved stereo
+                            (with src + 1 for the right channel).
+    \return                 The number of bytes written to dst.
+*/
+size_t snd_adpcm_encode(snd_adpcm_enc_t *enc, uint8 *dst, const int16 *src,
+                        size_t samples, int stride);
+
+/** \brief  Finish an ADPCM encoding.
+
+    If the encoder is holding the nibble of an odd sample, this writes it out
+    padded to a whole byte.
+
+    \param  enc             The encoder.
+    \param  dst             Where to write the last byte.
+    \return                 The number of bytes written (0 or 1).
+*/
+size_t snd_adpcm_enc_flush(snd_adpcm_enc_t *enc, uint8 *dst);
+
+/** \brief  Decode ADPCM data.
+
+    \param  dst             Where to write the samples; 2 * bytes of them.
+    \param  src             The ADPCM data, from the start of a sound.
+    \param  bytes           The number of bytes of ADPCM data.
+    \param  stride          The distance between samples in dst (2 to fill
+                            one channel of interleaved stereo).
+*/
+void snd_adpcm_decode(int16 *dst, const uint8 *src, size_t bytes, int stride);
+
+__END_DECLS
+
+#endif  /* __DC_SOUND_ADPCM_H */
@@ -46,6 +46,8 @@ int dbgio_handler_cnt = sizeof(dbgio_handlers) / sizeof(dbgio_handler_t *);
    to be running in your build, and also below in arch_main() */
 /* #if 0 */
 int  __attribute__((weak)) arch_auto_init() {
+    int mode;
+
     /* Initialize memory management */
     mm_init();
 
@@ -81,9 +83,14 @@ int  __attribute__((weak)) arch_auto_init() {
 
     /* Threads */
     if(__kos_init_flags & INIT_THD_PREEMPT)
-        thd_init(THD_MODE_PREEMPT);
+        mode = THD_MODE_PREEMPT;
     else
-        thd_init(THD_MODE_COOP);
+        mode = THD_MODE_COOP;
+
+    if(__kos_init_flags & INIT_MALLOC_TCACHE)
+        mode |= THD_MALLOC_TCACHE;
+
+    thd_init(mode);
 
     nmmgr_init();
 
@@ -140,6 +147,10 @@ int  __attribute__((weak)) arch_auto_init() {
 }
 
 void  __attribute__((weak)) arch_auto_shutdown() {
+    /* Close whatever files are still open while their filesystems (and the
+       network, for sockets) are still around to do it. */
+    fs_fdtbl_destroy();
+
     fs_dclsocket_shutdown();
     net_shutdown();
 
@@ -0,0 +1,66 @@
+/* KallistiOS ##version##
+
+   snd_adpcm.c
+
+*/
+
+#include <dc/sound/adpcm.h>
+
+#include "snd_adpcm_core.h"
+
+static const int beams[4] = { 1, 4, 8, 16 };
+
+static void load(snda_enc_t *e, const snd_adpcm_enc_t *enc) {
+    e->signal = enc->signal;
+    e->step = enc->step;
+    e->beam = enc->beam;
+    e->odd = enc->odd;
+    e->byte = enc->byte;
+}
+
+static void save(snd_adpcm_enc_t *enc, const snda_enc_t *e) {
+    enc->signal = e->signal;
+    enc->step = e->step;
+    enc->beam = e->beam;
+    enc->odd = e->odd;
+    enc->byte = e->byte;
+}
+
+void snd_adpcm_enc_init(snd_adpcm_enc_t *enc, int quality) {
+    snda_enc_t e;
+
+    if(quality < SND_ADPCM_FAST)
+        quality = SND_ADPCM_FAST;
+    else if(quality > SND_ADPCM_BEST)
+        quality = SND_ADPCM_BEST;
+
+    snda_init(&e, beams[quality]);
+    save(enc, &e);
+}
+
+size_t snd_adpcm_encode(snd_adpcm_enc_t *enc, uint8 *dst, const int16 *src,
+                        size_t samples, int stride) {
+    snda_enc_t e;
+    size_t rv;
+
+    load(&e, enc);
+    rv = snda_encode(&e, dst, src, samples, stride);
+    save(enc, &e);
+
+    return rv;
+}
+
+size_t snd_adpcm_enc_flush(snd_adpcm_enc_t *enc, uint8 *dst) {
+    snda_enc_t e;
+    size_t rv;
+
+    load(&e, enc);
+    rv = snda_flush(&e, dst);
+    save(enc, &e);
+
+    return rv;
+}
+
+void snd_adpcm_decode(int16 *dst, const uint8 *src, size_t bytes, int stride) {
+    snda_decode(dst, src, bytes, stride);
+}
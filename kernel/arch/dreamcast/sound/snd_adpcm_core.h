@@ -0,0 +1,266 @@
+/* KallistiOS ##version##
+
+   snd_adpcm_core.h
+
+*/
+
+#ifndef __SND_ADPCM_CORE_H
+#define __SND_ADPCM_CORE_H
+
+/* Yamaha (AICA) 4-bit ADPCM encoding and decoding, shared by snd_adpcm.c
+   and utils/wav2adpcm, which includes this straight from the kernel tree.
+   Nothing here touches the hardware. The includer provides the uint8,
+   int16, uint32, int64 and uint64 types.
+
+   Each sample is one nibble, low nibble first. The decoder keeps a signal
+   and a step size; a nibble's low three bits pick a multiple of the step to
+   add (bit 3 is the sign) and how much the step grows or shrinks. Picking
+   the nearest nibble for each sample on its own ("greedy") is cheap, but
+   the step it leaves behind may be a poor one for the samples that follow,
+   which is what smears transients. The trellis coder keeps the best few
+   nibble sequences over a short window instead, and commits to the one
+   with the least squared error when the window ends. */
+
+#define SNDA_STEP_MIN   0x7f
+#define SNDA_STEP_MAX   0x6000
+
+/* Widest trellis, and samples per trellis window */
+#define SNDA_BEAM_MAX   16
+#define SNDA_WINDOW     32
+
+static const int snda_diff[16] = {
+    1, 3, 5, 7, 9, 11, 13, 15,
+    -1, -3, -5, -7, -9, -11, -13, -15,
+};
+
+static const int snda_scale[8] = {
+    0x0e6, 0x0e6, 0x0e6, 0x0e6, 0x133, 0x199, 0x200, 0x266
+};
+
+typedef struct snda_enc {
+    int signal;         /* Decoder state after the last sample */
+    int step;
+    int beam;           /* Trellis width; 1 for greedy */
+    int odd;            /* A low nibble is waiting in byte */
+    uint8 byte;
+} snda_enc_t;
+
+typedef struct snda_node {
+    int signal;
+    int step;
+    uint64 err;
+    uint8 parent;
+    uint8 code;
+} snda_node_t;
+
+static inline int snda_limit(int val, int min, int max) {
+    return val < min ? min : val > max ? max : val;
+}
+
+static inline void snda_init(snda_enc_t *e, int beam) {
+    e->signal = 0;
+    e->step = SNDA_STEP_MIN;
+    e->beam = snda_limit(beam, 1, SNDA_BEAM_MAX);
+    e->odd = 0;
+    e->byte = 0;
+}
+
+/* Run the decoder on one nibble. */
+static inline void snda_apply(int *signal, int *step, int code) {
+    *signal = snda_limit(*signal + (*step * snda_diff[code]) / 8,
+                         -32768, 32767);
+    *step = snda_limit((*step * snda_scale[code & 7]) >> 8,
+                       SNDA_STEP_MIN, SNDA_STEP_MAX);
+}
+
+/* The nibble whose step multiple is closest to diff. */
+static inline int snda_nearest(int diff, int step) {
+    int d = (diff * 8) / step;
+    int val = (d < 0 ? -d : d) / 2;
+
+    if(val > 7)
+        val = 7;
+
+    return d < 0 ? val + 8 : val;
+}
+
+static inline void snda_put(snda_enc_t *e, uint8 **dst, int code) {
+    if(!e->odd) {
+        e->byte = code;
+        e->odd = 1;
+    }
+    else {
+        *(*dst)++ = e->byte | (code << 4);
+        e->odd = 0;
+    }
+}
+
+/* Add a path to the sorted list of survivors v, unless there are already
+   beam better ones. Two paths that leave the decoder in the same state
+   will code the rest of the window the same way, so only the better one
+   is kept. */
+static inline void snda_keep(snda_node_t *v, int *n, int beam,
+                             const snda_node_t *c) {
+    int i;
+
+    /* Nothing this bad can displace anything, not even a duplicate */
+    if(*n == beam && c->err >= v[*n - 1].err)
+        return;
+
+    for(i = 0; i < *n; i++) {
+        if(v[i].signal == c->signal && v[i].step == c->step)
+            break;
+    }
+
+    if(i < *n) {
+        if(v[i].err <= c->err)
+            return;
+    }
+    else if(*n < beam) {
+        i = (*n)++;
+    }
+    else if(c->err < v[*n - 1].err) {
+        i = *n - 1;
+    }
+    else {
+        return;
+    }
+
+    while(i > 0 && v[i - 1].err > c->err) {
+        v[i] = v[i - 1];
+        i--;
+    }
+
+    v[i] = *c;
+}
+
+/* Trellis-code up to SNDA_WINDOW samples. */
+static void snda_window(snda_enc_t *e, uint8 **dst, const int16 *src,
+                        uint32 n, uint32 stride) {
+    snda_node_t a[SNDA_BEAM_MAX], b[SNDA_BEAM_MAX], c;
+    snda_node_t *cur = a, *nxt = b, *tmp;
+    uint8 parents[SNDA_WINDOW][SNDA_BEAM_MAX];
+    uint8 codes[SNDA_WINDOW][SNDA_BEAM_MAX];
+    int ncur = 1, nnxt, k, j, code, mag, x;
+    int tries[4], ntries;
+    uint32 t;
+    int64 d;
+
+    cur[0].signal = e->signal;
+    cur[0].step = e->step;
+    cur[0].err = 0;
+
+    for(t = 0; t < n; t++) {
+        x = src[t * stride];
+        nnxt = 0;
+
+        for(k = 0; k < ncur; k++) {
+            /* Try the nearest nibble, the magnitudes either side of it, and
+               the smallest step the other way. */
+            code = snda_nearest(x - cur[k].signal, cur[k].step);
+            mag = code & 7;
+            ntries = 0;
+            tries[ntries++] = code;
+
+            if(mag > 0)
+                tries[ntries++] = code - 1;
+
+            if(mag < 7)
+                tries[ntries++] = code + 1;
+
+            tries[ntries++] = (code & 8) ^ 8;
+
+            for(j = 0; j < ntries; j++) {
+                c.signal = cur[k].signal;
+                c.step = cur[k].step;
+                snda_apply(&c.signal, &c.step, tries[j]);
+                d = x - c.signal;
+                c.err = cur[k].err + (uint64)(d * d);
+                c.parent = k;
+                c.code = tries[j];
+                snda_keep(nxt, &nnxt, e->beam, &c);
+            }
+        }
+
+        for(k = 0; k < nnxt; k++) {
+            parents[t][k] = nxt[k].parent;
+            codes[t][k] = nxt[k].code;
+        }
+
+        tmp = cur;
+        cur = nxt;
+        nxt = tmp;
+        ncur = nnxt;
+    }
+
+    /* The survivors are sorted, so the best path ends at cur[0]. Trace it
+       back, then write it out forwards. */
+    e->signal = cur[0].signal;
+    e->step = cur[0].step;
+
+    for(t = n, k = 0; t-- > 0;) {
+        j = codes[t][k];
+        k = parents[t][k];
+        codes[t][0] = j;
+    }
+
+    for(t = 0; t < n; t++)
+        snda_put(e, dst, codes[t][0]);
+}
+
+/* Encode n samples, taking every stride'th one from src (so one channel
+   can be picked out of interleaved stereo). Returns the number of bytes
+   written to dst; an odd sample's nibble is held until the next call or
+   snda_flush(). */
+static uint32 snda_encode(snda_enc_t *e, uint8 *dst, const int16 *src,
+                          uint32 n, uint32 stride) {
+    uint8 *start = dst;
+    uint32 i, w;
+    int code;
+
+    if(e->beam <= 1) {
+        for(i = 0; i < n; i++) {
+            code = snda_nearest(src[i * stride] - e->signal, e->step);
+            snda_apply(&e->signal, &e->step, code);
+            snda_put(e, &dst, code);
+        }
+    }
+    else {
+        for(i = 0; i < n; i += w) {
+            w = n - i < SNDA_WINDOW ? n - i : SNDA_WINDOW;
+            snda_window(e, &dst, src + i * stride, w, stride);
+        }
+    }
+
+    return dst - start;
+}
+
+/* Write out a held nibble, padded with a zero one. Returns the number of
+   bytes written (0 or 1). */
+static inline uint32 snda_flush(snda_enc_t *e, uint8 *dst) {
+    if(!e->odd)
+        return 0;
+
+    *dst = e->byte;
+    e->odd = 0;
+    return 1;
+}
+
+/* Decode bytes of ADPCM into 2 * bytes samples, stored every stride'th
+   sample of dst. */
+static void snda_decode(int16 *dst, const uint8 *src, uint32 bytes,
+                        uint32 stride) {
+    int signal = 0, step = SNDA_STEP_MIN;
+    uint32 i;
+
+    for(i = 0; i < bytes; i++) {
+        snda_apply(&signal, &step, src[i] & 15);
+        *dst = signal;
+        dst += stride;
+        snda_apply(&signal, &step, src[i] >> 4);
+        *dst = signal;
+        dst += stride;
+    }
+}
+
+#endif  /* __SND_ADPCM_CORE_H */
@@ -14,6 +14,7 @@
 #include <malloc.h>
 #include <sys/queue.h>
 
+#include <kos/slab.h>
 #include <arch/timer.h>
 #include <dc/g2bus.h>
 #include <dc/spu.h>
@@ -43,6 +44,9 @@ typedef struct filter {
     void            * data;
 } filter_t;
 
+/* Filters come from their own cache, made by snd_stream_init() */
+static slab_cache_t *filter_cache = NULL;
+
 /* Each of these represents an active streaming channel */
 typedef struct strchan {
     // Which AICA channels are we using?
@@ -105,7 +109,11 @@ void snd_stream_filter_add(snd_stream_hnd_t hnd, snd_stream_filter_t filtfunc, v
 
     CHECK_HND(hnd);
 
-    f = malloc(sizeof(filter_t));
+    if(!(f = (filter_t *)slab_alloc(filter_cache))) {
+        dbglog(DBG_ERROR, "snd_stream_filter_add(): out of memory\n");
+        return;
+    }
+
     f->func = filtfunc;
     f->data = obj;
     TAILQ_INSERT_TAIL(&streams[hnd].filters, f, lent);
@@ -119,7 +127,7 @@ void snd_stream_filter_remove(snd_stream_hnd_t hnd, snd_stream_filter_t filtfunc
     TAILQ_FOREACH(f, &streams[hnd].filters, lent) {
         if(f->func == filtfunc && f->data == obj) {
             TAILQ_REMOVE(&streams[hnd].filters, f, lent);
-            free(f);
+            slab_free(filter_cache, f);
             return;
         }
     }
@@ -232,6 +240,13 @@ int snd_stream_init() {
         sep_buffer[1] = memalign(32, (SND_STREAM_BUFFER_MAX / 2));
     }
 
+    if(!filter_cache &&
+       !(filter_cache = slab_cache_create("snd_filter", sizeof(filter_t),
+                                          SLAB_DEFAULTS, NULL))) {
+        dbglog(DBG_ERROR, "snd_stream_init(): can't create filter cache\n");
+        return -1;
+    }
+
     /* Finish loading the stream driver */
     if(snd_init() < 0) {
         dbglog(DBG_ERROR, "snd_stream_init(): snd_init() failed, giving up\n");
@@ -315,7 +330,7 @@ void snd_stream_destroy(snd_stream_hnd_t hnd) {
 
     while(c) {
         n = TAILQ_NEXT(c, lent);
-        free(c);
+        slab_free(filter_cache, c);
         c = n;
     }
 
@@ -343,6 +358,11 @@ void snd_stream_shutdown() {
         free(sep_buffer[1]);
         sep_buffer[1] = NULL;
     }
+
+    if(filter_cache) {
+        slab_cache_destroy(filter_cache);
+        filter_cache = NULL;
+    }
 }
 
 /* Enable / disable stream queueing */
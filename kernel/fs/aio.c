@@ -0,0 +1,418 @@
+/* KallistiOS ##version##
+
+   aio.c
+
+*/
+
+/*
+
+Asynchronous file reads
+
+Submitted requests go on a single FIFO. Each worker thread takes the request
+at the head, runs it with fs_pread() and posts the result, so requests on the
+same file never wait on each other for the file pointer.
+
+If the filesystem starts a native transfer instead (fs_pread() failing with
+EINPROGRESS on a file opened with O_ASYNC), the worker sleeps in
+fs_complete_wait() until it's done. The transfer has to be completed by the
+thread that started it, which is why the worker stays with it rather than
+moving on to the next request.
+
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <kos/aio.h>
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <arch/timer.h>
+
+TAILQ_HEAD(aio_queue, aio_req);
+
+static struct aio_queue queue;
+static mutex_t aio_mutex = MUTEX_INITIALIZER;
+static condvar_t work_cv = COND_INITIALIZER;
+static condvar_t done_cv = COND_INITIALIZER;
+
+static kthread_t *workers[AIO_MAX_WORKERS];
+static int worker_cnt = 0;
+static int running = 0;
+static int quit = 0;
+
+static aio_stats_t stats;
+
+/* Which latency histogram bucket a request that took us microseconds goes
+   in. See AIO_LAT_BUCKETS. */
+static int lat_bucket(uint64 us) {
+    int b = 0;
+
+    us >>= 7;
+
+    while(us && b < AIO_LAT_BUCKETS - 1) {
+        us >>= 1;
+        ++b;
+    }
+
+    return b;
+}
+
+/* Put a request on the queue. Called with the mutex held. */
+static void aio_enqueue(aio_req_t *req) {
+    req->state = AIO_QUEUED;
+    req->rv = 0;
+    req->err = 0;
+    TAILQ_INSERT_TAIL(&queue, req, q);
+
+    if(++stats.queued > stats.queued_max)
+        stats.queued_max = stats.queued;
+}
+
+/* Post the result of a request, run its callback and then mark it done and
+   wake anyone waiting. Called with the mutex held, which is dropped around
+   the callback. Once the request is AIO_DONE its owner may free it, so
+   nothing here touches it after that. */
+static void aio_finish(aio_req_t *req, ssize_t rv, int err) {
+    for(;;) {
+        req->rv = rv;
+        req->err = err;
+
+        stats.completed++;
+        stats.latency[lat_bucket(timer_us_gettime64() - req->submitted)]++;
+
+        if(rv < 0)
+            stats.failed++;
+        else
+            stats.bytes += rv;
+
+        if(!req->callback)
+            break;
+
+        req->state = AIO_CALLBACK;
+        req->requeue = 0;
+
+        mutex_unlock(&aio_mutex);
+        req->callback(req);
+        mutex_lock(&aio_mutex);
+
+        if(!req->requeue)
+            break;
+
+        /* Resubmitted from the callback. If the engine has been shut down
+           since, it's canceled instead (which runs the callback again). */
+        req->requeue = 0;
+
+        if(running) {
+            aio_enqueue(req);
+            cond_signal(&work_cv);
+            return;
+        }
+
+        stats.canceled++;
+        rv = -1;
+        err = ECANCELED;
+    }
+
+    req->state = AIO_DONE;
+    cond_broadcast(&done_cv);
+}
+
+static void *aio_worker(void *param) {
+    aio_req_t *req;
+    ssize_t rv;
+    int err, native;
+
+    (void)param;
+
+    mutex_lock(&aio_mutex);
+
+    for(;;) {
+        while(!quit && TAILQ_EMPTY(&queue))
+            cond_wait(&work_cv, &aio_mutex);
+
+        if(quit)
+            break;
+
+        req = TAILQ_FIRST(&queue);
+        TAILQ_REMOVE(&queue, req, q);
+        req->state = AIO_RUNNING;
+
+        stats.queued--;
+
+        if(++stats.in_flight > stats.in_flight_max)
+            stats.in_flight_max = stats.in_flight;
+
+        mutex_unlock(&aio_mutex);
+
+        native = 0;
+        rv = fs_pread(req->fd, req->buf, req->cnt, req->offset);
+
+        if(rv < 0 && errno == EINPROGRESS) {
+            native = 1;
+
+            mutex_lock(&aio_mutex);
+            stats.native++;
+            mutex_unlock(&aio_mutex);
+
+            if(fs_complete_wait(req->fd, &rv) < 0)
+                rv = -1;
+        }
+
+        err = rv < 0 ? errno : 0;
+
+        mutex_lock(&aio_mutex);
+
+        stats.in_flight--;
+
+        if(native) {
+            stats.native--;
+            stats.native_total++;
+        }
+
+        aio_finish(req, rv, err);
+    }
+
+    mutex_unlock(&aio_mutex);
+    return NULL;
+}
+
+int aio_init(int count) {
+    kthread_t *thd;
+    int i;
+
+    if(count < 1 || count > AIO_MAX_WORKERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&aio_mutex);
+
+    if(running) {
+        mutex_unlock(&aio_mutex);
+        errno = EBUSY;
+        return -1;
+    }
+
+    TAILQ_INIT(&queue);
+    memset(&stats, 0, sizeof(stats));
+    quit = 0;
+    worker_cnt = 0;
+
+    for(i = 0; i < count; i++) {
+        if(!(thd = thd_create(0, aio_worker, NULL)))
+            break;
+
+        thd_set_label(thd, "[aio]");
+        workers[worker_cnt++] = thd;
+    }
+
+    if(worker_cnt < count) {
+        quit = 1;
+        cond_broadcast(&work_cv);
+        mutex_unlock(&aio_mutex);
+
+        for(i = 0; i < worker_cnt; i++)
+            thd_join(workers[i], NULL);
+
+        worker_cnt = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    stats.workers = worker_cnt;
+    running = 1;
+    mutex_unlock(&aio_mutex);
+
+    return 0;
+}
+
+void aio_shutdown(void) {
+    struct aio_queue canceled;
+    aio_req_t *req;
+    int i;
+
+    mutex_lock(&aio_mutex);
+
+    if(!running) {
+        mutex_unlock(&aio_mutex);
+        return;
+    }
+
+    running = 0;
+    quit = 1;
+    cond_broadcast(&work_cv);
+
+    /* Take everything that hasn't started off the queue. */
+    TAILQ_INIT(&canceled);
+
+    while((req = TAILQ_FIRST(&queue))) {
+        TAILQ_REMOVE(&queue, req, q);
+        TAILQ_INSERT_TAIL(&canceled, req, q);
+    }
+
+    mutex_unlock(&aio_mutex);
+
+    for(i = 0; i < worker_cnt; i++)
+        thd_join(workers[i], NULL);
+
+    worker_cnt = 0;
+
+    mutex_lock(&aio_mutex);
+
+    while((req = TAILQ_FIRST(&canceled))) {
+        TAILQ_REMOVE(&canceled, req, q);
+        stats.queued--;
+        stats.canceled++;
+        aio_finish(req, -1, ECANCELED);
+    }
+
+    stats.workers = 0;
+    quit = 0;
+    mutex_unlock(&aio_mutex);
+}
+
+int aio_submit(aio_req_t *reqs[], int n) {
+    uint64 now = timer_us_gettime64();
+    int i, j;
+
+    if(n <= 0 || !reqs) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&aio_mutex);
+
+    if(!running) {
+        mutex_unlock(&aio_mutex);
+        errno = ENXIO;
+        return -1;
+    }
+
+    /* Claim each request as it passes the checks; that also catches the same
+       request showing up twice in the batch. A request whose callback is
+       still running is only marked, and aio_finish() queues it once the
+       callback returns. */
+    for(i = 0; i < n; i++) {
+        if(!reqs[i] || (!reqs[i]->buf && reqs[i]->cnt) ||
+           reqs[i]->offset < 0 || reqs[i]->state == AIO_QUEUED ||
+           reqs[i]->state == AIO_RUNNING ||
+           (reqs[i]->state == AIO_CALLBACK && reqs[i]->requeue)) {
+            for(j = 0; j < i; j++) {
+                if(reqs[j]->state == AIO_CALLBACK)
+                    reqs[j]->requeue = 0;
+                else
+                    reqs[j]->state = AIO_IDLE;
+            }
+
+            mutex_unlock(&aio_mutex);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if(reqs[i]->state == AIO_CALLBACK)
+            reqs[i]->requeue = 1;
+        else
+            reqs[i]->state = AIO_QUEUED;
+    }
+
+    for(i = 0; i < n; i++) {
+        reqs[i]->submitted = now;
+
+        if(reqs[i]->state == AIO_QUEUED)
+            aio_enqueue(reqs[i]);
+    }
+
+    stats.submitted += n;
+
+    cond_broadcast(&work_cv);
+    mutex_unlock(&aio_mutex);
+
+    return n;
+}
+
+static int count_done(aio_req_t *reqs[], int n) {
+    int i, done = 0;
+
+    for(i = 0; i < n; i++)
+        if(reqs[i]->state == AIO_DONE)
+            ++done;
+
+    return done;
+}
+
+int aio_poll(aio_req_t *reqs[], int n) {
+    return count_done(reqs, n);
+}
+
+int aio_wait(aio_req_t *reqs[], int n, int min, int timeout) {
+    uint64 end = timer_ms_gettime64() + timeout, now;
+    int done;
+
+    if(min > n)
+        min = n;
+
+    mutex_lock(&aio_mutex);
+
+    for(;;) {
+        if((done = count_done(reqs, n)) >= min)
+            break;
+
+        if(!timeout) {
+            cond_wait(&done_cv, &aio_mutex);
+            continue;
+        }
+
+        if((now = timer_ms_gettime64()) >= end) {
+            done = -1;
+            errno = ETIMEDOUT;
+            break;
+        }
+
+        cond_wait_timed(&done_cv, &aio_mutex, (int)(end - now));
+    }
+
+    mutex_unlock(&aio_mutex);
+    return done;
+}
+
+int aio_cancel(aio_req_t *req) {
+    mutex_lock(&aio_mutex);
+
+    if(req->state == AIO_RUNNING || req->state == AIO_CALLBACK) {
+        mutex_unlock(&aio_mutex);
+        errno = EINPROGRESS;
+        return -1;
+    }
+    else if(req->state != AIO_QUEUED) {
+        mutex_unlock(&aio_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    TAILQ_REMOVE(&queue, req, q);
+    stats.queued--;
+    stats.canceled++;
+    aio_finish(req, -1, ECANCELED);
+    mutex_unlock(&aio_mutex);
+
+    return 0;
+}
+
+void aio_get_stats(aio_stats_t *st) {
+    mutex_lock(&aio_mutex);
+    memcpy(st, &stats, sizeof(aio_stats_t));
+    mutex_unlock(&aio_mutex);
+}
+
+void aio_reset_stats(void) {
+    mutex_lock(&aio_mutex);
+
+    stats.queued_max = stats.queued;
+    stats.in_flight_max = stats.in_flight;
+    stats.submitted = stats.completed = stats.failed = stats.canceled = 0;
+    stats.native_total = 0;
+    stats.bytes = 0;
+    memset(stats.latency, 0, sizeof(stats.latency));
+
+    mutex_unlock(&aio_mutex);
+}
@@ -39,6 +39,7 @@ something like this:
 #include <kos/mutex.h>
 #include <kos/nmmgr.h>
 #include <kos/dbgio.h>
+#include <kos/slab.h>
 
 /* File handle structure; this is an entirely internal structure so it does
    not go in a header file. */
@@ -48,8 +49,32 @@ typedef struct fs_hnd {
     int     refcnt;     /* Reference count */
 } fs_hnd_t;
 
-/* The global file descriptor table */
-fs_hnd_t * fd_table[FD_SETSIZE] = { NULL };
+/* The file descriptor table. Descriptors live in chunks of FS_FD_CHUNK that
+   are allocated as they're first needed and never move or go away until
+   shutdown, so looking up a descriptor is just two loads and doesn't need the
+   lock. Everything that changes the table (and the handle reference counts)
+   holds fd_mutex. */
+typedef struct fs_fd_chunk {
+    fs_hnd_t    * volatile hnd[FS_FD_CHUNK];   /* Open handles */
+    uint32      opens[FS_FD_CHUNK];     /* Times each fd was handed out */
+    uint32      used[FS_FD_CHUNK / 32]; /* Bitmap of fds in use */
+    int         nused;                  /* Number of bits set in used */
+} fs_fd_chunk_t;
+
+#define FD_CHUNKS   (FS_FD_LIMIT / FS_FD_CHUNK)
+
+static fs_fd_chunk_t * volatile fd_chunks[FD_CHUNKS];
+static mutex_t fd_mutex = MUTEX_INITIALIZER;
+static int fd_max = FD_SETSIZE;
+static int fd_hint = 0;         /* No free fds in chunks below this one */
+static fs_fd_stats_t fd_stats;
+
+/* Where file handle structures come from */
+static slab_cache_t *fs_hnd_slab = NULL;
+
+/* Serializes the seek/read/seek emulation of pread/pwrite for handlers that
+   don't provide them natively. */
+static mutex_t fs_pio_mutex = MUTEX_INITIALIZER;
 
 /* For some reason, Newlib doesn't seem to define this function in stdlib.h. */
 extern char *realpath(const char *, const char *);
@@ -59,7 +84,11 @@ extern char *realpath(const char *, const char *);
 static fs_hnd_t * fs_root_opendir() {
     fs_hnd_t    *hnd;
 
-    hnd = malloc(sizeof(fs_hnd_t));
+    if(!(hnd = slab_alloc(fs_hnd_slab))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
     hnd->handler = NULL;
     hnd->hnd = 0;
     hnd->refcnt = 0;
@@ -149,7 +178,7 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
     if(h == NULL) return NULL;
 
     /* Wrap it up in a structure */
-    hnd = malloc(sizeof(fs_hnd_t));
+    hnd = slab_alloc(fs_hnd_slab);
 
     if(hnd == NULL) {
         cur->close(h);
@@ -164,8 +193,21 @@ static fs_hnd_t * fs_hnd_open(const char *fn, int mode) {
     return hnd;
 }
 
+/* Look up the handle for a file descriptor, without locking. */
+static inline fs_hnd_t * fd_lookup(file_t fd) {
+    fs_fd_chunk_t *c;
+
+    if(fd < 0 || fd >= FS_FD_LIMIT)
+        return NULL;
+
+    if(!(c = fd_chunks[fd / FS_FD_CHUNK]))
+        return NULL;
+
+    return c->hnd[fd % FS_FD_CHUNK];
+}
+
 /* Reference a file handle. This should be called when a persistent reference
-   to a raw handle is created somewhere. */
+   to a raw handle is created somewhere. Call with fd_mutex held. */
 static void fs_hnd_ref(fs_hnd_t * ref) {
     assert(ref);
     assert(ref->refcnt < (1 << 30));
@@ -175,58 +217,246 @@ static void fs_hnd_ref(fs_hnd_t * ref) {
 /* Unreference a file handle. Should be called when a persistent reference
    to a raw handle is no longer applicable. This function may destroy the
    file handle, so under no circumstances should you presume that it will
-   still exist later. */
+   still exist later. Call without fd_mutex held, since the handler's close
+   function may block. */
 static int fs_hnd_unref(fs_hnd_t * ref) {
-    int retval = 0;
+    int retval = 0, last;
+
     assert(ref);
+
+    mutex_lock(&fd_mutex);
     assert(ref->refcnt > 0);
-    ref->refcnt--;
+    last = !--ref->refcnt;
+    mutex_unlock(&fd_mutex);
 
-    if(ref->refcnt == 0) {
+    if(last) {
         if(ref->handler != NULL) {
             if(ref->handler->close == NULL) return retval;
 
             retval = ref->handler->close(ref->hnd);
         }
 
-        free(ref);
+        slab_free(fs_hnd_slab, ref);
     }
     return retval;
 }
 
+/* Put a handle in the given descriptor slot, which must be free and have its
+   chunk allocated. Call with fd_mutex held. */
+static void fd_set_slot(file_t fd, fs_hnd_t * hnd) {
+    fs_fd_chunk_t *c = fd_chunks[fd / FS_FD_CHUNK];
+    int i = fd % FS_FD_CHUNK;
+
+    c->used[i / 32] |= 1u << (i % 32);
+    c->nused++;
+    c->opens[i]++;
+    c->hnd[i] = hnd;
+
+    fs_hnd_ref(hnd);
+
+    fd_stats.opens++;
+
+    if(++fd_stats.open > fd_stats.open_peak)
+        fd_stats.open_peak = fd_stats.open;
+}
+
+/* Empty a descriptor slot, returning the handle that was in it. Call with
+   fd_mutex held. */
+static fs_hnd_t * fd_clear_slot(file_t fd) {
+    fs_fd_chunk_t *c = fd_chunks[fd / FS_FD_CHUNK];
+    int i = fd % FS_FD_CHUNK;
+    fs_hnd_t *hnd = c->hnd[i];
+
+    c->hnd[i] = NULL;
+    c->used[i / 32] &= ~(1u << (i % 32));
+    c->nused--;
+
+    if(fd / FS_FD_CHUNK < fd_hint)
+        fd_hint = fd / FS_FD_CHUNK;
+
+    fd_stats.closes++;
+    fd_stats.open--;
+
+    return hnd;
+}
+
+/* Make sure the chunk holding the given descriptor exists. Call with fd_mutex
+   held. */
+static int fd_chunk_alloc(int ci) {
+    fs_fd_chunk_t *c;
+
+    if(fd_chunks[ci])
+        return 0;
+
+    if(!(c = (fs_fd_chunk_t *)calloc(1, sizeof(fs_fd_chunk_t))))
+        return -1;
+
+    fd_chunks[ci] = c;
+    fd_stats.chunks++;
+
+    return 0;
+}
+
+/* Find the lowest free descriptor, growing the table if needed. Returns -1
+   with errno set to EMFILE if they're all in use, or ENOMEM if the table
+   couldn't be grown. Call with fd_mutex held. */
+static file_t fd_alloc_slot(void) {
+    fs_fd_chunk_t *c;
+    uint32 bits;
+    int ci, w, fd;
+
+    for(ci = fd_hint; ci * FS_FD_CHUNK < fd_max; ci++) {
+        if(fd_chunk_alloc(ci) < 0) {
+            fd_stats.failures++;
+            errno = ENOMEM;
+            return -1;
+        }
+
+        c = fd_chunks[ci];
+
+        if(c->nused == FS_FD_CHUNK)
+            continue;
+
+        for(w = 0; w < FS_FD_CHUNK / 32; w++) {
+            if((bits = ~c->used[w])) {
+                fd = ci * FS_FD_CHUNK + w * 32 + __builtin_ctz(bits);
+
+                if(fd >= fd_max)
+                    goto full;
+
+                fd_hint = ci;
+                return fd;
+            }
+        }
+    }
+
+full:
+    fd_stats.failures++;
+    errno = EMFILE;
+    return -1;
+}
+
 /* Assigns a file descriptor (index) to a file handle (pointer). Will auto-
    reference the handle, and unrefs on error. */
 static int fs_hnd_assign(fs_hnd_t * hnd) {
-    int i;
+    file_t fd;
+    int err;
 
-    fs_hnd_ref(hnd);
-
-    /* XXX Not thread-safe! */
-    for(i = 0; i < FD_SETSIZE; i++)
-        if(!fd_table[i])
-            break;
+    mutex_lock(&fd_mutex);
 
-    if(i >= FD_SETSIZE) {
+    if((fd = fd_alloc_slot()) < 0) {
+        /* Take a reference anyway, so that dropping it below closes a handle
+           that was just opened. */
+        err = errno;
+        fs_hnd_ref(hnd);
+        mutex_unlock(&fd_mutex);
         fs_hnd_unref(hnd);
-        errno = EMFILE;
+        errno = err;
         return -1;
     }
 
-    fd_table[i] = hnd;
+    fd_set_slot(fd, hnd);
+    mutex_unlock(&fd_mutex);
 
-    return i;
+    return fd;
 }
 
 int fs_fdtbl_destroy() {
-    int i;
+    fs_hnd_t *hnd;
+    int ci, i;
+
+    for(ci = 0; ci < FD_CHUNKS; ci++) {
+        if(!fd_chunks[ci])
+            continue;
+
+        for(i = 0; i < FS_FD_CHUNK; i++) {
+            mutex_lock(&fd_mutex);
+            hnd = fd_chunks[ci]->hnd[i] ?
+                  fd_clear_slot(ci * FS_FD_CHUNK + i) : NULL;
+            mutex_unlock(&fd_mutex);
+
+            if(hnd)
+                fs_hnd_unref(hnd);
+        }
+    }
+
+    return 0;
+}
+
+int fs_fd_set_max(int max) {
+    fs_fd_chunk_t *c;
+    int ci, i;
+
+    if(max < 1 || max > FS_FD_LIMIT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&fd_mutex);
+
+    /* Make sure nothing's open at or above the new limit. */
+    for(ci = max / FS_FD_CHUNK; ci < FD_CHUNKS; ci++) {
+        if(!(c = fd_chunks[ci]) || !c->nused)
+            continue;
+
+        for(i = ci == max / FS_FD_CHUNK ? max % FS_FD_CHUNK : 0;
+            i < FS_FD_CHUNK; i++) {
+            if(c->hnd[i]) {
+                mutex_unlock(&fd_mutex);
+                errno = EBUSY;
+                return -1;
+            }
+        }
+    }
+
+    fd_max = max;
+    mutex_unlock(&fd_mutex);
+
+    return 0;
+}
+
+int fs_fd_get_max(void) {
+    return fd_max;
+}
 
-    for(i = 0; i < FD_SETSIZE; i++) {
-        if(fd_table[i])
-            fs_hnd_unref(fd_table[i]);
+void fs_fd_get_stats(fs_fd_stats_t *stats) {
+    mutex_lock(&fd_mutex);
+    memcpy(stats, &fd_stats, sizeof(fs_fd_stats_t));
+    stats->max = fd_max;
+    mutex_unlock(&fd_mutex);
+}
+
+int fs_fd_pslist(int (*pf)(const char *fmt, ...)) {
+    fs_fd_chunk_t *c;
+    fs_hnd_t *h;
+    int ci, i;
+
+    mutex_lock(&fd_mutex);
+
+    pf("File descriptors (%lu open, peak %lu, limit %d):\n", fd_stats.open,
+       fd_stats.open_peak, fd_max);
+    pf("fd\tfs\t\thandle\t\trefs\topens\n");
 
-        fd_table[i] = NULL;
+    for(ci = 0; ci < FD_CHUNKS; ci++) {
+        if(!(c = fd_chunks[ci]))
+            continue;
+
+        for(i = 0; i < FS_FD_CHUNK; i++) {
+            if(!(h = c->hnd[i]))
+                continue;
+
+            pf("%d\t%-12s\t%08lx\t%d\t%lu\n", ci * FS_FD_CHUNK + i,
+               h->handler ? h->handler->nmmgr.pathname : "/",
+               (uint32)h->hnd, h->refcnt, c->opens[i]);
+        }
     }
 
+    pf("%lu opened, %lu closed, %lu failed\n", fd_stats.opens,
+       fd_stats.closes, fd_stats.failures);
+    pf("--end of list--\n");
+
+    mutex_unlock(&fd_mutex);
+
     return 0;
 }
 
@@ -250,7 +480,7 @@ file_t fs_open_handle(vfs_handler_t * vfs, void * vhnd) {
     fs_hnd_t * hnd;
 
     /* Wrap it up in a structure */
-    hnd = malloc(sizeof(fs_hnd_t));
+    hnd = slab_alloc(fs_hnd_slab);
 
     if(hnd == NULL) {
         errno = ENOMEM;
@@ -266,55 +496,85 @@ file_t fs_open_handle(vfs_handler_t * vfs, void * vhnd) {
 }
 
 vfs_handler_t * fs_get_handler(file_t fd) {
+    fs_hnd_t *h;
+
     /* Make sure it exists */
-    if(!fd_table[fd]) {
+    if(!(h = fd_lookup(fd))) {
         errno = EBADF;
         return NULL;
     }
 
-    return fd_table[fd]->handler;
+    return h->handler;
 }
 
 void * fs_get_handle(file_t fd) {
+    fs_hnd_t *h;
+
     /* Make sure it exists */
-    if(!fd_table[fd]) {
+    if(!(h = fd_lookup(fd))) {
         errno = EBADF;
         return NULL;
     }
 
-    return fd_table[fd]->hnd;
+    return h->hnd;
 }
 
 file_t fs_dup(file_t oldfd) {
+    fs_hnd_t *h;
+    file_t fd;
+
+    mutex_lock(&fd_mutex);
+
     /* Make sure it exists */
-    if(oldfd < 0 || oldfd >= FD_SETSIZE) {
+    if(!(h = fd_lookup(oldfd))) {
+        mutex_unlock(&fd_mutex);
         errno = EBADF;
         return -1;
     }
-    else if(!fd_table[oldfd]) {
-        errno = EBADF;
+
+    if((fd = fd_alloc_slot()) < 0) {
+        mutex_unlock(&fd_mutex);
         return -1;
     }
 
-    return fs_hnd_assign(fd_table[oldfd]);
+    fd_set_slot(fd, h);
+    mutex_unlock(&fd_mutex);
+
+    return fd;
 }
 
 file_t fs_dup2(file_t oldfd, file_t newfd) {
+    fs_hnd_t *h, *old = NULL;
+
+    mutex_lock(&fd_mutex);
+
     /* Make sure the descriptors are valid */
-    if(oldfd < 0 || oldfd >= FD_SETSIZE || newfd < 0 || newfd >= FD_SETSIZE) {
+    if(!(h = fd_lookup(oldfd)) || newfd < 0 || newfd >= fd_max) {
+        mutex_unlock(&fd_mutex);
         errno = EBADF;
         return -1;
     }
-    else if(!fd_table[oldfd]) {
-        errno = EBADF;
+
+    if(oldfd == newfd) {
+        mutex_unlock(&fd_mutex);
+        return newfd;
+    }
+
+    if(fd_chunk_alloc(newfd / FS_FD_CHUNK) < 0) {
+        mutex_unlock(&fd_mutex);
+        errno = ENOMEM;
         return -1;
     }
 
-    if(fd_table[newfd])
-        fs_close(newfd);
+    if(fd_lookup(newfd))
+        old = fd_clear_slot(newfd);
 
-    fd_table[newfd] = fd_table[oldfd];
-    fs_hnd_ref(fd_table[newfd]);
+    fd_set_slot(newfd, h);
+    mutex_unlock(&fd_mutex);
+
+    /* Close whatever used to be there, now that the lock is released. */
+    if(old)
+        fs_hnd_unref(old);
 
     return newfd;
 }
@@ -322,32 +582,34 @@ file_t fs_dup2(file_t oldfd, file_t newfd) {
 /* Returns a file handle for a given fd, or NULL if the parameters
    are not valid. */
 static fs_hnd_t * fs_map_hnd(file_t fd) {
-    if(fd < 0 || fd >= FD_SETSIZE) {
-        errno = EBADF;
-        return NULL;
-    }
+    fs_hnd_t *h;
 
-    if(!fd_table[fd]) {
+    if(!(h = fd_lookup(fd))) {
         errno = EBADF;
         return NULL;
     }
 
-    return fd_table[fd];
+    return h;
 }
 
 /* Close a file and clean up the handle */
 int fs_close(file_t fd) {
     int retval;
-    fs_hnd_t * hnd = fs_map_hnd(fd);
+    fs_hnd_t * hnd;
+
+    /* Remove it from our table, then deref it */
+    mutex_lock(&fd_mutex);
 
-    if(!hnd) {
-      errno = EBADF;
-      return -1;
+    if(!fd_lookup(fd)) {
+        mutex_unlock(&fd_mutex);
+        errno = EBADF;
+        return -1;
     }
 
-    /* Deref it and remove it from our table */
+    hnd = fd_clear_slot(fd);
+    mutex_unlock(&fd_mutex);
+
     retval = fs_hnd_unref(hnd);
-    fd_table[fd] = NULL;
     return retval ? -1 : 0;
 }
 
@@ -387,6 +649,327 @@ ssize_t fs_write(file_t fd, const void *buffer, size_t cnt) {
     return h->handler->write(h->hnd, buffer, cnt);
 }
 
+/* Move the file pointer of a raw handle, using whichever seek function the
+   handler provides. */
+static _off64_t fs_hnd_seek(fs_hnd_t *h, _off64_t offset, int whence) {
+    if(h->handler->seek64)
+        return h->handler->seek64(h->hnd, offset, whence);
+    else if(h->handler->seek)
+        return (_off64_t)h->handler->seek(h->hnd, (off_t)offset, whence);
+
+    errno = ESPIPE;
+    return -1;
+}
+
+/* Emulate pread/pwrite with a seek, a read or write, and a seek back to
+   where the file pointer was. */
+static ssize_t fs_pio_emulate(fs_hnd_t *h, void *buffer, size_t cnt,
+                              off_t offset, int wr) {
+    _off64_t old;
+    ssize_t rv;
+    int err;
+
+    mutex_lock(&fs_pio_mutex);
+
+    if((old = fs_hnd_seek(h, 0, SEEK_CUR)) < 0 ||
+       fs_hnd_seek(h, offset, SEEK_SET) < 0) {
+        mutex_unlock(&fs_pio_mutex);
+        return -1;
+    }
+
+    if(wr)
+        rv = h->handler->write(h->hnd, buffer, cnt);
+    else
+        rv = h->handler->read(h->hnd, buffer, cnt);
+
+    err = errno;
+    fs_hnd_seek(h, old, SEEK_SET);
+    errno = err;
+
+    mutex_unlock(&fs_pio_mutex);
+    return rv;
+}
+
+ssize_t fs_pread(file_t fd, void *buffer, size_t cnt, off_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->pread)
+        return h->handler->pread(h->hnd, buffer, cnt, offset);
+
+    if(h->handler->read == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return fs_pio_emulate(h, buffer, cnt, offset, 0);
+}
+
+ssize_t fs_pwrite(file_t fd, const void *buffer, size_t cnt, off_t offset) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->pwrite)
+        return h->handler->pwrite(h->hnd, buffer, cnt, offset);
+
+    if(h->handler->write == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return fs_pio_emulate(h, (void *)buffer, cnt, offset, 1);
+}
+
+/* Make sure an iovec array is sane: a sensible count, and a total length that
+   fits in the return value. */
+static int fs_iov_check(const iovec_t *iov, int iovcnt) {
+    size_t total = 0;
+    int i;
+
+    if(iovcnt <= 0 || iovcnt > FS_IOV_MAX || !iov) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        if(iov[i].iov_len > (~(size_t)0 >> 1) - total) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        total += iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+ssize_t fs_readv(file_t fd, const iovec_t *iov, int iovcnt) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+    ssize_t rv, total = 0;
+    int i;
+
+    if(h == NULL) return -1;
+
+    if(fs_iov_check(iov, iovcnt) < 0)
+        return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->readv)
+        return h->handler->readv(h->hnd, iov, iovcnt);
+
+    if(h->handler->read == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Fall back to one read per buffer, stopping at the first short one. */
+    for(i = 0; i < iovcnt; i++) {
+        if(!iov[i].iov_len)
+            continue;
+
+        rv = h->handler->read(h->hnd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+ssize_t fs_writev(file_t fd, const iovec_t *iov, int iovcnt) {
+    fs_hnd_t *h;
+    ssize_t rv, total = 0;
+    int i;
+
+    if(fs_iov_check(iov, iovcnt) < 0)
+        return -1;
+
+    /* Same newlib printf hack as in fs_write(). */
+    if(fd == 1 || fd == 2) {
+        for(i = 0; i < iovcnt; i++) {
+            dbgio_write_buffer_xlat((const uint8 *)iov[i].iov_base,
+                                    iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+
+        return total;
+    }
+
+    h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(h->handler == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->writev)
+        return h->handler->writev(h->hnd, iov, iovcnt);
+
+    if(h->handler->write == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        if(!iov[i].iov_len)
+            continue;
+
+        rv = h->handler->write(h->hnd, iov[i].iov_base, iov[i].iov_len);
+
+        if(rv < 0)
+            return total ? total : -1;
+
+        total += rv;
+
+        if((size_t)rv < iov[i].iov_len)
+            break;
+    }
+
+    return total;
+}
+
+/* Splice sink for fs_sendfile(): write everything we're given to the output
+   file, stopping early only if it errors out or stops taking data. */
+static ssize_t fs_sendfile_sink(void *ctx, const void *buf, size_t cnt) {
+    file_t out = (file_t)ctx;
+    const uint8 *p = (const uint8 *)buf;
+    size_t done = 0;
+    ssize_t rv;
+
+    while(done < cnt) {
+        if((rv = fs_write(out, p + done, cnt - done)) <= 0)
+            return done ? (ssize_t)done : rv;
+
+        done += rv;
+    }
+
+    return done;
+}
+
+ssize_t fs_sendfile(file_t out_fd, file_t in_fd, off_t *offset, size_t count) {
+    fs_hnd_t *in, *out;
+    ssize_t rv = 0, got = 0, total = 0;
+    size_t want;
+    off_t pos;
+    uint8 *buf;
+    int err;
+
+    if(!(in = fs_map_hnd(in_fd)))
+        return -1;
+
+    /* fd 1 and 2 may not have a handle (see fs_write()). */
+    if(!(out = fs_map_hnd(out_fd)) && out_fd != 1 && out_fd != 2)
+        return -1;
+
+    if(in->handler == NULL || (out && out->handler == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(offset) {
+        if(*offset < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        pos = *offset;
+    }
+    else if((pos = (off_t)fs_hnd_seek(in, 0, SEEK_CUR)) < 0) {
+        return -1;
+    }
+
+    if(count > (~(size_t)0 >> 1))
+        count = ~(size_t)0 >> 1;
+
+    if(!count)
+        return 0;
+
+    /* Let the input filesystem hand us its own copy of the data, unless the
+       output is on the same filesystem (and may be the same file). */
+    if(in->handler->splice && (!out || out->handler != in->handler)) {
+        rv = in->handler->splice(in->hnd, pos, count, fs_sendfile_sink,
+                                 (void *)out_fd);
+
+        if(rv < 0)
+            return -1;
+
+        total = rv;
+    }
+    else {
+        if(!(buf = (uint8 *)malloc(FS_SENDFILE_CHUNK))) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        while((size_t)total < count) {
+            want = count - total;
+
+            if(want > FS_SENDFILE_CHUNK)
+                want = FS_SENDFILE_CHUNK;
+
+            if((got = fs_pread(in_fd, buf, want, pos + total)) <= 0)
+                break;
+
+            if((rv = fs_sendfile_sink((void *)out_fd, buf, got)) <= 0)
+                break;
+
+            total += rv;
+
+            /* Stop at the end of the file, or if the output is full. */
+            if(rv < got || (size_t)got < want)
+                break;
+        }
+
+        err = errno;
+        free(buf);
+
+        if(!total && (got < 0 || rv < 0)) {
+            errno = err;
+            return -1;
+        }
+    }
+
+    if(offset)
+        *offset = pos + total;
+    else
+        fs_hnd_seek(in, pos + total, SEEK_SET);
+
+    return total;
+}
+
 off_t fs_seek(file_t fd, off_t offset, int whence) {
     fs_hnd_t *h = fs_map_hnd(fd);
 
@@ -646,6 +1229,29 @@ int fs_complete(file_t fd, ssize_t * rv) {
     return h->handler->complete(h->hnd, rv);
 }
 
+int fs_complete_wait(file_t fd, ssize_t * rv) {
+    fs_hnd_t *h = fs_map_hnd(fd);
+
+    if(h == NULL) return -1;
+
+    if(h->handler == NULL || h->handler->complete == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(h->handler->complete_wait)
+        return h->handler->complete_wait(h->hnd, rv);
+
+    while(h->handler->complete(h->hnd, rv) < 0) {
+        if(errno != EAGAIN)
+            return -1;
+
+        thd_sleep(1);
+    }
+
+    return 0;
+}
+
 int fs_mkdir(const char * fn) {
     vfs_handler_t   *cur;
     char        rfn[PATH_MAX];
@@ -873,8 +1479,28 @@ int fs_rewinddir(file_t fd) {
 
 /* Initialize FS structures */
 int fs_init() {
+    if(!(fs_hnd_slab = slab_cache_create("fs_hnd", sizeof(fs_hnd_t),
+                                         SLAB_DEFAULTS, NULL)))
+        return -1;
+
     return 0;
 }
 
 void fs_shutdown() {
+    int i;
+
+    /* Anything still open has to be closed before the handles go away.
+       Normally there's nothing left by now (see arch_auto_shutdown()). */
+    fs_fdtbl_destroy();
+
+    for(i = 0; i < FD_CHUNKS; i++) {
+        free(fd_chunks[i]);
+        fd_chunks[i] = NULL;
+    }
+
+    memset(&fd_stats, 0, sizeof(fd_stats));
+    fd_hint = 0;
+
+    slab_cache_destroy(fs_hnd_slab);
+    fs_hnd_slab = NULL;
 }
@@ -29,6 +29,11 @@ in read-only mode. You'd then be safe.
 So at the moment this is mainly useful as a scratch space for temp files or to
 cache data from disk rather than as a general purpose file system.
 
+File data is kept in a table of fixed-size extents rather than one block, so
+growing a file never copies the data that's already there. Directories are
+hashed by name. All of the file data in a mount counts against that mount's
+optional quota.
+
 */
 
 #include <kos/thread.h>
@@ -37,6 +42,7 @@ cache data from disk rather than as a general purpose file system.
 #include <malloc.h>
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -49,27 +55,50 @@ cache data from disk rather than as a general purpose file system.
 char 	*_EXFUN(strdup,(const char *));
 #endif
 
+/* Size of each piece of file data. Files are stored as a table of these, so
+   growing a file never moves the data that's already there. */
+#define RD_EXTENT_SIZE  4096
+
+/* Initial number of hash buckets in a directory; doubled whenever there are
+   more than two entries per bucket. */
+#define RD_HASH_INIT    8
+
+struct rd_dir;
+struct rd_mount;
+
 /* File definition */
 typedef struct rd_file {
     char    * name;     /* File name -- allocated */
+    int     namelen;    /* strlen(name) */
+    uint32  hash;       /* rd_hash() of the name */
     uint32  size;       /* Actual file size */
     int type;       /* File type */
     int openfor;    /* Lock constant */
     int usage;      /* Usage count (unopened is 0) */
 
     /* For the following two members:
-      - In files, this is a block of allocated memory containing the
-        actual file data. Each time we need to expand it beyond its
-        current capacity, we realloc() with enough to hold the new
-        data plus 4k (to avoid realloc thrashing). All files start
-        out with a 1K block of space.
+      - In files, this is either NULL (and the data is in the extents
+        below), or a contiguous block holding the whole file. Blocks come
+        from fs_ramdisk_attach(), or from mmap, which gathers the extents
+        into one. The first write past the end of the block breaks it back
+        up into extents.
       - In directories, this is just a pointer to an rd_dir struct,
         which is defined below. datasize has no meaning for a
         directory. */
     void    * data;     /* Data block pointer */
     uint32  datasize;   /* Size of data block pointer */
 
-    LIST_ENTRY(rd_file) dirlist;    /* Directory list entry */
+    /* Table of RD_EXTENT_SIZE pieces of the file. A NULL entry is a hole,
+       which reads back as zeros. The part of an extent past the end of the
+       file is always zero. */
+    uint8   ** ext;     /* Extent table */
+    uint32  extcnt;     /* Number of entries in ext */
+
+    struct rd_dir   * parent;   /* Directory containing this file */
+    struct rd_mount * mnt;      /* Mount whose quota the data counts against */
+
+    LIST_ENTRY(rd_file) hashlist;   /* Hash bucket entry */
+    TAILQ_ENTRY(rd_file) dirlist;   /* Directory list entry */
 } rd_file_t;
 
 /* Lock constants */
@@ -77,12 +106,29 @@ typedef struct rd_file {
 #define OPENFOR_READ    1   /* Opened read-only */
 #define OPENFOR_WRITE   2   /* Opened read-write */
 
-/* Directory definition -- just basically a list of files we contain */
-typedef LIST_HEAD(rd_dir, rd_file) rd_dir_t;
-
-/* Pointer to the root diretctory */
-static rd_file_t *root = NULL;
-static rd_dir_t  *rootdir = NULL;
+LIST_HEAD(rd_bucket, rd_file);
+
+/* Directory definition -- a list of the files we contain, in creation order
+   (for readdir), and a hash table to find them by name */
+typedef struct rd_dir {
+    TAILQ_HEAD(rd_dir_list, rd_file) files;
+    struct rd_bucket    * hash;
+    int                 hashsize;   /* Always a power of two */
+    int                 count;
+    struct rd_mount     * mnt;      /* Mount the directory is in */
+} rd_dir_t;
+
+/* A mounted ramdisk: its root directory, and the bytes of file data
+   allocated in it along with the most it's allowed (0 for no limit) */
+typedef struct rd_mount {
+    rd_file_t   * root;
+    rd_dir_t    * rootdir;
+    size_t      used;
+    size_t      quota;
+} rd_mount_t;
+
+/* There's only the one, on /ram */
+static rd_mount_t ram_mnt;
 
 /********************************************************************************/
 /* File primitives */
@@ -102,13 +148,279 @@ static struct {
 /* Mutex for file system structs */
 static mutex_t rd_mutex;
 
+/* Account for newly allocated file data, failing if it would put the
+   file's mount over its quota. Assumes we hold rd_mutex. */
+static int rd_charge(rd_file_t *f, size_t bytes) {
+    rd_mount_t *m = f->mnt;
+
+    if(m->quota && (bytes > m->quota || m->used > m->quota - bytes)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    m->used += bytes;
+    return 0;
+}
+
+static void rd_uncharge(rd_file_t *f, size_t bytes) {
+    assert(f->mnt->used >= bytes);
+    f->mnt->used -= bytes;
+}
+
+/* Case-insensitive FNV-1a hash of a file name */
+static uint32 rd_hash(const char *name, int len) {
+    uint32 h = 2166136261UL;
+
+    while(len--) {
+        h ^= (uint8)tolower((unsigned char)*name++);
+        h *= 16777619UL;
+    }
+
+    return h;
+}
+
+static rd_dir_t * rd_dir_create(rd_mount_t *mnt) {
+    rd_dir_t *d;
+
+    if(!(d = (rd_dir_t *)malloc(sizeof(rd_dir_t))))
+        return NULL;
+
+    if(!(d->hash = (struct rd_bucket *)calloc(RD_HASH_INIT,
+                                              sizeof(struct rd_bucket)))) {
+        free(d);
+        return NULL;
+    }
+
+    TAILQ_INIT(&d->files);
+    d->hashsize = RD_HASH_INIT;
+    d->count = 0;
+    d->mnt = mnt;
+
+    return d;
+}
+
+static void rd_dir_destroy(rd_dir_t *d) {
+    free(d->hash);
+    free(d);
+}
+
+/* Add a file to a directory, growing the hash table if it's getting full.
+   Assumes we hold rd_mutex. */
+static void rd_dir_insert(rd_dir_t *d, rd_file_t *f) {
+    struct rd_bucket *nh;
+    rd_file_t *i;
+    int ns;
+
+    if(d->count >= d->hashsize * 2) {
+        ns = d->hashsize * 2;
+
+        /* If this fails, we just carry on with longer chains. */
+        if((nh = (struct rd_bucket *)calloc(ns, sizeof(struct rd_bucket)))) {
+            TAILQ_FOREACH(i, &d->files, dirlist) {
+                LIST_INSERT_HEAD(&nh[i->hash & (ns - 1)], i, hashlist);
+            }
+
+            free(d->hash);
+            d->hash = nh;
+            d->hashsize = ns;
+        }
+    }
+
+    LIST_INSERT_HEAD(&d->hash[f->hash & (d->hashsize - 1)], f, hashlist);
+    TAILQ_INSERT_TAIL(&d->files, f, dirlist);
+    d->count++;
+    f->parent = d;
+}
+
+static void rd_dir_remove(rd_file_t *f) {
+    LIST_REMOVE(f, hashlist);
+    TAILQ_REMOVE(&f->parent->files, f, dirlist);
+    f->parent->count--;
+}
+
+/* Bytes of data allocated to a file */
+static size_t rd_file_allocated(rd_file_t *f) {
+    size_t rv = 0;
+    uint32 i;
+
+    if(f->type == STAT_TYPE_DIR)
+        return 0;
+
+    if(f->data)
+        return f->datasize;
+
+    for(i = 0; i < f->extcnt; i++)
+        if(f->ext[i])
+            rv += RD_EXTENT_SIZE;
+
+    return rv;
+}
+
+/* Free all of a file's data, leaving it empty. Assumes we hold rd_mutex. */
+static void rd_file_clear(rd_file_t *f) {
+    uint32 i;
+
+    rd_uncharge(f, rd_file_allocated(f));
+
+    for(i = 0; i < f->extcnt; i++)
+        free(f->ext[i]);
+
+    free(f->ext);
+    free(f->data);
+
+    f->ext = NULL;
+    f->extcnt = 0;
+    f->data = NULL;
+    f->datasize = 0;
+    f->size = 0;
+}
+
+/* Make sure the extent table has room for at least cnt entries. Assumes we
+   hold rd_mutex. */
+static int rd_ext_reserve(rd_file_t *f, uint32 cnt) {
+    uint32 ns;
+    uint8 **ne;
+
+    if(cnt <= f->extcnt)
+        return 0;
+
+    /* Only the table of pointers is ever copied. */
+    ns = f->extcnt ? f->extcnt : 4;
+
+    while(ns < cnt)
+        ns <<= 1;
+
+    if(!(ne = (uint8 **)realloc(f->ext, ns * sizeof(uint8 *)))) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memset(ne + f->extcnt, 0, (ns - f->extcnt) * sizeof(uint8 *));
+    f->ext = ne;
+    f->extcnt = ns;
+
+    return 0;
+}
+
+/* Allocate an extent for a file, charging it to the quota. The caller zeroes
+   the parts it doesn't fill in. Assumes we hold rd_mutex. */
+static uint8 * rd_ext_alloc(rd_file_t *f) {
+    uint8 *e;
+
+    if(rd_charge(f, RD_EXTENT_SIZE) < 0)
+        return NULL;
+
+    if(!(e = (uint8 *)malloc(RD_EXTENT_SIZE))) {
+        rd_uncharge(f, RD_EXTENT_SIZE);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    return e;
+}
+
+/* Break a file's contiguous block up into extents. The block's charge is
+   given back first, so the file isn't counted twice while both are around.
+   Assumes we hold rd_mutex. */
+static int rd_unflatten(rd_file_t *f) {
+    uint32 i, n, cnt = (f->size + RD_EXTENT_SIZE - 1) / RD_EXTENT_SIZE;
+
+    if(!f->data)
+        return 0;
+
+    if(rd_ext_reserve(f, cnt) < 0)
+        return -1;
+
+    rd_uncharge(f, f->datasize);
+
+    for(i = 0; i < cnt; i++) {
+        if(!(f->ext[i] = rd_ext_alloc(f))) {
+            while(i--) {
+                free(f->ext[i]);
+                f->ext[i] = NULL;
+                rd_uncharge(f, RD_EXTENT_SIZE);
+            }
+
+            /* The block was already counted, so it goes back regardless. */
+            f->mnt->used += f->datasize;
+            return -1;
+        }
+
+        n = f->size - i * RD_EXTENT_SIZE;
+
+        if(n > RD_EXTENT_SIZE)
+            n = RD_EXTENT_SIZE;
+
+        memcpy(f->ext[i], (uint8 *)f->data + i * RD_EXTENT_SIZE, n);
+        memset(f->ext[i] + n, 0, RD_EXTENT_SIZE - n);
+    }
+
+    free(f->data);
+    f->data = NULL;
+    f->datasize = 0;
+
+    return 0;
+}
+
+/* Gather a file's extents into one contiguous block, for mmap. Holes take
+   up space in the block, so a sparse file's block can be far bigger than its
+   extents; what it adds is charged before it's allocated. Assumes we hold
+   rd_mutex. */
+static void * rd_flatten(rd_file_t *f) {
+    size_t held = rd_file_allocated(f), extra = 0;
+    uint32 i, n;
+    uint8 *d;
+
+    if(f->data)
+        return f->data;
+
+    if(f->size > held) {
+        extra = f->size - held;
+
+        if(rd_charge(f, extra) < 0)
+            return NULL;
+    }
+
+    /* Always hand back something, even for an empty file. */
+    if(!(d = (uint8 *)malloc(f->size ? f->size : 1))) {
+        rd_uncharge(f, extra);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for(i = 0; i * RD_EXTENT_SIZE < f->size; i++) {
+        n = f->size - i * RD_EXTENT_SIZE;
+
+        if(n > RD_EXTENT_SIZE)
+            n = RD_EXTENT_SIZE;
+
+        if(i < f->extcnt && f->ext[i])
+            memcpy(d + i * RD_EXTENT_SIZE, f->ext[i], n);
+        else
+            memset(d + i * RD_EXTENT_SIZE, 0, n);
+    }
+
+    /* Clearing the file gives back what its extents held, and the block
+       takes its place (less what was charged above). */
+    n = f->size;
+    rd_file_clear(f);
+
+    f->data = d;
+    f->datasize = f->size = n;
+    f->mnt->used += n - extra;
+
+    return d;
+}
+
 /* Search a directory for the named file; return the struct if
    we find it. Assumes we hold rd_mutex. */
 static rd_file_t * ramdisk_find(rd_dir_t * parent, const char * name, int namelen) {
     rd_file_t   *f;
+    uint32      h = rd_hash(name, namelen);
 
-    LIST_FOREACH(f, parent, dirlist) {
-        if(!strncasecmp(name, f->name, namelen))
+    LIST_FOREACH(f, &parent->hash[h & (parent->hashsize - 1)], hashlist) {
+        if(f->hash == h && f->namelen == namelen &&
+           !strncasecmp(name, f->name, namelen))
             return f;
     }
 
@@ -149,7 +461,8 @@ static rd_file_t * ramdisk_find_path(rd_dir_t * parent, const char * fn, int dir
     if(fn[0] != 0) {
         f = ramdisk_find(parent, fn, strlen(fn));
 
-        if((!dir && f->type == STAT_TYPE_DIR) || (dir && f->type != STAT_TYPE_DIR))
+        if(f == NULL || (!dir && f->type == STAT_TYPE_DIR) ||
+           (dir && f->type != STAT_TYPE_DIR))
             return NULL;
     }
     else {
@@ -204,23 +517,30 @@ static rd_file_t * ramdisk_create_file(rd_dir_t * parent, const char * fn, int d
         return NULL;
 
     /* Now add a file to the parent */
-    f = (rd_file_t *)malloc(sizeof(rd_file_t));
-    f->name = strdup(p);
-    f->size = 0;
+    if(!(f = (rd_file_t *)calloc(1, sizeof(rd_file_t))))
+        return NULL;
+
+    if(!(f->name = strdup(p))) {
+        free(f);
+        return NULL;
+    }
+
+    f->namelen = strlen(p);
+    f->hash = rd_hash(p, f->namelen);
     f->type = dir ? STAT_TYPE_DIR : STAT_TYPE_FILE;
     f->openfor = OPENFOR_NOTHING;
-    f->usage = 0;
 
-    if(!dir) {
-        f->data = malloc(1024);
-        f->datasize = 1024;
-    }
-    else {
-        f->data = malloc(sizeof(rd_dir_t));
-        f->datasize = 0;
+    /* Files start out empty; their first extent is allocated by the first
+       write. */
+    f->mnt = pdir->mnt;
+
+    if(dir && !(f->data = rd_dir_create(pdir->mnt))) {
+        free(f->name);
+        free(f);
+        return NULL;
     }
 
-    LIST_INSERT_HEAD(pdir, f, dirlist);
+    rd_dir_insert(pdir, f);
 
     return f;
 }
@@ -243,19 +563,20 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
         goto error_out;
 
     /* Look for the file */
-    assert(root != NULL);
+    assert(ram_mnt.root != NULL);
 
     if(fn[0] == 0) {
-        f = root;
+        f = ram_mnt.root;
     }
     else {
-        f = ramdisk_find_path(rootdir, fn + 1, mode & O_DIR);
+        f = ramdisk_find_path(ram_mnt.rootdir, fn + 1, mode & O_DIR);
 
         if(f == NULL) {
             /* Are we planning to write anyway? */
             if(mm != O_RDONLY && !(mode & O_DIR)) {
                 /* Create a new file */
-                f = ramdisk_create_file(rootdir, fn + 1, mode & O_DIR);
+                f = ramdisk_create_file(ram_mnt.rootdir, fn + 1,
+                                        mode & O_DIR);
 
                 if(f == NULL)
                     goto error_out;
@@ -316,17 +637,14 @@ static void * ramdisk_open(vfs_handler_t * vfs, const char *fn, int mode) {
 
     /* If we're opening with O_TRUNC, kill the existing contents */
     if(mm != O_RDONLY && (mode & O_TRUNC)) {
-        free(f->data);
-        f->data = malloc(1024);
-        f->datasize = 1024;
-        f->size = 0;
+        rd_file_clear(f);
         fh[fd].ptr = 0;
     }
 
     /* If we opened a dir, then ptr is actually a pointer to the first
        file entry. */
     if(mode & O_DIR) {
-        fh[fd].ptr = (uint32)LIST_FIRST((rd_dir_t *)f->data);
+        fh[fd].ptr = (uint32)TAILQ_FIRST(&((rd_dir_t *)f->data)->files);
     }
 
     /* Increase the usage count */
@@ -371,6 +689,122 @@ static int ramdisk_close(void * h) {
     return 0;
 }
 
+/* Is fd an open file (not a directory)? Assumes we hold rd_mutex. */
+static int ramdisk_fd_ok(file_t fd, int wr) {
+    if(fd >= MAX_RAM_FILES || fh[fd].file == NULL || fh[fd].dir)
+        return 0;
+
+    if(wr && fh[fd].file->openfor != OPENFOR_WRITE)
+        return 0;
+
+    return 1;
+}
+
+/* Copy data out of a file at the given position. Assumes we hold rd_mutex. */
+static size_t ramdisk_read_at(file_t fd, void *buf, size_t bytes, uint32 pos) {
+    rd_file_t *f = fh[fd].file;
+    uint8 *out = (uint8 *)buf;
+    uint32 idx, off, n;
+    size_t rv;
+
+    /* Is there enough left? */
+    if(pos >= f->size)
+        return 0;
+
+    if(bytes > f->size - pos)
+        bytes = f->size - pos;
+
+    /* Copy out the requested amount */
+    if(f->data) {
+        memcpy(buf, ((uint8 *)f->data) + pos, bytes);
+        return bytes;
+    }
+
+    for(rv = bytes; bytes; bytes -= n, pos += n, out += n) {
+        idx = pos / RD_EXTENT_SIZE;
+        off = pos % RD_EXTENT_SIZE;
+        n = RD_EXTENT_SIZE - off;
+
+        if(n > bytes)
+            n = bytes;
+
+        if(idx < f->extcnt && f->ext[idx])
+            memcpy(out, f->ext[idx] + off, n);
+        else
+            memset(out, 0, n);
+    }
+
+    return rv;
+}
+
+/* Copy data into a file at the given position, growing it as needed. Any gap
+   between the old end of the file and pos reads back as zeros (and takes no
+   space, unless it shares an extent with data). Assumes we hold rd_mutex. */
+static ssize_t ramdisk_write_at(file_t fd, const void *buf, size_t bytes,
+                                uint32 pos) {
+    rd_file_t *f = fh[fd].file;
+    const uint8 *in = (const uint8 *)buf;
+    uint32 idx, off, n;
+    size_t done;
+    uint8 *e;
+
+    if(!bytes)
+        return 0;
+
+    if(bytes > 0xffffffff - pos) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    /* Writes that fit in a contiguous block go straight into it. Anything
+       else means switching the file over to extents. */
+    if(f->data) {
+        if(pos + bytes <= f->datasize) {
+            if(pos > f->size)
+                memset(((uint8 *)f->data) + f->size, 0, pos - f->size);
+
+            memcpy(((uint8 *)f->data) + pos, buf, bytes);
+
+            if(f->size < pos + bytes)
+                f->size = pos + bytes;
+
+            return bytes;
+        }
+
+        if(rd_unflatten(f) < 0)
+            return -1;
+    }
+
+    if(rd_ext_reserve(f, (pos + bytes - 1) / RD_EXTENT_SIZE + 1) < 0)
+        return -1;
+
+    for(done = 0; done < bytes; done += n, pos += n) {
+        idx = pos / RD_EXTENT_SIZE;
+        off = pos % RD_EXTENT_SIZE;
+        n = RD_EXTENT_SIZE - off;
+
+        if(n > bytes - done)
+            n = bytes - done;
+
+        if(!(e = f->ext[idx])) {
+            if(!(e = rd_ext_alloc(f)))
+                break;
+
+            /* Keep the invariant that everything we don't write is zero. */
+            memset(e, 0, off);
+            memset(e + off + n, 0, RD_EXTENT_SIZE - off - n);
+            f->ext[idx] = e;
+        }
+
+        memcpy(e + off, in + done, n);
+
+        if(f->size < pos + n)
+            f->size = pos + n;
+    }
+
+    return done ? (ssize_t)done : -1;
+}
+
 /* Read from a file */
 static ssize_t ramdisk_read(void * h, void *buf, size_t bytes) {
     ssize_t rv = -1;
@@ -379,16 +813,9 @@ static ssize_t ramdisk_read(void * h, void *buf, size_t bytes) {
     mutex_lock(&rd_mutex);
 
     /* Check that the fd is valid */
-    if(fd < MAX_RAM_FILES && fh[fd].file != NULL && !fh[fd].dir) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->size)
-            bytes = fh[fd].file->size - fh[fd].ptr;
-
-        /* Copy out the requested amount */
-        memcpy(buf, ((uint8 *)fh[fd].file->data) + fh[fd].ptr, bytes);
-        fh[fd].ptr += bytes;
-
-        rv = bytes;
+    if(ramdisk_fd_ok(fd, 0)) {
+        rv = ramdisk_read_at(fd, buf, bytes, fh[fd].ptr);
+        fh[fd].ptr += rv;
     }
 
     mutex_unlock(&rd_mutex);
@@ -403,31 +830,171 @@ static ssize_t ramdisk_write(void * h, const void *buf, size_t bytes) {
     mutex_lock(&rd_mutex);
 
     /* Check that the fd is valid */
-    if(fd < MAX_RAM_FILES && fh[fd].file != NULL && !fh[fd].dir && fh[fd].file->openfor == OPENFOR_WRITE) {
-        /* Is there enough left? */
-        if((fh[fd].ptr + bytes) > fh[fd].file->datasize) {
-            /* We need to realloc the block */
-            void * np = realloc(fh[fd].file->data, (fh[fd].ptr + bytes) + 4096);
+    if(ramdisk_fd_ok(fd, 1)) {
+        if((rv = ramdisk_write_at(fd, buf, bytes, fh[fd].ptr)) > 0)
+            fh[fd].ptr += rv;
+    }
 
-            if(np == NULL)
-                goto error_out;
+    mutex_unlock(&rd_mutex);
+    return rv;
+}
+
+/* Hand a piece of the file to fs_sendfile(). A contiguous block can't move or
+   be freed while the file is open for reading, since only a write can do
+   that, so it goes to the sink as it is. Anything else could change under the
+   sink (extents get gathered up by an mmap from another handle, for one), and
+   the lock can't be held while the sink runs, so it goes through a bounce
+   buffer an extent at a time. */
+static ssize_t ramdisk_splice(void * h, off_t offset, size_t cnt,
+                              fs_splice_sink_t sink, void *ctx) {
+    file_t fd = (file_t)h;
+    uint32 pos = (uint32)offset, n;
+    rd_file_t *f;
+    ssize_t rv = 0, sent;
+    uint8 *bounce;
 
-            fh[fd].file->data = np;
-            fh[fd].file->datasize = (fh[fd].ptr + bytes) + 4096;
+    mutex_lock(&rd_mutex);
+
+    if(!ramdisk_fd_ok(fd, 0)) {
+        mutex_unlock(&rd_mutex);
+        errno = EINVAL;
+        return -1;
+    }
+
+    f = fh[fd].file;
+
+    if(pos >= f->size) {
+        mutex_unlock(&rd_mutex);
+        return 0;
+    }
+
+    if(cnt > f->size - pos)
+        cnt = f->size - pos;
+
+    if(f->data && f->openfor != OPENFOR_WRITE) {
+        mutex_unlock(&rd_mutex);
+        return sink(ctx, ((uint8 *)f->data) + pos, cnt);
+    }
+
+    mutex_unlock(&rd_mutex);
+
+    if(!(bounce = (uint8 *)malloc(RD_EXTENT_SIZE))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(cnt) {
+        n = RD_EXTENT_SIZE - pos % RD_EXTENT_SIZE;
+
+        if(n > cnt)
+            n = cnt;
+
+        /* The file may have been closed or cut short in the meantime */
+        mutex_lock(&rd_mutex);
+        n = ramdisk_fd_ok(fd, 0) ? ramdisk_read_at(fd, bounce, n, pos) : 0;
+        mutex_unlock(&rd_mutex);
+
+        if(!n)
+            break;
+
+        if((sent = sink(ctx, bounce, n)) <= 0) {
+            if(!rv)
+                rv = sent;
+
+            break;
         }
 
-        /* Copy out the requested amount */
-        memcpy(((uint8 *)fh[fd].file->data) + fh[fd].ptr, buf, bytes);
-        fh[fd].ptr += bytes;
+        rv += sent;
+        pos += sent;
+        cnt -= sent;
+
+        if((uint32)sent < n)
+            break;
+    }
+
+    free(bounce);
+    return rv;
+}
+
+/* Read from a file at a given offset, leaving the file pointer alone */
+static ssize_t ramdisk_pread(void * h, void *buf, size_t bytes, off_t offset) {
+    ssize_t rv = -1;
+    file_t  fd = (file_t)h;
+
+    mutex_lock(&rd_mutex);
+
+    if(ramdisk_fd_ok(fd, 0))
+        rv = ramdisk_read_at(fd, buf, bytes, (uint32)offset);
 
-        if(fh[fd].file->size < fh[fd].ptr) {
-            fh[fd].file->size = fh[fd].ptr;
+    mutex_unlock(&rd_mutex);
+    return rv;
+}
+
+/* Write to a file at a given offset, leaving the file pointer alone */
+static ssize_t ramdisk_pwrite(void * h, const void *buf, size_t bytes,
+                              off_t offset) {
+    ssize_t rv = -1;
+    file_t  fd = (file_t)h;
+
+    mutex_lock(&rd_mutex);
+
+    if(ramdisk_fd_ok(fd, 1))
+        rv = ramdisk_write_at(fd, buf, bytes, (uint32)offset);
+
+    mutex_unlock(&rd_mutex);
+    return rv;
+}
+
+/* Scatter read from the current file pointer, under one lock */
+static ssize_t ramdisk_readv(void * h, const iovec_t *iov, int iovcnt) {
+    ssize_t rv = -1;
+    file_t  fd = (file_t)h;
+    size_t  n;
+    int     i;
+
+    mutex_lock(&rd_mutex);
+
+    if(ramdisk_fd_ok(fd, 0)) {
+        for(rv = 0, i = 0; i < iovcnt; i++) {
+            n = ramdisk_read_at(fd, iov[i].iov_base, iov[i].iov_len,
+                                fh[fd].ptr);
+            fh[fd].ptr += n;
+            rv += n;
+
+            if(n < iov[i].iov_len)
+                break;
         }
+    }
+
+    mutex_unlock(&rd_mutex);
+    return rv;
+}
+
+/* Gather write at the current file pointer, under one lock */
+static ssize_t ramdisk_writev(void * h, const iovec_t *iov, int iovcnt) {
+    ssize_t rv = -1, n;
+    file_t  fd = (file_t)h;
+    int     i;
 
-        rv = bytes;
+    mutex_lock(&rd_mutex);
+
+    if(ramdisk_fd_ok(fd, 1)) {
+        for(rv = 0, i = 0; i < iovcnt; i++) {
+            n = ramdisk_write_at(fd, iov[i].iov_base, iov[i].iov_len,
+                                 fh[fd].ptr);
+
+            if(n < 0) {
+                if(!rv)
+                    rv = -1;
+
+                break;
+            }
+
+            fh[fd].ptr += n;
+            rv += n;
+        }
     }
 
-error_out:
     mutex_unlock(&rd_mutex);
     return rv;
 }
@@ -532,7 +1099,7 @@ static dirent_t *ramdisk_readdir(void * h) {
     if(fd < MAX_RAM_FILES && fh[fd].file != NULL && fh[fd].ptr != 0 && fh[fd].dir) {
         /* Find the current file and advance to the next */
         f = (rd_file_t *)fh[fd].ptr;
-        fh[fd].ptr = (uint32)LIST_NEXT(f, dirlist);
+        fh[fd].ptr = (uint32)TAILQ_NEXT(f, dirlist);
 
         /* Copy out the requested data */
         strcpy(fh[fd].dirent.name, f->name);
@@ -567,17 +1134,17 @@ static int ramdisk_unlink(vfs_handler_t * vfs, const char *fn) {
     mutex_lock(&rd_mutex);
 
     /* Find the file */
-    f = ramdisk_find_path(rootdir, fn, 0);
+    f = ramdisk_find_path(ram_mnt.rootdir, fn, 0);
 
     if(f) {
         /* Make sure it's not in use */
         if(f->usage == 0) {
             /* Free its data */
             free(f->name);
-            free(f->data);
+            rd_file_clear(f);
 
             /* Remove it from the parent list */
-            LIST_REMOVE(f, dirlist);
+            rd_dir_remove(f);
 
             /* Free the entry itself */
             free(f);
@@ -595,8 +1162,13 @@ static void * ramdisk_mmap(void * h) {
 
     mutex_lock(&rd_mutex);
 
+    /* Files kept in extents get gathered into one block first; it stays
+       that way until a write goes past its end. */
     if(fd < MAX_RAM_FILES && fh[fd].file != NULL && !fh[fd].dir) {
-        rv = fh[fd].file->data;
+        rv = rd_flatten(fh[fd].file);
+    }
+    else {
+        errno = EINVAL;
     }
 
     mutex_unlock(&rd_mutex);
@@ -614,7 +1186,7 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *buf,
     mutex_lock(&rd_mutex);
 
     /* Find the file */
-    f = ramdisk_find_path(rootdir, path, 0);
+    f = ramdisk_find_path(ram_mnt.rootdir, path, 0);
 
     if(f) {
         memset(buf, 0, sizeof(struct stat));
@@ -627,12 +1199,10 @@ static int ramdisk_stat(vfs_handler_t *vfs, const char *path, struct stat *buf,
             buf->st_mode |= S_IFREG;
 
         buf->st_nlink = 1;
-        buf->st_size = f->datasize;
-        buf->st_blksize = 1024;
-        buf->st_blocks = f->datasize >> 10;
-
-        if(f->datasize & 0x3ff)
-            ++buf->st_blocks;
+        buf->st_size = f->size;
+        buf->st_blksize = RD_EXTENT_SIZE;
+        buf->st_blocks = (rd_file_allocated(f) + 511) >> 9;
+        rv = 0;
     }
     else {
         errno = ENOENT;
@@ -688,7 +1258,7 @@ static int ramdisk_rewinddir(void * h) {
     }
     else {
         /* Rewind to the first file. */
-        fh[fd].ptr = (uint32)LIST_FIRST((rd_dir_t *)fh[fd].file->data);
+        fh[fd].ptr = (uint32)TAILQ_FIRST(&((rd_dir_t *)fh[fd].file->data)->files);
     }
 
     mutex_unlock(&rd_mutex);
@@ -734,7 +1304,12 @@ static vfs_handler_t vh = {
     NULL,               /* tell64 XXX */
     NULL,               /* total64 XXX */
     NULL,               /* readlink XXX */
-    ramdisk_rewinddir
+    ramdisk_rewinddir,
+    ramdisk_pread,
+    ramdisk_pwrite,
+    ramdisk_readv,
+    ramdisk_writev,
+    ramdisk_splice
 };
 
 /* Attach a piece of memory to a file. This works somewhat like open for
@@ -743,6 +1318,7 @@ static vfs_handler_t vh = {
 int fs_ramdisk_attach(const char * fn, void * obj, size_t size) {
     void        *fd;
     rd_file_t   *f;
+    int         rv = 0;
 
     /* First of all, open a file for writing. This'll save us a bunch
        of duplicated code. */
@@ -751,17 +1327,32 @@ int fs_ramdisk_attach(const char * fn, void * obj, size_t size) {
     if(fd == NULL)
         return -1;
 
-    /* Ditch the data block we had and replace it with the user one. */
+    /* The (now empty) file gets the user's block as its contiguous data
+       block, if the quota allows. */
+    mutex_lock(&rd_mutex);
     f = fh[(int)fd].file;
-    free(f->data);
-    f->data = obj;
-    f->datasize = size;
-    f->size = size;
+
+    if(rd_charge(f, size) < 0) {
+        rv = -1;
+    }
+    else {
+        f->data = obj;
+        f->datasize = size;
+        f->size = size;
+    }
+
+    mutex_unlock(&rd_mutex);
 
     /* Close the file */
     ramdisk_close(fd);
 
-    return 0;
+    /* Don't leave an empty file behind if it couldn't be attached */
+    if(rv < 0) {
+        ramdisk_unlink(&vh, fn);
+        errno = ENOSPC;
+    }
+
+    return rv;
 }
 
 /* Does the opposite of attach. This again piggybacks on open. */
@@ -780,14 +1371,24 @@ int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size) {
     assert(obj != NULL);
     assert(size != NULL);
 
+    mutex_lock(&rd_mutex);
     f = fh[(int)fd].file;
+
+    if(!rd_flatten(f)) {
+        mutex_unlock(&rd_mutex);
+        ramdisk_close(fd);
+        return -1;
+    }
+
     *obj = f->data;
     *size = f->size;
 
-    /* Ditch the data block we had and replace it with a fake one. */
-    f->data = malloc(64);
-    f->datasize = 64;
-    f->size = 64;
+    /* The block is the caller's now, so leave the file empty. */
+    rd_uncharge(f, f->datasize);
+    f->data = NULL;
+    f->datasize = 0;
+    f->size = 0;
+    mutex_unlock(&rd_mutex);
 
     /* Close the file */
     ramdisk_close(fd);
@@ -798,19 +1399,37 @@ int fs_ramdisk_detach(const char * fn, void ** obj, size_t * size) {
     return 0;
 }
 
+int fs_ramdisk_set_quota(size_t bytes) {
+    mutex_lock(&rd_mutex);
+    ram_mnt.quota = bytes;
+    mutex_unlock(&rd_mutex);
+
+    return 0;
+}
+
+size_t fs_ramdisk_get_quota(void) {
+    return ram_mnt.quota;
+}
+
+size_t fs_ramdisk_get_usage(void) {
+    return ram_mnt.used;
+}
+
 /* Initialize the file system */
 int fs_ramdisk_init() {
+    rd_file_t *root;
+
     /* Create an empty root dir */
-    rootdir = (rd_dir_t *)malloc(sizeof(rd_dir_t));
-    LIST_INIT(rootdir);
-    root = (rd_file_t *)malloc(sizeof(rd_file_t));
+    ram_mnt.rootdir = rd_dir_create(&ram_mnt);
+    ram_mnt.root = root = (rd_file_t *)calloc(1, sizeof(rd_file_t));
     root->name = strdup("/");
-    root->size = 0;
+    root->namelen = 1;
     root->type = STAT_TYPE_DIR;
     root->openfor = OPENFOR_NOTHING;
-    root->usage = 0;
-    root->data = rootdir;
-    root->datasize = 0;
+    root->data = ram_mnt.rootdir;
+    root->mnt = &ram_mnt;
+
+    ram_mnt.used = 0;
 
     /* Reset fd's */
     memset(fh, 0, sizeof(fh));
@@ -827,18 +1446,21 @@ int fs_ramdisk_shutdown() {
     rd_file_t *f1, *f2;
     /* For now assume there's only the root dir, since mkdir and
        rmdir aren't even implemented... */
-    f1 = LIST_FIRST(rootdir);
+    f1 = TAILQ_FIRST(&ram_mnt.rootdir->files);
 
     while(f1) {
-        f2 = LIST_NEXT(f1, dirlist);
+        f2 = TAILQ_NEXT(f1, dirlist);
         free(f1->name);
-        free(f1->data);
+        rd_file_clear(f1);
         free(f1);
         f1 = f2;
     }
 
-    free(rootdir);
-    free(root);
+    rd_dir_destroy(ram_mnt.rootdir);
+    free(ram_mnt.root->name);
+    free(ram_mnt.root);
+    ram_mnt.root = NULL;
+    ram_mnt.rootdir = NULL;
 
     mutex_destroy(&rd_mutex);
     return nmmgr_handler_remove(&vh.nmmgr);
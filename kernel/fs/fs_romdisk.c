@@ -252,6 +252,23 @@ static int romdisk_close(void * h) {
     return 0;
 }
 
+/* Copy out of a file at the given position. The image is read-only, so
+   this needs no locking. */
+static ssize_t romdisk_read_at(file_t fd, void *buf, size_t bytes,
+                               uint32 pos) {
+    /* Is there enough left? */
+    if(pos >= fh[fd].size)
+        return 0;
+
+    if(bytes > fh[fd].size - pos)
+        bytes = fh[fd].size - pos;
+
+    /* Copy out the requested amount */
+    memcpy(buf, fh[fd].mnt->image + fh[fd].index + pos, bytes);
+
+    return bytes;
+}
+
 /* Read from a file */
 static ssize_t romdisk_read(void * h, void *buf, size_t bytes) {
     file_t fd = (file_t)h;
@@ -262,17 +279,69 @@ static ssize_t romdisk_read(void * h, void *buf, size_t bytes) {
         return -1;
     }
 
-    /* Is there enough left? */
-    if((fh[fd].ptr + bytes) > fh[fd].size)
-        bytes = fh[fd].size - fh[fd].ptr;
-
-    /* Copy out the requested amount */
-    memcpy(buf, fh[fd].mnt->image + fh[fd].index + fh[fd].ptr, bytes);
+    bytes = romdisk_read_at(fd, buf, bytes, fh[fd].ptr);
     fh[fd].ptr += bytes;
 
     return bytes;
 }
 
+/* Read from a file at a given offset, leaving the file pointer alone */
+static ssize_t romdisk_pread(void * h, void *buf, size_t bytes,
+                             off_t offset) {
+    file_t fd = (file_t)h;
+
+    if(fd >= MAX_RD_FILES || fh[fd].index == 0 || fh[fd].dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return romdisk_read_at(fd, buf, bytes, (uint32)offset);
+}
+
+/* Scatter read from the current file pointer */
+static ssize_t romdisk_readv(void * h, const iovec_t *iov, int iovcnt) {
+    file_t fd = (file_t)h;
+    ssize_t rv = 0;
+    size_t n;
+    int i;
+
+    if(fd >= MAX_RD_FILES || fh[fd].index == 0 || fh[fd].dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for(i = 0; i < iovcnt; i++) {
+        n = romdisk_read_at(fd, iov[i].iov_base, iov[i].iov_len, fh[fd].ptr);
+        fh[fd].ptr += n;
+        rv += n;
+
+        if(n < iov[i].iov_len)
+            break;
+    }
+
+    return rv;
+}
+
+/* Hand a piece of the file straight out of the image, for fs_sendfile() */
+static ssize_t romdisk_splice(void * h, off_t offset, size_t cnt,
+                              fs_splice_sink_t sink, void *ctx) {
+    file_t fd = (file_t)h;
+    uint32 pos = (uint32)offset;
+
+    if(fd >= MAX_RD_FILES || fh[fd].index == 0 || fh[fd].dir) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(pos >= fh[fd].size)
+        return 0;
+
+    if(cnt > fh[fd].size - pos)
+        cnt = fh[fd].size - pos;
+
+    return sink(ctx, fh[fd].mnt->image + fh[fd].index + pos, cnt);
+}
+
 /* Seek elsewhere in a file */
 static off_t romdisk_seek(void * h, off_t offset, int whence) {
     file_t fd = (file_t)h;
@@ -487,7 +556,12 @@ static vfs_handler_t vh = {
     NULL,                       /* tell64 */
     NULL,                       /* total64 */
     NULL,                       /* readlink */
-    romdisk_rewinddir
+    romdisk_rewinddir,
+    romdisk_pread,
+    NULL,                       /* pwrite */
+    romdisk_readv,
+    NULL,                       /* writev */
+    romdisk_splice
 };
 
 /* Are we initialized? */
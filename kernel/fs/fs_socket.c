@@ -11,10 +11,12 @@
 #include <kos/net.h>
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <malloc.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -79,6 +81,127 @@ static ssize_t fs_socket_write(void *hnd, const void *buffer, size_t cnt) {
     return sock->protocol->sendto(sock, buffer, cnt, 0, NULL, 0);
 }
 
+static ssize_t fs_socket_pread(void *hnd, void *buffer, size_t cnt,
+                               off_t offset) {
+    (void)hnd;
+    (void)buffer;
+    (void)cnt;
+    (void)offset;
+    errno = ESPIPE;
+    return -1;
+}
+
+static ssize_t fs_socket_pwrite(void *hnd, const void *buffer, size_t cnt,
+                                off_t offset) {
+    (void)hnd;
+    (void)buffer;
+    (void)cnt;
+    (void)offset;
+    errno = ESPIPE;
+    return -1;
+}
+
+static size_t iov_total(const iovec_t *iov, int iovcnt) {
+    size_t total = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    return total;
+}
+
+/* A vectored read or write has to be a single receive or send, otherwise a
+   datagram would be split up (or truncated) across the buffers. Anything
+   more than one buffer is bounced through a temporary one. */
+static ssize_t recv_msg(net_socket_t *sock, struct msghdr *msg, int flags) {
+    const iovec_t *iov = msg->msg_iov;
+    struct sockaddr *addr = (struct sockaddr *)msg->msg_name;
+    socklen_t *alen = addr ? &msg->msg_namelen : NULL;
+    size_t total, n;
+    ssize_t rv;
+    uint8 *buf, *p;
+    int i;
+
+    if(msg->msg_iovlen == 1)
+        return sock->protocol->recvfrom(sock, iov[0].iov_base, iov[0].iov_len,
+                                        flags, addr, alen);
+
+    total = iov_total(iov, msg->msg_iovlen);
+
+    if(!(buf = (uint8 *)malloc(total ? total : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rv = sock->protocol->recvfrom(sock, buf, total, flags, addr, alen);
+
+    for(i = 0, p = buf; rv > 0 && i < msg->msg_iovlen && p < buf + rv; i++) {
+        n = iov[i].iov_len;
+
+        if(n > (size_t)(buf + rv - p))
+            n = buf + rv - p;
+
+        memcpy(iov[i].iov_base, p, n);
+        p += n;
+    }
+
+    free(buf);
+    return rv;
+}
+
+static ssize_t send_msg(net_socket_t *sock, const struct msghdr *msg,
+                        int flags) {
+    const iovec_t *iov = msg->msg_iov;
+    const struct sockaddr *addr = (const struct sockaddr *)msg->msg_name;
+    socklen_t alen = addr ? msg->msg_namelen : 0;
+    size_t total;
+    ssize_t rv;
+    uint8 *buf, *p;
+    int i;
+
+    if(msg->msg_iovlen == 1)
+        return sock->protocol->sendto(sock, iov[0].iov_base, iov[0].iov_len,
+                                      flags, addr, alen);
+
+    total = iov_total(iov, msg->msg_iovlen);
+
+    if(!(buf = (uint8 *)malloc(total ? total : 1))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0, p = buf; i < msg->msg_iovlen; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
+    rv = sock->protocol->sendto(sock, buf, total, flags, addr, alen);
+
+    free(buf);
+    return rv;
+}
+
+static ssize_t fs_socket_readv(void *hnd, const iovec_t *iov, int iovcnt) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (iovec_t *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return recv_msg((net_socket_t *)hnd, &msg, 0);
+}
+
+static ssize_t fs_socket_writev(void *hnd, const iovec_t *iov, int iovcnt) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (iovec_t *)iov;
+    msg.msg_iovlen = iovcnt;
+
+    return send_msg((net_socket_t *)hnd, &msg, 0);
+}
+
 static int fs_socket_fcntl(void *hnd, int cmd, va_list ap) {
     net_socket_t *sock = (net_socket_t *)hnd;
     return sock->protocol->fcntl(sock, cmd, ap);
@@ -127,7 +250,11 @@ static vfs_handler_t vh = {
     NULL,            /* tell64 */
     NULL,            /* total64 */
     NULL,            /* readlink */
-    NULL             /* rewinddir */
+    NULL,            /* rewinddir */
+    fs_socket_pread, /* pread */
+    fs_socket_pwrite, /* pwrite */
+    fs_socket_readv, /* readv */
+    fs_socket_writev /* writev */
 };
 
 /* Have we been initialized? */
@@ -538,6 +665,100 @@ ssize_t sendto(int sock, const void *message, size_t length, int flags,
                                  dest_len);
 }
 
+int recvmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+    int ms = 0;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(timeout) {
+        if(timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+           timeout->tv_nsec >= 1000000000) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* Round up, so that a short timeout doesn't mean forever, and keep
+           a long one from overflowing. */
+        if(timeout->tv_sec >= INT_MAX / 1000)
+            ms = INT_MAX;
+        else
+            ms = (int)timeout->tv_sec * 1000 +
+                 (timeout->tv_nsec + 999999) / 1000000;
+
+        if(!ms)
+            flags |= MSG_DONTWAIT;
+    }
+
+    if(hnd->protocol->recvmmsg)
+        return hnd->protocol->recvmmsg(hnd, msgvec, vlen, flags, ms);
+
+    /* The protocol can't do it itself, so receive them one at a time, only
+       waiting for the first. The timeout can't be honoured here. */
+    for(i = 0; i < vlen; ++i) {
+        msgvec[i].msg_hdr.msg_flags = 0;
+        msgvec[i].msg_hdr.msg_controllen = 0;
+        rv = recv_msg(hnd, &msgvec[i].msg_hdr,
+                      i ? flags | MSG_DONTWAIT : flags);
+
+        if(rv < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+
+        /* Don't return the same data over and over. */
+        if(!rv || (flags & MSG_PEEK))
+            return i + 1;
+    }
+
+    return (int)i;
+}
+
+int sendmmsg(int sock, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    net_socket_t *hnd;
+    unsigned int i;
+    ssize_t rv;
+
+    hnd = (net_socket_t *)fs_get_handle(sock);
+
+    if(hnd == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Make sure this is actually a socket. */
+    if(fs_get_handler(sock) != &vh) {
+        errno = ENOTSOCK;
+        return -1;
+    }
+
+    if(hnd->protocol->sendmmsg)
+        return hnd->protocol->sendmmsg(hnd, msgvec, vlen, flags);
+
+    for(i = 0; i < vlen; ++i) {
+        if((rv = send_msg(hnd, &msgvec[i].msg_hdr, flags)) < 0)
+            return i ? (int)i : -1;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    return (int)i;
+}
+
 int shutdown(int sock, int how) {
     net_socket_t *hnd;
 
@@ -18,10 +18,12 @@
    The implementations of getaddrinfo() and freeaddrinfo() are new to this
    version of the code though.
 
-   Eventually, I'd like to add some sort of cacheing of results to this file so
-   that if you look something up more than once, it doesn't have to go back out
-   to the server to do so. But, for now, there is no local database of cached
-   addresses...
+   Answers are cached for as long as their TTL says (and names that don't
+   exist for as long as the zone's SOA says, see RFC 2308), one entry per name
+   and address family, with the least recently used entry thrown out when the
+   cache is full. A lookup for a name that is already being looked up waits for
+   that query instead of sending its own. Failures that might go away on their
+   own (timeouts, server failures) aren't cached.
 */
 
 #include <stdio.h>
@@ -37,6 +39,11 @@
 
 #include <kos/net.h>
 #include <kos/dbglog.h>
+#include <kos/dns.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/thread.h>
+#include <arch/timer.h>
 
 /* How many attempts to make at contacting the DNS server before giving up. */
 #define DNS_ATTEMPTS    4
@@ -44,6 +51,24 @@
 /* How long to wait between attempts. */
 #define DNS_TIMEOUT     500
 
+/* The most addresses kept for one name. Any more in an answer are ignored. */
+#define DNS_ADDRS_MAX   8
+
+/* Longest name that can be looked up, including the NUL */
+#define DNS_NAME_MAX    256
+
+/* Default number of cache entries */
+#define DNS_DEFAULT_ENTRIES 32
+
+/* Limits on how long to cache answers (seconds). Names that don't exist are
+   cached for DNS_NEG_TTL if the server doesn't say how long. */
+#define DNS_TTL_MAX     86400
+#define DNS_NEG_TTL     30
+#define DNS_NEG_TTL_MAX 300
+
+/* getaddrinfo_dns() would have to ask the server */
+#define DNS_NOT_CACHED  -1
+
 /*
    This performs a simple DNS A-record query. It hasn't been tested extensively
    but so far it seems to work fine.
@@ -72,6 +97,10 @@ typedef struct dnsmsg {
 
 static uint16_t qnum = 0;
 
+/* Protects the cache, the statistics and the server address */
+static mutex_t cache_mutex = MUTEX_INITIALIZER;
+static dns_stats_t dns_stats;
+
 #define QTYPE_A         1
 #define QTYPE_AAAA      28
 
@@ -211,87 +240,57 @@ static size_t dns_make_query(const char *host, dnsmsg_t *buf, int ip4,
    name, and the A answer contains the address.
  */
 
+/* The addresses in an answer, and how long they can be kept. */
+typedef struct dns_answer {
+    int naddrs;
+    uint8_t addrs[DNS_ADDRS_MAX][16];
+    uint32_t ttl;
+} dns_answer_t;
+
+static inline uint16_t get16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
 // Scans through and skips a label in the data payload, starting
 // at the given offset. The new offset (after the label) will be
-// returned.
-static int dns_skip_label(dnsmsg_t *resp, int o) {
-    int cnt;
-
+// returned, or -1 if it runs off the end of the len bytes of data.
+static int dns_skip_label(const dnsmsg_t *resp, int o, int len) {
     // End of the label?
-    while(resp->data[o] != 0) {
+    while(o < len && resp->data[o] != 0) {
         // Is it a pointer?
         if((resp->data[o] & 0xc0) == 0xc0)
-            return o + 2;
+            return o + 2 <= len ? o + 2 : -1;
 
         // Skip this part.
-        cnt = resp->data[o++];
-        o += cnt;
+        o += resp->data[o] + 1;
     }
 
     // Skip the terminator
-    o++;
-
-    return o;
+    return o < len ? o + 1 : -1;
 }
 
-// Scans through and copies out a label in the data payload,
-// starting at the given offset. The new offset (after the label)
-// will be returned as well as the label string.
-static int dns_copy_label(dnsmsg_t *resp, int o, char *outbuf) {
-    int cnt;
-    int rv = -1;
-
-    // Do each part.
-    outbuf[0] = 0;
-
-    for(;;) {
-        // Is it a pointer?
-        if((resp->data[o] & 0xc0) == 0xc0) {
-            int offs = ((resp->data[o] & ~0xc0) << 8) | resp->data[o + 1];
-
-            if(rv < 0)
-                rv = o + 2;
-
-            o = offs - sizeof(dnsmsg_t);
-        }
-        else {
-            cnt = resp->data[o++];
-
-            if(cnt) {
-                if(outbuf[0] != 0)
-                    strcat(outbuf, ".");
-
-                strncat(outbuf, (char *)(resp->data + o), cnt);
-                o += cnt;
-            }
-            else {
-                break;
-            }
-        }
-    }
-
-    if(rv < 0)
-        return o;
-    else
-        return rv;
-}
+// Parse a response packet of size bytes from the DNS server, keeping the
+// addresses of the given family. Returns 0 if there were any, otherwise an
+// EAI_* code. For EAI_NONAME, ans->ttl is how long to remember that.
+static int dns_parse_response(const dnsmsg_t *resp, size_t size, int family,
+                              dns_answer_t *ans) {
+    int i, o, len, cnt, p;
+    uint16_t flags, type, rdlen;
+    int want = family == AF_INET ? QTYPE_A : QTYPE_AAAA;
+    int alen = family == AF_INET ? 4 : 16;
+    uint32_t ttl, ttl_min = DNS_TTL_MAX;
+
+    ans->naddrs = 0;
+    ans->ttl = DNS_NEG_TTL;
+
+    if(size < sizeof(dnsmsg_t))
+        return EAI_AGAIN;
 
-/* Forward declaration... */
-static struct addrinfo *add_ipv4_ai(uint32_t ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-static struct addrinfo *add_ipv6_ai(const struct in6_addr *ip, uint16_t port,
-                                    struct addrinfo *h, struct addrinfo *tail);
-
-// Parse a response packet from the DNS server. The IP address
-// will be filled in upon a successful return, otherwise the
-// return value will be <0.
-static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
-                              uint16_t port, struct addrinfo **res) {
-    int i, o, arecs;
-    uint16_t flags;
-    char tmp[64];
-    uint16_t ancnt, len;
-    struct addrinfo *ptr = NULL;
+    len = size - sizeof(dnsmsg_t);
 
     /* Check the flags first to see if it was successful. */
     flags = ntohs(resp->flags);
@@ -304,6 +303,7 @@ static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
     /* Did the server report an error? */
     switch(flags & 0x000f) {
         case 0:   /* No error */
+        case 3:   /* Name error */
             break;
 
         case 1:   /* Format error */
@@ -312,157 +312,125 @@ static int dns_parse_response(dnsmsg_t *resp, struct addrinfo *hints,
         default:
             return EAI_FAIL;
 
-        case 3:   /* Name error */
-            return EAI_NONAME;
-
         case 2:   /* Server failure */
             return EAI_AGAIN;
     }
 
-    /* Getting zero answers is also a failure. */
-    ancnt = ntohs(resp->ancount);
-
-    if(ancnt < 1)
-        return EAI_NONAME;
-
     /* If we have any query sections (should have at least one), skip 'em. */
     o = 0;
-    len = ntohs(resp->qdcount);
+    cnt = ntohs(resp->qdcount);
 
-    for(i = 0; i < len; i++) {
-        /* Skip the label. */
-        o = dns_skip_label(resp, o);
-
-        /* And the two type fields. */
-        o += 4;
+    for(i = 0; i < cnt && o >= 0; i++) {
+        /* Skip the label, and the two type fields. */
+        if((o = dns_skip_label(resp, o, len)) >= 0)
+            o += 4;
     }
 
-    /* Ok, now the answer section (what we're interested in). */
-    arecs = 0;
-
-    for(i = 0; i < ancnt; i++) {
-        /* Copy out the label, in case we need it. */
-        o = dns_copy_label(resp, o, tmp);
+    /* Now the answer section (what we're interested in), then the authority
+       section, which may tell us how long to remember a name doesn't exist. */
+    cnt = ntohs(resp->ancount) + ntohs(resp->nscount);
 
-        /* Get the type code. If it's not A or AAAA, skip it. */
-        if(resp->data[o] == 0 && resp->data[o + 1] == 1 &&
-           (hints->ai_family == AF_INET || hints->ai_family == AF_UNSPEC)) {
-            uint32_t addr;
-
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+    for(i = 0; i < cnt; i++) {
+        if((o = dns_skip_label(resp, o, len)) < 0 || o + 10 > len)
+            break;
 
-            /* Grab the address from the response. */
-            addr = htonl((resp->data[o] << 24) | (resp->data[o + 1] << 16) |
-                         (resp->data[o + 2] << 8) | resp->data[o + 3]);
+        type = get16(resp->data + o);
+        ttl = get32(resp->data + o + 4);
+        rdlen = get16(resp->data + o + 8);
+        o += 10;
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv4_ai(addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+        if(o + rdlen > len)
+            break;
 
-            if(!*res)
-                *res = ptr;
+        if(i < ntohs(resp->ancount)) {
+            /* A CNAME's TTL limits the addresses it leads to as well. */
+            if((type == want && rdlen == alen) || type == 5) {
+                if(ttl < ttl_min)
+                    ttl_min = ttl;
+            }
 
-            o += len;
-            arecs++;
+            if(type == want && rdlen == alen && ans->naddrs < DNS_ADDRS_MAX)
+                memcpy(ans->addrs[ans->naddrs++], resp->data + o, alen);
         }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 28 &&
-                (hints->ai_family == AF_INET6 || hints->ai_family == AF_UNSPEC)) {
-            struct in6_addr addr;
-
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
+        else if(type == 6) {
+            /* SOA: skip the two names, and the minimum is the last of the five
+               numbers after them. */
+            p = dns_skip_label(resp, o, o + rdlen);
 
-            /* Grab the address from the response. */
-            memcpy(addr.s6_addr, &resp->data[o], 16);
+            if(p >= 0)
+                p = dns_skip_label(resp, p, o + rdlen);
 
-            /* Add this address to the chain. */
-            if(!(ptr = add_ipv6_ai(&addr, port, hints, ptr)))
-                /* If something goes wrong in here, it's in calling malloc, so
-                   it is definitely a system error. */
-                return EAI_SYSTEM;
+            if(p >= 0 && p + 20 <= o + rdlen) {
+                if(get32(resp->data + p + 16) < ttl)
+                    ttl = get32(resp->data + p + 16);
 
-            if(!*res)
-                *res = ptr;
-
-            o += len;
-            arecs++;
+                ans->ttl = ttl < DNS_NEG_TTL_MAX ? ttl : DNS_NEG_TTL_MAX;
+            }
         }
-        else if(resp->data[o] == 0 && resp->data[o + 1] == 5) {
-            char tmp2[64];
 
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2;
-            o = dns_copy_label(resp, o, tmp2);
-        }
-        else {
-            o += 8;
-            len = (resp->data[o] << 8) | resp->data[o + 1];
-            o += 2 + len;
-        }
+        o += rdlen;
     }
 
-    /* Did we find something? */
-    return arecs > 0 ? 0 : EAI_NONAME;
+    if(!ans->naddrs)
+        return EAI_NONAME;
+
+    ans->ttl = ttl_min;
+    return 0;
 }
 
-static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
-                           uint16_t port, struct addrinfo **res) {
+static struct sockaddr_in dns_server;
+static int dns_server_set = 0;
+
+/* Ask the DNS server for the addresses of one family for a name. */
+static int dns_query(const char *name, int family, dns_answer_t *ans) {
     struct sockaddr_in toaddr;
-    uint8_t qb[512];
+    uint8_t qb[512], rb[512];
     size_t size;
-    int sock, rv, tries;
+    int sock, rv = EAI_AGAIN, tries;
     in_addr_t raddr;
-    ssize_t rsize = 0;
+    ssize_t rsize;
+    uint16_t id;
     struct pollfd pfd;
 
-    /* Make sure we have a network device to communicate on. */
-    if(!net_default_dev) {
-        errno = ENETDOWN;
-        return EAI_SYSTEM;
-    }
+    mutex_lock(&cache_mutex);
+    toaddr = dns_server;
+    tries = dns_server_set;
+    mutex_unlock(&cache_mutex);
 
-    /* Do we have a DNS server specified? */
-    if(net_default_dev->dns[0] == 0 && net_default_dev->dns[1] == 0 &&
-       net_default_dev->dns[2] == 0 && net_default_dev->dns[3] == 0) {
-        return EAI_FAIL;
-    }
-
-    /* Setup a query */
-    if(hints->ai_family == AF_UNSPEC)
-        /* Note: This should (in theory) work, but it seems that some resolvers
-           cannot handle multiple questions in one query. So... while the code
-           here supports multiple questions in one query, this branch will never
-           actually be taken -- getaddrinfo() will always make two separate
-           calls if we need to do both IPv4 and IPv6. */
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 1);
-    else if(hints->ai_family == AF_INET)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 1, 0);
-    else if(hints->ai_family == AF_INET6)
-        size = dns_make_query(name, (dnsmsg_t *)qb, 0, 1);
-    else {
-        errno = EAFNOSUPPORT;
-        return EAI_SYSTEM;
+    if(!tries) {
+        /* Make sure we have a network device to communicate on. */
+        if(!net_default_dev) {
+            errno = ENETDOWN;
+            return EAI_SYSTEM;
+        }
+
+        /* Do we have a DNS server specified? */
+        if(net_default_dev->dns[0] == 0 && net_default_dev->dns[1] == 0 &&
+           net_default_dev->dns[2] == 0 && net_default_dev->dns[3] == 0) {
+            return EAI_FAIL;
+        }
+
+        raddr = (net_default_dev->dns[0] << 24) |
+                (net_default_dev->dns[1] << 16) |
+                (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
+
+        memset(&toaddr, 0, sizeof(toaddr));
+        toaddr.sin_family = AF_INET;
+        toaddr.sin_port = htons(53);
+        toaddr.sin_addr.s_addr = htonl(raddr);
     }
 
+    /* Setup a query. Some resolvers cannot handle more than one question in a
+       query, so we only ever ask one. */
+    size = dns_make_query(name, (dnsmsg_t *)qb, family == AF_INET,
+                          family == AF_INET6);
+    id = ((dnsmsg_t *)qb)->id;
+
     /* Make a socket to talk to the DNS server. */
     if((sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
         return EAI_SYSTEM;
 
     /* "Connect" the socket to the DNS server's address. */
-    raddr = (net_default_dev->dns[0] << 24) | (net_default_dev->dns[1] << 16) |
-            (net_default_dev->dns[2] << 8) | net_default_dev->dns[3];
-
-    memset(&toaddr, 0, sizeof(toaddr));
-    toaddr.sin_family = AF_INET;
-    toaddr.sin_port = htons(53);
-    toaddr.sin_addr.s_addr = htonl(raddr);
-
     if(connect(sock, (struct sockaddr *)&toaddr, sizeof(toaddr))) {
         close(sock);
         return EAI_SYSTEM;
@@ -473,21 +441,32 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
     pfd.events = POLLIN;
     pfd.revents = 0;
 
-    for(tries = 0; tries < DNS_ATTEMPTS; ++tries) {
+    for(tries = 0; tries < DNS_ATTEMPTS && rv == EAI_AGAIN; ++tries) {
         /* Send the query to the server. */
         if(send(sock, qb, size, 0) < 0) {
-            return EAI_SYSTEM;
+            rv = EAI_SYSTEM;
+            break;
         }
 
+        mutex_lock(&cache_mutex);
+        dns_stats.queries++;
+        mutex_unlock(&cache_mutex);
+
         /* Wait for the timeout to expire or for us to get the response. */
-        if(poll(&pfd, 1, DNS_TIMEOUT) == 1) {
-            /* Get the response. */
-            if((rsize = recv(sock, qb, 512, 0)) < 0) {
-                return EAI_SYSTEM;
-            }
+        if(poll(&pfd, 1, DNS_TIMEOUT) != 1)
+            continue;
 
+        /* Get the response. */
+        if((rsize = recv(sock, rb, sizeof(rb), 0)) < 0) {
+            rv = EAI_SYSTEM;
             break;
         }
+
+        /* Ignore anything that isn't the answer to this question. */
+        if((size_t)rsize < sizeof(dnsmsg_t) || ((dnsmsg_t *)rb)->id != id)
+            continue;
+
+        rv = dns_parse_response((const dnsmsg_t *)rb, rsize, family, ans);
     }
 
     /* Close the socket */
@@ -497,21 +476,15 @@ static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
        the server on the other end. I'm not entirely sure what to return in that
        case, to be perfectly honest. I suppose that EAI_SYSTEM + ETIMEDOUT would
        make the most sense, since that's really what happened... */
-    if(!rsize) {
+    if(rv == EAI_AGAIN && tries == DNS_ATTEMPTS) {
+        mutex_lock(&cache_mutex);
+        dns_stats.timeouts++;
+        mutex_unlock(&cache_mutex);
+
         errno = ETIMEDOUT;
         return EAI_SYSTEM;
     }
 
-    /* Parse the response. */
-    rv = dns_parse_response((dnsmsg_t *)qb, hints, port, res);
-
-    /* If we got something in the result, but got an error value in the return,
-       free whatever we got. */
-    if(rv != 0 && *res) {
-        freeaddrinfo(*res);
-        *res = NULL;
-    }
-
     return rv;
 }
 
@@ -612,16 +585,225 @@ void freeaddrinfo(struct addrinfo *ai) {
     }
 }
 
-int getaddrinfo(const char *nodename, const char *servname,
-                const struct addrinfo *hints, struct addrinfo **res) {
+/* The cache. Entries are kept most recently used first. An entry being
+   looked up is pending, and anyone else after the same name waits on
+   cache_cv for it. */
+typedef struct dns_entry {
+    TAILQ_ENTRY(dns_entry) lru;
+    char name[DNS_NAME_MAX];
+    int family;
+    int pending;
+    int waiters;
+    int rv;
+    int err;
+    uint64 expires;
+    dns_answer_t ans;
+} dns_entry_t;
+
+static TAILQ_HEAD(dns_lru, dns_entry) cache = TAILQ_HEAD_INITIALIZER(cache);
+static int cache_count = 0;
+static int cache_size = DNS_DEFAULT_ENTRIES;
+static condvar_t cache_cv = COND_INITIALIZER;
+
+/* Signalled when an asynchronous request finishes */
+static condvar_t async_cv = COND_INITIALIZER;
+
+static dns_entry_t *cache_find(const char *name, int family) {
+    dns_entry_t *e;
+
+    TAILQ_FOREACH(e, &cache, lru) {
+        if(e->family == family && !strcasecmp(e->name, name))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void cache_remove(dns_entry_t *e) {
+    TAILQ_REMOVE(&cache, e, lru);
+    --cache_count;
+    free(e);
+}
+
+/* Throw out the least recently used entries until the cache fits its size.
+   Entries that someone is still using stay. */
+static void cache_trim(void) {
+    dns_entry_t *e, *prev;
+
+    e = TAILQ_LAST(&cache, dns_lru);
+
+    while(e && cache_count > cache_size) {
+        prev = TAILQ_PREV(e, dns_lru, lru);
+
+        if(!e->pending && !e->waiters) {
+            cache_remove(e);
+            dns_stats.evicted++;
+        }
+
+        e = prev;
+    }
+}
+
+/* Drop an entry once nobody is waiting on it, if it shouldn't be kept. */
+static void cache_release(dns_entry_t *e) {
+    if(!e->waiters && (!cache_size || e->expires <= timer_ms_gettime64()))
+        cache_remove(e);
+}
+
+/* Build the addrinfo chain for a cached answer. */
+static int cache_result(const dns_entry_t *e, struct addrinfo *hints,
+                        uint16_t port, struct addrinfo **res) {
+    struct addrinfo *ptr = NULL;
+    uint32_t addr;
+    int i;
+
+    if(e->rv) {
+        errno = e->err;
+        return e->rv;
+    }
+
+    for(i = 0; i < e->ans.naddrs; i++) {
+        if(e->family == AF_INET) {
+            memcpy(&addr, e->ans.addrs[i], 4);
+            ptr = add_ipv4_ai(addr, port, hints, ptr);
+        }
+        else {
+            ptr = add_ipv6_ai((const struct in6_addr *)e->ans.addrs[i], port,
+                              hints, ptr);
+        }
+
+        if(!ptr) {
+            freeaddrinfo(*res);
+            *res = NULL;
+            return EAI_MEMORY;
+        }
+
+        if(!*res)
+            *res = ptr;
+    }
+
+    return 0;
+}
+
+static int getaddrinfo_dns(const char *name, struct addrinfo *hints,
+                           uint16_t port, struct addrinfo **res,
+                           int cached_only) {
+    dns_entry_t *e;
+    dns_answer_t ans;
+    int rv, err;
+    uint64 now;
+
+    if(hints->ai_family != AF_INET && hints->ai_family != AF_INET6) {
+        errno = EAFNOSUPPORT;
+        return EAI_SYSTEM;
+    }
+
+    if(strlen(name) >= DNS_NAME_MAX)
+        return EAI_NONAME;
+
+    mutex_lock(&cache_mutex);
+
+    e = cache_find(name, hints->ai_family);
+    now = timer_ms_gettime64();
+
+    if(e && (e->pending || e->expires > now)) {
+        if(cached_only && e->pending) {
+            mutex_unlock(&cache_mutex);
+            return DNS_NOT_CACHED;
+        }
+
+        if(e->pending) {
+            /* Someone's already asking; wait for their answer. */
+            dns_stats.coalesced++;
+            e->waiters++;
+
+            while(e->pending)
+                cond_wait(&cache_cv, &cache_mutex);
+
+            e->waiters--;
+        }
+        else if(e->rv) {
+            dns_stats.neg_hits++;
+        }
+        else {
+            dns_stats.hits++;
+        }
+
+        TAILQ_REMOVE(&cache, e, lru);
+        TAILQ_INSERT_HEAD(&cache, e, lru);
+
+        rv = cache_result(e, hints, port, res);
+        err = errno;
+        cache_release(e);
+        mutex_unlock(&cache_mutex);
+
+        errno = err;
+        return rv;
+    }
+
+    if(cached_only) {
+        mutex_unlock(&cache_mutex);
+        return DNS_NOT_CACHED;
+    }
+
+    /* Claim the entry (reusing a stale one) so anyone else who wants this
+       name waits for us. */
+    if(e) {
+        TAILQ_REMOVE(&cache, e, lru);
+    }
+    else if((e = (dns_entry_t *)malloc(sizeof(dns_entry_t)))) {
+        memset(e, 0, sizeof(dns_entry_t));
+        strcpy(e->name, name);
+        e->family = hints->ai_family;
+        ++cache_count;
+    }
+    else {
+        mutex_unlock(&cache_mutex);
+        return EAI_MEMORY;
+    }
+
+    TAILQ_INSERT_HEAD(&cache, e, lru);
+    e->pending = 1;
+    dns_stats.misses++;
+    cache_trim();
+    mutex_unlock(&cache_mutex);
+
+    rv = dns_query(name, hints->ai_family, &ans);
+    err = errno;
+
+    mutex_lock(&cache_mutex);
+
+    e->ans = ans;
+    e->rv = rv;
+    e->err = err;
+    e->pending = 0;
+    e->expires = timer_ms_gettime64();
+
+    /* Only remember answers, and names that don't exist. */
+    if(rv == 0 || rv == EAI_NONAME)
+        e->expires += ans.ttl * 1000ULL;
+
+    cond_broadcast(&cache_cv);
+
+    rv = cache_result(e, hints, port, res);
+    err = errno;
+    cache_release(e);
+    cache_trim();
+    mutex_unlock(&cache_mutex);
+
+    errno = err;
+    return rv;
+}
+
+static int do_getaddrinfo(const char *nodename, const char *servname,
+                          const struct addrinfo *hints, struct addrinfo **res,
+                          int cached_only) {
     in_port_t port = 0;
     unsigned long tmp;
     char *endp;
     int old_errno;
     struct addrinfo ihints;
 
-    (void)hints;
-
     /* What to do if res is NULL?... I'll assume we should return error... */
     if(!res) {
         errno = EFAULT;
@@ -714,13 +896,18 @@ int getaddrinfo(const char *nodename, const char *servname,
         int rv;
 
         ihints.ai_family = AF_INET;
-        rv = getaddrinfo_dns(nodename, &ihints, port, &res1);
+        rv = getaddrinfo_dns(nodename, &ihints, port, &res1, cached_only);
 
         if(rv && rv != EAI_NONAME)
             return rv;
 
         ihints.ai_family = AF_INET6;
-        getaddrinfo_dns(nodename, &ihints, port, &res2);
+
+        if(getaddrinfo_dns(nodename, &ihints, port, &res2,
+                           cached_only) == DNS_NOT_CACHED) {
+            freeaddrinfo(res1);
+            return DNS_NOT_CACHED;
+        }
 
         /* Figure out what to do with the result(s). */
         if(res1 && res2) {
@@ -747,5 +934,150 @@ int getaddrinfo(const char *nodename, const char *servname,
         }
     }
 
-    return getaddrinfo_dns(nodename, &ihints, port, res);
+    return getaddrinfo_dns(nodename, &ihints, port, res, cached_only);
+}
+
+int getaddrinfo(const char *nodename, const char *servname,
+                const struct addrinfo *hints, struct addrinfo **res) {
+    return do_getaddrinfo(nodename, servname, hints, res, 0);
+}
+
+/* Post the result of a lookup. The callback runs before the request is
+   marked done, since whoever is in dns_wait() may free it as soon as it is. */
+static void dns_finish(dns_req_t *req, int rv) {
+    req->rv = rv;
+    req->err = errno;
+
+    if(req->callback)
+        req->callback(req);
+
+    mutex_lock(&cache_mutex);
+    req->state = DNS_DONE;
+    cond_broadcast(&async_cv);
+    mutex_unlock(&cache_mutex);
+}
+
+static void *dns_async_thd(void *param) {
+    dns_req_t *req = (dns_req_t *)param;
+
+    dns_finish(req, do_getaddrinfo(req->node, req->service, req->hints,
+                                   &req->res, 0));
+    return NULL;
+}
+
+int dns_resolve_async(dns_req_t *req) {
+    int rv;
+
+    if(req->state == DNS_PENDING) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    req->res = NULL;
+    req->state = DNS_PENDING;
+
+    /* Answer straight away if we can. */
+    if((rv = do_getaddrinfo(req->node, req->service, req->hints, &req->res,
+                            1)) != DNS_NOT_CACHED) {
+        dns_finish(req, rv);
+        return 0;
+    }
+
+    if(!thd_create(1, dns_async_thd, req)) {
+        req->state = DNS_IDLE;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int dns_wait(dns_req_t *req, int timeout) {
+    uint64 end = timer_ms_gettime64() + timeout, now;
+    int rv = 0;
+
+    mutex_lock(&cache_mutex);
+
+    while(req->state == DNS_PENDING) {
+        if(!timeout) {
+            cond_wait(&async_cv, &cache_mutex);
+            continue;
+        }
+
+        if((now = timer_ms_gettime64()) >= end) {
+            rv = -1;
+            errno = ETIMEDOUT;
+            break;
+        }
+
+        cond_wait_timed(&async_cv, &cache_mutex, (int)(end - now));
+    }
+
+    mutex_unlock(&cache_mutex);
+    return rv;
+}
+
+int dns_cache_set_size(int entries) {
+    if(entries < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&cache_mutex);
+    cache_size = entries;
+    cache_trim();
+    mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+void dns_cache_flush(void) {
+    dns_entry_t *e, *next;
+
+    mutex_lock(&cache_mutex);
+
+    for(e = TAILQ_FIRST(&cache); e; e = next) {
+        next = TAILQ_NEXT(e, lru);
+
+        if(!e->pending && !e->waiters)
+            cache_remove(e);
+    }
+
+    mutex_unlock(&cache_mutex);
+}
+
+int dns_set_server(const struct sockaddr_in *server) {
+    if(server && server->sin_family != AF_INET) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    mutex_lock(&cache_mutex);
+
+    if(server) {
+        dns_server = *server;
+        dns_server_set = 1;
+    }
+    else {
+        dns_server_set = 0;
+    }
+
+    mutex_unlock(&cache_mutex);
+
+    /* Answers from the old server shouldn't stand in for the new one's. */
+    dns_cache_flush();
+    return 0;
+}
+
+void dns_get_stats(dns_stats_t *st) {
+    mutex_lock(&cache_mutex);
+    *st = dns_stats;
+    st->entries = cache_count;
+    mutex_unlock(&cache_mutex);
+}
+
+void dns_reset_stats(void) {
+    mutex_lock(&cache_mutex);
+    memset(&dns_stats, 0, sizeof(dns_stats));
+    mutex_unlock(&cache_mutex);
 }
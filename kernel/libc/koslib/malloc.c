@@ -22,6 +22,9 @@
 #include <string.h>
 #include <arch/spinlock.h>
 #include <arch/arch.h>
+#include <arch/irq.h>
+#include <kos/thread.h>
+#include <kos/mprof.h>
 
 #include <kos/opts.h>
 
@@ -1642,6 +1645,57 @@ static pthread_mutex_t mALLOC_MUTEx = PTHREAD_MUTEX_INITIALIZER;
 /********************************************************************************************************/
 /*** Begin KOS Code ***/
 
+/************************** Thread Cache **************************/
+
+/* Optional per-thread cache of small chunks sitting in front of the global
+   heap. Each thread keeps a handful of singly-linked free lists indexed by
+   chunk size; allocations and frees that hit the cache never touch the
+   global lock. Chunks move between the cache and the heap in small batches
+   so that the lock is taken once per batch rather than once per call.
+
+   Cached chunks are still "in use" as far as dlmalloc is concerned, so
+   mallinfo() and malloc_stats() subtract them back out (see mALLINFo).
+
+   The cache is bypassed inside interrupts, before threads are up, and when
+   KM_DBG is enabled (the sentinel code needs to see every block). It is
+   turned on by thd_init() with THD_MALLOC_TCACHE. */
+#ifndef KM_DBG
+
+/* Largest chunk size (including overhead) that the cache will hold. */
+#define TCACHE_MAX_SIZE     256
+
+/* Largest request that maps to a cacheable chunk size. */
+#define TCACHE_MAX_REQUEST  (TCACHE_MAX_SIZE - SIZE_SZ)
+
+/* One bin per possible chunk size up to TCACHE_MAX_SIZE. */
+#define TCACHE_BINS         (TCACHE_MAX_SIZE / MALLOC_ALIGNMENT + 1)
+
+/* Maximum number of chunks in one bin before a batch goes back. */
+#define TCACHE_BIN_MAX      8
+
+/* Maximum number of bytes held by one thread before a batch goes back. */
+#define TCACHE_MAX_BYTES    4096
+
+/* Number of chunks moved per trip to the global heap. */
+#define TCACHE_BATCH        4
+
+typedef struct malloc_tcache {
+    LIST_ENTRY(malloc_tcache) list;
+    Void_t          *bins[TCACHE_BINS];
+    uint16          counts[TCACHE_BINS];
+    size_t          bytes;
+} malloc_tcache_t;
+
+static LIST_HEAD(tcache_list, malloc_tcache) tcache_list;
+static int tcache_enabled = 0;
+
+static malloc_tcache_t *tcache_get(void);
+static Void_t *tcache_malloc(malloc_tcache_t *tc, size_t bytes);
+static int tcache_free(malloc_tcache_t *tc, Void_t *m);
+static size_t tcache_held(void);
+
+#endif  /* !KM_DBG */
+
 
 /************************** Debug Stuff **************************/
 
@@ -1681,6 +1735,18 @@ Void_t* public_mALLOc(size_t bytes) {
 #ifdef KM_DBG
     uint32 rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     memctl_t * ctl;
+#else
+    uint32 rv = arch_get_ret_addr();
+    malloc_tcache_t *tc;
+
+    if(bytes <= TCACHE_MAX_REQUEST && (tc = tcache_get()) != NULL) {
+        m = tcache_malloc(tc, bytes);
+
+        if(m)
+            MPROF_HOOK(MPROF_OP_MALLOC, m, bytes, rv);
+
+        return m;
+    }
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -1729,6 +1795,9 @@ Void_t* public_mALLOc(size_t bytes) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+    if(m)
+        MPROF_HOOK(MPROF_OP_MALLOC, m, bytes, rv);
+
     return m;
 }
 
@@ -1737,12 +1806,22 @@ void public_fREe(Void_t* m) {
     uint32 rv = arch_get_ret_addr(), *nt, i;
     memctl_t * ctl;
     int dmg = 0;
+#else
+    uint32 rv = arch_get_ret_addr();
+    malloc_tcache_t *tc;
 #endif
 
     /* standard C says if block is NULL, do not try to free it */
     if(m == NULL)
         return;
 
+    MPROF_HOOK(MPROF_OP_FREE, m, 0, rv);
+
+#ifndef KM_DBG
+    if((tc = tcache_get()) != NULL && !tcache_free(tc, m))
+        return;
+#endif
+
     if(MALLOC_PREACTION != 0) {
         return;
     }
@@ -1899,7 +1978,10 @@ Void_t* public_rEALLOc(Void_t* m, size_t bytes) {
     uint32 rv = arch_get_ret_addr(), rs, *nt, i;
     memctl_t * ctl;
     int dmg = 0;
+#else
+    uint32 rv = arch_get_ret_addr();
 #endif
+    Void_t *old = m;
 
     if(MALLOC_PREACTION != 0) {
         return 0;
@@ -2019,6 +2101,18 @@ Void_t* public_rEALLOc(Void_t* m, size_t bytes) {
     m = rEALLOc(m, bytes);
 #endif
 
+    /* A failed realloc leaves the old block alone; anything else retires
+       it, even if the new block ends up at the same address. Both records
+       go in before the lock is dropped, so nothing else can be handed the
+       old block (and have that recorded) in between. */
+    if(m || !bytes) {
+        if(old)
+            MPROF_HOOK(MPROF_OP_FREE, old, 0, rv);
+
+        if(m)
+            MPROF_HOOK(MPROF_OP_REALLOC, m, bytes, rv);
+    }
+
     if(MALLOC_POSTACTION != 0) {
     }
 
@@ -2031,6 +2125,8 @@ Void_t* public_mEMALIGn(size_t alignment, size_t bytes) {
 #ifdef KM_DBG
     uint32 rv = arch_get_ret_addr(), rs, *nt1, *nt2, i;
     memctl_t * ctl;
+#else
+    uint32 rv = arch_get_ret_addr();
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -2080,6 +2176,9 @@ Void_t* public_mEMALIGn(size_t alignment, size_t bytes) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+    if(m)
+        MPROF_HOOK(MPROF_OP_MEMALIGN, m, bytes, rv);
+
     return m;
 }
 
@@ -2106,6 +2205,21 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     uint32 rv = arch_get_ret_addr(), *nt1, *nt2, i, rs;
     size_t bytes = n * elem_size;
     memctl_t * ctl;
+#else
+    uint32 rv = arch_get_ret_addr();
+    malloc_tcache_t *tc;
+
+    /* Both factors are small here, so the product can't overflow. */
+    if(n <= TCACHE_MAX_REQUEST && elem_size <= TCACHE_MAX_REQUEST &&
+            n * elem_size <= TCACHE_MAX_REQUEST &&
+            (tc = tcache_get()) != NULL) {
+        if((m = tcache_malloc(tc, n * elem_size)) != NULL) {
+            memset(m, 0, n * elem_size);
+            MPROF_HOOK(MPROF_OP_CALLOC, m, n * elem_size, rv);
+        }
+
+        return m;
+    }
 #endif
 
     if(MALLOC_PREACTION != 0) {
@@ -2155,6 +2269,9 @@ Void_t* public_cALLOc(size_t n, size_t elem_size) {
     if(MALLOC_POSTACTION != 0) {
     }
 
+    if(m)
+        MPROF_HOOK(MPROF_OP_CALLOC, m, n * elem_size, rv);
+
     return m;
 }
 
@@ -5198,6 +5315,181 @@ size_t mUSABLe(mem) Void_t* mem;
     return 0;
 }
 
+/*
+  ------------------------- KOS thread cache -------------------------
+*/
+
+#ifndef KM_DBG
+
+/* Return the calling thread's cache, creating it on first use. Returns NULL
+   if the cache is disabled or can't be used from this context. */
+static malloc_tcache_t *tcache_get(void) {
+    kthread_t *cur = thd_current;
+    malloc_tcache_t *tc;
+
+    if(!tcache_enabled || !cur || irq_inside_int())
+        return NULL;
+
+    if((tc = (malloc_tcache_t *)cur->malloc_cache) != NULL)
+        return tc;
+
+    if(MALLOC_PREACTION != 0)
+        return NULL;
+
+    tc = (malloc_tcache_t *)mALLOc(sizeof(malloc_tcache_t));
+
+    if(tc) {
+        memset(tc, 0, sizeof(malloc_tcache_t));
+        LIST_INSERT_HEAD(&tcache_list, tc, list);
+    }
+
+    if(MALLOC_POSTACTION != 0) {
+    }
+
+    cur->malloc_cache = tc;
+    return tc;
+}
+
+/* Push a chunk onto its bin. The caller has checked that it fits. */
+static inline void tcache_push(malloc_tcache_t *tc, Void_t *m, size_t sz) {
+    int idx = sz / MALLOC_ALIGNMENT;
+
+    *(Void_t **)m = tc->bins[idx];
+    tc->bins[idx] = m;
+    ++tc->counts[idx];
+    tc->bytes += sz;
+}
+
+/* Send up to cnt chunks from one bin back to the global heap. Called with the
+   malloc lock held. */
+static void tcache_drain(malloc_tcache_t *tc, int idx, int cnt) {
+    Void_t *m;
+
+    while(cnt-- && (m = tc->bins[idx]) != NULL) {
+        tc->bins[idx] = *(Void_t **)m;
+        --tc->counts[idx];
+        tc->bytes -= idx * MALLOC_ALIGNMENT;
+        fREe(m);
+    }
+}
+
+static Void_t *tcache_malloc(malloc_tcache_t *tc, size_t bytes) {
+    int idx = request2size(bytes) / MALLOC_ALIGNMENT, i;
+    Void_t *m, *extra;
+    size_t sz;
+
+    /* Fast path: nothing but a list pop. */
+    if((m = tc->bins[idx]) != NULL) {
+        tc->bins[idx] = *(Void_t **)m;
+        --tc->counts[idx];
+        tc->bytes -= idx * MALLOC_ALIGNMENT;
+        return m;
+    }
+
+    /* Miss: grab a batch from the heap under a single lock. The first chunk
+       goes to the caller, the rest are cached by their real size (dlmalloc
+       may hand back a slightly bigger chunk than asked for). */
+    if(MALLOC_PREACTION != 0)
+        return 0;
+
+    m = mALLOc(bytes);
+
+    for(i = 1; m && i < TCACHE_BATCH; ++i) {
+        if(tc->bytes >= TCACHE_MAX_BYTES)
+            break;
+
+        if(!(extra = mALLOc(bytes)))
+            break;
+
+        sz = chunksize(mem2chunk(extra));
+
+        if(sz <= TCACHE_MAX_SIZE &&
+                tc->counts[sz / MALLOC_ALIGNMENT] < TCACHE_BIN_MAX)
+            tcache_push(tc, extra, sz);
+        else
+            fREe(extra);
+    }
+
+    if(MALLOC_POSTACTION != 0) {
+    }
+
+    return m;
+}
+
+/* Returns 0 if the chunk was taken by the cache, -1 if the caller should free
+   it to the global heap itself. */
+static int tcache_free(malloc_tcache_t *tc, Void_t *m) {
+    size_t sz = chunksize(mem2chunk(m));
+    int idx;
+
+    if(sz > TCACHE_MAX_SIZE)
+        return -1;
+
+    tcache_push(tc, m, sz);
+    idx = sz / MALLOC_ALIGNMENT;
+
+    /* Over one of the limits? Hand a batch of this size back. */
+    if(tc->counts[idx] > TCACHE_BIN_MAX || tc->bytes > TCACHE_MAX_BYTES) {
+        if(MALLOC_PREACTION != 0)
+            return 0;
+
+        tcache_drain(tc, idx, TCACHE_BATCH);
+
+        if(MALLOC_POSTACTION != 0) {
+        }
+    }
+
+    return 0;
+}
+
+/* Total bytes sitting in all thread caches. Called with the malloc lock
+   held, which keeps the list stable; the per-cache counts are only ever
+   written by their owning thread. */
+static size_t tcache_held(void) {
+    malloc_tcache_t *tc;
+    size_t total = 0;
+
+    LIST_FOREACH(tc, &tcache_list, list) {
+        total += tc->bytes;
+    }
+
+    return total;
+}
+
+#endif  /* !KM_DBG */
+
+void malloc_tcache_enable(int enable) {
+#ifndef KM_DBG
+    tcache_enabled = enable;
+#else
+    (void)enable;
+#endif
+}
+
+void malloc_tcache_release(void *cache) {
+#ifndef KM_DBG
+    malloc_tcache_t *tc = (malloc_tcache_t *)cache;
+    int i;
+
+    if(!tc)
+        return;
+
+    if(MALLOC_PREACTION != 0)
+        return;
+
+    for(i = 0; i < TCACHE_BINS; ++i)
+        tcache_drain(tc, i, tc->counts[i]);
+
+    LIST_REMOVE(tc, list);
+    fREe(tc);
+
+    if(MALLOC_POSTACTION != 0) {
+    }
+#else
+    (void)cache;
+#endif
+}
+
 /*
   ------------------------------ mallinfo ------------------------------
 */
@@ -5245,6 +5537,12 @@ struct mallinfo mALLINFo() {
         }
     }
 
+#ifndef KM_DBG
+    /* Chunks parked in thread caches look allocated to dlmalloc, but they're
+       really free space as far as the user is concerned. */
+    avail += tcache_held();
+#endif
+
     mi.smblks = nfastblocks;
     mi.ordblks = nblocks;
     mi.fordblks = avail;
@@ -5286,6 +5584,12 @@ void mSTATs() {
     fprintf(stderr, "in use bytes     = %10lu\n",
             (CHUNK_SIZE_T)(mi.uordblks + mi.hblkhd));
 
+#ifndef KM_DBG
+    if(!LIST_EMPTY(&tcache_list))
+        fprintf(stderr, "thd cache bytes  = %10lu\n",
+                (CHUNK_SIZE_T)tcache_held());
+#endif
+
 #ifdef WIN32
     {
         CHUNK_SIZE_T  kernel, user;
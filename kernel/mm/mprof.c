@@ -0,0 +1,410 @@
+/* KallistiOS ##version##
+
+   mprof.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <kos/mprof.h>
+#include <kos/fs.h>
+#include <kos/dbglog.h>
+#include <kos/thread.h>
+#include <arch/irq.h>
+#include <arch/timer.h>
+
+/*
+
+Heap allocation profiler. malloc() and friends call mprof_record() (through
+MPROF_HOOK) for each successful operation. free() records a block before
+releasing it, and realloc() records both of its blocks before dropping the
+malloc lock, so a block is never seen being handed out again before its
+free has been recorded. Each call appends a record to a ring buffer and
+updates two hash tables:
+
+  - A call site table, keyed by the caller's return address, holding the
+    allocation counters for that site. Sites that don't fit are charged to
+    a single "other" site with a PC of zero.
+
+  - A live block table, keyed by block address, remembering the size and
+    site of every block allocated while profiling. free() looks blocks up
+    here to credit the bytes back to the right site. Blocks allocated before
+    profiling started aren't in the table and are simply ignored on free.
+
+Both tables use open addressing with linear probing, and are sized once in
+mprof_start(); nothing in the recording path allocates memory, so it can't
+recurse into malloc().
+
+While mprof_dump() is writing a file, the dumping thread's own operations
+are ignored, and the other threads' still go into the tables but not into
+the ring (which is being written out). Those records are counted as lost in
+the next dump.
+
+*/
+
+/* Number of call site slots. At most 3/4 of these are used. */
+#define MPROF_SITES     1024
+#define SITE_OTHER      0xffff
+
+typedef struct live_blk {
+    uint32      ptr;        /* Block address, or 0 if the slot is empty */
+    uint32      size;       /* Requested size */
+    uint32      site;       /* Index into sites, or SITE_OTHER */
+} live_blk_t;
+
+volatile int mprof_active = 0;
+
+static mprof_rec_t *ring;
+static uint32 ring_size, ring_head, ring_total;
+
+static mprof_site_t *sites;
+static mprof_site_t site_other;
+static uint32 site_count;
+
+static live_blk_t *live;
+static uint32 live_mask, live_max, live_count, untracked;
+
+static uint64 start_time;
+
+/* The thread in mprof_dump(), if any, and the records skipped meanwhile. */
+static kthread_t *dumper;
+static uint32 dump_skipped;
+
+/* The end of the program, where the heap starts (see mm.c). */
+extern unsigned long end;
+
+static inline uint32 hash_addr(uint32 a) {
+    return (a >> 1) * 0x9e3779b1;
+}
+
+static inline uint32 live_home(uint32 ptr) {
+    return (hash_addr(ptr >> 2) >> 8) & live_mask;
+}
+
+/* Find or create the site for a PC. Called with interrupts disabled. */
+static mprof_site_t *site_get(uint32 pc, uint32 *idx) {
+    uint32 i = (hash_addr(pc) >> 12) & (MPROF_SITES - 1);
+
+    while(sites[i].pc) {
+        if(sites[i].pc == pc) {
+            *idx = i;
+            return sites + i;
+        }
+
+        i = (i + 1) & (MPROF_SITES - 1);
+    }
+
+    if(!pc || site_count >= MPROF_SITES * 3 / 4) {
+        *idx = SITE_OTHER;
+        return &site_other;
+    }
+
+    ++site_count;
+    sites[i].pc = pc;
+    *idx = i;
+    return sites + i;
+}
+
+static void live_insert(uint32 ptr, uint32 size, uint32 site) {
+    uint32 i;
+
+    if(live_count >= live_max) {
+        ++untracked;
+        return;
+    }
+
+    i = live_home(ptr);
+
+    while(live[i].ptr)
+        i = (i + 1) & live_mask;
+
+    live[i].ptr = ptr;
+    live[i].size = size;
+    live[i].site = site;
+    ++live_count;
+}
+
+/* Remove a block from the live table, filling the hole by shifting later
+   entries of the same probe run back so lookups never need tombstones. */
+static int live_remove(uint32 ptr, live_blk_t *out) {
+    uint32 i, j, k;
+
+    i = live_home(ptr);
+
+    while(live[i].ptr != ptr) {
+        if(!live[i].ptr)
+            return -1;
+
+        i = (i + 1) & live_mask;
+    }
+
+    *out = live[i];
+    --live_count;
+
+    for(j = (i + 1) & live_mask; live[j].ptr; j = (j + 1) & live_mask) {
+        k = live_home(live[j].ptr);
+
+        /* Leave the entry alone if its home is cyclically in (i, j]. */
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        live[i] = live[j];
+        i = j;
+    }
+
+    live[i].ptr = 0;
+    return 0;
+}
+
+void mprof_record(int op, void *ptr, size_t size, uint32 pc) {
+    mprof_rec_t *r;
+    mprof_site_t *s;
+    live_blk_t blk;
+    uint32 idx;
+    uint64 now;
+    int old;
+
+    old = irq_disable();
+
+    if(!mprof_active || (dumper && thd_current == dumper)) {
+        irq_restore(old);
+        return;
+    }
+
+    if(op == MPROF_OP_FREE) {
+        if(!live_remove((uint32)ptr, &blk)) {
+            s = blk.site == SITE_OTHER ? &site_other : sites + blk.site;
+            s->frees++;
+            s->live_bytes -= blk.size;
+            size = blk.size;
+        }
+        else {
+            size = 0;
+        }
+    }
+    else {
+        s = site_get(pc, &idx);
+        s->allocs++;
+        s->total_bytes += size;
+        s->live_bytes += size;
+
+        if(s->live_bytes > s->peak_bytes)
+            s->peak_bytes = s->live_bytes;
+
+        live_insert((uint32)ptr, size, idx);
+    }
+
+    if(dumper) {
+        ++dump_skipped;
+        irq_restore(old);
+        return;
+    }
+
+    now = timer_us_gettime64() - start_time;
+
+    r = ring + ring_head;
+    r->time = (uint32)now;
+    r->time_hi = (uint32)(now >> 32);
+    r->pc = pc;
+    r->ptr = (uint32)ptr;
+    r->size = ((uint32)op << 28) | (size & 0x0fffffff);
+
+    if(++ring_head == ring_size)
+        ring_head = 0;
+
+    ++ring_total;
+
+    irq_restore(old);
+}
+
+static void mprof_free_bufs(void) {
+    free(ring);
+    free(sites);
+    free(live);
+    ring = NULL;
+    sites = NULL;
+    live = NULL;
+}
+
+int mprof_start(size_t ring_entries, size_t live_entries) {
+    uint32 lsz;
+    int old;
+
+    if(mprof_active || dumper || !ring_entries || !live_entries) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Throw away the results of any previous run. */
+    mprof_free_bufs();
+
+    /* Keep the live table at most 3/4 full. */
+    for(lsz = 16; lsz < live_entries + live_entries / 3; lsz <<= 1)
+        ;
+
+    ring = (mprof_rec_t *)malloc(ring_entries * sizeof(mprof_rec_t));
+    sites = (mprof_site_t *)calloc(MPROF_SITES, sizeof(mprof_site_t));
+    live = (live_blk_t *)calloc(lsz, sizeof(live_blk_t));
+
+    if(!ring || !sites || !live) {
+        mprof_free_bufs();
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&site_other, 0, sizeof(site_other));
+
+    old = irq_disable();
+    ring_size = ring_entries;
+    ring_head = ring_total = 0;
+    site_count = 0;
+    live_mask = lsz - 1;
+    live_max = live_entries;
+    live_count = untracked = 0;
+    dump_skipped = 0;
+    start_time = timer_us_gettime64();
+    mprof_active = 1;
+    irq_restore(old);
+
+    return 0;
+}
+
+void mprof_stop(void) {
+    mprof_active = 0;
+}
+
+void mprof_shutdown(void) {
+    mprof_stop();
+    mprof_free_bufs();
+}
+
+static int dump_write(file_t fd, const void *buf, size_t len) {
+    if(!len)
+        return 0;
+
+    return fs_write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+int mprof_dump(const char *fn) {
+    mprof_hdr_t hdr;
+    mprof_site_t site;
+    struct mallinfo mi;
+    file_t fd;
+    uint32 i, first, n, nsites;
+    int old, other, rv = -1;
+
+    old = irq_disable();
+
+    if(!ring || dumper) {
+        irq_restore(old);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Stop recording into the ring while it's written out, and ignore our
+       own file I/O altogether. Everyone else's operations still go into
+       the tables. */
+    dumper = thd_current;
+    n = ring_total < ring_size ? ring_total : ring_size;
+    first = ring_total < ring_size ? 0 : ring_head;
+
+    hdr.magic = MPROF_MAGIC;
+    hdr.version = MPROF_VERSION;
+    hdr.rec_count = n;
+    hdr.rec_lost = ring_total - n + dump_skipped;
+    hdr.untracked = untracked;
+    hdr.heap_base = ((uint32)&end / 4) * 4 + 4;
+
+    nsites = site_count;
+    other = site_other.allocs != 0;
+    hdr.site_count = nsites + other;
+
+    irq_restore(old);
+
+    if((fd = fs_open(fn, O_WRONLY | O_TRUNC)) < 0) {
+        dbglog(DBG_ERROR, "mprof_dump: can't open '%s'\n", fn);
+        goto out;
+    }
+
+    mi = mallinfo();
+    hdr.heap_size = mi.arena;
+
+    if(dump_write(fd, &hdr, sizeof(hdr)))
+        goto err;
+
+    /* Records go out oldest first, which means two pieces once the ring
+       has wrapped around. */
+    if(dump_write(fd, ring + first, (n - first) * sizeof(mprof_rec_t)) ||
+            dump_write(fd, ring, first * sizeof(mprof_rec_t)))
+        goto err;
+
+    /* The sites can still change (or be added) underneath us, so each is
+       copied out with interrupts off, and only as many as the header
+       promised are written. */
+    for(i = 0; i < MPROF_SITES && nsites; ++i) {
+        old = irq_disable();
+        site = sites[i];
+        irq_restore(old);
+
+        if(!site.pc)
+            continue;
+
+        if(dump_write(fd, &site, sizeof(mprof_site_t)))
+            goto err;
+
+        --nsites;
+    }
+
+    if(other) {
+        old = irq_disable();
+        site = site_other;
+        irq_restore(old);
+
+        if(dump_write(fd, &site, sizeof(mprof_site_t)))
+            goto err;
+    }
+
+    rv = 0;
+
+err:
+    fs_close(fd);
+
+    if(rv)
+        dbglog(DBG_ERROR, "mprof_dump: error writing '%s'\n", fn);
+
+out:
+    dumper = NULL;
+    return rv;
+}
+
+int mprof_pslist(int (*pf)(const char *fmt, ...)) {
+    uint32 i;
+    int old;
+
+    old = irq_disable();
+
+    pf("Heap profile (%lu records, %lu live blocks, %lu untracked):\n",
+       ring_total, live_count, untracked);
+    pf("pc\t\tallocs\tfrees\tlive\tpeak\ttotal\n");
+
+    for(i = 0; sites && i < MPROF_SITES; ++i) {
+        if(!sites[i].live_bytes)
+            continue;
+
+        pf("%08lx\t%lu\t%lu\t%lu\t%lu\t%lu\n", sites[i].pc,
+           sites[i].allocs, sites[i].frees, sites[i].live_bytes,
+           sites[i].peak_bytes, sites[i].total_bytes);
+    }
+
+    if(site_other.live_bytes)
+        pf("other\t\t%lu\t%lu\t%lu\t%lu\t%lu\n", site_other.allocs,
+           site_other.frees, site_other.live_bytes, site_other.peak_bytes,
+           site_other.total_bytes);
+
+    pf("--end of list--\n");
+    irq_restore(old);
+
+    return 0;
+}
@@ -0,0 +1,340 @@
+/* KallistiOS ##version##
+
+   slab.c
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/queue.h>
+#include <kos/slab.h>
+#include <kos/dbglog.h>
+#include <arch/irq.h>
+#include <arch/cache.h>
+
+/*
+
+Fixed-size object caches. Each cache owns a set of slabs; a slab is a single
+power-of-two sized block from memalign(), aligned to its own size, with a
+small header at the start and the objects packed in after it. Because of the
+alignment, the slab an object belongs to can be found just by masking the
+object's address, so freeing never has to search.
+
+Slabs live on one of three lists per cache: full, partial and empty.
+Allocation always comes from a partial slab if there is one, which keeps the
+number of live slabs low. One empty slab is kept around to avoid thrashing;
+any more than that go straight back to the heap.
+
+Everything is protected by disabling interrupts, just like the rest of the
+core kernel structures, since these caches hold things that get allocated
+from interrupt context (network buffers and the like).
+
+*/
+
+/* Slab size limits. The allocator tries to fit at least SLAB_MIN_OBJS objects
+   in each slab, but only grows the slab up to SLAB_GROW_SIZE to do so; big
+   objects (like threads) just get fewer per slab, since a large, self-aligned
+   memalign() is hard on the heap. Past that, a slab only grows (up to
+   SLAB_MAX_SIZE) if not even one object fits. */
+#define SLAB_MIN_SIZE   1024
+#define SLAB_GROW_SIZE  4096
+#define SLAB_MAX_SIZE   16384
+#define SLAB_MIN_OBJS   8
+
+typedef struct slab {
+    LIST_ENTRY(slab)    list;       /* Which list we're on in the cache */
+    slab_cache_t        *cache;     /* The cache we belong to */
+    void                *free;      /* Free objects in this slab */
+    uint32              inuse;      /* Number of allocated objects */
+} slab_t;
+
+LIST_HEAD(slab_list, slab);
+
+struct slab_cache {
+    LIST_ENTRY(slab_cache)  list;
+    const char          *name;
+    int                 flags;
+    void                (*ctor)(void *obj);
+
+    size_t              obj_size;   /* Object size, with padding */
+    size_t              slab_size;  /* Size of each slab */
+    size_t              first;      /* Offset of the first object */
+    uint32              per_slab;   /* Objects per slab */
+
+    struct slab_list    full;
+    struct slab_list    partial;
+    struct slab_list    empty;
+    uint32              nempty;
+
+    slab_stats_t        stats;
+};
+
+static LIST_HEAD(slab_cache_list, slab_cache) cache_list =
+    LIST_HEAD_INITIALIZER(cache_list);
+
+#define ALIGN_UP(x, a)  (((x) + (a) - 1) & ~((a) - 1))
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, int flags,
+                                void (*ctor)(void *obj)) {
+    slab_cache_t *c;
+    size_t align, first, ssz;
+    int old;
+
+    if(!size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Figure out the layout of a slab. Objects need to be big enough to hold
+       the free list link, and aligned at least as well as malloc would. */
+    align = (flags & SLAB_CACHE_ALIGN) ? CPU_CACHE_BLOCK_SIZE : 8;
+
+    if(size < sizeof(void *))
+        size = sizeof(void *);
+
+    size = ALIGN_UP(size, align);
+    first = ALIGN_UP(sizeof(slab_t), align);
+
+    for(ssz = SLAB_MIN_SIZE; ssz < SLAB_MAX_SIZE; ssz <<= 1) {
+        if((ssz - first) / size >= SLAB_MIN_OBJS)
+            break;
+
+        if(ssz >= SLAB_GROW_SIZE && ssz - first >= size)
+            break;
+    }
+
+    if(ssz - first < size) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(c = (slab_cache_t *)malloc(sizeof(slab_cache_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(slab_cache_t));
+    c->name = name;
+    c->flags = flags;
+    c->ctor = ctor;
+    c->obj_size = size;
+    c->slab_size = ssz;
+    c->first = first;
+    c->per_slab = (ssz - first) / size;
+    LIST_INIT(&c->full);
+    LIST_INIT(&c->partial);
+    LIST_INIT(&c->empty);
+
+    c->stats.obj_size = size;
+    c->stats.slab_size = ssz;
+
+    old = irq_disable();
+    LIST_INSERT_HEAD(&cache_list, c, list);
+    irq_restore(old);
+
+    return c;
+}
+
+static void slab_list_free(struct slab_list *l) {
+    slab_t *s, *n;
+
+    s = LIST_FIRST(l);
+
+    while(s) {
+        n = LIST_NEXT(s, list);
+        free(s);
+        s = n;
+    }
+
+    LIST_INIT(l);
+}
+
+void slab_cache_destroy(slab_cache_t *c) {
+    int old;
+
+    if(!c)
+        return;
+
+    old = irq_disable();
+    LIST_REMOVE(c, list);
+    irq_restore(old);
+
+    if(c->stats.objs_inuse)
+        dbglog(DBG_KDEBUG, "slab_cache_destroy: cache '%s' still has %lu "
+               "objects in use\n", c->name, c->stats.objs_inuse);
+
+    slab_list_free(&c->full);
+    slab_list_free(&c->partial);
+    slab_list_free(&c->empty);
+    free(c);
+}
+
+/* Allocate and set up a fresh slab. Called with interrupts disabled. */
+static slab_t *slab_grow(slab_cache_t *c) {
+    slab_t *s;
+    uint8 *obj;
+    uint32 i;
+
+    if(irq_inside_int() && !malloc_irq_safe())
+        return NULL;
+
+    if(!(s = (slab_t *)memalign(c->slab_size, c->slab_size)))
+        return NULL;
+
+    s->cache = c;
+    s->inuse = 0;
+    s->free = NULL;
+
+    /* Build the free list backwards so objects come out in address order. */
+    obj = (uint8 *)s + c->first + (c->per_slab - 1) * c->obj_size;
+
+    for(i = 0; i < c->per_slab; ++i, obj -= c->obj_size) {
+        if(c->ctor)
+            c->ctor(obj);
+
+        *(void **)obj = s->free;
+        s->free = obj;
+    }
+
+    c->stats.slabs++;
+    c->stats.objs_total += c->per_slab;
+
+    return s;
+}
+
+void *slab_alloc(slab_cache_t *c) {
+    slab_t *s;
+    void *obj;
+    int old;
+
+    old = irq_disable();
+
+    if((s = LIST_FIRST(&c->partial)) == NULL) {
+        if((s = LIST_FIRST(&c->empty)) != NULL) {
+            LIST_REMOVE(s, list);
+            --c->nempty;
+        }
+        else if((s = slab_grow(c)) == NULL) {
+            c->stats.failures++;
+            irq_restore(old);
+            return NULL;
+        }
+
+        LIST_INSERT_HEAD(&c->partial, s, list);
+    }
+
+    obj = s->free;
+    s->free = *(void **)obj;
+
+    if(++s->inuse == c->per_slab) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&c->full, s, list);
+    }
+
+    c->stats.allocs++;
+
+    if(++c->stats.objs_inuse > c->stats.objs_peak)
+        c->stats.objs_peak = c->stats.objs_inuse;
+
+    irq_restore(old);
+
+    if(c->flags & SLAB_ZERO)
+        memset(obj, 0, c->obj_size);
+
+    return obj;
+}
+
+void slab_free(slab_cache_t *c, void *obj) {
+    slab_t *s;
+    int old;
+
+    if(!obj)
+        return;
+
+    s = (slab_t *)((ptr_t)obj & ~(ptr_t)(c->slab_size - 1));
+    assert(s->cache == c);
+
+    old = irq_disable();
+
+    *(void **)obj = s->free;
+    s->free = obj;
+
+    /* Move the slab to the right list, if it changed state. */
+    if(s->inuse-- == c->per_slab) {
+        LIST_REMOVE(s, list);
+        LIST_INSERT_HEAD(&c->partial, s, list);
+    }
+
+    if(!s->inuse) {
+        LIST_REMOVE(s, list);
+
+        if(!c->nempty || !malloc_irq_safe()) {
+            LIST_INSERT_HEAD(&c->empty, s, list);
+            ++c->nempty;
+            s = NULL;
+        }
+        else {
+            c->stats.slabs--;
+            c->stats.objs_total -= c->per_slab;
+        }
+    }
+    else {
+        s = NULL;
+    }
+
+    c->stats.frees++;
+    c->stats.objs_inuse--;
+
+    if(s)
+        free(s);
+
+    irq_restore(old);
+}
+
+size_t slab_cache_shrink(slab_cache_t *c) {
+    size_t rv;
+    int old;
+
+    old = irq_disable();
+    rv = c->nempty * c->slab_size;
+    c->stats.slabs -= c->nempty;
+    c->stats.objs_total -= c->nempty * c->per_slab;
+    c->nempty = 0;
+    slab_list_free(&c->empty);
+    irq_restore(old);
+
+    return rv;
+}
+
+void slab_cache_stats(slab_cache_t *c, slab_stats_t *stats) {
+    int old;
+
+    old = irq_disable();
+    memcpy(stats, &c->stats, sizeof(slab_stats_t));
+    irq_restore(old);
+}
+
+int slab_pslist(int (*pf)(const char *fmt, ...)) {
+    slab_cache_t *c;
+    int old;
+
+    old = irq_disable();
+
+    pf("Object caches:\n");
+    pf("name\t\t\tsize\tslab\tslabs\tinuse\ttotal\tpeak\tfails\n");
+
+    LIST_FOREACH(c, &cache_list, list) {
+        pf("%-20s\t%u\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\n", c->name,
+           c->stats.obj_size, c->stats.slab_size, c->stats.slabs,
+           c->stats.objs_inuse, c->stats.objs_total, c->stats.objs_peak,
+           c->stats.failures);
+    }
+
+    pf("--end of list--\n");
+    irq_restore(old);
+
+    return 0;
+}
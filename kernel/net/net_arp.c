@@ -9,15 +9,27 @@
 #include <string.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <errno.h>
 #include <kos/net.h>
 #include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/slab.h>
+#include <arch/irq.h>
 
 #include "net_ipv4.h"
+#include "net_thd.h"
 
 /*
 
   ARP handling system
 
+  Entries are kept in a small hash table keyed on the IP address. An entry
+  that hasn't been resolved yet holds on to the last few packets sent to it,
+  and they go out as soon as the reply comes in. Retrying unanswered queries,
+  expiring old entries and re-querying entries that are still in use before
+  they expire are all done once a second from the network timer, rather than
+  on every lookup.
+
 */
 
 /* ARP Packet Structre */
@@ -35,11 +47,31 @@ typedef struct {
 } packed arp_pkt_t;
 #undef packed
 
+#define ARP_HASH_SIZE   32          /* Must be a power of two */
+#define ARP_QUEUE_MAX   4           /* Packets held per unresolved entry */
+#define ARP_QUERY_MAX   16          /* Queries sent per tick, at most */
+#define ARP_TICK        1000        /* Milliseconds between maintenance runs */
+
+#define ARP_EXPIRE      (120 * HZ)  /* Lifetime of a confirmed entry */
+#define ARP_REFRESH     (100 * HZ)  /* Age at which in-use entries are
+                                       queried again */
+#define ARP_ACTIVE      (60 * HZ)   /* An entry used this recently is in use */
+#define ARP_RETRY       HZ          /* Between queries for one address */
+#define ARP_TRIES       3           /* Unanswered queries before an entry is
+                                       dropped */
+
+/* A packet waiting for its destination's address to be resolved */
+typedef struct arp_pending {
+    ip_hdr_t            hdr;
+    int                 data_size;
+    uint8               data[];
+} arp_pending_t;
+
 /* Structure describing an ARP entry; each entry contains a MAC address,
    an IP address, and a timestamp from 'jiffies'. The timestamp allows
    aging and eventual removal. */
 typedef struct netarp {
-    /* ARP cache list handle */
+    /* Hash bucket handle */
     LIST_ENTRY(netarp)  ac_list;
 
     /* Mac address */
@@ -48,17 +80,25 @@ typedef struct netarp {
     /* Associated IP address */
     uint8               ip[4];
 
-    /* Cache entry time; if zero, this entry won't expire */
+    /* Non-zero once the MAC address is known */
+    int                 resolved;
+
+    /* When the entry was last confirmed; if zero, this entry won't expire */
     uint32              timestamp;
 
-    /* Optional packet to send when the entry is filled in */
-    ip_hdr_t            *pkt;
+    /* When the entry was last looked up, and last queried */
+    uint32              used;
+    uint32              queried;
 
-    /* Additional data for that packet, if any */
-    uint8               *data;
+    /* Queries sent since the entry was last confirmed */
+    int                 tries;
 
-    /* Size of the additional data for the packet */
-    int                 data_size;
+    /* The device to send queries on */
+    netif_t             *nif;
+
+    /* Packets to send when the entry is filled in, oldest first */
+    arp_pending_t       *pending[ARP_QUEUE_MAX];
+    int                 qlen;
 } netarp_t;
 
 /* Define the list type */
@@ -68,177 +108,311 @@ LIST_HEAD(netarp_list, netarp);
 /* Variables */
 
 /* ARP cache */
-struct netarp_list net_arp_cache = LIST_HEAD_INITIALIZER(0);
+static struct netarp_list arp_hash[ARP_HASH_SIZE];
+static mutex_t arp_mutex = MUTEX_INITIALIZER;
+static net_arp_stats_t arp_stats;
+static int arp_cbid = -1;
+
+/* Where ARP entries come from */
+static slab_cache_t *net_arp_slab = NULL;
 
 /**************************************************************************/
 /* Cache management */
 
-/* Garbage collect timed out entries */
-static int net_arp_gc(netif_t *nif) {
+/* Lookups and inserts are often done inside an interrupt, where waiting for
+   the lock isn't an option. */
+static int arp_lock(void) {
+    if(irq_inside_int()) {
+        if(mutex_trylock(&arp_mutex) == -1) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+    }
+    else {
+        mutex_lock(&arp_mutex);
+    }
+
+    return 0;
+}
+
+static inline struct netarp_list *arp_bucket(const uint8 ip[4]) {
+    return &arp_hash[(ip[0] ^ ip[1] ^ ip[2] ^ ip[3]) & (ARP_HASH_SIZE - 1)];
+}
+
+static netarp_t *arp_find(const uint8 ip[4]) {
+    netarp_t *cur;
+
+    LIST_FOREACH(cur, arp_bucket(ip), ac_list) {
+        if(!memcmp(ip, cur->ip, 4))
+            return cur;
+    }
+
+    return NULL;
+}
+
+static netarp_t *arp_alloc(netif_t *nif, const uint8 ip[4]) {
+    netarp_t *cur;
+
+    if(!(cur = (netarp_t *)slab_alloc(net_arp_slab)))
+        return NULL;
+
+    memset(cur, 0, sizeof(netarp_t));
+    memcpy(cur->ip, ip, 4);
+    cur->nif = nif;
+    cur->timestamp = cur->queried = jiffies;
+    cur->used = jiffies - ARP_ACTIVE;
+    LIST_INSERT_HEAD(arp_bucket(ip), cur, ac_list);
+    ++arp_stats.entries;
+
+    return cur;
+}
+
+static void arp_free(netarp_t *cur) {
+    int i;
+
+    for(i = 0; i < cur->qlen; ++i)
+        free(cur->pending[i]);
+
+    arp_stats.queue_dropped += cur->qlen;
+    --arp_stats.entries;
+
+    LIST_REMOVE(cur, ac_list);
+    slab_free(net_arp_slab, cur);
+}
+
+/* Hold a copy of a packet until the entry is resolved. If the queue is full,
+   the oldest packet makes way for it. */
+static int arp_enqueue(netarp_t *cur, const ip_hdr_t *pkt, const uint8 *data,
+                       int data_size) {
+    arp_pending_t *p;
+
+    if(!(p = (arp_pending_t *)malloc(sizeof(arp_pending_t) + data_size)))
+        return -1;
+
+    memcpy(&p->hdr, pkt, sizeof(ip_hdr_t));
+    memcpy(p->data, data, data_size);
+    p->data_size = data_size;
+
+    if(cur->qlen == ARP_QUEUE_MAX) {
+        free(cur->pending[0]);
+        memmove(cur->pending, cur->pending + 1,
+                (ARP_QUEUE_MAX - 1) * sizeof(arp_pending_t *));
+        --cur->qlen;
+        ++arp_stats.queue_dropped;
+    }
+
+    cur->pending[cur->qlen++] = p;
+    ++arp_stats.queued;
+
+    return 0;
+}
+
+/* Should the entry be (re)queried? Unresolved entries are, as are entries in
+   use that are getting close to expiring. */
+static int arp_want_query(const netarp_t *cur, uint32 now) {
+    if(!cur->resolved)
+        return 1;
+
+    return cur->timestamp && now - cur->timestamp >= ARP_REFRESH &&
+           now - cur->used < ARP_ACTIVE;
+}
+
+/* Retry unanswered queries, expire old entries, and query the ones still in
+   use before they expire. An entry that doesn't answer a few queries in a row
+   is dropped, along with anything queued on it. The queries are sent once the
+   lock is dropped. */
+static void arp_thd_cb(void *data) {
+    struct {
+        netif_t *nif;
+        uint8 ip[4];
+    } q[ARP_QUERY_MAX];
     netarp_t *a1, *a2;
+    uint32 now = jiffies;
+    int i, nq = 0;
 
-    a1 = LIST_FIRST(&net_arp_cache);
+    (void)data;
 
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+    mutex_lock(&arp_mutex);
 
-        if(a1->timestamp) {
-            if(jiffies >= (a1->timestamp + 120 * HZ)) {
-                LIST_REMOVE(a1, ac_list);
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        a1 = LIST_FIRST(&arp_hash[i]);
 
-                if(a1->pkt) {
-                    free(a1->pkt);
-                    free(a1->data);
-                }
+        while(a1 != NULL) {
+            a2 = LIST_NEXT(a1, ac_list);
 
-                free(a1);
-                a1 = a2;
-                continue;
+            if(a1->resolved && a1->timestamp &&
+               now - a1->timestamp >= ARP_EXPIRE) {
+                ++arp_stats.expired;
+                arp_free(a1);
             }
+            else if(arp_want_query(a1, now) &&
+                    now - a1->queried >= ARP_RETRY) {
+                if(a1->tries >= ARP_TRIES) {
+                    ++arp_stats.expired;
+                    arp_free(a1);
+                }
+                else if(nq < ARP_QUERY_MAX) {
+                    q[nq].nif = a1->nif;
+                    memcpy(q[nq].ip, a1->ip, 4);
+                    ++nq;
+
+                    a1->queried = now;
+                    ++a1->tries;
 
-            /* If the entry is incomplete and it's been more than 5 seconds
-               since we queried it, try again. */
-            if(a1->mac[0] == 0 && a1->mac[1] == 0 && a1->mac[2] == 0 &&
-               a1->mac[3] == 0 && a1->mac[4] == 0 && a1->mac[5] == 0 &&
-               jiffies > (a1->timestamp + 5 * HZ)) {
-                net_arp_query(nif, a1->ip);
+                    if(a1->resolved)
+                        ++arp_stats.refreshes;
+                }
             }
-        }
 
-        a1 = a2;
+            a1 = a2;
+        }
     }
 
-    return 0;
+    mutex_unlock(&arp_mutex);
+
+    for(i = 0; i < nq; ++i)
+        net_arp_query(q[i].nif, q[i].ip);
 }
 
 /* Add an entry to the ARP cache manually */
 int net_arp_insert(netif_t *nif, const uint8 mac[6], const uint8 ip[4],
                    uint32 timestamp) {
+    arp_pending_t *pending[ARP_QUEUE_MAX];
     netarp_t *cur;
+    int i, n;
 
-    /* First make sure the entry isn't already there */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip, cur->ip, 4)) {
-            memcpy(cur->mac, mac, 6);
-            cur->timestamp = timestamp;
-
-            /* Send our queued packet, if we have one */
-            if(cur->pkt) {
-                net_ipv4_send_packet(nif, cur->pkt, cur->data, cur->data_size);
-                free(cur->pkt);
-                free(cur->data);
-
-                cur->pkt = NULL;
-                cur->data = NULL;
-                cur->data_size = 0;
-            }
+    if(arp_lock())
+        return -1;
 
-            return 0;
-        }
+    /* Update the entry if it's already there, or add one if it's not */
+    if(!(cur = arp_find(ip)) && !(cur = arp_alloc(nif, ip))) {
+        mutex_unlock(&arp_mutex);
+        return -1;
     }
 
-    /* It's not there, add an entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-    memcpy(cur->mac, mac, 6);
-    memcpy(cur->ip, ip, 4);
-    cur->timestamp = timestamp;
-    cur->pkt = NULL;
-    cur->data = NULL;
-    cur->data_size = 0;
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+    /* Don't let a reply make a permanent entry expire */
+    if(!cur->resolved || cur->timestamp)
+        cur->timestamp = timestamp;
 
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
+    memcpy(cur->mac, mac, 6);
+    cur->nif = nif;
+    cur->resolved = 1;
+    cur->tries = 0;
+
+    /* Take the queued packets, and send them once we've let go of the lock
+       (sending them looks the entry up again). */
+    n = cur->qlen;
+    memcpy(pending, cur->pending, n * sizeof(arp_pending_t *));
+    cur->qlen = 0;
+    arp_stats.queue_sent += n;
+
+    mutex_unlock(&arp_mutex);
+
+    for(i = 0; i < n; ++i) {
+        net_ipv4_send_packet(nif, &pending[i]->hdr, pending[i]->data,
+                             pending[i]->data_size);
+        free(pending[i]);
+    }
 
     return 0;
 }
 
 /* Look up an entry from the ARP cache; if no entry is found, then an ARP
-   query will be sent and an error will be returned. Thus your packet send
-   should also fail. Later when the transmit retries, hopefully the answer
-   will have arrived. */
+   query will be sent and the packet (if any) will be held until the reply
+   comes in. */
 int net_arp_lookup(netif_t *nif, const uint8 ip_in[4], uint8 mac_out[6],
                    const ip_hdr_t *pkt, const uint8 *data, int data_size) {
     netarp_t *cur;
+    int rv, new_entry = 0;
 
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
-
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip_in, cur->ip, 4)) {
-            if(cur->mac[0] == 0 && cur->mac[1] == 0 &&
-               cur->mac[2] == 0 && cur->mac[3] == 0 &&
-               cur->mac[4] == 0 && cur->mac[5] == 0) {
-                return -1;
-            }
+    memset(mac_out, 0, 6);
 
-            memcpy(mac_out, cur->mac, 6);
+    if(arp_lock())
+        return -1;
 
-            if(cur->timestamp != 0)
-                cur->timestamp = jiffies;
+    /* Look for the entry */
+    if((cur = arp_find(ip_in)) && cur->resolved) {
+        memcpy(mac_out, cur->mac, 6);
+        cur->used = jiffies;
+        ++arp_stats.hits;
 
-            return 0;
-        }
+        mutex_unlock(&arp_mutex);
+        return 0;
     }
 
+    ++arp_stats.misses;
+
     /* It's not there... Add an incomplete ARP entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-    memset(cur, 0, sizeof(netarp_t));
-    memcpy(cur->ip, ip_in, 4);
-    cur->timestamp = jiffies;
+    if(!cur) {
+        if(!(cur = arp_alloc(nif, ip_in))) {
+            mutex_unlock(&arp_mutex);
+            return -1;
+        }
 
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        cur->data = (uint8 *)malloc(data_size);
+        cur->tries = 1;
+        new_entry = 1;
+    }
 
-        if(cur->data) {
-            cur->pkt = (ip_hdr_t *)malloc(sizeof(ip_hdr_t));
+    cur->used = jiffies;
+    rv = new_entry ? -2 : -1;
 
-            if(!cur->pkt) {
-                free(cur->data);
-                cur->data = NULL;
-            }
-            else {
-                memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
-                cur->data_size = data_size;
-            }
-        }
-    }
+    /* Hold on to our packet if we have one. */
+    if(pkt && data && data_size)
+        rv = arp_enqueue(cur, pkt, data, data_size) ? -1 : -2;
 
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
+    mutex_unlock(&arp_mutex);
 
     /* Generate an ARP who-has packet */
-    net_arp_query(nif, ip_in);
+    if(new_entry)
+        net_arp_query(nif, ip_in);
 
-    /* Return failure */
-    memset(mac_out, 0, 6);
-    return -2;
+    return rv;
 }
 
 /* Do a reverse ARP lookup: look for an IP for a given mac address; note
    that if this fails, you have no recourse. */
 int net_arp_revlookup(netif_t *nif, uint8 ip_out[4], const uint8 mac_in[6]) {
     netarp_t *cur;
+    int i;
 
     (void)nif;
 
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(mac_in, cur->mac, 6)) {
-            memcpy(ip_out, cur->ip, 4);
-
-            if(cur->timestamp != 0)
-                cur->timestamp = jiffies;
+    if(arp_lock())
+        return -1;
 
-            return 0;
+    /* Look for the entry */
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        LIST_FOREACH(cur, &arp_hash[i], ac_list) {
+            if(cur->resolved && !memcmp(mac_in, cur->mac, 6)) {
+                memcpy(ip_out, cur->ip, 4);
+                cur->used = jiffies;
+
+                mutex_unlock(&arp_mutex);
+                return 0;
+            }
         }
     }
 
+    mutex_unlock(&arp_mutex);
     return -1;
 }
 
+/* Retrieve the cache statistics */
+net_arp_stats_t net_arp_get_stats(void) {
+    net_arp_stats_t rv;
+    int locked;
+
+    /* Inside an interrupt, settle for a copy that may be caught mid-update
+       rather than fail. */
+    locked = !arp_lock();
+    rv = arp_stats;
+
+    if(locked)
+        mutex_unlock(&arp_mutex);
+
+    return rv;
+}
+
 /* Send an ARP reply packet on the specified network adapter */
 static int net_arp_send(netif_t *nif, arp_pkt_t *pkt)   {
     arp_pkt_t pkt_out;
@@ -339,6 +513,12 @@ int net_arp_query(netif_t *nif, const uint8 ip[4]) {
     /* Send it away */
     nif->if_tx(nif, buf, sizeof(eth_hdr_t) + sizeof(arp_pkt_t), NETIF_BLOCK);
 
+    /* The stats are kept under the cache lock, which isn't held here. */
+    if(!arp_lock()) {
+        ++arp_stats.queries;
+        mutex_unlock(&arp_mutex);
+    }
+
     return 0;
 }
 
@@ -347,30 +527,42 @@ int net_arp_query(netif_t *nif, const uint8 ip[4]) {
 
 /* Init */
 int net_arp_init(void) {
+    int i;
+
     /* Initialize the ARP cache */
-    LIST_INIT(&net_arp_cache);
+    for(i = 0; i < ARP_HASH_SIZE; ++i)
+        LIST_INIT(&arp_hash[i]);
+
+    memset(&arp_stats, 0, sizeof(arp_stats));
+
+    if(!(net_arp_slab = slab_cache_create("net_arp", sizeof(netarp_t),
+                                          SLAB_DEFAULTS, NULL)))
+        return -1;
+
+    arp_cbid = net_thd_add_callback(&arp_thd_cb, NULL, ARP_TICK);
 
     return 0;
 }
 
 /* Shutdown */
 void net_arp_shutdown(void) {
-    /* Free all ARP entries */
-    netarp_t *a1, *a2;
+    int i;
 
-    a1 = LIST_FIRST(&net_arp_cache);
-
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
+    if(arp_cbid != -1) {
+        net_thd_del_callback(arp_cbid);
+        arp_cbid = -1;
+    }
 
-        if(a1->pkt) {
-            free(a1->pkt);
-            free(a1->data);
-        }
+    /* Free all ARP entries */
+    mutex_lock(&arp_mutex);
 
-        free(a1);
-        a1 = a2;
+    for(i = 0; i < ARP_HASH_SIZE; ++i) {
+        while(!LIST_EMPTY(&arp_hash[i]))
+            arp_free(LIST_FIRST(&arp_hash[i]));
     }
 
-    LIST_INIT(&net_arp_cache);
+    mutex_unlock(&arp_mutex);
+
+    slab_cache_destroy(net_arp_slab);
+    net_arp_slab = NULL;
 }
@@ -297,5 +297,8 @@ uint16 net_ipv4_checksum_pseudo(in_addr_t src, in_addr_t dst, uint8 proto,
 }
 
 net_ipv4_stats_t net_ipv4_get_stats(void) {
-    return ipv4_stats;
+    net_ipv4_stats_t st = ipv4_stats;
+
+    net_ipv4_frag_stats(&st);
+    return st;
 }
@@ -44,6 +44,7 @@ int net_ipv4_frag_send(netif_t *net, ip_hdr_t *hdr, const uint8 *data,
                        size_t size);
 int net_ipv4_reassemble(netif_t *net, const ip_hdr_t *hdr, const uint8 *data,
                         size_t size);
+void net_ipv4_frag_stats(net_ipv4_stats_t *st);
 int net_ipv4_frag_init(void);
 void net_ipv4_frag_shutdown(void);
 
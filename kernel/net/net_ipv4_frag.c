@@ -7,7 +7,7 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <string.h>
+#include <sys/queue.h>
 #include <errno.h>
 #include <arpa/inet.h>
 
@@ -19,9 +19,36 @@
 #include "net_ipv4.h"
 #include "net_thd.h"
 
-#define MAX(a, b) a > b ? a : b;
+/* Datagrams being reassembled are found through a small hash table on
+   (src, dst, id, proto), and are also kept on a list in the order they were
+   started. The parts that have arrived are kept as a sorted list of byte
+   ranges, which is usually a single range, since fragments tend to arrive in
+   order. All of it counts against a memory budget; when a new fragment would
+   go over it, the oldest datagrams are thrown away to make room. */
+
+/* Most memory all datagrams being reassembled may use, including their
+   bookkeeping */
+#define FRAG_MEM_MAX    (256 * 1024)
+
+/* A datagram that arrives in more pieces than this is dropped; nothing
+   legitimate should get close. */
+#define FRAG_RANGES_MAX 64
+
+/* Ranges kept in the datagram before more have to be allocated */
+#define FRAG_RANGES_INLINE  4
+
+#define FRAG_HASH_SIZE  32
+
+/* The largest datagram IPv4 can carry, less the smallest header */
+#define FRAG_DATA_MAX   (65535 - 20)
+
+struct frag_range {
+    int start;
+    int end;
+};
 
 struct ip_frag {
+    LIST_ENTRY(ip_frag) hashhnd;
     TAILQ_ENTRY(ip_frag) listhnd;
 
     uint32 src;
@@ -31,22 +58,89 @@ struct ip_frag {
 
     ip_hdr_t hdr;
     uint8 *data;
-    uint8 bitfield[8192];
-    int cur_length;
+    int data_size;
     int total_length;
     uint64 death_time;
+
+    struct frag_range *ranges;
+    int nranges;
+    int ranges_size;
+    struct frag_range inline_ranges[FRAG_RANGES_INLINE];
 };
 
+LIST_HEAD(ip_frag_hash, ip_frag);
 TAILQ_HEAD(ip_frag_list, ip_frag);
 
+static struct ip_frag_hash frag_hash[FRAG_HASH_SIZE];
 static struct ip_frag_list frags;
 static mutex_t frag_mutex = MUTEX_INITIALIZER;
 static int cbid = -1;
 static int initted = 0;
 
-/* IP fragment "thread" -- this thread is set up to delete fragments for which
-   the "death_time" has passed. This is run approximately once every two
-   seconds (since death_time is always on the order of seconds). */
+/* Memory used by the datagrams above */
+static size_t frag_mem;
+
+/* Counters for net_ipv4_get_stats() */
+static uint32 frag_recv, frag_reassembled, frag_timeouts, frag_dropped;
+static uint32 frag_evicted;
+
+static inline int frag_hash_of(uint32 src, uint32 dst, uint16 ident,
+                               uint8 proto) {
+    uint32 h = src ^ dst ^ ((uint32)ident << 8) ^ proto;
+
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h & (FRAG_HASH_SIZE - 1);
+}
+
+static size_t frag_size(const struct ip_frag *f) {
+    size_t sz = sizeof(struct ip_frag) + f->data_size;
+
+    if(f->ranges != f->inline_ranges)
+        sz += f->ranges_size * sizeof(struct frag_range);
+
+    return sz;
+}
+
+static void frag_free(struct ip_frag *f) {
+    frag_mem -= frag_size(f);
+    LIST_REMOVE(f, hashhnd);
+    TAILQ_REMOVE(&frags, f, listhnd);
+
+    if(f->ranges != f->inline_ranges)
+        free(f->ranges);
+
+    free(f->data);
+    free(f);
+}
+
+/* Throw away the oldest datagrams (other than keep) until another need bytes
+   fit in the budget. Returns -1 if they can't. */
+static int frag_make_room(size_t need, const struct ip_frag *keep) {
+    struct ip_frag *f, *n;
+
+    if(need > FRAG_MEM_MAX)
+        return -1;
+
+    f = TAILQ_FIRST(&frags);
+
+    while(f && frag_mem + need > FRAG_MEM_MAX) {
+        n = TAILQ_NEXT(f, listhnd);
+
+        if(f != keep) {
+            frag_free(f);
+            ++frag_evicted;
+        }
+
+        f = n;
+    }
+
+    return frag_mem + need > FRAG_MEM_MAX ? -1 : 0;
+}
+
+/* IP fragment "thread" -- this is set up to delete fragments for which the
+   "death_time" has passed. This is run approximately once every two seconds
+   (since death_time is always on the order of seconds). */
 static void frag_thd_cb(void *data __attribute__((unused))) {
     struct ip_frag *f, *n;
     uint64 now = timer_ms_gettime64();
@@ -54,16 +148,15 @@ static void frag_thd_cb(void *data __attribute__((unused))) {
     mutex_lock(&frag_mutex);
 
     /* Look at each fragment item, and see if the timer has expired. If so,
-       remvoe it. */
+       remove it. */
     f = TAILQ_FIRST(&frags);
 
     while(f) {
         n = TAILQ_NEXT(f, listhnd);
 
         if(f->death_time < now) {
-            TAILQ_REMOVE(&frags, f, listhnd);
-            free(f->data);
-            free(f);
+            frag_free(f);
+            ++frag_timeouts;
         }
 
         f = n;
@@ -72,55 +165,72 @@ static void frag_thd_cb(void *data __attribute__((unused))) {
     mutex_unlock(&frag_mutex);
 }
 
-/* Set the bits in the bitfield for the given set of fragment blocks. */
-static inline void set_bits(uint8 *bitfield, int start, int end) {
-    /* Use a slightly more efficient method when dealing with an end that is not
-       in the same byte as the start. */
-    if((end >> 3) > (start >> 3)) {
-        int bits = start & 0x07;
-
-        /* Finish off anything in the start byte... */
-        while(bits && bits < 8) {
-            bitfield[start >> 3] |= (1 << bits);
-            ++bits;
-        }
+/* Mark [start, end) as received, merging it with any ranges it touches. */
+static int frag_add_range(struct ip_frag *f, int start, int end) {
+    struct frag_range *r = f->ranges, *tmp;
+    int i, j;
 
-        /* ...and the start of the end byte. */
-        bits = end & 0x07;
-        bitfield[end >> 3] |= (1 << bits) - 1;
+    /* Find the first range that ends at or after our start... */
+    for(i = 0; i < f->nranges && r[i].end < start; ++i);
 
-        /* Now, fill anything in in the middle. */
-        bits = (end >> 3) - ((start + 1) >> 3);
-        memset(bitfield + ((start + 1) >> 3), 0xFF, bits);
-    }
-    /* Fall back to brute-forcing it for when the two are in the same byte. */
-    else {
-        --end;
+    /* ...and swallow every range that starts at or before our end. */
+    for(j = i; j < f->nranges && r[j].start <= end; ++j) {
+        if(r[j].start < start)
+            start = r[j].start;
 
-        while(end >= start) {
-            bitfield[end >> 3] |= (1 << (end & 0x07));
-            --end;
-        }
+        if(r[j].end > end)
+            end = r[j].end;
     }
-}
 
-/* Check if all bits in the bitfield that should be set are set. */
-static inline int all_bits_set(const uint8 *bitfield, int end) {
-    int i;
+    if(i == j) {
+        /* Nothing overlapped, so we need a new range at i. */
+        if(f->nranges == FRAG_RANGES_MAX)
+            return -1;
+
+        if(f->nranges == f->ranges_size) {
+            if(frag_make_room(f->ranges_size * sizeof(struct frag_range), f))
+                return -1;
+
+            tmp = (struct frag_range *)malloc(f->ranges_size * 2 *
+                                              sizeof(struct frag_range));
+
+            if(!tmp)
+                return -1;
+
+            memcpy(tmp, r, f->nranges * sizeof(struct frag_range));
+            frag_mem -= frag_size(f);
 
-    /* Make sure each of the beginning bytes are fully set. */
-    for(i = 0; i < (end >> 3); ++i) {
-        if(bitfield[i] != 0xFF) {
-            return 0;
+            if(r != f->inline_ranges)
+                free(r);
+
+            f->ranges = r = tmp;
+            f->ranges_size *= 2;
+            frag_mem += frag_size(f);
         }
+
+        memmove(r + i + 1, r + i, (f->nranges - i) * sizeof(struct frag_range));
+        ++f->nranges;
+        j = i + 1;
     }
 
-    /* Check the last byte to make sure it has the right number of bits set. */
-    if(bitfield[(end >> 3)] != ((1 << (end & 0x07)) - 1)) {
-        return 0;
+    r[i].start = start;
+    r[i].end = end;
+
+    /* Close the gap left by any ranges we merged */
+    if(j > i + 1) {
+        memmove(r + i + 1, r + j, (f->nranges - j) * sizeof(struct frag_range));
+        f->nranges -= j - i - 1;
     }
 
-    return 1;
+    return 0;
+}
+
+/* Drop a datagram that can't be completed. Returns -1 for convenience. */
+static int frag_drop(struct ip_frag *f) {
+    frag_free(f);
+    ++frag_dropped;
+    mutex_unlock(&frag_mutex);
+    return -1;
 }
 
 /* Import the data for a fragment, potentially passing it onward in processing,
@@ -133,26 +243,46 @@ static int frag_import(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
     int start = (fo << 3);
     int ihl = (hdr->version_ihl & 0x0F) << 2;
     int end = start + tl - ihl;
-    int rv = 0;
+    int rv = 0, sz;
     uint64 now = timer_ms_gettime64();
 
     (void)size;
 
-    /* Reallocate space for the data buffer, if needed. */
-    if(end > frag->cur_length) {
-        tmp = realloc(frag->data, end);
+    /* A fragment that goes past the end of the datagram (or past anything an
+       IPv4 datagram could hold) means it can never be put together right. */
+    if(end > FRAG_DATA_MAX || end <= start ||
+            (frag->total_length && end > frag->total_length) ||
+            (!(flags & 0x2000) && frag->nranges &&
+             frag->ranges[frag->nranges - 1].end > end)) {
+        errno = EINVAL;
+        return frag_drop(frag);
+    }
+
+    /* Grow the data buffer, if needed. Fragments usually come in order, so
+       leave some room for the next few. */
+    if(end > frag->data_size) {
+        sz = (flags & 0x2000) ? end + (end - start) * 4 : end;
 
-        if(!tmp) {
+        if(sz > FRAG_DATA_MAX)
+            sz = FRAG_DATA_MAX;
+
+        if(frag_make_room(sz - frag->data_size, frag) ||
+                !(tmp = realloc(frag->data, sz))) {
             errno = ENOMEM;
-            rv = -1;
-            goto out;
+            return frag_drop(frag);
         }
 
+        frag_mem += sz - frag->data_size;
         frag->data = tmp;
+        frag->data_size = sz;
+    }
+
+    if(frag_add_range(frag, start, end)) {
+        errno = ENOMEM;
+        return frag_drop(frag);
     }
 
     memcpy(frag->data + start, data, end - start);
-    set_bits(frag->bitfield, fo, fo + (((tl - ihl) + 7) >> 3));
 
     /* If the MF flag is not set, set the data length. */
     if(!(flags & 0x2000)) {
@@ -164,27 +294,28 @@ static int frag_import(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
         frag->hdr = *hdr;
     }
 
-    /* If the total length is not zero, and all the bits in the bitfield are
-       set, we continue on. */
-    if(frag->total_length &&
-            all_bits_set(frag->bitfield, frag->total_length >> 3)) {
+    /* Once the last fragment has arrived and there are no holes left, we
+       continue on. */
+    if(frag->total_length && frag->nranges == 1 &&
+            frag->ranges[0].start == 0 &&
+            frag->ranges[0].end == frag->total_length) {
         /* Set the right length. Don't worry about updating the checksum, since
            net_ipv4_input_proto doesn't check it anyway. */
         frag->hdr.length = htons(frag->total_length +
                                  ((frag->hdr.version_ihl & 0x0F) << 2));
 
         rv = net_ipv4_input_proto(src, &frag->hdr, frag->data);
+        ++frag_reassembled;
 
         /* Remove the fragment from our buffer. */
-        TAILQ_REMOVE(&frags, frag, listhnd);
-        free(frag->data);
-        free(frag);
+        frag_free(frag);
 
         goto out;
     }
 
     /* Update the timer. */
-    frag->death_time = MAX(frag->death_time, (now + hdr->ttl * 1000));
+    if(frag->death_time < now + hdr->ttl * 1000)
+        frag->death_time = now + hdr->ttl * 1000;
 
 out:
     mutex_unlock(&frag_mutex);
@@ -247,6 +378,7 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
                         size_t size) {
     uint16 flags = ntohs(hdr->flags_frag_offs);
     struct ip_frag *f;
+    int h;
 
     /* If the fragment offset is zero and the MF flag is 0, this is the whole
        packet. Treat it as such. */
@@ -266,8 +398,11 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
         mutex_lock(&frag_mutex);
     }
 
+    ++frag_recv;
+    h = frag_hash_of(hdr->src, hdr->dest, hdr->packet_id, hdr->protocol);
+
     /* Find the packet if we already have this one in our data buffer. */
-    TAILQ_FOREACH(f, &frags, listhnd) {
+    LIST_FOREACH(f, &frag_hash[h], hashhnd) {
         if(f->src == hdr->src && f->dst == hdr->dest &&
            f->ident == hdr->packet_id && f->proto == hdr->protocol) {
             /* We've got it, import the data (this function handles unlocking
@@ -277,9 +412,10 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
     }
 
     /* We don't have a fragment with that identifier, so make one. */
-    f = (struct ip_frag *)malloc(sizeof(struct ip_frag));
-
-    if(!f) {
+    if(frag_make_room(sizeof(struct ip_frag), NULL) ||
+            !(f = (struct ip_frag *)malloc(sizeof(struct ip_frag)))) {
+        ++frag_dropped;
+        mutex_unlock(&frag_mutex);
         errno = ENOMEM;
         return -1;
     }
@@ -289,19 +425,39 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8 *data,
     f->ident = hdr->packet_id;
     f->proto = hdr->protocol;
     f->data = NULL;
-    f->cur_length = 0;
+    f->data_size = 0;
     f->total_length = 0;
-    memset(f->bitfield, 0, sizeof(f->bitfield));
+    f->death_time = 0;
+    f->ranges = f->inline_ranges;
+    f->nranges = 0;
+    f->ranges_size = FRAG_RANGES_INLINE;
 
+    LIST_INSERT_HEAD(&frag_hash[h], f, hashhnd);
     TAILQ_INSERT_TAIL(&frags, f, listhnd);
+    frag_mem += frag_size(f);
 
     return frag_import(src, hdr, data, size, flags, f);
 }
 
+void net_ipv4_frag_stats(net_ipv4_stats_t *st) {
+    st->frag_recv = frag_recv;
+    st->frag_reassembled = frag_reassembled;
+    st->frag_timeouts = frag_timeouts;
+    st->frag_dropped = frag_dropped;
+    st->frag_evicted = frag_evicted;
+}
+
 int net_ipv4_frag_init(void) {
+    int i;
+
     if(!initted) {
-        cbid = net_thd_add_callback(&frag_thd_cb, NULL, 2000);
         TAILQ_INIT(&frags);
+
+        for(i = 0; i < FRAG_HASH_SIZE; ++i)
+            LIST_INIT(&frag_hash[i]);
+
+        frag_mem = 0;
+        cbid = net_thd_add_callback(&frag_thd_cb, NULL, 2000);
     }
 
     initted = 1;
@@ -309,23 +465,18 @@ int net_ipv4_frag_init(void) {
 }
 
 void net_ipv4_frag_shutdown(void) {
-    struct ip_frag *c, *n;
-
     if(initted) {
         if(cbid != -1)
             net_thd_del_callback(cbid);
 
-        c = TAILQ_FIRST(&frags);
+        mutex_lock(&frag_mutex);
+
+        while(!TAILQ_EMPTY(&frags))
+            frag_free(TAILQ_FIRST(&frags));
 
-        while(c) {
-            n = TAILQ_NEXT(c, listhnd);
-            free(c->data);
-            free(c->bitfield);
-            c = n;
-        }
+        mutex_unlock(&frag_mutex);
     }
 
     cbid = -1;
     initted = 0;
-    TAILQ_INIT(&frags);
 }
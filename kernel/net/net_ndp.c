@@ -8,34 +8,70 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <sys/queue.h>
 #include <kos/net.h>
+#include <kos/mutex.h>
 #include <arch/timer.h>
+#include <arch/irq.h>
 
 #include "net_ipv6.h"
 #include "net_icmp6.h"
+#include "net_thd.h"
 
 /* This file implements the Neighbor Discovery Protocol for IPv6. Basically, NDP
    acts much like ARP does for IPv4. It is responsible for keeping track of the
    low-level addresses of other hosts on the network. Everything it does is
    through ICMPv6 packets. NDP is specified in RFC 4861. Note however, that, for
-   the time being at least, this isn't fully compliant with that spec. */
+   the time being at least, this isn't fully compliant with that spec.
+
+   As with ARP, the cache is hashed on the address, packets to a neighbor that
+   is still being solicited are held until it answers, and entries that are in
+   use are solicited again before they go stale. */
+
+#define NDP_HASH_SIZE   32          /* Must be a power of two */
+#define NDP_QUEUE_MAX   4           /* Packets held per incomplete entry */
+#define NDP_QUERY_MAX   16          /* Solicitations sent per tick, at most */
+#define NDP_TICK        1000        /* Milliseconds between maintenance runs */
+
+/* All in milliseconds */
+#define NDP_EXPIRE      600000      /* Unconfirmed this long, it's removed */
+#define NDP_REACHABLE   30000       /* Confirmed this long ago, it's stale */
+#define NDP_REFRESH     25000       /* Age at which in-use entries are
+                                       solicited again */
+#define NDP_ACTIVE      30000       /* An entry used this recently is in use */
+#define NDP_RETRY       1000        /* Between solicitations for one address */
+#define NDP_TRIES       3           /* Unanswered solicitations before an
+                                       entry is dropped */
+
+/* A packet waiting for its destination to answer */
+typedef struct ndp_pending {
+    ipv6_hdr_t              hdr;
+    int                     data_size;
+    uint8                   data[];
+} ndp_pending_t;
 
 /* Structure describing a NDP entry. Analogous to the netarp_t for ARP. */
 typedef struct ndp_entry {
     LIST_ENTRY(ndp_entry)   entry;
     struct in6_addr         ip;
     uint64                  last_reachable;
+    uint64                  used;
+    uint64                  queried;
     int                     state;
+    int                     tries;
     uint8                   mac[6];
-    ipv6_hdr_t              *pkt;
-    uint8                   *data;
-    int                     data_size;
+    netif_t                 *net;
+    ndp_pending_t           *pending[NDP_QUEUE_MAX];
+    int                     qlen;
 } ndp_entry_t;
 
 LIST_HEAD(ndp_list, ndp_entry);
-static struct ndp_list ndp_cache = LIST_HEAD_INITIALIZER(0);
+static struct ndp_list ndp_hash[NDP_HASH_SIZE];
+static mutex_t ndp_mutex = MUTEX_INITIALIZER;
+static net_ndp_stats_t ndp_stats;
+static int ndp_cbid = -1;
 
 /* List of states for the ndp entry */
 #define NDP_STATE_INCOMPLETE    0
@@ -44,96 +80,93 @@ static struct ndp_list ndp_cache = LIST_HEAD_INITIALIZER(0);
 #define NDP_STATE_DELAY         3
 #define NDP_STATE_PROBE         4
 
-void net_ndp_gc(void) {
-    ndp_entry_t *i, *tmp;
-    uint64 now = timer_ms_gettime64();
-
-    i = LIST_FIRST(&ndp_cache);
-
-    while(i) {
-        tmp = LIST_NEXT(i, entry);
+/* Lookups and inserts are often done inside an interrupt, where waiting for
+   the lock isn't an option. */
+static int ndp_lock(void) {
+    if(irq_inside_int()) {
+        if(mutex_trylock(&ndp_mutex) == -1) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+    }
+    else {
+        mutex_lock(&ndp_mutex);
+    }
 
-        /* If we haven't gotten a reachable confirmation within 10 minutes, its
-           pretty safe to remove it. Also, remove any incomplete entries that
-           are still incomplete after a few seconds have passed. */
-        if(i->last_reachable + 600000 < now ||
-                (i->state == NDP_STATE_INCOMPLETE &&
-                 i->last_reachable + 2000 < now)) {
-            LIST_REMOVE(i, entry);
+    return 0;
+}
 
-            if(i->pkt) {
-                free(i->pkt);
-                free(i->data);
-            }
+/* The low bits of the interface identifier vary the most on a link */
+static inline struct ndp_list *ndp_bucket(const struct in6_addr *ip) {
+    return &ndp_hash[(ip->s6_addr[14] ^ ip->s6_addr[15]) &
+                     (NDP_HASH_SIZE - 1)];
+}
 
-            free(i);
-        }
+static ndp_entry_t *ndp_find(const struct in6_addr *ip) {
+    ndp_entry_t *i;
 
-        i = tmp;
+    LIST_FOREACH(i, ndp_bucket(ip), entry) {
+        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr)))
+            return i;
     }
+
+    return NULL;
 }
 
-int net_ndp_insert(netif_t *net, const uint8 mac[6], const struct in6_addr *ip,
-                   int unsol) {
+static ndp_entry_t *ndp_alloc(netif_t *net, const struct in6_addr *ip,
+                              uint64 now) {
     ndp_entry_t *i;
-    uint64 now = timer_ms_gettime64();
 
-    /* Don't allow any multicast or unspecified addresses to end up in the NDP
-       cache... */
-    if(ip->s6_addr[0] == 0xFF || ip->s6_addr[0] == 0x00) {
-        return -1;
-    }
+    if(!(i = (ndp_entry_t *)malloc(sizeof(ndp_entry_t))))
+        return NULL;
 
-    /* Look through the list first to see if its there */
-    LIST_FOREACH(i, &ndp_cache, entry) {
-        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr))) {
-            /* We found it, update everything */
-            if(unsol && memcmp(i->mac, mac, 6)) {
-                i->state = NDP_STATE_STALE;
-            }
-            else {
-                i->state = NDP_STATE_REACHABLE;
-            }
+    memset(i, 0, sizeof(ndp_entry_t));
+    memcpy(&i->ip, ip, sizeof(struct in6_addr));
+    i->net = net;
+    i->last_reachable = i->queried = now;
+    i->used = now - NDP_ACTIVE;
+    LIST_INSERT_HEAD(ndp_bucket(ip), i, entry);
+    ++ndp_stats.entries;
 
-            memcpy(i->mac, mac, 6);
-            i->last_reachable = now;
+    return i;
+}
 
-            /* Send our queued packet, if we have one */
-            if(i->pkt) {
-                net_ipv6_send_packet(net, i->pkt, i->data, i->data_size);
-                free(i->pkt);
-                free(i->data);
+static void ndp_free(ndp_entry_t *i) {
+    int j;
 
-                i->pkt = NULL;
-                i->data = NULL;
-                i->data_size = 0;
-            }
+    for(j = 0; j < i->qlen; ++j)
+        free(i->pending[j]);
 
-            return 0;
-        }
-    }
+    ndp_stats.queue_dropped += i->qlen;
+    --ndp_stats.entries;
 
-    /* No entry exists yet, so create one */
-    if(!(i = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
+    LIST_REMOVE(i, entry);
+    free(i);
+}
+
+/* Hold a copy of a packet until the entry is complete. If the queue is full,
+   the oldest packet makes way for it. */
+static int ndp_enqueue(ndp_entry_t *i, const ipv6_hdr_t *pkt,
+                       const uint8 *data, int data_size) {
+    ndp_pending_t *p;
+
+    if(!(p = (ndp_pending_t *)malloc(sizeof(ndp_pending_t) + data_size)))
         return -1;
-    }
 
-    memset(i, 0, sizeof(ndp_entry_t));
-    memcpy(&i->ip, ip, sizeof(struct in6_addr));
-    memcpy(i->mac, mac, 6);
-    i->last_reachable = now;
+    memcpy(&p->hdr, pkt, sizeof(ipv6_hdr_t));
+    memcpy(p->data, data, data_size);
+    p->data_size = data_size;
 
-    if(unsol) {
-        i->state = NDP_STATE_STALE;
-    }
-    else {
-        i->state = NDP_STATE_REACHABLE;
+    if(i->qlen == NDP_QUEUE_MAX) {
+        free(i->pending[0]);
+        memmove(i->pending, i->pending + 1,
+                (NDP_QUEUE_MAX - 1) * sizeof(ndp_pending_t *));
+        --i->qlen;
+        ++ndp_stats.queue_dropped;
     }
 
-    LIST_INSERT_HEAD(&ndp_cache, i, entry);
-
-    /* Garbage collect! */
-    net_ndp_gc();
+    i->pending[i->qlen++] = p;
+    ++ndp_stats.queued;
 
     return 0;
 }
@@ -154,91 +187,238 @@ static void net_ndp_send_sol(netif_t *net, const struct in6_addr *ip) {
     dst.s6_addr[12] = 0xFF;
 
     net_icmp6_send_nsol(net, &dst, ip, 0);
+
+    /* The stats are kept under the cache lock, which isn't held here. */
+    if(!ndp_lock()) {
+        ++ndp_stats.queries;
+        mutex_unlock(&ndp_mutex);
+    }
 }
 
-int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8 mac_out[6],
-                   const ipv6_hdr_t *pkt, const uint8 *data, int data_size) {
-    ndp_entry_t *i;
+/* Should the entry be (re)solicited? Incomplete entries are, as are entries in
+   use that haven't been confirmed for a while. */
+static int ndp_want_query(const ndp_entry_t *i, uint64 now) {
+    if(i->state == NDP_STATE_INCOMPLETE)
+        return 1;
+
+    return now - i->last_reachable >= NDP_REFRESH && now - i->used < NDP_ACTIVE;
+}
+
+void net_ndp_gc(void) {
+    struct {
+        netif_t *net;
+        struct in6_addr ip;
+    } q[NDP_QUERY_MAX];
+    ndp_entry_t *i, *tmp;
     uint64 now = timer_ms_gettime64();
+    int j, nq = 0;
 
-    /* Garbage collect, so we don't end up returning really stale entries */
-    net_ndp_gc();
+    mutex_lock(&ndp_mutex);
+
+    for(j = 0; j < NDP_HASH_SIZE; ++j) {
+        i = LIST_FIRST(&ndp_hash[j]);
 
-    /* Look for the entry */
-    LIST_FOREACH(i, &ndp_cache, entry) {
-        if(!memcmp(ip, &i->ip, sizeof(struct in6_addr))) {
-            if(i->state == NDP_STATE_INCOMPLETE) {
-                memset(mac_out, 0, 6);
-                return -1;
+        while(i) {
+            tmp = LIST_NEXT(i, entry);
+
+            /* If we haven't gotten a reachable confirmation within 10 minutes,
+               its pretty safe to remove it. Entries that don't answer a few
+               solicitations in a row go too, along with anything queued. */
+            if(now - i->last_reachable >= NDP_EXPIRE) {
+                ++ndp_stats.expired;
+                ndp_free(i);
+                i = tmp;
+                continue;
             }
-            else if(i->state == NDP_STATE_STALE) {
-                net_ndp_send_sol(net, ip);
+
+            if(i->state == NDP_STATE_REACHABLE &&
+               now - i->last_reachable >= NDP_REACHABLE)
+                i->state = NDP_STATE_STALE;
+
+            if(ndp_want_query(i, now) && now - i->queried >= NDP_RETRY) {
+                if(i->tries >= NDP_TRIES) {
+                    ++ndp_stats.expired;
+                    ndp_free(i);
+                }
+                else if(nq < NDP_QUERY_MAX) {
+                    q[nq].net = i->net;
+                    q[nq].ip = i->ip;
+                    ++nq;
+
+                    i->queried = now;
+                    ++i->tries;
+
+                    if(i->state != NDP_STATE_INCOMPLETE)
+                        ++ndp_stats.refreshes;
+                }
             }
 
-            memcpy(mac_out, i->mac, 6);
-            return 0;
+            i = tmp;
         }
     }
 
-    /* Its not there, add an incomplete entry and solicit the info */
-    if(!(i = (ndp_entry_t *)malloc(sizeof(ndp_entry_t)))) {
+    mutex_unlock(&ndp_mutex);
+
+    for(j = 0; j < nq; ++j)
+        net_ndp_send_sol(q[j].net, &q[j].ip);
+}
+
+static void ndp_thd_cb(void *data) {
+    (void)data;
+    net_ndp_gc();
+}
+
+int net_ndp_insert(netif_t *net, const uint8 mac[6], const struct in6_addr *ip,
+                   int unsol) {
+    ndp_pending_t *pending[NDP_QUEUE_MAX];
+    ndp_entry_t *i;
+    uint64 now = timer_ms_gettime64();
+    int j, n;
+
+    /* Don't allow any multicast or unspecified addresses to end up in the NDP
+       cache... */
+    if(ip->s6_addr[0] == 0xFF || ip->s6_addr[0] == 0x00) {
         return -1;
     }
 
-    memset(i, 0, sizeof(ndp_entry_t));
-    memcpy(&i->ip, ip, sizeof(struct in6_addr));
+    if(ndp_lock())
+        return -1;
+
+    /* Look through the cache first to see if its there */
+    if((i = ndp_find(ip))) {
+        /* We found it, update everything */
+        if(unsol && memcmp(i->mac, mac, 6)) {
+            i->state = NDP_STATE_STALE;
+        }
+        else {
+            i->state = NDP_STATE_REACHABLE;
+        }
+    }
+    /* No entry exists yet, so create one */
+    else if((i = ndp_alloc(net, ip, now))) {
+        i->state = unsol ? NDP_STATE_STALE : NDP_STATE_REACHABLE;
+    }
+    else {
+        mutex_unlock(&ndp_mutex);
+        return -1;
+    }
+
+    memcpy(i->mac, mac, 6);
+    i->net = net;
     i->last_reachable = now;
-    i->state = NDP_STATE_INCOMPLETE;
+    i->tries = 0;
 
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        i->data = (uint8 *)malloc(data_size);
+    /* Take the queued packets, and send them once we've let go of the lock
+       (sending them looks the entry up again). */
+    n = i->qlen;
+    memcpy(pending, i->pending, n * sizeof(ndp_pending_t *));
+    i->qlen = 0;
+    ndp_stats.queue_sent += n;
 
-        if(i->data) {
-            i->pkt = (ipv6_hdr_t *)malloc(sizeof(ipv6_hdr_t));
+    mutex_unlock(&ndp_mutex);
 
-            if(!i->pkt) {
-                free(i->data);
-                i->data = NULL;
-            }
-            else {
-                memcpy(i->pkt, pkt, sizeof(ipv6_hdr_t));
-                memcpy(i->data, data, data_size);
-                i->data_size = data_size;
-            }
-        }
+    for(j = 0; j < n; ++j) {
+        net_ipv6_send_packet(net, &pending[j]->hdr, pending[j]->data,
+                             pending[j]->data_size);
+        free(pending[j]);
     }
 
-    LIST_INSERT_HEAD(&ndp_cache, i, entry);
+    return 0;
+}
 
-    net_ndp_send_sol(net, ip);
+int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8 mac_out[6],
+                   const ipv6_hdr_t *pkt, const uint8 *data, int data_size) {
+    ndp_entry_t *i;
+    uint64 now = timer_ms_gettime64();
+    int rv, new_entry = 0;
 
     memset(mac_out, 0, 6);
-    return -2;
+
+    if(ndp_lock())
+        return -1;
+
+    /* Look for the entry. Stale entries are still used; the next maintenance
+       run will solicit them again. */
+    if((i = ndp_find(ip)) && i->state != NDP_STATE_INCOMPLETE) {
+        memcpy(mac_out, i->mac, 6);
+        i->used = now;
+        ++ndp_stats.hits;
+
+        mutex_unlock(&ndp_mutex);
+        return 0;
+    }
+
+    ++ndp_stats.misses;
+
+    /* Its not there, add an incomplete entry and solicit the info */
+    if(!i) {
+        if(!(i = ndp_alloc(net, ip, now))) {
+            mutex_unlock(&ndp_mutex);
+            return -1;
+        }
+
+        i->state = NDP_STATE_INCOMPLETE;
+        i->tries = 1;
+        new_entry = 1;
+    }
+
+    i->used = now;
+    rv = new_entry ? -2 : -1;
+
+    /* Hold on to our packet if we have one. */
+    if(pkt && data && data_size)
+        rv = ndp_enqueue(i, pkt, data, data_size) ? -1 : -2;
+
+    mutex_unlock(&ndp_mutex);
+
+    if(new_entry)
+        net_ndp_send_sol(net, ip);
+
+    return rv;
+}
+
+net_ndp_stats_t net_ndp_get_stats(void) {
+    net_ndp_stats_t rv;
+    int locked;
+
+    /* Inside an interrupt, settle for a copy that may be caught mid-update
+       rather than fail. */
+    locked = !ndp_lock();
+    rv = ndp_stats;
+
+    if(locked)
+        mutex_unlock(&ndp_mutex);
+
+    return rv;
 }
 
 int net_ndp_init(void) {
+    int i;
+
+    for(i = 0; i < NDP_HASH_SIZE; ++i)
+        LIST_INIT(&ndp_hash[i]);
+
+    memset(&ndp_stats, 0, sizeof(ndp_stats));
+    ndp_cbid = net_thd_add_callback(&ndp_thd_cb, NULL, NDP_TICK);
+
     return 0;
 }
 
 void net_ndp_shutdown(void) {
-    /* Free all entries */
-    ndp_entry_t *i, *tmp;
+    int i;
 
-    i = LIST_FIRST(&ndp_cache);
-
-    while(i) {
-        tmp = LIST_NEXT(i, entry);
+    if(ndp_cbid != -1) {
+        net_thd_del_callback(ndp_cbid);
+        ndp_cbid = -1;
+    }
 
-        if(i->pkt) {
-            free(i->pkt);
-            free(i->data);
-        }
+    /* Free all entries */
+    mutex_lock(&ndp_mutex);
 
-        free(i);
-        i = tmp;
+    for(i = 0; i < NDP_HASH_SIZE; ++i) {
+        while(!LIST_EMPTY(&ndp_hash[i]))
+            ndp_free(LIST_FIRST(&ndp_hash[i]));
     }
 
-    /* Reinit the list to the clean state, in case we call net_ndp_init later */
-    LIST_INIT(&ndp_cache);
+    mutex_unlock(&ndp_mutex);
 }
@@ -18,6 +18,7 @@
 #include <kos/mutex.h>
 #include <kos/rwsem.h>
 #include <kos/fs_socket.h>
+#include <kos/slab.h>
 
 #include <arch/timer.h>
 
@@ -180,6 +181,7 @@ LIST_HEAD(tcp_sock_list, tcp_sock);
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
 static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 static int thd_cb_id = 0;
+static slab_cache_t *tcp_sock_cache = NULL;
 
 /* Default starting window size for connections. This should be big enough as a
    starting point, in general. If you need to adjust it, you can do so... */
@@ -259,7 +261,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     (void)type;
     (void)proto;
 
-    if(!(sock = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock = (struct tcp_sock *)slab_alloc(tcp_sock_cache))) {
         errno = ENOMEM;
         return -1;
     }
@@ -268,7 +270,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
     if(mutex_init(&sock->mutex, MUTEX_TYPE_NORMAL)) {
         errno = ENOMEM;
-        free(sock);
+        slab_free(tcp_sock_cache, sock);
         return -1;
     }
 
@@ -280,7 +282,7 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
     if(irq_inside_int()) {
         if(rwsem_write_trylock(&tcp_sem)) {
-            free(sock);
+            slab_free(tcp_sock_cache, sock);
             errno = EWOULDBLOCK;
             return -1;
         }
@@ -428,7 +430,7 @@ ret_remove:
     LIST_REMOVE(sock, sock_list);
     mutex_unlock(&sock->mutex);
     mutex_destroy(&sock->mutex);
-    free(sock);
+    slab_free(tcp_sock_cache, sock);
 
     rwsem_write_unlock(&tcp_sem);
     return;
@@ -529,7 +531,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             LIST_REMOVE(sock, sock_list);
             mutex_unlock(&sock->mutex);
             mutex_destroy(&sock->mutex);
-            free(sock);
+            slab_free(tcp_sock_cache, sock);
 
             rwsem_write_unlock(&tcp_sem);
 
@@ -547,7 +549,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         sock->listen.head = 0;
 
     /* Allocate the memory we will need... */
-    if(!(sock2 = (struct tcp_sock *)malloc(sizeof(struct tcp_sock)))) {
+    if(!(sock2 = (struct tcp_sock *)slab_alloc(tcp_sock_cache))) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
         return -1;
@@ -558,7 +560,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     if(mutex_init(&sock2->mutex, MUTEX_TYPE_NORMAL)) {
         mutex_unlock(&sock->mutex);
         errno = ENOMEM;
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -566,7 +568,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         errno = ENOMEM;
         mutex_unlock(&sock->mutex);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -575,7 +577,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         mutex_unlock(&sock->mutex);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -585,7 +587,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -596,7 +598,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -608,7 +610,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         free(sock2->data.sndbuf);
         free(sock2->data.rcvbuf);
         mutex_destroy(&sock2->mutex);
-        free(sock2);
+        slab_free(tcp_sock_cache, sock2);
         return -1;
     }
 
@@ -672,7 +674,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
             free(sock2->data.sndbuf);
             free(sock2->data.rcvbuf);
             mutex_destroy(&sock2->mutex);
-            free(sock2);
+            slab_free(tcp_sock_cache, sock2);
             errno = EWOULDBLOCK;
             return -1;
         }
@@ -2983,7 +2985,7 @@ static void tcp_thd_cb(void *arg) {
             mutex_destroy(&i->mutex);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
-            free(i);
+            slab_free(tcp_sock_cache, i);
         }
 
         i = tmp;
@@ -3015,10 +3017,26 @@ static fs_socket_proto_t proto = {
 };
 
 int net_tcp_init(void) {
-    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
+    if(!(tcp_sock_cache = slab_cache_create("tcp_sock",
+                                            sizeof(struct tcp_sock),
+                                            SLAB_CACHE_ALIGN, NULL)))
         return -1;
 
-    return fs_socket_proto_add(&proto);
+    if((thd_cb_id = net_thd_add_callback(tcp_thd_cb, NULL, 50)) < 0)
+        goto out_cache;
+
+    if(fs_socket_proto_add(&proto) < 0)
+        goto out_cb;
+
+    return 0;
+
+out_cb:
+    net_thd_del_callback(thd_cb_id);
+    thd_cb_id = -1;
+out_cache:
+    slab_cache_destroy(tcp_sock_cache);
+    tcp_sock_cache = NULL;
+    return -1;
 }
 
 void net_tcp_shutdown(void) {
@@ -3048,7 +3066,7 @@ void net_tcp_shutdown(void) {
             mutex_destroy(&i->mutex);
             free(i->data.sndbuf);
             free(i->data.rcvbuf);
-            free(i);
+            slab_free(tcp_sock_cache, i);
         }
 
         i = tmp;
@@ -3060,4 +3078,7 @@ void net_tcp_shutdown(void) {
     fs_socket_proto_remove(&proto);
 
     irq_restore(old);
+
+    slab_cache_destroy(tcp_sock_cache);
+    tcp_sock_cache = NULL;
 }
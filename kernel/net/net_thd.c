@@ -5,12 +5,17 @@
 
 */
 
+/* The periodic network callbacks (TCP timers, fragment expiry, DHCP and so
+   on) used to be run by a thread of our own that woke every 50ms and
+   checked each of them. They're kernel timers now, so each runs on time on
+   the shared timer thread, and nothing wakes up when none are due. */
+
 #include <sys/queue.h>
 #include <errno.h>
 #include <stdlib.h>
 
-#include <kos/thread.h>
-#include <arch/timer.h>
+#include <kos/ktimer.h>
+#include <arch/irq.h>
 #include "net_thd.h"
 
 struct thd_cb {
@@ -19,37 +24,19 @@ struct thd_cb {
     int cbid;
     void (*cb)(void *);
     void *data;
-    uint64 timeout;
-    uint64 nextrun;
+    ktimer_t timer;
 };
 
 TAILQ_HEAD(thd_cb_queue, thd_cb);
 
 static struct thd_cb_queue cbs;
-static kthread_t *thd;
-static int done = 0;
 static int cbid_top;
 
-static void *net_thd_thd(void *data __attribute__((unused))) {
-    struct thd_cb *cb;
-    uint64 now;
-
-    while(!done) {
-        now = timer_ms_gettime64();
-
-        /* Run any callbacks that need to be run now. */
-        TAILQ_FOREACH(cb, &cbs, thds) {
-            if(now >= cb->nextrun) {
-                cb->cb(cb->data);
-                cb->nextrun = now + cb->timeout;
-            }
-        }
-
-        /* Go to sleep til we need to be run again. */
-        thd_sleep(50);
-    }
+static void net_thd_run(ktimer_t *timer, void *data) {
+    struct thd_cb *cb = (struct thd_cb *)data;
 
-    return NULL;
+    (void)timer;
+    cb->cb(cb->data);
 }
 
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout) {
@@ -64,17 +51,18 @@ int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout) {
         return -1;
     }
 
-    newcb->cbid = cbid_top++;
     newcb->cb = cb;
     newcb->data = data;
-    newcb->timeout = timeout;
-    newcb->nextrun = timer_ms_gettime64() + timeout;
+    ktimer_setup(&newcb->timer, net_thd_run, newcb);
 
     /* Disable interrupts, insert, and reenable interrupts */
     old = irq_disable();
+    newcb->cbid = cbid_top++;
     TAILQ_INSERT_TAIL(&cbs, newcb, thds);
     irq_restore(old);
 
+    ktimer_arm(&newcb->timer, (uint32)timeout, (uint32)timeout);
+
     return newcb->cbid;
 }
 
@@ -90,8 +78,12 @@ int net_thd_del_callback(int cbid) {
     TAILQ_FOREACH(cb, &cbs, thds) {
         if(cb->cbid == cbid) {
             TAILQ_REMOVE(&cbs, cb, thds);
-            free(cb);
             irq_restore(old);
+
+            /* This waits for the callback if it's running right now (unless
+               it's the one deleting itself). */
+            ktimer_cancel(&cb->timer);
+            free(cb);
             return 0;
         }
     }
@@ -102,40 +94,30 @@ int net_thd_del_callback(int cbid) {
 }
 
 int net_thd_is_current(void) {
-    return thd_current == thd;
+    return ktimer_is_current();
 }
 
 void net_thd_kill(void) {
-    /* Do things gracefully, if we can... Otherwise, punt. */
-    done = 1;
+    struct thd_cb *cb;
 
-    if(!irq_inside_int()) {
-        thd_join(thd, NULL);
-    }
-    else {
-        thd_destroy(thd);
+    /* Stop all the callbacks, but leave them registered so they can be
+       deleted as each part of the stack shuts down. */
+    TAILQ_FOREACH(cb, &cbs, thds) {
+        ktimer_cancel(&cb->timer);
     }
-
-    thd = NULL;
 }
 
 int net_thd_init(void) {
     TAILQ_INIT(&cbs);
-    done = 0;
     cbid_top = 1;
 
-    thd = thd_create(0, &net_thd_thd, NULL);
-
     return 0;
 }
 
 void net_thd_shutdown(void) {
     struct thd_cb *c, *n;
 
-    /* Kill the thread. */
-    if(thd) {
-        net_thd_kill();
-    }
+    net_thd_kill();
 
     /* Free any handlers that we have laying around */
     c = TAILQ_FIRST(&cbs);
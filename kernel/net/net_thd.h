@@ -15,6 +15,11 @@ __BEGIN_DECLS
 #include <arch/types.h>
 
 int net_thd_add_callback(void (*cb)(void *), void *data, uint64 timeout);
+
+/* Remove a callback. If it's running on the network thread right now, this
+   waits for it to return, so it must not be called with any lock the
+   callback takes (or with interrupts disabled). A callback may remove
+   itself. */
 int net_thd_del_callback(int cbid);
 
 int net_thd_is_current(void);
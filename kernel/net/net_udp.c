@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <errno.h>
 #include <poll.h>
 #include <stdint.h>
@@ -18,6 +19,7 @@
 #include <sys/queue.h>
 #include <kos/fs_socket.h>
 #include <arch/irq.h>
+#include <arch/timer.h>
 #include <sys/socket.h>
 
 #include "net_ipv4.h"
@@ -26,6 +28,18 @@
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define UDP_DEFAULT_HOPS    64
 
+/* Receive buffer sizes (SO_RCVBUF). A datagram that doesn't fit in the whole
+   buffer can never be received, so by default the buffer may grow to hold the
+   largest one (reassembled from fragments) there can be. A smaller limit can
+   be asked for to save memory, down to one full-sized Ethernet frame's worth,
+   in which case anything bigger than that is dropped. The buffer starts out
+   with room for a few full-sized frames and only grows as far as the limit
+   when datagrams arrive faster than they're read (or are bigger). */
+#define UDP_DEFAULT_RCVBUF  UDP_PKT_SIZE(65535)
+#define UDP_INIT_RCVBUF     (4 * UDP_PKT_SIZE(1500))
+#define UDP_MIN_RCVBUF      2048
+#define UDP_MAX_RCVBUF      262144
+
 #define packed __attribute__((packed))
 typedef struct {
     uint16 src_port    packed;
@@ -35,14 +49,30 @@ typedef struct {
 } udp_hdr_t;
 #undef packed
 
+/* Received datagrams are stored one after another in a ring buffer that is
+   allocated with the socket, each behind one of these. A datagram that
+   doesn't fit in the space left at the end of the buffer goes at the start
+   instead, and end marks where the ones at the end stop. When the buffer is
+   full, it's reallocated bigger (up to max) if the receive path is allowed
+   to allocate; otherwise, or once it's as big as it can get, new datagrams
+   are dropped. */
 struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
     struct sockaddr_in6 from;
-    uint8 *data;
     uint16 datasize;
+    uint16 reserved;
 };
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+#define UDP_PKT_SIZE(n) ((sizeof(struct udp_pkt) + (n) + 3) & ~3)
+
+struct udp_ring {
+    uint8 *buf;
+    uint32 size;
+    uint32 max;
+    uint32 head;
+    uint32 tail;
+    uint32 end;
+    uint32 count;
+};
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
@@ -64,7 +94,7 @@ struct udp_sock {
         uint16_t recv_cscov;
     } udp_lite;
 
-    struct udp_pkt_queue packets;
+    struct udp_ring rcv;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
@@ -74,10 +104,216 @@ static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8 *data,
-                            size_t size, uint32_t flags, int hops,
+                            const struct sockaddr_in6 *dst, const iovec_t *iov,
+                            int iovcnt, uint32_t flags, int hops,
                             uint32_t iflags, int proto, uint16_t cscov);
 
+extern void __poll_event_trigger(int fd, short event);
+
+static int ring_init(struct udp_ring *r, uint32 size, uint32 max) {
+    if(!(r->buf = (uint8 *)malloc(size)))
+        return -1;
+
+    r->size = r->end = size;
+    r->max = max;
+    r->head = r->tail = r->count = 0;
+    return 0;
+}
+
+static struct udp_pkt *ring_first(struct udp_ring *r) {
+    return r->count ? (struct udp_pkt *)(r->buf + r->head) : NULL;
+}
+
+/* Make room for a datagram of size bytes at the tail, and fill in its header.
+   Returns NULL if the ring is too full for it. */
+static struct udp_pkt *ring_put(struct udp_ring *r,
+                                const struct sockaddr_in6 *from, size_t size) {
+    uint32 need = UDP_PKT_SIZE(size), pos;
+    struct udp_pkt *pkt;
+
+    if(!r->count) {
+        r->head = r->tail = 0;
+        r->end = r->size;
+    }
+
+    if(!r->count || r->tail > r->head) {
+        /* The free space is after the tail, and maybe before the head too. */
+        if(r->size - r->tail >= need) {
+            pos = r->tail;
+        }
+        else if(r->head >= need) {
+            r->end = r->tail;
+            pos = 0;
+        }
+        else {
+            return NULL;
+        }
+    }
+    else if(r->head - r->tail >= need) {
+        pos = r->tail;
+    }
+    else {
+        return NULL;
+    }
+
+    pkt = (struct udp_pkt *)(r->buf + pos);
+    pkt->from = *from;
+    pkt->datasize = (uint16)size;
+    r->tail = pos + need;
+    ++r->count;
+
+    return pkt;
+}
+
+static void ring_pop(struct udp_ring *r) {
+    struct udp_pkt *pkt = (struct udp_pkt *)(r->buf + r->head);
+
+    r->head += UDP_PKT_SIZE(pkt->datasize);
+    --r->count;
+
+    if(r->head == r->end) {
+        r->head = 0;
+        r->end = r->size;
+    }
+}
+
+static size_t iov_size(const iovec_t *iov, int iovcnt) {
+    size_t size = 0;
+    int i;
+
+    for(i = 0; i < iovcnt; ++i)
+        size += iov[i].iov_len;
+
+    return size;
+}
+
+/* Scatter a datagram into an iovec. Returns the number of bytes copied. */
+static size_t copy_to_iov(const struct udp_pkt *pkt, const iovec_t *iov,
+                          int iovcnt) {
+    const uint8 *data = (const uint8 *)(pkt + 1);
+    size_t left = pkt->datasize, n;
+    int i;
+
+    for(i = 0; i < iovcnt && left; ++i) {
+        n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, data, n);
+        data += n;
+        left -= n;
+    }
+
+    return pkt->datasize - left;
+}
+
+/* Move a socket's queued datagrams into a new receive buffer of size bytes,
+   that may grow up to max. Any that don't fit are dropped. The UDP mutex must
+   be held. */
+static int udp_resize_rcvbuf(struct udp_sock *sock, uint32 size, uint32 max) {
+    struct udp_ring r;
+    struct udp_pkt *pkt, *npkt;
+
+    if(irq_inside_int() && !malloc_irq_safe())
+        return -1;
+
+    if(ring_init(&r, size, max))
+        return -1;
+
+    while((pkt = ring_first(&sock->rcv))) {
+        if((npkt = ring_put(&r, &pkt->from, pkt->datasize)))
+            memcpy(npkt + 1, pkt + 1, pkt->datasize);
+        else
+            ++udp_stats.pkt_recv_dropped;
+
+        ring_pop(&sock->rcv);
+    }
+
+    free(sock->rcv.buf);
+    sock->rcv = r;
+    return 0;
+}
+
+/* Grow a socket's receive buffer so that a datagram of size bytes fits on
+   the end of what's queued, if the limit allows. The UDP mutex must be held. */
+static int udp_grow_rcvbuf(struct udp_sock *sock, size_t size) {
+    struct udp_ring *r = &sock->rcv;
+    uint32 want = r->size * 2, need = UDP_PKT_SIZE(size);
+
+    /* What's queued gets packed at the start of the new buffer. */
+    if(r->count && r->tail > r->head)
+        need += r->tail - r->head;
+    else if(r->count)
+        need += r->end - r->head + r->tail;
+
+    if(r->size >= r->max || need > r->max)
+        return -1;
+
+    if(want < need)
+        want = need;
+
+    if(want > r->max)
+        want = r->max;
+
+    return udp_resize_rcvbuf(sock, want, r->max);
+}
+
+/* Queue a received datagram on a socket. The UDP mutex must be held. */
+static int udp_enqueue(struct udp_sock *sock, const struct sockaddr_in6 *from,
+                       const uint8 *data, size_t size) {
+    struct udp_pkt *pkt;
+
+    if(!(pkt = ring_put(&sock->rcv, from, size)) &&
+       (udp_grow_rcvbuf(sock, size) ||
+        !(pkt = ring_put(&sock->rcv, from, size)))) {
+        ++udp_stats.pkt_recv_dropped;
+        return -1;
+    }
+
+    memcpy(pkt + 1, data, size);
+
+    ++udp_stats.pkt_recv;
+    __poll_event_trigger(sock->sock, POLLRDNORM);
+    genwait_wake_one(sock);
+
+    return 0;
+}
+
+/* Fill in the address a datagram came from, in the socket's family. */
+static void udp_copy_addr(const struct udp_sock *udpsock,
+                          const struct sockaddr_in6 *from,
+                          struct sockaddr *addr, socklen_t *addr_len) {
+    if(udpsock->domain == AF_INET) {
+        struct sockaddr_in realaddr;
+
+        memset(&realaddr, 0, sizeof(struct sockaddr_in));
+        realaddr.sin_family = AF_INET;
+        realaddr.sin_addr.s_addr = from->sin6_addr.__s6_addr.__s6_addr32[3];
+        realaddr.sin_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in)) {
+            memcpy(addr, &realaddr, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
+            *addr_len = sizeof(struct sockaddr_in);
+        }
+    }
+    else if(udpsock->domain == AF_INET6) {
+        struct sockaddr_in6 realaddr6;
+
+        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6.sin6_family = AF_INET6;
+        realaddr6.sin6_addr = from->sin6_addr;
+        realaddr6.sin6_port = from->sin6_port;
+
+        if(*addr_len < sizeof(struct sockaddr_in6)) {
+            memcpy(addr, &realaddr6, *addr_len);
+        }
+        else {
+            memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
+            *addr_len = sizeof(struct sockaddr_in6);
+        }
+    }
+}
+
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
     (void)hnd;
@@ -349,7 +585,7 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    if(TAILQ_EMPTY(&udpsock->packets) &&
+    if(!udpsock->rcv.count &&
        ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
         irq_inside_int())) {
         mutex_unlock(&udp_mutex);
@@ -357,82 +593,41 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         return -1;
     }
 
-    while(TAILQ_EMPTY(&udpsock->packets)) {
+    while(!udpsock->rcv.count) {
         mutex_unlock(&udp_mutex);
         genwait_wait(udpsock, "net_udp_recvfrom", 0, NULL);
         mutex_lock(&udp_mutex);
     }
 
-    pkt = TAILQ_FIRST(&udpsock->packets);
+    pkt = ring_first(&udpsock->rcv);
 
     if(pkt->datasize > length) {
-        memcpy(buffer, pkt->data, length);
+        memcpy(buffer, pkt + 1, length);
     }
     else {
-        memcpy(buffer, pkt->data, pkt->datasize);
+        memcpy(buffer, pkt + 1, pkt->datasize);
         length = pkt->datasize;
     }
 
-    if(addr != NULL) {
-        if(udpsock->domain == AF_INET) {
-            struct sockaddr_in realaddr;
-
-            memset(&realaddr, 0, sizeof(struct sockaddr_in));
-            realaddr.sin_family = AF_INET;
-            realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
-
-            if(*addr_len < sizeof(struct sockaddr_in)) {
-                memcpy(addr, &realaddr, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr, sizeof(struct sockaddr_in));
-                *addr_len = sizeof(struct sockaddr_in);
-            }
-        }
-        else if(udpsock->domain == AF_INET6) {
-            struct sockaddr_in6 realaddr6;
-
-            memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-            realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
-
-            if(*addr_len < sizeof(struct sockaddr_in6)) {
-                memcpy(addr, &realaddr6, *addr_len);
-            }
-            else {
-                memcpy(addr, &realaddr6, sizeof(struct sockaddr_in6));
-                *addr_len = sizeof(struct sockaddr_in6);
-            }
-        }
-    }
+    if(addr != NULL)
+        udp_copy_addr(udpsock, &pkt->from, addr, addr_len);
 
     /* Remove the packet if we're pulling data out of the queue. */
-    if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
-    }
+    if(!(flags & MSG_PEEK))
+        ring_pop(&udpsock->rcv);
 
     mutex_unlock(&udp_mutex);
 
     return length;
 }
 
-static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
-                              size_t length, int flags,
-                              const struct sockaddr *addr, socklen_t addr_len) {
+static int net_udp_recvmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags, int timeout) {
     struct udp_sock *udpsock;
-    struct sockaddr_in *realaddr;
-    struct sockaddr_in6 realaddr6;
-    uint32_t sflags, iflags;
-    int hops, proto;
-    uint16_t cscov;
-    struct sockaddr_in6 local_addr;
-
-    (void)flags;
+    struct udp_pkt *pkt;
+    struct msghdr *msg;
+    unsigned int i;
+    uint64 now, deadline;
 
     if(irq_inside_int()) {
         if(mutex_trylock(&udp_mutex) == -1) {
@@ -447,84 +642,196 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     udpsock = (struct udp_sock *)hnd->data;
 
     if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
         errno = EBADF;
-        goto err;
+        return -1;
     }
 
-    if(udpsock->flags & (SHUT_WR << 24)) {
-        errno = EPIPE;
-        goto err;
+    if(udpsock->flags & (SHUT_RD << 24)) {
+        mutex_unlock(&udp_mutex);
+        return 0;
+    }
+
+    if(msgvec == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EFAULT;
+        return -1;
     }
 
+    if(!udpsock->rcv.count &&
+       ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
+        irq_inside_int())) {
+        mutex_unlock(&udp_mutex);
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    /* Wait for the first datagram only; after that, take whatever is already
+       queued. */
+    deadline = timer_ms_gettime64() + timeout;
+
+    while(!udpsock->rcv.count) {
+        now = timer_ms_gettime64();
+
+        if(timeout && now >= deadline) {
+            mutex_unlock(&udp_mutex);
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+
+        mutex_unlock(&udp_mutex);
+        genwait_wait(udpsock, "net_udp_recvmmsg",
+                     timeout ? (int)(deadline - now) : 0, NULL);
+        mutex_lock(&udp_mutex);
+    }
+
+    /* Peeking would just return the first datagram over and over. */
+    if(flags & MSG_PEEK)
+        vlen = 1;
+
+    for(i = 0; i < vlen && (pkt = ring_first(&udpsock->rcv)); ++i) {
+        msg = &msgvec[i].msg_hdr;
+        msgvec[i].msg_len = copy_to_iov(pkt, msg->msg_iov, msg->msg_iovlen);
+        msg->msg_flags = msgvec[i].msg_len < pkt->datasize ? MSG_TRUNC : 0;
+        msg->msg_controllen = 0;
+
+        if(msg->msg_name)
+            udp_copy_addr(udpsock, &pkt->from,
+                          (struct sockaddr *)msg->msg_name, &msg->msg_namelen);
+
+        if(!(flags & MSG_PEEK))
+            ring_pop(&udpsock->rcv);
+    }
+
+    mutex_unlock(&udp_mutex);
+
+    return (int)i;
+}
+
+/* Work out where a datagram sent on a socket should go. The UDP mutex must be
+   held, or udpsock must be a copy of the socket. */
+static int udp_dest(const struct udp_sock *udpsock,
+                    const struct sockaddr *addr, socklen_t addr_len,
+                    struct sockaddr_in6 *realaddr6) {
+    const struct sockaddr_in *realaddr;
+
     if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr) &&
        udpsock->remote_addr.sin6_port != 0) {
         if(addr) {
             errno = EISCONN;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = udpsock->remote_addr;
+        *realaddr6 = udpsock->remote_addr;
     }
     else if(addr == NULL) {
         errno = EDESTADDRREQ;
-        goto err;
+        return -1;
     }
     else if(addr->sa_family != udpsock->domain) {
         errno = EAFNOSUPPORT;
-        goto err;
+        return -1;
     }
     else if(udpsock->domain == AF_INET6) {
         if(addr_len != sizeof(struct sockaddr_in6)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr6 = *((struct sockaddr_in6 *)addr);
+        *realaddr6 = *((const struct sockaddr_in6 *)addr);
     }
     else if(udpsock->domain == AF_INET) {
         if(addr_len != sizeof(struct sockaddr_in)) {
             errno = EINVAL;
-            goto err;
+            return -1;
         }
 
-        realaddr = (struct sockaddr_in *)addr;
-        memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
-        realaddr6.sin6_family = AF_INET6;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        realaddr6.sin6_addr.__s6_addr.__s6_addr32[3] =
+        realaddr = (const struct sockaddr_in *)addr;
+        memset(realaddr6, 0, sizeof(struct sockaddr_in6));
+        realaddr6->sin6_family = AF_INET6;
+        realaddr6->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        realaddr6->sin6_addr.__s6_addr.__s6_addr32[3] =
             realaddr->sin_addr.s_addr;
-        realaddr6.sin6_port = realaddr->sin_port;
+        realaddr6->sin6_port = realaddr->sin_port;
     }
     else {
         /* Shouldn't be able to get here... */
         errno = EBADF;
-        goto err;
+        return -1;
     }
 
-    if(message == NULL) {
-        errno = EFAULT;
-        goto err;
-    }
+    return 0;
+}
 
-    if(udpsock->local_addr.sin6_port == 0) {
-        uint16 port = 1024, tmp = 0;
-        struct udp_sock *iter;
+/* Give a socket that's sending without having been bound a local port. The
+   UDP mutex must be held. */
+static void udp_autobind(struct udp_sock *udpsock) {
+    uint16 port = 1024, tmp = 0;
+    struct udp_sock *iter;
 
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
+    if(udpsock->local_addr.sin6_port != 0)
+        return;
 
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
+    /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
+    while(tmp != port) {
+        tmp = port;
+
+        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
+            if(iter->local_addr.sin6_port == port) {
+                ++port;
+                break;
             }
         }
+    }
 
-        udpsock->local_addr.sin6_port = htons(port);
+    udpsock->local_addr.sin6_port = htons(port);
+}
+
+static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
+                              size_t length, int flags,
+                              const struct sockaddr *addr, socklen_t addr_len) {
+    struct udp_sock *udpsock;
+    struct sockaddr_in6 realaddr6;
+    uint32_t sflags, iflags;
+    int hops, proto;
+    uint16_t cscov;
+    struct sockaddr_in6 local_addr;
+    iovec_t iov;
+
+    (void)flags;
+
+    if(irq_inside_int()) {
+        if(mutex_trylock(&udp_mutex) == -1) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+    }
+    else {
+        mutex_lock(&udp_mutex);
     }
 
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        errno = EBADF;
+        goto err;
+    }
+
+    if(udpsock->flags & (SHUT_WR << 24)) {
+        errno = EPIPE;
+        goto err;
+    }
+
+    if(udp_dest(udpsock, addr, addr_len, &realaddr6))
+        goto err;
+
+    if(message == NULL) {
+        errno = EFAULT;
+        goto err;
+    }
+
+    udp_autobind(udpsock);
+
     local_addr = udpsock->local_addr;
     sflags = udpsock->flags;
     iflags = udpsock->int_flags;
@@ -533,14 +840,85 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     cscov = udpsock->udp_lite.send_cscov;
     mutex_unlock(&udp_mutex);
 
-    return net_udp_send_raw(NULL, &local_addr, &realaddr6,
-                            (const uint8 *)message, length, sflags, hops,
-                            iflags, proto, cscov);
+    iov.iov_base = (char *)message;
+    iov.iov_len = length;
+
+    return net_udp_send_raw(NULL, &local_addr, &realaddr6, &iov, 1, sflags,
+                            hops, iflags, proto, cscov);
 err:
     mutex_unlock(&udp_mutex);
     return -1;
 }
 
+static int net_udp_sendmmsg(net_socket_t *hnd, struct mmsghdr *msgvec,
+                            unsigned int vlen, int flags) {
+    struct udp_sock *udpsock, copy;
+    struct sockaddr_in6 realaddr6;
+    struct msghdr *msg;
+    unsigned int i;
+    int rv;
+
+    (void)flags;
+
+    if(irq_inside_int()) {
+        if(mutex_trylock(&udp_mutex) == -1) {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+    }
+    else {
+        mutex_lock(&udp_mutex);
+    }
+
+    udpsock = (struct udp_sock *)hnd->data;
+
+    if(udpsock == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EBADF;
+        return -1;
+    }
+
+    if(udpsock->flags & (SHUT_WR << 24)) {
+        mutex_unlock(&udp_mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    if(msgvec == NULL) {
+        mutex_unlock(&udp_mutex);
+        errno = EFAULT;
+        return -1;
+    }
+
+    /* Take the socket's settings once for the whole batch. The datagrams have
+       to be sent without the mutex held, since one looped back to us would
+       need it to be received. */
+    udp_autobind(udpsock);
+    copy = *udpsock;
+    mutex_unlock(&udp_mutex);
+
+    for(i = 0; i < vlen; ++i) {
+        msg = &msgvec[i].msg_hdr;
+
+        if(udp_dest(&copy, (const struct sockaddr *)msg->msg_name,
+                    msg->msg_namelen, &realaddr6))
+            break;
+
+        rv = net_udp_send_raw(NULL, &copy.local_addr, &realaddr6,
+                              msg->msg_iov, msg->msg_iovlen, copy.flags,
+                              copy.hop_limit, copy.int_flags, copy.proto,
+                              copy.udp_lite.send_cscov);
+
+        if(rv < 0)
+            break;
+
+        msgvec[i].msg_len = rv;
+    }
+
+    /* Like sendmmsg() elsewhere, only report an error if nothing was sent. */
+    return i ? (int)i : -1;
+}
+
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
     struct udp_sock *udpsock;
 
@@ -579,7 +957,14 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     struct udp_sock *udpsock;
 
     (void)type;
-    (void)proto;
+
+    if(!proto) {
+        proto = IPPROTO_UDP;
+    }
+    else if(proto != IPPROTO_UDP && proto != IPPROTO_UDPLITE) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
 
     udpsock = (struct udp_sock *)malloc(sizeof(struct udp_sock));
 
@@ -588,22 +973,21 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
         return -1;
     }
 
-    if(!proto) {
-        proto = IPPROTO_UDP;
-    }
-    else if(proto != IPPROTO_UDP && proto != IPPROTO_UDPLITE) {
-        errno = EPROTONOSUPPORT;
+    memset(udpsock, 0, sizeof(struct udp_sock));
+
+    if(ring_init(&udpsock->rcv, UDP_INIT_RCVBUF, UDP_DEFAULT_RCVBUF)) {
+        free(udpsock);
+        errno = ENOMEM;
         return -1;
     }
 
-    memset(udpsock, 0, sizeof(struct udp_sock));
-    TAILQ_INIT(&udpsock->packets);
     udpsock->domain = domain;
     udpsock->proto = proto;
     udpsock->hop_limit = UDP_DEFAULT_HOPS;
 
     if(irq_inside_int()) {
         if(mutex_trylock(&udp_mutex) == -1) {
+            free(udpsock->rcv.buf);
             free(udpsock);
             errno = EWOULDBLOCK;
             return -1;
@@ -622,7 +1006,6 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
 
     if(irq_inside_int()) {
         if(mutex_trylock(&udp_mutex) == -1) {
@@ -642,14 +1025,9 @@ static void net_udp_close(net_socket_t *hnd) {
         return;
     }
 
-    TAILQ_FOREACH(pkt, &udpsock->packets, pkt_queue) {
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
-    }
-
     LIST_REMOVE(udpsock, sock_list);
 
+    free(udpsock->rcv.buf);
     free(udpsock);
     mutex_unlock(&udp_mutex);
 }
@@ -682,6 +1060,10 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
                     tmp = 0;
                     goto copy_int;
 
+                case SO_RCVBUF:
+                    tmp = sock->rcv.max;
+                    goto copy_int;
+
                 case SO_TYPE:
                     tmp = SOCK_DGRAM;
                     goto copy_int;
@@ -803,6 +1185,29 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_ERROR:
                 case SO_TYPE:
                     goto ret_inval;
+
+                case SO_RCVBUF:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < UDP_MIN_RCVBUF)
+                        tmp = UDP_MIN_RCVBUF;
+                    else if(tmp > UDP_MAX_RCVBUF)
+                        tmp = UDP_MAX_RCVBUF;
+
+                    /* The buffer only needs to move if it's already bigger
+                       than the new limit. */
+                    if(sock->rcv.size <= (uint32)tmp)
+                        sock->rcv.max = tmp;
+                    else if(udp_resize_rcvbuf(sock, tmp, tmp)) {
+                        mutex_unlock(&udp_mutex);
+                        errno = ENOMEM;
+                        return -1;
+                    }
+
+                    goto ret_success;
             }
 
             break;
@@ -1015,7 +1420,7 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
         return POLLNVAL;
     }
 
-    if(!TAILQ_EMPTY(&sock->packets))
+    if(sock->rcv.count)
         rv |= POLLRDNORM;
 
     mutex_unlock(&udp_mutex);
@@ -1023,15 +1428,13 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
     return rv & events;
 }
 
-extern void __poll_event_trigger(int fd, short event);
-
 static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
     uint16 cs, cscov = 0;
-    int partial = 1;
+    int partial = 1, rv;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct sockaddr_in6 from;
 
     (void)src;
 
@@ -1127,36 +1530,17 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8 *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8 *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+        memset(&from, 0, sizeof(struct sockaddr_in6));
+        from.sin6_family = AF_INET6;
+        from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
+        from.sin6_port = hdr->src_port;
 
-        ++udp_stats.pkt_recv;
-        __poll_event_trigger(sock->sock, POLLRDNORM);
-        genwait_wake_one(sock);
+        rv = udp_enqueue(sock, &from, data + sizeof(udp_hdr_t),
+                         size - sizeof(udp_hdr_t));
         mutex_unlock(&udp_mutex);
 
-        return 0;
+        return rv;
     }
 
     ++udp_stats.pkt_recv_no_sock;
@@ -1169,9 +1553,9 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
                           size_t size) {
     udp_hdr_t *hdr = (udp_hdr_t *)data;
     uint16 cs, cscov = 0;
-    int partial = 1;
+    int partial = 1, rv;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    struct sockaddr_in6 from;
 
     (void)src;
 
@@ -1265,35 +1649,16 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8 *data,
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
+        memset(&from, 0, sizeof(struct sockaddr_in6));
+        from.sin6_family = AF_INET6;
+        from.sin6_addr = ip->src_addr;
+        from.sin6_port = hdr->src_port;
 
-        if(!(pkt->data = (uint8 *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr = ip->src_addr;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
-
-        ++udp_stats.pkt_recv;
-        __poll_event_trigger(sock->sock, POLLRDNORM);
-        genwait_wake_one(sock);
+        rv = udp_enqueue(sock, &from, data + sizeof(udp_hdr_t),
+                         size - sizeof(udp_hdr_t));
         mutex_unlock(&udp_mutex);
 
-        return 0;
+        return rv;
     }
 
     ++udp_stats.pkt_recv_no_sock;
@@ -1317,13 +1682,15 @@ static int net_udp_input(netif_t *src, int domain, const void *hdr,
 
 /* XXX */
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
-                            const struct sockaddr_in6 *dst, const uint8 *data,
-                            size_t size, uint32_t flags, int hops,
+                            const struct sockaddr_in6 *dst, const iovec_t *iov,
+                            int iovcnt, uint32_t flags, int hops,
                             uint32_t iflags, int proto, uint16_t cscov) {
+    size_t size = iov_size(iov, iovcnt);
     uint8 buf[size + sizeof(udp_hdr_t)];
     udp_hdr_t *hdr = (udp_hdr_t *)buf;
+    uint8 *p = buf + sizeof(udp_hdr_t);
     uint16 cs;
-    int err;
+    int err, i;
     struct in6_addr srcaddr = src->sin6_addr;
 
     (void)flags;
@@ -1370,7 +1737,11 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
-    memcpy(buf + sizeof(udp_hdr_t), data, size);
+    for(i = 0; i < iovcnt; ++i) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+
     size += sizeof(udp_hdr_t);
 
     hdr->src_port = src->sin6_port;
@@ -1437,7 +1808,9 @@ static fs_socket_proto_t proto = {
     net_udp_getsockopt,
     net_udp_setsockopt,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 static fs_socket_proto_t proto_lite = {
@@ -1458,7 +1831,9 @@ static fs_socket_proto_t proto_lite = {
     net_udp_getsockopt,
     net_udp_setsockopt,
     net_udp_fcntl,
-    net_udp_poll
+    net_udp_poll,
+    net_udp_recvmmsg,
+    net_udp_sendmmsg
 };
 
 int net_udp_init(void) {
@@ -23,6 +23,7 @@
 #include <arch/timer.h>
 #include <kos/genwait.h>
 #include <kos/sem.h>
+#include <kos/job.h>
 
 /* Our sleep queues table. This is also modeled after the BSD numbers. I
    figure if they've been using it as long as they have, they must be
@@ -99,9 +100,16 @@ int genwait_wait(void * obj, const char * mesg, int timeout, void (*callback)(vo
     /* Insert us on the appropriate wait queue */
     TAILQ_INSERT_TAIL(&slpque[LOOKUP(obj)], me, thdq);
 
+    /* Let the job pool stand in for us if we're one of its workers */
+    if(me->flags & THD_JOB)
+        job_worker_blocked(1);
+
     /* Block us until we're signaled */
     rv = thd_block_now(&me->context);
 
+    if(me->flags & THD_JOB)
+        job_worker_blocked(0);
+
     irq_restore(old);
 
     return rv;
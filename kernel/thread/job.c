@@ -0,0 +1,439 @@
+/* KallistiOS ##version##
+
+   job.c
+
+*/
+
+/* The job scheduler. The queues, dependency tracking and spare worker
+   accounting are in job_core.h (shared with utils/jobbench); this adds the
+   threads. Everything that touches the scheduler does so with interrupts
+   disabled, so jobs can be submitted from interrupts and genwait_wait() can
+   tell us about workers going to sleep.
+
+   genwait_wait() calls job_worker_blocked() when a pool worker goes to sleep
+   in its job, which wakes one of the spare workers if there's work for it. */
+
+#include <errno.h>
+#include <malloc.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <arch/irq.h>
+#include <kos/thread.h>
+#include <kos/genwait.h>
+#include <kos/mutex.h>
+#include <kos/job.h>
+
+#include "job_core.h"
+
+#define JOB_THREADS (JOB_WORKERS_MAX + JOB_SPARE_WORKERS + 1)
+
+static jobc_t sched;
+static kthread_t *threads[JOB_THREADS];
+static int nthreads;
+static int inited;
+static volatile int done;
+
+static uint32 helped_cnt;
+
+static mutex_t init_lock = MUTEX_INITIALIZER;
+
+typedef struct pfor {
+    int next;
+    int end;
+    int grain;
+    void (*func)(int first, int last, void *data);
+    void *data;
+} pfor_t;
+
+/* Wake workers for jobs that just went onto the run queues. Interrupts
+   must be disabled. */
+static void job_kick(int woken[JOBC_LANES]) {
+    int i;
+
+    for(i = 0; i < JOBC_LANES; i++) {
+        if(woken[i])
+            genwait_wake_cnt(&sched.ready[i], woken[i], 0);
+    }
+}
+
+/* Finish a job that has run (or was taken off its queue unrun) */
+static void job_complete(struct job *j) {
+    struct jobc_edge *e, *n;
+    int woken[JOBC_LANES] = { 0, 0 };
+    int old, rel;
+
+    old = irq_disable();
+    e = jobc_finish(&sched, j, woken);
+    job_kick(woken);
+    genwait_wake_all(j);
+    rel = jobc_unref(j);
+    irq_restore(old);
+
+    for(; e; e = n) {
+        n = e->next;
+        free(e);
+    }
+
+    if(rel)
+        free(j);
+}
+
+static void job_exec(struct job *j) {
+    j->func(j->data);
+    job_complete(j);
+}
+
+static void *job_worker(void *param) {
+    int lane = (int)(ptr_t)param;
+    struct job *j;
+    int old;
+
+    old = irq_disable();
+
+    while(!done) {
+        if(!(j = jobc_take(&sched, lane))) {
+            genwait_wait(&sched.ready[lane], "job_idle", 0, NULL);
+            continue;
+        }
+
+        if(lane == JOBC_NORMAL)
+            thd_current->flags |= THD_JOB;
+
+        irq_restore(old);
+        job_exec(j);
+        old = irq_disable();
+
+        jobc_idle(&sched, lane);
+        thd_current->flags &= ~THD_JOB;
+    }
+
+    irq_restore(old);
+    return NULL;
+}
+
+void job_worker_blocked(int blocked) {
+    /* Let a spare in while this one sleeps */
+    if(jobc_blocked(&sched, blocked))
+        genwait_wake_one(&sched.ready[JOBC_NORMAL]);
+}
+
+static void job_stop_threads(void) {
+    int old, i;
+
+    old = irq_disable();
+    done = 1;
+
+    for(i = 0; i < JOBC_LANES; i++)
+        genwait_wake_all(&sched.ready[i]);
+
+    irq_restore(old);
+
+    for(i = 0; i < nthreads; i++)
+        thd_join(threads[i], NULL);
+
+    nthreads = 0;
+}
+
+int job_init(int workers) {
+    kthread_t *t;
+    int i, lane;
+
+    if(workers < 1 || workers > JOB_WORKERS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&init_lock);
+
+    if(inited) {
+        mutex_unlock(&init_lock);
+        return 0;
+    }
+
+    jobc_init(&sched, workers);
+    done = 0;
+    helped_cnt = 0;
+
+    /* The first thread is the background lane's */
+    for(i = 0; i < workers + JOB_SPARE_WORKERS + 1; i++) {
+        lane = i ? JOBC_NORMAL : JOBC_BACKGROUND;
+
+        if(!(t = thd_create(0, job_worker, (void *)(ptr_t)lane))) {
+            job_stop_threads();
+            mutex_unlock(&init_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        threads[nthreads++] = t;
+
+        if(lane == JOBC_BACKGROUND) {
+            thd_set_label(t, "[job background]");
+            thd_set_prio(t, JOB_BACKGROUND_PRIO);
+        }
+        else {
+            thd_set_label(t, "[job worker]");
+        }
+    }
+
+    inited = 1;
+    mutex_unlock(&init_lock);
+    return 0;
+}
+
+void job_shutdown(void) {
+    mutex_lock(&init_lock);
+
+    if(inited) {
+        job_stop_threads();
+        inited = 0;
+    }
+
+    mutex_unlock(&init_lock);
+}
+
+job_t *job_create(job_func_t func, void *data, int flags) {
+    struct job *j;
+
+    if(!func) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!inited && job_init(JOB_WORKERS_DEFAULT) < 0)
+        return NULL;
+
+    if(!(j = (struct job *)malloc(sizeof(struct job)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    jobc_job_init(j, func, data,
+                  (flags & JOB_BACKGROUND) ? JOBC_BACKGROUND : JOBC_NORMAL);
+    return j;
+}
+
+int job_depend(job_t *job, job_t *on) {
+    struct jobc_edge *e;
+    int old, used;
+
+    if(job->state != JOBC_NEW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(e = (struct jobc_edge *)malloc(sizeof(struct jobc_edge)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    old = irq_disable();
+    used = jobc_depend(job, on, e);
+    irq_restore(old);
+
+    if(!used)
+        free(e);
+
+    return 0;
+}
+
+int job_submit(job_t *job) {
+    int woken[JOBC_LANES] = { 0, 0 };
+    int old;
+
+    old = irq_disable();
+
+    if(job->state != JOBC_NEW) {
+        irq_restore(old);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(jobc_submit(&sched, job)) {
+        woken[job->lane] = 1;
+        job_kick(woken);
+    }
+
+    irq_restore(old);
+    return 0;
+}
+
+job_t *job_run(job_func_t func, void *data, int flags) {
+    job_t *j = job_create(func, data, flags);
+
+    if(j)
+        job_submit(j);
+
+    return j;
+}
+
+job_t *job_then(job_t *job, job_func_t func, void *data, int flags) {
+    job_t *j = job_create(func, data, flags);
+
+    if(!j)
+        return NULL;
+
+    /* Nothing knows about it yet, so it can just be freed */
+    if(job_depend(j, job) < 0) {
+        free(j);
+        return NULL;
+    }
+
+    job_submit(j);
+    return j;
+}
+
+int job_done(job_t *job) {
+    return job->state == JOBC_DONE;
+}
+
+int job_wait(job_t *job, int timeout) {
+    struct job *j;
+    int old, rv = 0;
+
+    if(irq_inside_int()) {
+        errno = EPERM;
+        return -1;
+    }
+
+    if(job->state == JOBC_NEW) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    old = irq_disable();
+
+    while(job->state != JOBC_DONE) {
+        /* A worker sleeping here would hold up the pool, so it keeps
+           running queued jobs until there are none left. */
+        if((thd_current->flags & THD_JOB) &&
+                (j = jobc_pop(&sched, JOBC_NORMAL))) {
+            helped_cnt++;
+            irq_restore(old);
+            job_exec(j);
+            old = irq_disable();
+            continue;
+        }
+
+        if(genwait_wait(job, "job_wait", timeout, NULL) < 0) {
+            errno = ETIMEDOUT;
+            rv = -1;
+            break;
+        }
+    }
+
+    irq_restore(old);
+    return rv;
+}
+
+void job_release(job_t *job) {
+    int old, rel;
+
+    old = irq_disable();
+    rel = jobc_unref(job);
+    irq_restore(old);
+
+    if(rel)
+        free(job);
+}
+
+/* Hand out the next chunk of a parallel_for */
+static int pfor_take(pfor_t *p, int *first, int *last) {
+    int old, rv = 0;
+
+    old = irq_disable();
+
+    if(p->next < p->end) {
+        *first = p->next;
+        *last = p->end - p->next > p->grain ? p->next + p->grain : p->end;
+        p->next = *last;
+        rv = 1;
+    }
+
+    irq_restore(old);
+    return rv;
+}
+
+static void pfor_run(void *data) {
+    pfor_t *p = (pfor_t *)data;
+    int first, last;
+
+    while(pfor_take(p, &first, &last))
+        p->func(first, last, p->data);
+}
+
+int job_parallel_for(int start, int end, int grain,
+                     void (*func)(int first, int last, void *data),
+                     void *data) {
+    job_t *helpers[JOB_WORKERS_MAX];
+    pfor_t p;
+    int i, n, chunks, old, unrun, nworkers;
+
+    if(!func || end < start || grain < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(end == start)
+        return 0;
+
+    if(!inited && job_init(JOB_WORKERS_DEFAULT) < 0)
+        return -1;
+
+    nworkers = sched.nworkers;
+
+    if(!grain)
+        grain = (end - start + nworkers * 4 - 1) / (nworkers * 4);
+
+    chunks = (end - start + grain - 1) / grain;
+    n = chunks - 1 < nworkers ? chunks - 1 : nworkers;
+
+    p.next = start;
+    p.end = end;
+    p.grain = grain;
+    p.func = func;
+    p.data = data;
+
+    /* If a helper can't be had, the ones there are (and this thread) just
+       do more of the chunks. */
+    for(i = 0; i < n; i++) {
+        if(!(helpers[i] = job_run(pfor_run, &p, 0)))
+            break;
+    }
+
+    n = i;
+    pfor_run(&p);
+
+    /* Helpers that haven't started yet have nothing left to do, so don't
+       wait for a worker to get to them. */
+    for(i = 0; i < n; i++) {
+        old = irq_disable();
+        unrun = jobc_unqueue(&sched, helpers[i]);
+        irq_restore(old);
+
+        if(unrun)
+            job_complete(helpers[i]);
+        else
+            job_wait(helpers[i], 0);
+
+        job_release(helpers[i]);
+    }
+
+    return 0;
+}
+
+void job_get_stats(job_stats_t *stats) {
+    int old = irq_disable();
+
+    stats->submitted = sched.submitted;
+    stats->completed = sched.completed;
+    stats->queued = sched.queued[JOBC_NORMAL];
+    stats->queued_max = sched.queued_max[JOBC_NORMAL];
+    stats->bg_queued = sched.queued[JOBC_BACKGROUND];
+    stats->bg_queued_max = sched.queued_max[JOBC_BACKGROUND];
+    stats->active = sched.active;
+    stats->blocked = sched.blocked;
+    stats->helped = helped_cnt;
+
+    irq_restore(old);
+}
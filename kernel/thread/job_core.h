@@ -0,0 +1,211 @@
+/* KallistiOS ##version##
+
+   job_core.h
+
+*/
+
+#ifndef __JOB_CORE_H
+#define __JOB_CORE_H
+
+/* The run queues and dependency tracking behind kos/job.h, shared by job.c
+   and utils/jobbench, which includes this straight from the kernel tree.
+   Nothing here locks, sleeps or allocates: everything is called with the
+   scheduler's lock held (interrupts disabled in the kernel, a mutex on the
+   host), and the caller does any waking and freeing once it has let go.
+   The includer provides sys/queue.h and the uint32 type.
+
+   A job's pending count is the number of jobs it is still waiting on, plus
+   one until it has been submitted, so it goes onto a run queue when that
+   drops to zero. Each job it is waiting on holds an edge back to it. A job
+   starts with two references: the creator's, and one the scheduler drops
+   once the job has finished.
+
+   The pool lane runs at most nworkers jobs at once, counting only workers
+   that are awake. There are a few more worker threads than that; the spares
+   only get to take a job while others are blocked in theirs. */
+
+#define JOBC_NEW        0   /* Created, not submitted yet */
+#define JOBC_WAITING    1   /* Submitted, waiting on other jobs */
+#define JOBC_READY      2   /* On a run queue */
+#define JOBC_RUNNING    3
+#define JOBC_DONE       4
+
+/* Run queues: the worker pool's, and the background lane's */
+#define JOBC_NORMAL     0
+#define JOBC_BACKGROUND 1
+#define JOBC_LANES      2
+
+struct job;
+
+struct jobc_edge {
+    struct jobc_edge *next;
+    struct job *job;            /* The job waiting */
+};
+
+struct job {
+    TAILQ_ENTRY(job) q;
+    void (*func)(void *data);
+    void *data;
+    int lane;
+    volatile int state;
+    int pending;
+    int refs;
+    struct jobc_edge *dependents;
+};
+
+TAILQ_HEAD(jobc_queue, job);
+
+typedef struct jobc {
+    struct jobc_queue ready[JOBC_LANES];
+    uint32 queued[JOBC_LANES];
+    uint32 queued_max[JOBC_LANES];
+    uint32 submitted;
+    uint32 completed;
+    int nworkers;               /* Pool jobs to run at once */
+    int active;                 /* Pool workers running a job, not blocked */
+    uint32 blocked;             /* Times a pool job has blocked */
+} jobc_t;
+
+static inline void jobc_init(jobc_t *s, int nworkers) {
+    int i;
+
+    for(i = 0; i < JOBC_LANES; i++) {
+        TAILQ_INIT(&s->ready[i]);
+        s->queued[i] = s->queued_max[i] = 0;
+    }
+
+    s->submitted = s->completed = 0;
+    s->nworkers = nworkers;
+    s->active = 0;
+    s->blocked = 0;
+}
+
+static inline void jobc_job_init(struct job *j, void (*func)(void *),
+                                 void *data, int lane) {
+    j->func = func;
+    j->data = data;
+    j->lane = lane;
+    j->state = JOBC_NEW;
+    j->pending = 1;
+    j->refs = 2;
+    j->dependents = NULL;
+}
+
+static inline void jobc_ready(jobc_t *s, struct job *j) {
+    j->state = JOBC_READY;
+    TAILQ_INSERT_TAIL(&s->ready[j->lane], j, q);
+
+    if(++s->queued[j->lane] > s->queued_max[j->lane])
+        s->queued_max[j->lane] = s->queued[j->lane];
+}
+
+/* Make job (which hasn't been submitted) wait for on. Returns 0 if on has
+   already finished, in which case e wasn't used. */
+static inline int jobc_depend(struct job *job, struct job *on,
+                              struct jobc_edge *e) {
+    if(on->state == JOBC_DONE)
+        return 0;
+
+    e->job = job;
+    e->next = on->dependents;
+    on->dependents = e;
+    job->pending++;
+    return 1;
+}
+
+/* Returns non-zero if the job went straight onto a run queue. */
+static inline int jobc_submit(jobc_t *s, struct job *j) {
+    s->submitted++;
+    j->state = JOBC_WAITING;
+
+    if(--j->pending)
+        return 0;
+
+    jobc_ready(s, j);
+    return 1;
+}
+
+static inline struct job *jobc_pop(jobc_t *s, int lane) {
+    struct job *j = TAILQ_FIRST(&s->ready[lane]);
+
+    if(j) {
+        TAILQ_REMOVE(&s->ready[lane], j, q);
+        s->queued[lane]--;
+        j->state = JOBC_RUNNING;
+    }
+
+    return j;
+}
+
+/* Take the next job for a worker on the given lane, or NULL if there's none
+   or the pool already has nworkers jobs running. Hand a pool job back with
+   jobc_idle() once it's finished. */
+static inline struct job *jobc_take(jobc_t *s, int lane) {
+    struct job *j;
+
+    if(lane == JOBC_NORMAL && s->active >= s->nworkers)
+        return NULL;
+
+    if((j = jobc_pop(s, lane)) && lane == JOBC_NORMAL)
+        s->active++;
+
+    return j;
+}
+
+static inline void jobc_idle(jobc_t *s, int lane) {
+    if(lane == JOBC_NORMAL)
+        s->active--;
+}
+
+/* A pool worker running a job has gone to sleep in it (blocked non-zero) or
+   woken up again. Returns non-zero if a spare should be woken to stand in
+   for it. */
+static inline int jobc_blocked(jobc_t *s, int blocked) {
+    if(!blocked) {
+        s->active++;
+        return 0;
+    }
+
+    s->blocked++;
+    return --s->active < s->nworkers && !TAILQ_EMPTY(&s->ready[JOBC_NORMAL]);
+}
+
+/* Take a job that nobody has started off its run queue, so it can be
+   finished without running. Returns 0 if it wasn't waiting there. */
+static inline int jobc_unqueue(jobc_t *s, struct job *j) {
+    if(j->state != JOBC_READY)
+        return 0;
+
+    TAILQ_REMOVE(&s->ready[j->lane], j, q);
+    s->queued[j->lane]--;
+    j->state = JOBC_RUNNING;
+    return 1;
+}
+
+/* Mark a job finished and queue any jobs that were only waiting on it;
+   woken[lane] is increased by how many went onto each run queue. Returns
+   the job's edges, for the caller to free. */
+static inline struct jobc_edge *jobc_finish(jobc_t *s, struct job *j,
+                                            int woken[JOBC_LANES]) {
+    struct jobc_edge *e, *list = j->dependents;
+
+    j->state = JOBC_DONE;
+    j->dependents = NULL;
+    s->completed++;
+
+    for(e = list; e; e = e->next) {
+        if(--e->job->pending == 0) {
+            jobc_ready(s, e->job);
+            woken[e->job->lane]++;
+        }
+    }
+
+    return list;
+}
+
+/* Drop a reference. Returns non-zero if the job can be freed. */
+static inline int jobc_unref(struct job *j) {
+    return --j->refs == 0;
+}
+
+#endif  /* __JOB_CORE_H */
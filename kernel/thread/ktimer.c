@@ -0,0 +1,235 @@
+/* KallistiOS ##version##
+
+   ktimer.c
+
+*/
+
+/* Kernel timers. Pending timers sit on a queue sorted by deadline (like
+   genwait's timer queue; there are rarely more than a handful), and the
+   timer thread genwaits on the queue with a timeout of the first deadline.
+   Arming a timer that becomes the new head of the queue wakes the thread
+   early so it can go back to sleep for the shorter time. Everything that
+   touches the queue does so with interrupts disabled, so timers can be
+   armed and cancelled from interrupts. */
+
+#include <errno.h>
+#include <string.h>
+
+#include <arch/irq.h>
+#include <arch/timer.h>
+#include <kos/thread.h>
+#include <kos/genwait.h>
+#include <kos/ktimer.h>
+
+static TAILQ_HEAD(ktimer_queue, ktimer) timers;
+static kthread_t *ktimer_thd;
+static volatile int done;
+
+/* The timer whose callback is running, so ktimer_cancel() can wait for it */
+static ktimer_t *volatile running;
+
+static ktimer_stats_t stats;
+
+/* Insert a timer after any others with the same deadline. Returns non-zero
+   if it went at the head of the queue. Interrupts must be disabled. */
+static int tq_insert(ktimer_t *t) {
+    ktimer_t *i;
+
+    t->pending = 1;
+    stats.pending++;
+
+    TAILQ_FOREACH(i, &timers, q) {
+        if(t->deadline < i->deadline) {
+            TAILQ_INSERT_BEFORE(i, t, q);
+            return t == TAILQ_FIRST(&timers);
+        }
+    }
+
+    TAILQ_INSERT_TAIL(&timers, t, q);
+    return t == TAILQ_FIRST(&timers);
+}
+
+static void tq_remove(ktimer_t *t) {
+    TAILQ_REMOVE(&timers, t, q);
+    t->pending = 0;
+    stats.pending--;
+}
+
+static void record(ktimer_t *t) {
+    uint64 now = timer_us_gettime64();
+    uint32 late = 0;
+
+    if(now > t->deadline * 1000)
+        late = (uint32)(now - t->deadline * 1000);
+
+    stats.fired++;
+    stats.lateness_total += late;
+
+    if(late >= 1000)
+        stats.late++;
+
+    if(late > stats.lateness_max)
+        stats.lateness_max = late;
+}
+
+static void *ktimer_thd_func(void *param) {
+    ktimer_t *t;
+    uint64 now;
+    int old;
+
+    (void)param;
+
+    old = irq_disable();
+
+    while(!done) {
+        t = TAILQ_FIRST(&timers);
+        now = timer_ms_gettime64();
+
+        if(!t || t->deadline > now) {
+            /* Sleep until the first deadline, or until woken because the
+               queue changed. A timeout of 0 would mean forever. */
+            genwait_wait(&timers, "ktimer", t ? (int)(t->deadline - now) : 0,
+                         NULL);
+            continue;
+        }
+
+        tq_remove(t);
+        record(t);
+
+        /* Re-arm periodic timers before the callback, so it can cancel or
+           re-arm them itself. */
+        if(t->period) {
+            t->deadline += t->period;
+
+            if(t->deadline <= now) {
+                stats.skipped += (now - t->deadline) / t->period + 1;
+                t->deadline += ((now - t->deadline) / t->period + 1) *
+                               t->period;
+            }
+
+            tq_insert(t);
+        }
+
+        /* The timer can be freed once its callback returns, so don't touch
+           it after this. */
+        running = t;
+        irq_restore(old);
+
+        t->cb(t, t->data);
+
+        old = irq_disable();
+        running = NULL;
+        genwait_wake_all((void *)&running);
+    }
+
+    irq_restore(old);
+    return NULL;
+}
+
+void ktimer_setup(ktimer_t *timer, ktimer_cb_t cb, void *data) {
+    memset(timer, 0, sizeof(ktimer_t));
+    timer->cb = cb;
+    timer->data = data;
+}
+
+int ktimer_arm(ktimer_t *timer, uint32 ms, uint32 period) {
+    int old;
+
+    if(!timer->cb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    old = irq_disable();
+
+    if(timer->pending)
+        tq_remove(timer);
+
+    timer->deadline = timer_ms_gettime64() + ms;
+    timer->period = period;
+
+    /* Let the timer thread know if it needs to wake up sooner */
+    if(tq_insert(timer) && ktimer_thd)
+        genwait_wake_all(&timers);
+
+    irq_restore(old);
+    return 0;
+}
+
+int ktimer_cancel(ktimer_t *timer) {
+    int old, rv = 0;
+
+    old = irq_disable();
+
+    if(timer->pending) {
+        tq_remove(timer);
+        rv = 1;
+    }
+
+    /* Wait for the callback to finish, if we can. Nothing sleeps on the
+       queue head, so there's no need to wake the timer thread. */
+    while(running == timer && !irq_inside_int() && !ktimer_is_current())
+        genwait_wait((void *)&running, "ktimer_cancel", 0, NULL);
+
+    irq_restore(old);
+    return rv;
+}
+
+int ktimer_pending(ktimer_t *timer) {
+    return timer->pending;
+}
+
+int ktimer_is_current(void) {
+    return ktimer_thd && thd_current == ktimer_thd;
+}
+
+void ktimer_get_stats(ktimer_stats_t *st) {
+    int old = irq_disable();
+    *st = stats;
+    irq_restore(old);
+}
+
+void ktimer_reset_stats(void) {
+    int old = irq_disable();
+    uint32 pending = stats.pending;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.pending = pending;
+    irq_restore(old);
+}
+
+int ktimer_init(void) {
+    TAILQ_INIT(&timers);
+    memset(&stats, 0, sizeof(stats));
+    running = NULL;
+    done = 0;
+
+    if(!(ktimer_thd = thd_create(0, ktimer_thd_func, NULL)))
+        return -1;
+
+    /* Callbacks are meant to be short, so keep them ahead of ordinary
+       threads to keep them on time. */
+    thd_set_label(ktimer_thd, "[ktimer]");
+    thd_set_prio(ktimer_thd, PRIO_DEFAULT - 1);
+
+    return 0;
+}
+
+void ktimer_shutdown(void) {
+    ktimer_t *t;
+    int old;
+
+    if(!ktimer_thd)
+        return;
+
+    /* This is only called from thd_shutdown(), which frees every thread
+       without running it again, so just stop anything still armed. */
+    old = irq_disable();
+    done = 1;
+    ktimer_thd = NULL;
+
+    while((t = TAILQ_FIRST(&timers)))
+        tq_remove(t);
+
+    irq_restore(old);
+}
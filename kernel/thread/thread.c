@@ -18,6 +18,8 @@
 #include <kos/rwsem.h>
 #include <kos/cond.h>
 #include <kos/genwait.h>
+#include <kos/slab.h>
+#include <kos/ktimer.h>
 #include <arch/irq.h>
 #include <arch/timer.h>
 #include <arch/arch.h>
@@ -25,7 +27,8 @@
 /*
 
 This module supports thread scheduling in KOS. The timer interrupt is used
-to re-schedule the processor HZ times per second in pre-emptive mode.
+to re-schedule the processor at the end of each thread's time slice in
+pre-emptive mode (1000 / HZ ms unless changed with thd_set_slice()).
 This is a fairly simplistic scheduler, though it does employ some
 standard advanced OS tactics like priority scheduling and semaphores.
 
@@ -66,9 +69,32 @@ static semaphore_t thd_reap_sem;
 /* Number of threads active in the system. */
 static uint32 thd_count = 0;
 
+/* Number of those that belong to the kernel (idle, reaper and ktimer); once
+   they're all that's left, there's nothing more to do. */
+static uint32 thd_kernel_count = 2;
+
 /* The idle task */
 static kthread_t *thd_idle_thd = NULL;
 
+/* Where thread structures come from */
+static slab_cache_t *thd_slab = NULL;
+
+/* The thread whose CPU time is being counted, and since when (in us). This
+   isn't always thd_current, which is NULL by the time the scheduler runs if
+   the thread blocked. */
+static kthread_t *thd_charged = NULL;
+static uint64 thd_charge_start;
+
+/* Time slice lengths for each class of priority, in ms, and when the
+   running thread's slice is up */
+static uint32 thd_slices[THD_SLICE_CLASSES] = {
+    1000 / HZ, 1000 / HZ, 1000 / HZ
+};
+static uint64 thd_slice_end;
+
+/* When the primary timer is next due to go off */
+static uint64 thd_timer_due;
+
 /*****************************************************************************/
 /* Debug */
 
@@ -96,9 +122,11 @@ static const char *thd_state_to_str(kthread_t * thd) {
 
 int thd_pslist(int (*pf)(const char *fmt, ...)) {
     kthread_t *cur;
+    uint64 now = timer_us_gettime64();
 
     pf("All threads (may not be deterministic):\n");
-    pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
+    pf("addr\t\ttid\tprio\tflags\twait_timeout\tcpu_ms\truns\tlast_ms\t"
+       "state     name\n");
 
     LIST_FOREACH(cur, &thd_list, t_list) {
         pf("%08lx\t", CONTEXT_PC(cur->context));
@@ -111,6 +139,14 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
 
         pf("%08lx\t", cur->flags);
         pf("%ld\t\t", (uint32)cur->wait_timeout);
+        pf("%lu\t", (uint32)(thd_get_cpu_time(cur) / 1000));
+        pf("%lu\t", cur->run_count);
+
+        if(cur->run_count)
+            pf("%lu\t", (uint32)((now - cur->last_run) / 1000));
+        else
+            pf("-\t");
+
         pf("%10s", thd_state_to_str(cur));
         pf("%s\n", cur->label);
     }
@@ -335,7 +371,7 @@ kthread_t *thd_create(int detach, void * (*routine)(void *param), void *param) {
 
     if(tid >= 0) {
         /* Create a new thread structure */
-        nt = malloc(sizeof(kthread_t));
+        nt = slab_alloc(thd_slab);
 
         if(nt != NULL) {
             /* Clear out potentially unused stuff */
@@ -345,7 +381,7 @@ kthread_t *thd_create(int detach, void * (*routine)(void *param), void *param) {
             nt->stack = (uint32*)malloc(THD_STACK_SIZE);
 
             if(!nt->stack) {
-                free(nt);
+                slab_free(thd_slab, nt);
                 irq_restore(oldirq);
                 return NULL;
             }
@@ -413,6 +449,10 @@ int thd_destroy(kthread_t *thd) {
     /* De-schedule the thread if it's scheduled and free the
        thread structure */
     thd_remove_from_runnable(thd);
+
+    if(thd_charged == thd)
+        thd_charged = NULL;
+
     LIST_REMOVE(thd, t_list);
 
     /* Clean up any thread-local data */
@@ -430,11 +470,14 @@ int thd_destroy(kthread_t *thd) {
         i = i2;
     }
 
+    /* Give back anything sitting in its malloc cache */
+    malloc_tcache_release(thd->malloc_cache);
+
     /* Free its stack */
     free(thd->stack);
 
     /* Free the thread */
-    free(thd);
+    slab_free(thd_slab, thd);
 
     /* Remove it from the count */
     --thd_count;
@@ -455,9 +498,92 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
     return 0;
 }
 
+int thd_set_slice(int cls, int ms) {
+    if(cls < 0 || cls >= THD_SLICE_CLASSES || ms < 1 || ms > 1000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    thd_slices[cls] = ms;
+    return 0;
+}
+
+int thd_get_slice(int cls) {
+    if(cls < 0 || cls >= THD_SLICE_CLASSES)
+        return -1;
+
+    return thd_slices[cls];
+}
+
+uint64 thd_get_cpu_time(kthread_t *thd) {
+    int old = irq_disable();
+    uint64 rv = thd->cpu_time;
+
+    if(thd == thd_charged)
+        rv += timer_us_gettime64() - thd_charge_start;
+
+    irq_restore(old);
+    return rv;
+}
+
 /*****************************************************************************/
 /* Scheduling routines */
 
+static int thd_slice_class(prio_t prio) {
+    if(prio < PRIO_DEFAULT)
+        return THD_SLICE_HIGH;
+    else if(prio == PRIO_DEFAULT)
+        return THD_SLICE_NORMAL;
+    else
+        return THD_SLICE_LOW;
+}
+
+/* Schedule the next timer interrupt: when the running thread's slice is
+   up, or sooner if a timed wait (and so a ktimer) is due before then.
+   Without this, timeouts would only be noticed at the end of the slice. */
+static void thd_timer_rearm(uint64 now) {
+    uint64 next = genwait_next_timeout();
+    uint64 end = thd_slice_end;
+
+    if(next && next < end)
+        end = next;
+
+    if(end <= now)
+        end = now + 1;
+
+    thd_timer_due = end;
+    timer_primary_wakeup((uint32)(end - now));
+}
+
+/* Charge the thread that was running for its time, and start counting for
+   the one about to run. A thread switched to always gets a fresh slice; one
+   that keeps running only does if new_slice is set. */
+static void thd_switch_to(kthread_t *thd, int new_slice, uint64 now) {
+    uint64 us = timer_us_gettime64();
+
+    if(thd_charged)
+        thd_charged->cpu_time += us - thd_charge_start;
+
+    if(thd != thd_charged) {
+        thd->run_count++;
+        thd->last_run = us;
+        new_slice = 1;
+    }
+
+    thd_charged = thd;
+    thd_charge_start = us;
+
+    if(new_slice) {
+        thd_slice_end = now + thd_slices[thd_slice_class(thd->prio)];
+
+        /* Switches from other interrupts (and thd_schedule_next()) don't go
+           through the timer handler, so make sure the timer doesn't let the
+           new slice overrun. */
+        if(thd_mode == THD_MODE_PREEMPT && thd_slice_end < thd_timer_due)
+            thd_timer_rearm(now);
+    }
+}
+
 /* Thread scheduler; this function will find a new thread to run when a
    context switch is requested. No work is done in here except to change
    out the thd_current variable contents. Assumed that we are in an
@@ -473,6 +599,9 @@ int thd_set_prio(kthread_t *thd, prio_t prio) {
    IRQ after doing something like a sem_signal, where you'd ideally like
    to make sure the priorities are all straight before returning, but you
    don't want a full context switch inside the same priority group.
+
+   Going round the priority group also starts a new time slice, while
+   staying at the front of the line keeps what's left of the current one.
 */
 void thd_schedule(int front_of_line, uint64 now) {
     int dontenq;
@@ -485,9 +614,9 @@ void thd_schedule(int front_of_line, uint64 now) {
        thread blocked itself somewhere) or if it's a zombie (below) */
     dontenq = !thd_current;
 
-    /* If there's only two thread left, it's the idle task and the reaper task:
-       exit the OS */
-    if(thd_count == 2) {
+    /* If the only threads left are the idle task, the reaper task and the
+       timer thread: exit the OS */
+    if(thd_count == thd_kernel_count) {
         dbgio_printf("\nthd_schedule: idle tasks are the only things left; exiting\n");
         arch_exit();
     }
@@ -532,6 +661,7 @@ void thd_schedule(int front_of_line, uint64 now) {
     /* We should now have a runnable thread, so remove it from the
        run queue and switch to it. */
     thd_remove_from_runnable(thd);
+    thd_switch_to(thd, !front_of_line, now);
 
     thd_current = thd;
     _impure_ptr = &thd->thd_reent;
@@ -572,6 +702,7 @@ void thd_schedule_next(kthread_t *thd) {
     }
 
     thd_remove_from_runnable(thd);
+    thd_switch_to(thd, 1, timer_ms_gettime64());
     thd_current = thd;
     _impure_ptr = &thd->thd_reent;
     thd_current->state = STATE_RUNNING;
@@ -587,6 +718,11 @@ irq_context_t * thd_choose_new() {
     /* Do any re-scheduling */
     thd_schedule(0, now);
 
+    /* A thread that just blocked may have started a timed wait, so the next
+       tick may need to come sooner. The new thread gets a full slice. */
+    if(thd_mode == THD_MODE_PREEMPT)
+        thd_timer_rearm(now);
+
     /* Return the new IRQ context back to the caller */
     return &thd_current->context;
 }
@@ -605,8 +741,11 @@ static void thd_timer_hnd(irq_context_t *context) {
 
     //printf("timer woke at %d\n", (uint32)now);
 
-    thd_schedule(0, now);
-    timer_primary_wakeup(1000 / HZ);
+    /* Only go round the priority group once the slice is up. A tick that
+       came early for a timeout just lets anything it woke with a higher
+       priority in. */
+    thd_schedule(now < thd_slice_end, now);
+    thd_timer_rearm(now);
 }
 
 /*****************************************************************************/
@@ -779,6 +918,7 @@ int thd_set_mode(int mode) {
 
     if(thd_mode == THD_MODE_COOP) {
         /* Schedule our first pre-emption wakeup */
+        thd_timer_due = timer_ms_gettime64() + 1000 / HZ;
         timer_primary_wakeup(1000 / HZ);
     }
 
@@ -839,9 +979,21 @@ int thd_init(int mode) {
     if(thd_mode != THD_MODE_NONE)
         return -1;
 
+    /* Set up the malloc thread cache, if requested. This has to happen before
+       any threads exist, so that no thread starts using it halfway. */
+    malloc_tcache_enable(mode & THD_MALLOC_TCACHE);
+    mode &= ~THD_MALLOC_TCACHE;
+
     /* Setup our mode as appropriate */
     thd_mode = mode;
 
+    /* Set up the thread structure cache */
+    if(!(thd_slab = slab_cache_create("kthread", sizeof(kthread_t),
+                                      SLAB_CACHE_ALIGN, NULL))) {
+        thd_mode = THD_MODE_NONE;
+        return -1;
+    }
+
     /* Initialize handle counters */
     tid_highest = 1;
 
@@ -884,6 +1036,8 @@ int thd_init(int mode) {
     /* Main thread -- the kern thread */
     thd_current = kern;
     irq_set_context(&kern->context);
+    thd_charged = NULL;
+    thd_switch_to(kern, 1, timer_ms_gettime64());
 
     /* Re-initialize jiffy counter */
     jiffies = 0;
@@ -891,12 +1045,19 @@ int thd_init(int mode) {
     /* Initialize thread sync primitives */
     genwait_init();
 
+    /* Start the kernel timer thread */
+    thd_kernel_count = 2;
+
+    if(!ktimer_init())
+        thd_kernel_count++;
+
     /* Setup our pre-emption handler */
     timer_primary_set_callback(thd_timer_hnd);
 
     /* If we're in pre-emptive mode, then schedule the first context switch */
     if(thd_mode == THD_MODE_PREEMPT) {
         /* Schedule our first wakeup */
+        thd_timer_due = timer_ms_gettime64() + 1000 / HZ;
         timer_primary_wakeup(1000 / HZ);
 
         printf("thd: pre-emption enabled, HZ=%d\n", HZ);
@@ -916,16 +1077,25 @@ void thd_shutdown() {
         timer_primary_set_callback(NULL);
     }
 
+    /* Stop using the malloc caches before we tear them down */
+    malloc_tcache_enable(0);
+
+    ktimer_shutdown();
+
     /* Kill remaining live threads */
     n1 = LIST_FIRST(&thd_list);
 
     while(n1 != NULL) {
         n2 = LIST_NEXT(n1, t_list);
+        malloc_tcache_release(n1->malloc_cache);
         free(n1->stack);
-        free(n1);
+        slab_free(thd_slab, n1);
         n1 = n2;
     }
 
+    slab_cache_destroy(thd_slab);
+    thd_slab = NULL;
+
     sem_destroy(&thd_reap_sem);
 
     /* Shutdown thread sync primitives */
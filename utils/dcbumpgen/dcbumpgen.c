@@ -23,53 +23,59 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
 
-/* TODO:
- * With this utility included, there are now three utilities
- * (the other two being "vqenc" and "kmgenc") using common texture
- * operations such as twiddling and loading of png and jpeg images.
- * Maybe it is time to break that stuff out into its own library
- * or create a megatool consisting of all the tree tools in one
- * executable.
- */
+/* Image loading, twiddling and batching are shared with vqenc and kmgenc
+ * (see ../imageio). */
 #include "get_image.h"
+#include "twiddle.h"
+#include "batch.h"
 
 void printUsage() {
 	printf("dcbumpgen - Dreamcast bumpmap generator v0.1\n");
 	printf("Copyright (c) 2005 Fredrik Ehnbom\n");
 	printf("usage: dcbumpgen <infile.png/.jpg> <outfile.raw>\n");
+	printf("       dcbumpgen [-j threads] [-c cachefile] -f manifest\n");
+	printf("\n");
+	printf("The manifest has one \"infile [outfile]\" per line (- reads it from\n");
+	printf("stdin); outfile defaults to infile with a .raw extension. The files\n");
+	printf("are converted on several threads, and with -c, inputs that haven't\n");
+	printf("changed since the last run are skipped.\n");
 }
 
-/* twiddling stuff copied from kmgenc.c */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-	((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
+static int pow2(int x) {
+	return x >= 1 && x <= 1024 && !(x & (x - 1));
+}
 
-int main(int argc, char **argv) {
+static int bumpgen(const char *in, const char *out, void *data) {
 	image_t img;
 	FILE *fp;
-	int y, x;
+	int y, x, rv = 0;
 	unsigned char *buffer;
+	uint16_t *twidbuffer;
 	int imgpos, dest;
 
-	if (argc != 3) {
-		printUsage();
-		exit(1);
+	if (get_image(in, &img) < 0) {
+		fprintf(stderr, "couldn't open %s\n", in);
+		return -1;
 	}
 
-	if (get_image(argv[1], &img) < 0) {
-		fprintf(stderr, "couldn't open %s\n", argv[1]);
+	if (!pow2(img.w) || !pow2(img.h)) {
+		fprintf(stderr, "%s: %dx%d isn't a power of two up to 1024\n",
+			in, img.w, img.h);
+		free(img.data);
 		return -1;
 	}
 
-	/* TODO:
-	 * - error-checking for missing files and other file failures
-	 * - check that image is power of two
-	 */
-	fp = fopen(argv[2], "wb");
 	buffer = malloc(2 * img.w * img.h);
+	twidbuffer = malloc(2 * img.w * img.h);
+	if (!buffer || !twidbuffer) {
+		fprintf(stderr, "%s: out of memory\n", in);
+		rv = -1;
+		goto out;
+	}
 
 	imgpos = 1; /* 1 to skip the alpha-channel */
 	dest = 0;
@@ -97,27 +103,58 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	/* twiddle code based on code from kmgenc.c */
-	int min = MIN(img.w, img.h);
-	int mask = min-1;
-	short *sbuffer = (short*) buffer;
-	short *twidbuffer = malloc(2 * img.w * img.h);
-	for (y=0; y<img.h; y++) {
-		int yout = y;
-		for (x=0; x<img.w; x++) {
-			twidbuffer[TWIDOUT(x&mask, yout&mask) +
-				(x/min + yout/min)*min*min] = sbuffer[y*img.w+x];
-		}
+	twiddle16((uint16_t *) buffer, twidbuffer, img.w, img.h);
+
+	fp = fopen(out, "wb");
+	if (!fp) {
+		fprintf(stderr, "couldn't create %s\n", out);
+		rv = -1;
+		goto out;
 	}
 
-	fwrite(twidbuffer, 1, 2* img.w * img.h, fp);
-	fclose(fp);
+	if (fwrite(twidbuffer, 1, 2 * img.w * img.h, fp) != 2 * img.w * img.h)
+		rv = -1;
+	if (fclose(fp) || rv < 0) {
+		fprintf(stderr, "couldn't write %s\n", out);
+		remove(out);
+		rv = -1;
+	}
 
+out:
 	free(buffer);
 	free(twidbuffer);
-	if (img.data) {
-		free(img.data);
-	}
-	return 0;
+	free(img.data);
+	return rv;
 }
 
+int main(int argc, char **argv) {
+	batch_t b;
+	int i;
+
+	if (argc == 3 && argv[1][0] != '-')
+		return bumpgen(argv[1], argv[2], NULL) < 0 ? 1 : 0;
+
+	memset(&b, 0, sizeof(b));
+	b.ext = "raw";
+	b.salt = "dcbumpgen 1";
+	b.verbose = 1;
+	b.convert = bumpgen;
+
+	for (i = 1; i < argc; i++) {
+		if (i + 1 < argc && !strcmp(argv[i], "-f"))
+			b.manifest = argv[++i];
+		else if (i + 1 < argc && !strcmp(argv[i], "-c"))
+			b.cache = argv[++i];
+		else if (i + 1 < argc && !strcmp(argv[i], "-j"))
+			b.threads = atoi(argv[++i]);
+		else
+			break;
+	}
+
+	if (i != argc || !b.manifest) {
+		printUsage();
+		exit(1);
+	}
+
+	return batch_run(&b) ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+/* KallistiOS ##version##
+
+   hostcheck.h
+
+   Common pieces of the host tools in utils that build part of the kernel
+   straight from the source tree to check and time it. Each tool runs its
+   checks first, then its benchmarks, and exits with 1 if any check failed.
+
+   Timings from these tools are only good for comparing one build of the
+   kernel code with another (e.g. before and after a change); the host is
+   nothing like an SH4.
+*/
+
+#ifndef __HOSTCHECK_H
+#define __HOSTCHECK_H
+
+#include <stdio.h>
+#include <time.h>
+
+static int check_failures;
+
+/* Report a failed check, with a printf-style message. */
+#define CHECK(c, ...) do { \
+        if(!(c)) { \
+            printf("FAIL: " __VA_ARGS__); \
+            printf("\n"); \
+            check_failures++; \
+        } \
+    } while(0)
+
+/* Print how the checks went; the result is the tool's exit status. */
+static inline int check_result(void) {
+    printf("self check: %s (%d failures)\n",
+           check_failures ? "FAILED" : "ok", check_failures);
+    return check_failures ? 1 : 0;
+}
+
+/* Wall clock time in seconds, for timing. */
+static inline double check_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif  /* __HOSTCHECK_H */
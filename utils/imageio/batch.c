@@ -0,0 +1,409 @@
+/* KallistiOS ##version##
+
+   batch.c
+
+   The cache is a text file of "hash output" lines. The hash is FNV-1a over
+   the batch's salt and the input's contents, so it changes when either the
+   input or the tool's settings do. It is rewritten after every run, keeping
+   entries for outputs that weren't part of the run and dropping those of
+   jobs that failed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "batch.h"
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+#define JOB_PENDING 0
+#define JOB_DONE    1
+#define JOB_SKIPPED 2
+#define JOB_FAILED  3
+
+typedef struct job {
+    char *in;
+    char *out;
+    uint64_t hash;
+    int hashed;
+    int state;
+} job_t;
+
+typedef struct entry {
+    uint64_t hash;
+    char *out;
+} entry_t;
+
+typedef struct run {
+    const batch_t *b;
+    job_t *jobs;
+    int njobs;
+    entry_t *cache;
+    int ncache;
+    int next;
+    pthread_mutex_t lock;
+} run_t;
+
+static uint64_t fnv(uint64_t h, const unsigned char *p, size_t n) {
+    while(n--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+
+    return h;
+}
+
+static int hash_file(const char *fn, const char *salt, uint64_t *out) {
+    unsigned char buf[65536];
+    uint64_t h = FNV_OFFSET;
+    FILE *fp;
+    size_t n;
+
+    if(!(fp = fopen(fn, "rb")))
+        return -1;
+
+    if(salt)
+        h = fnv(h, (const unsigned char *)salt, strlen(salt) + 1);
+
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        h = fnv(h, buf, n);
+
+    n = ferror(fp);
+    fclose(fp);
+
+    if(n)
+        return -1;
+
+    *out = h;
+    return 0;
+}
+
+char *batch_outname(const char *f, const char *ext) {
+    const char *dot = strrchr(f, '.');
+    const char *slash = strrchr(f, '/');
+    size_t len;
+    char *rv;
+
+    /* Only a dot in the file name itself starts an extension */
+    if(!dot || (slash && dot < slash))
+        len = strlen(f);
+    else
+        len = dot - f;
+
+    if(!(rv = malloc(len + strlen(ext) + 2)))
+        return NULL;
+
+    memcpy(rv, f, len);
+    sprintf(rv + len, ".%s", ext);
+    return rv;
+}
+
+static int add_job(run_t *r, const char *in, const char *out) {
+    job_t *j;
+
+    if(!out && !r->b->ext)
+        return -1;
+
+    if(!(r->njobs & (r->njobs - 1))) {
+        j = realloc(r->jobs, (r->njobs ? r->njobs * 2 : 16) * sizeof(job_t));
+
+        if(!j)
+            return -1;
+
+        r->jobs = j;
+    }
+
+    j = r->jobs + r->njobs;
+    memset(j, 0, sizeof(job_t));
+    j->in = strdup(in);
+    j->out = out ? strdup(out) : batch_outname(in, r->b->ext);
+
+    if(!j->in || !j->out) {
+        free(j->in);
+        free(j->out);
+        return -1;
+    }
+
+    r->njobs++;
+    return 0;
+}
+
+/* Trim trailing whitespace in place and return the first non-space. */
+static char *trim(char *s) {
+    char *e = s + strlen(s);
+
+    while(e > s && isspace((unsigned char)e[-1]))
+        *--e = 0;
+
+    while(isspace((unsigned char)*s))
+        s++;
+
+    return s;
+}
+
+static int read_manifest(run_t *r, const char *fn) {
+    char line[4096], *in, *out;
+    FILE *fp;
+    int ln = 0, rv = 0;
+
+    if(!strcmp(fn, "-"))
+        fp = stdin;
+    else if(!(fp = fopen(fn, "r"))) {
+        fprintf(stderr, "can't open manifest %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp)) {
+        ln++;
+        in = trim(line);
+
+        if(!*in || *in == '#')
+            continue;
+
+        out = in + strcspn(in, " \t");
+
+        if(*out) {
+            *out++ = 0;
+            out = trim(out);
+        }
+        else {
+            out = NULL;
+        }
+
+        if(add_job(r, in, out) < 0) {
+            fprintf(stderr, "%s:%d: %s\n", fn, ln,
+                    r->b->ext ? "out of memory" : "no output file given");
+            rv = -1;
+            break;
+        }
+    }
+
+    if(fp != stdin)
+        fclose(fp);
+
+    return rv;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp(((const entry_t *)a)->out, ((const entry_t *)b)->out);
+}
+
+static void read_cache(run_t *r, const char *fn) {
+    char line[4096], *out;
+    unsigned long long h;
+    entry_t *e;
+    FILE *fp;
+    int size = 0;
+
+    /* A missing cache just means nothing has been converted yet */
+    if(!(fp = fopen(fn, "r")))
+        return;
+
+    while(fgets(line, sizeof(line), fp)) {
+        if(sscanf(line, "%16llx", &h) != 1 || !(out = strchr(line, ' ')))
+            continue;
+
+        out = trim(out);
+
+        if(r->ncache == size) {
+            size = size ? size * 2 : 64;
+
+            if(!(e = realloc(r->cache, size * sizeof(entry_t))))
+                break;
+
+            r->cache = e;
+        }
+
+        if(!(r->cache[r->ncache].out = strdup(out)))
+            break;
+
+        r->cache[r->ncache++].hash = h;
+    }
+
+    fclose(fp);
+    qsort(r->cache, r->ncache, sizeof(entry_t), entry_cmp);
+}
+
+static entry_t *find_cache(run_t *r, const char *out) {
+    entry_t key;
+
+    key.out = (char *)out;
+    return bsearch(&key, r->cache, r->ncache, sizeof(entry_t), entry_cmp);
+}
+
+static int write_cache(run_t *r, const char *fn) {
+    char *tmp;
+    FILE *fp;
+    job_t *j;
+    entry_t *e;
+    int i;
+
+    if(!(tmp = malloc(strlen(fn) + 5)))
+        return -1;
+
+    sprintf(tmp, "%s.tmp", fn);
+
+    if(!(fp = fopen(tmp, "w"))) {
+        fprintf(stderr, "can't write %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    /* Mark the old entries this run replaces, then write out the rest
+       followed by this run's. */
+    for(i = 0; i < r->njobs; i++) {
+        if((e = find_cache(r, r->jobs[i].out)))
+            e->hash = 0;
+    }
+
+    for(i = 0; i < r->ncache; i++) {
+        if(r->cache[i].hash)
+            fprintf(fp, "%016llx %s\n", (unsigned long long)r->cache[i].hash,
+                    r->cache[i].out);
+    }
+
+    for(i = 0; i < r->njobs; i++) {
+        j = r->jobs + i;
+
+        if(j->hashed && (j->state == JOB_DONE || j->state == JOB_SKIPPED))
+            fprintf(fp, "%016llx %s\n", (unsigned long long)j->hash, j->out);
+    }
+
+    if(fclose(fp) || rename(tmp, fn)) {
+        fprintf(stderr, "can't write %s: %s\n", fn, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    free(tmp);
+    return 0;
+}
+
+static void *worker(void *p) {
+    run_t *r = (run_t *)p;
+    const batch_t *b = r->b;
+    entry_t *e;
+    job_t *j;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&r->lock);
+        i = r->next++;
+        pthread_mutex_unlock(&r->lock);
+
+        if(i >= r->njobs)
+            break;
+
+        j = r->jobs + i;
+
+        if(b->cache) {
+            j->hashed = !hash_file(j->in, b->salt, &j->hash);
+
+            if(j->hashed && (e = find_cache(r, j->out)) &&
+                    e->hash == j->hash && !access(j->out, F_OK)) {
+                j->state = JOB_SKIPPED;
+
+                if(b->verbose)
+                    printf("%s: unchanged\n", j->out);
+
+                continue;
+            }
+        }
+
+        if(b->convert(j->in, j->out, b->data) < 0) {
+            j->state = JOB_FAILED;
+            fprintf(stderr, "%s: conversion failed\n", j->in);
+        }
+        else {
+            j->state = JOB_DONE;
+
+            if(b->verbose)
+                printf("%s -> %s\n", j->in, j->out);
+        }
+    }
+
+    return NULL;
+}
+
+int batch_run(const batch_t *b) {
+    run_t r;
+    pthread_t *tids;
+    int i, n, cnt[4] = { 0 }, rv = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.b = b;
+    pthread_mutex_init(&r.lock, NULL);
+
+    if(b->manifest && read_manifest(&r, b->manifest) < 0)
+        rv = -1;
+
+    for(i = 0; rv == 0 && i < b->nfiles; i++) {
+        if(add_job(&r, b->files[i], NULL) < 0) {
+            fprintf(stderr, "out of memory\n");
+            rv = -1;
+        }
+    }
+
+    if(rv == 0 && b->cache)
+        read_cache(&r, b->cache);
+
+    n = b->threads > 0 ? b->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(n < 1)
+        n = 1;
+
+    if(n > r.njobs)
+        n = r.njobs;
+
+    if(rv == 0 && n > 0) {
+        tids = malloc(n * sizeof(pthread_t));
+
+        /* Work on this thread if no more can be had */
+        for(i = 0; tids && i < n; i++) {
+            if(pthread_create(tids + i, NULL, worker, &r))
+                break;
+        }
+
+        if(!tids || i == 0)
+            worker(&r);
+
+        while(tids && i > 0)
+            pthread_join(tids[--i], NULL);
+
+        free(tids);
+
+        for(i = 0; i < r.njobs; i++)
+            cnt[r.jobs[i].state]++;
+
+        if(b->cache && write_cache(&r, b->cache) < 0)
+            rv = -1;
+
+        if(b->verbose)
+            printf("%d converted, %d unchanged, %d failed\n",
+                   cnt[JOB_DONE], cnt[JOB_SKIPPED], cnt[JOB_FAILED]);
+
+        if(rv == 0)
+            rv = cnt[JOB_FAILED];
+    }
+
+    for(i = 0; i < r.njobs; i++) {
+        free(r.jobs[i].in);
+        free(r.jobs[i].out);
+    }
+
+    for(i = 0; i < r.ncache; i++)
+        free(r.cache[i].out);
+
+    free(r.jobs);
+    free(r.cache);
+    pthread_mutex_destroy(&r.lock);
+
+    return rv;
+}
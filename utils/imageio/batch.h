@@ -0,0 +1,55 @@
+/* KallistiOS ##version##
+
+   batch.h
+
+   Batch conversion for the host texture tools. A batch is a manifest (a
+   text file with one "input [output]" per line) and/or a list of input
+   files; the jobs are spread over a pool of threads, and with a cache file
+   an input whose contents and settings haven't changed since the last run
+   is skipped instead of being converted again.
+*/
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+/* Convert one input into one output, returning < 0 on failure. Called from
+   several threads at once, so it must not touch shared state. */
+typedef int (*batch_fn_t)(const char *infile, const char *outfile,
+                          void *data);
+
+typedef struct batch {
+    /* Manifest to read jobs from ("-" for stdin), or NULL. Blank lines and
+       lines starting with '#' are ignored; an input name can't contain
+       spaces, but the output name runs to the end of the line. */
+    const char *manifest;
+
+    /* More inputs, from the command line */
+    char **files;
+    int nfiles;
+
+    /* Extension for outputs not named in the manifest; if NULL, every
+       manifest line needs an output. */
+    const char *ext;
+
+    /* Cache of input hashes from earlier runs, or NULL to always convert */
+    const char *cache;
+
+    /* Everything besides the input that affects the output (the tool's
+       version and options); it is hashed along with each input. */
+    const char *salt;
+
+    int threads;        /* Worker threads, or <= 0 for one per CPU */
+    int verbose;
+
+    batch_fn_t convert;
+    void *data;         /* Passed to convert */
+} batch_t;
+
+/* Run a batch. Returns the number of jobs that failed, or -1 if the
+   manifest or cache couldn't be used. */
+int batch_run(const batch_t *b);
+
+/* Replace the extension of f with ext; the result is malloc'd. */
+char *batch_outname(const char *f, const char *ext);
+
+#endif
@@ -1,3 +1,11 @@
+/* KallistiOS ##version##
+
+   get_image.h
+
+   Image loading shared by the host texture tools (vqenc, kmgenc and
+   dcbumpgen). Every loader fills in an ARGB8888 image_t (4 bytes per
+   pixel, alpha first), and is safe to call from several threads at once.
+*/
 
 #ifndef __GET_IMAGE_H
 #define __GET_IMAGE_H
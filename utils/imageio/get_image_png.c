@@ -0,0 +1,184 @@
+/* KallistiOS ##version##
+
+   get_image_png.c
+   (c)2002 Jeffrey McBeth, Dan Potter
+
+   Based on Jeff's png_load_texture routine, but loads into a
+   KOS plat-independent image.
+
+   The libpng state used to live in static globals in readpng.c; it is
+   kept on the stack now so several images can be loaded at once.
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <png.h>
+#include "get_image.h"
+
+/* Expand whatever is in the file to 8-bit RGB or RGBA and read it, returning
+   the rows in one block. */
+static uint8_t *read_rows(png_structp png_ptr, png_infop info_ptr,
+                          uint32_t *channels, uint32_t *rowbytes,
+                          int *w, int *h) {
+    png_uint_32 width, height, i;
+    int bit_depth, color_type;
+    uint8_t *data;
+    png_bytepp rows;
+
+    png_get_IHDR(png_ptr, info_ptr, &width, &height, &bit_depth, &color_type,
+                 NULL, NULL, NULL);
+
+    *w = (int)width;
+    *h = (int)height;
+
+    /* expand palette images to RGB, low-bit-depth grayscale images to 8 bits,
+     * transparency chunks to full alpha channel; strip 16-bit-per-sample
+     * images to 8 bits per sample; and convert grayscale to RGB[A] */
+    if(color_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_expand(png_ptr);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand(png_ptr);
+
+    if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_expand(png_ptr);
+
+    if(bit_depth == 16)
+        png_set_strip_16(png_ptr);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY ||
+            color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+
+    png_read_update_info(png_ptr, info_ptr);
+
+    *rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    *channels = png_get_channels(png_ptr, info_ptr);
+
+    if((data = (uint8_t *)malloc(*rowbytes * height)) == NULL)
+        return NULL;
+
+    if((rows = (png_bytepp)malloc(height * sizeof(png_bytep))) == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    for(i = 0; i < height; ++i)
+        rows[i] = data + i * *rowbytes;
+
+    /* A broken file makes libpng jump back here instead of to the caller, so
+       the buffers can be freed. Neither pointer changes after this. */
+    if(setjmp(png_jmpbuf(png_ptr))) {
+        free(rows);
+        free(data);
+        return NULL;
+    }
+
+    png_read_image(png_ptr, rows);
+    png_read_end(png_ptr, NULL);
+    free(rows);
+
+    return data;
+}
+
+static void copy_texture(const uint8_t *buffer, uint8_t *temp_tex,
+                         uint32_t channels, uint32_t stride,
+                         uint32_t w, uint32_t h) {
+    uint32_t i, j;
+    uint8_t *ourbuffer;
+    const uint8_t *pRow;
+
+    for(i = 0; i < h; i++) {
+        pRow = &buffer[i * stride];
+        ourbuffer = &temp_tex[i * w * 4];
+
+        if(channels == 3) {
+            for(j = 0; j < w; j++) {
+                ourbuffer[j * 4 + 0] = 0xff;
+                ourbuffer[j * 4 + 1] = pRow[j * 3];
+                ourbuffer[j * 4 + 2] = pRow[j * 3 + 1];
+                ourbuffer[j * 4 + 3] = pRow[j * 3 + 2];
+            }
+        }
+        else if(channels == 4) {
+            for(j = 0; j < w; j++) {
+                ourbuffer[j * 4 + 0] = pRow[j * 4 + 3];
+                ourbuffer[j * 4 + 1] = pRow[j * 4 + 0];
+                ourbuffer[j * 4 + 2] = pRow[j * 4 + 1];
+                ourbuffer[j * 4 + 3] = pRow[j * 4 + 2];
+            }
+        }
+    }
+}
+
+int get_image_png(const char *filename, image_t *image) {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint8_t sig[8];
+    uint8_t *buffer;    /* Output row buffer */
+    uint32_t row_stride; /* physical row width in output buffer */
+    uint32_t channels;  /* 3 for RGB 4 for RGBA */
+    FILE *infile;       /* source file */
+
+    assert(image != NULL);
+
+    if((infile = fopen(filename, "rb")) == 0) {
+        fprintf(stderr, "png_to_texture: can't open %s\n", filename);
+        return -1;
+    }
+
+    /* Step 1: Initialize loader */
+    if(fread(sig, 1, 8, infile) != 8 || png_sig_cmp(sig, 0, 8)) {
+        fclose(infile);
+        return -2;
+    }
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    if(!png_ptr) {
+        fclose(infile);
+        return -2;
+    }
+
+    info_ptr = png_create_info_struct(png_ptr);
+
+    if(!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+        /* libpng jumps back here if the file is broken */
+        png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+        fclose(infile);
+        return -2;
+    }
+
+    png_init_io(png_ptr, infile);
+    png_set_sig_bytes(png_ptr, 8);
+    png_read_info(png_ptr, info_ptr);
+
+    /* Step 2: Read file */
+    buffer = read_rows(png_ptr, info_ptr, &channels, &row_stride,
+                       &image->w, &image->h);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(infile);
+
+    if(!buffer)
+        return -2;
+
+    image->data = (unsigned char *)malloc(4 * image->w * image->h);
+    image->bpp = 4;
+    image->stride = image->w * 4;
+
+    if(!image->data) {
+        free(buffer);
+        return -2;
+    }
+
+    copy_texture(buffer, image->data, channels, row_stride,
+                 image->w, image->h);
+
+    /* Step 3: Finish decompression */
+    free(buffer);
+
+    /* And we're done! */
+    return 0;
+}
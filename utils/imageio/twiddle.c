@@ -0,0 +1,26 @@
+/* KallistiOS ##version##
+
+   twiddle.c
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include "twiddle.h"
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+
+/* No store queues on the host; just write the tile. */
+#define PVRT_SQ_STORE(dst, w)   memcpy((dst), (w), 32)
+
+/* Only the twiddler is used here, not the VQ encoder. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_twiddle_core.h"
+#pragma GCC diagnostic pop
+
+void twiddle16(const uint16_t *src, uint16_t *dst, int w, int h) {
+    pvrt_twiddle(src, dst, w, h, 16, 0, 0);
+}
@@ -0,0 +1,17 @@
+/* KallistiOS ##version##
+
+   twiddle.h
+
+   Twiddling for the host texture tools, using the same code as
+   pvr_txr_load_ex() so tool output matches what the kernel loader makes.
+*/
+
+#ifndef __TWIDDLE_H
+#define __TWIDDLE_H
+
+#include <stdint.h>
+
+/* Twiddle a w x h 16bpp image (both powers of two, up to 1024) into dst. */
+void twiddle16(const uint16_t *src, uint16_t *dst, int w, int h);
+
+#endif
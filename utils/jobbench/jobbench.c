@@ -0,0 +1,439 @@
+/* KallistiOS ##version##
+
+   jobbench.c
+
+   Runs the job scheduler's queues, dependency tracking and spare worker
+   accounting (job_core.h) on the host. A pthread mutex stands in for
+   disabling interrupts and condition variables for genwait, and jobs that
+   block go through block_in_job(), which does what genwait_wait() does for
+   a pool worker. The checks run chains and diamonds of jobs and check the
+   order, and block every worker in the pool to make sure the spares keep
+   it going. The benchmark times independent and chained empty jobs.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "../hostcheck/hostcheck.h"
+
+typedef uint32_t uint32;
+
+#include "../../kernel/thread/job_core.h"
+
+/* kos/job.h can't be built on the host, so the Makefile passes these in
+   from it. */
+#if !defined(JOB_WORKERS_MAX) || !defined(JOB_SPARE_WORKERS)
+#error "JOB_WORKERS_MAX and JOB_SPARE_WORKERS must come from kos/job.h"
+#endif
+
+static jobc_t sched;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready[JOBC_LANES];
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[JOB_WORKERS_MAX + JOB_SPARE_WORKERS + 1];
+static int nthreads;
+static int done;
+
+static void kick(int woken[JOBC_LANES]) {
+    int i, n;
+
+    for(i = 0; i < JOBC_LANES; i++) {
+        for(n = 0; n < woken[i]; n++)
+            pthread_cond_signal(&ready[i]);
+    }
+}
+
+static void complete(struct job *j) {
+    struct jobc_edge *e, *n;
+    int woken[JOBC_LANES] = { 0, 0 };
+    int rel;
+
+    pthread_mutex_lock(&lock);
+    e = jobc_finish(&sched, j, woken);
+    kick(woken);
+    pthread_cond_broadcast(&finished);
+    rel = jobc_unref(j);
+    pthread_mutex_unlock(&lock);
+
+    for(; e; e = n) {
+        n = e->next;
+        free(e);
+    }
+
+    if(rel)
+        free(j);
+}
+
+static void *worker(void *param) {
+    int lane = (int)(intptr_t)param;
+    struct job *j;
+
+    pthread_mutex_lock(&lock);
+
+    while(!done) {
+        if(!(j = jobc_take(&sched, lane))) {
+            pthread_cond_wait(&ready[lane], &lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&lock);
+        j->func(j->data);
+        complete(j);
+        pthread_mutex_lock(&lock);
+        jobc_idle(&sched, lane);
+    }
+
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Sleep in a pool job until *flag is set, the way a job blocking on a
+   mutex or semaphore would, letting a spare worker in meanwhile. */
+static void block_in_job(volatile int *flag) {
+    pthread_mutex_lock(&lock);
+
+    if(jobc_blocked(&sched, 1))
+        pthread_cond_signal(&ready[JOBC_NORMAL]);
+
+    pthread_cond_broadcast(&finished);
+
+    while(!*flag)
+        pthread_cond_wait(&finished, &lock);
+
+    jobc_blocked(&sched, 0);
+    pthread_mutex_unlock(&lock);
+}
+
+static void start(int workers) {
+    int i;
+
+    jobc_init(&sched, workers);
+    done = 0;
+
+    for(i = 0; i < JOBC_LANES; i++)
+        pthread_cond_init(&ready[i], NULL);
+
+    /* The first thread is the background lane's */
+    for(nthreads = 0; nthreads <= workers + JOB_SPARE_WORKERS; nthreads++)
+        pthread_create(&threads[nthreads], NULL, worker,
+                       (void *)(intptr_t)(nthreads ? JOBC_NORMAL :
+                                          JOBC_BACKGROUND));
+}
+
+static void stop(void) {
+    int i;
+
+    pthread_mutex_lock(&lock);
+    done = 1;
+
+    for(i = 0; i < JOBC_LANES; i++)
+        pthread_cond_broadcast(&ready[i]);
+
+    pthread_mutex_unlock(&lock);
+
+    for(i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static struct job *create(void (*func)(void *), void *data, int lane) {
+    struct job *j = malloc(sizeof(struct job));
+
+    jobc_job_init(j, func, data, lane);
+    return j;
+}
+
+static void depend(struct job *job, struct job *on) {
+    struct jobc_edge *e = malloc(sizeof(struct jobc_edge));
+    int used;
+
+    pthread_mutex_lock(&lock);
+    used = jobc_depend(job, on, e);
+    pthread_mutex_unlock(&lock);
+
+    if(!used)
+        free(e);
+}
+
+static void submit(struct job *j) {
+    int woken[JOBC_LANES] = { 0, 0 };
+
+    pthread_mutex_lock(&lock);
+
+    if(jobc_submit(&sched, j)) {
+        woken[j->lane] = 1;
+        kick(woken);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+static void wait_for(struct job *j) {
+    pthread_mutex_lock(&lock);
+
+    while(j->state != JOBC_DONE)
+        pthread_cond_wait(&finished, &lock);
+
+    pthread_mutex_unlock(&lock);
+}
+
+/* Wait up to a second for cond, which is checked with the lock held.
+   Returns 0 if it never came true. */
+#define WAIT_UNTIL(cond) ({ \
+        struct timespec _ts; \
+        int _rv = 0; \
+        clock_gettime(CLOCK_REALTIME, &_ts); \
+        _ts.tv_sec += 1; \
+        pthread_mutex_lock(&lock); \
+        while(!(_rv = (cond)) && \
+              pthread_cond_timedwait(&finished, &lock, &_ts) != ETIMEDOUT) \
+            ; \
+        if(!_rv) \
+            _rv = (cond); \
+        pthread_mutex_unlock(&lock); \
+        _rv; \
+    })
+
+static void release(struct job *j) {
+    int rel;
+
+    pthread_mutex_lock(&lock);
+    rel = jobc_unref(j);
+    pthread_mutex_unlock(&lock);
+
+    if(rel)
+        free(j);
+}
+
+/* Each job appends its number to a shared log, so the order they ran in
+   can be checked afterwards. */
+static int order[64];
+static int norder;
+static int active_max;
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record(void *data) {
+    pthread_mutex_lock(&lock);
+
+    if(sched.active > active_max)
+        active_max = sched.active;
+
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_lock(&order_lock);
+    order[norder++] = (int)(intptr_t)data;
+    pthread_mutex_unlock(&order_lock);
+}
+
+static int position(int n) {
+    int i;
+
+    for(i = 0; i < norder; i++) {
+        if(order[i] == n)
+            return i;
+    }
+
+    return -1;
+}
+
+/* A job that keeps its worker busy until told to sleep, then blocks until
+   the gate opens */
+static volatile int sleep_now, gate;
+
+static void gatekeeper(void *data) {
+    (void)data;
+
+    while(!sleep_now)
+        sched_yield();
+
+    block_in_job(&gate);
+}
+
+static void self_check(void) {
+    struct job *j[16];
+    int i;
+
+    start(4);
+
+    /* A chain: each waits on the one before */
+    norder = 0;
+
+    for(i = 0; i < 8; i++) {
+        j[i] = create(record, (void *)(intptr_t)i, JOBC_NORMAL);
+
+        if(i)
+            depend(j[i], j[i - 1]);
+    }
+
+    /* Submit them backwards, so only the dependencies keep them in order */
+    for(i = 7; i >= 0; i--)
+        submit(j[i]);
+
+    wait_for(j[7]);
+
+    for(i = 0; i < 8; i++) {
+        CHECK(order[i] == i, "chain ran job %d at step %d", order[i], i);
+        release(j[i]);
+    }
+
+    /* A diamond, with the last job on the background lane */
+    norder = 0;
+    j[0] = create(record, (void *)0, JOBC_NORMAL);
+    j[1] = create(record, (void *)1, JOBC_NORMAL);
+    j[2] = create(record, (void *)2, JOBC_NORMAL);
+    j[3] = create(record, (void *)3, JOBC_BACKGROUND);
+    depend(j[1], j[0]);
+    depend(j[2], j[0]);
+    depend(j[3], j[1]);
+    depend(j[3], j[2]);
+
+    for(i = 3; i >= 0; i--)
+        submit(j[i]);
+
+    wait_for(j[3]);
+    CHECK(norder == 4, "diamond ran %d jobs", norder);
+    CHECK(position(0) < position(1) && position(0) < position(2),
+          "diamond ran a middle job before the first");
+    CHECK(position(3) == 3, "diamond ran the last job early");
+
+    /* A continuation of a job that has already finished runs at once */
+    norder = 0;
+    j[4] = create(record, (void *)4, JOBC_NORMAL);
+    depend(j[4], j[0]);
+    submit(j[4]);
+    wait_for(j[4]);
+    CHECK(norder == 1 && order[0] == 4, "late continuation didn't run");
+
+    for(i = 0; i < 5; i++)
+        release(j[i]);
+
+    stop();
+
+    /* Queue up more work while two jobs hold both pool workers, then have
+       those block. Nothing is submitted after that, so only their going to
+       sleep can let the spares in, and then no more than two jobs may run
+       at once between them. */
+    start(2);
+    norder = 0;
+    active_max = 0;
+    sleep_now = gate = 0;
+
+    for(i = 0; i < 10; i++)
+        j[i] = create(i < 2 ? gatekeeper : record, (void *)(intptr_t)i,
+                      JOBC_NORMAL);
+
+    submit(j[0]);
+    submit(j[1]);
+    CHECK(WAIT_UNTIL(sched.active == 2), "pool didn't start two jobs");
+
+    for(i = 2; i < 10; i++)
+        submit(j[i]);
+
+    /* Give the workers woken for those time to see the pool is busy */
+    usleep(10000);
+    CHECK(norder == 0, "a spare ran a job while the pool was busy");
+
+    sleep_now = 1;
+    CHECK(WAIT_UNTIL(sched.blocked == 2), "pool workers didn't block");
+    CHECK(WAIT_UNTIL(j[9]->state == JOBC_DONE),
+          "pool stalled with its workers blocked (%d of 8 jobs ran)",
+          norder);
+    CHECK(active_max <= 2, "%d jobs ran at once", active_max);
+
+    pthread_mutex_lock(&lock);
+    gate = 1;
+    pthread_cond_broadcast(&finished);
+    pthread_mutex_unlock(&lock);
+
+    wait_for(j[0]);
+    wait_for(j[1]);
+    CHECK(WAIT_UNTIL(!sched.active), "%d workers still active",
+          sched.active);
+
+    for(i = 0; i < 10; i++)
+        release(j[i]);
+
+    stop();
+
+    CHECK(sched.submitted == sched.completed, "%u submitted, %u completed",
+          sched.submitted, sched.completed);
+    CHECK(!sched.queued[0] && !sched.queued[1], "jobs left on the queues");
+}
+
+static void nothing(void *data) {
+    (void)data;
+}
+
+/* Time n independent empty jobs, and a chain of n, end to end */
+static void bench(int workers, int n) {
+    struct job **j = malloc(n * sizeof(struct job *));
+    double t0, tfan, tchain;
+    int i;
+
+    start(workers);
+
+    t0 = check_now();
+
+    for(i = 0; i < n; i++) {
+        j[i] = create(nothing, NULL, JOBC_NORMAL);
+        submit(j[i]);
+    }
+
+    for(i = 0; i < n; i++) {
+        wait_for(j[i]);
+        release(j[i]);
+    }
+
+    tfan = check_now() - t0;
+    t0 = check_now();
+
+    for(i = 0; i < n; i++) {
+        j[i] = create(nothing, NULL, JOBC_NORMAL);
+
+        if(i)
+            depend(j[i], j[i - 1]);
+    }
+
+    for(i = 0; i < n; i++)
+        submit(j[i]);
+
+    wait_for(j[n - 1]);
+
+    for(i = 0; i < n; i++)
+        release(j[i]);
+
+    tchain = check_now() - t0;
+    stop();
+
+    printf("%d workers: %7.0f ns per independent job, %7.0f ns per "
+           "chained job\n", workers, tfan * 1e9 / n, tchain * 1e9 / n);
+    free(j);
+}
+
+int main(int argc, char **argv) {
+    int n = 100000, rv;
+
+    if(argc > 1)
+        n = atoi(argv[1]);
+
+    if(n < 1) {
+        fprintf(stderr, "usage: %s [jobs]\n", argv[0]);
+        return 1;
+    }
+
+    self_check();
+    rv = check_result();
+
+    bench(1, n);
+    bench(2, n);
+    bench(4, n);
+
+    return rv;
+}
@@ -30,6 +30,10 @@
    such a file, the alpha channel will be silently ignored (you may get
    background noise depending on your PNG creation program).
 
+   Batches of images (listed in a manifest and/or on the command line)
+   can be converted on several threads at once, and with a cache file
+   only the images that have changed since the last run are converted.
+
 
    XXX
    Note: this is pretty darned unfinished and needs to be combined with
@@ -45,33 +49,11 @@ int use_verbose = 1;
 int use_debug = 1;
 int use_alpha = 0;
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
-
-/* This twiddling code is copied from pvr_texture.c, and the original
-   algorithm was written by Vincent Penne. */
-static void twiddle(image_t * src, uint16 * output) {
-    int w = src->w;
-    int h = src->h;
-    int min = MIN(w, h);
-    int mask = min - 1;
-    uint16 * pixels = (uint16 *)src->data;
-    uint16 * vtex = output;
-    int x, y, yout;
-
-    for(y = 0; y < h; y++) {
-        // yout = ((h - 1) - y);
-        yout = y;
-
-        for(x = 0; x < w; x++) {
-            vtex[TWIDOUT(x & mask, yout & mask) +
-                 (x / min + yout / min)*min * min] = pixels[y * w + x];
-        }
-    }
-}
+/* Batch mode settings */
+static const char *batch_list = NULL;
+static const char *batch_cache = NULL;
+static int batch_threads = 0;
+static int use_batch = 0;
 
 static void convert_to_16(image_t * img) {
     int i;
@@ -150,7 +132,7 @@ static int save(const char *filename, image_t *img) {
 
     /* Twiddle the image into a temp buffer */
     tmp = malloc(cnt);
-    twiddle(img, tmp);
+    twiddle16((uint16 *)img->data, tmp, img->w, img->h);
 
     /* Write it out */
     if(fwrite(tmp, cnt, 1, fp) != 1) {
@@ -175,6 +157,7 @@ loser:
 
 static void banner(const char *progname) {
     printf("Usage: %s [options] image1 [image2..]\n", progname);
+    printf("       %s [options] -f manifest [image1..]\n", progname);
     printf("\n");
     printf("Options:\n");
     // printf("\t-t, --twiddle\tcreate twiddled textures\n");
@@ -184,6 +167,13 @@ static void banner(const char *progname) {
     // printf("\t-q, --highq\thigher quality (much slower)\n");
     printf("\t-a4, --argb4444\tuse alpha channel (and output ARGB4444)\n");
     printf("\t-a1, --argb1555\tuse alpha channel (and output ARGB1555)\n");
+    printf("\t-f, --files=F\tconvert the images listed in F, one \"input [output]\"\n");
+    printf("\t\t\tper line (- for stdin)\n");
+    printf("\t-j, --threads=N\tconvert N images at once (default: one per CPU)\n");
+    printf("\t-c, --cache=F\tremember input hashes in F, and skip images that\n");
+    printf("\t\t\thaven't changed since the last run\n");
+    printf("\n");
+    printf("Any of -f, -j or -c converts the images in parallel.\n");
 }
 
 static int valid_size(int x) {
@@ -203,35 +193,6 @@ static int valid_size(int x) {
     return 1;
 }
 
-static const char *figure_outfilename(const char *f, const char *newext) {
-    char *newname;
-    char *ext;
-
-    ext = strrchr(f, '.');
-
-    if(ext == NULL) {
-        newname = (char *)malloc(strlen(f) + strlen(newext) + 2);
-
-        if(newname) {
-            sprintf(newname, "%s.%s", f, newext);
-        }
-    }
-    else {
-        int len;
-
-        len = (ext - f) + strlen(newext) + 2;
-        newname = (char *)malloc(len);
-
-        if(newname) {
-            strcpy(newname, f);
-            ext = strrchr(newname, '.') + 1;
-            strcpy(ext, newext);
-        }
-    }
-
-    return newname;
-}
-
 static void destroy_image(image_t *image) {
     if(image->data) {
         free(image->data);
@@ -239,14 +200,13 @@ static void destroy_image(image_t *image) {
     }
 }
 
-static int encode(const char *infile) {
+/* Convert one image; this runs on the batch threads, so it only reports
+   errors. */
+static int encode_to(const char *infile, const char *outfile, void *data) {
     int     ok;
     image_t     image;
-    const char  *outfile;
 
-    if(use_verbose) {
-        printf("encoding %s.. ", infile);
-    }
+    (void)data;
 
     if(get_image(infile, &image) < 0) {
         fprintf(stderr, "failed reading %s\n", infile);
@@ -259,13 +219,6 @@ static int encode(const char *infile) {
         return -EINVAL;
     }
 
-    outfile = figure_outfilename(infile, "kmg");
-
-    if(outfile == NULL) {
-        fprintf(stderr, "memory allocation failed for %s\n", infile);
-        return -ENOMEM;
-    }
-
     /* Convert the input image to a 16-bit image according to parameters */
     convert_to_16(&image);
 
@@ -274,10 +227,53 @@ static int encode(const char *infile) {
 
     destroy_image(&image);
 
+    return ok;
+}
+
+static int encode(const char *infile) {
+    int     ok;
+    char    *outfile;
+
+    if(use_verbose) {
+        printf("encoding %s.. ", infile);
+    }
+
+    outfile = batch_outname(infile, "kmg");
+
+    if(outfile == NULL) {
+        fprintf(stderr, "memory allocation failed for %s\n", infile);
+        return -ENOMEM;
+    }
+
+    ok = encode_to(infile, outfile, NULL);
+    free(outfile);
+
     printf("\n");
     return ok;
 }
 
+static int encode_batch(char **files, int nfiles) {
+    batch_t b;
+    char salt[64];
+
+    /* Anything that changes the output has to be in here, so that changing
+       it converts everything again. */
+    sprintf(salt, "kmgenc 1 alpha %d twiddle %d", use_alpha, use_twiddle);
+
+    memset(&b, 0, sizeof(b));
+    b.manifest = batch_list;
+    b.files = files;
+    b.nfiles = nfiles;
+    b.ext = "kmg";
+    b.cache = batch_cache;
+    b.salt = salt;
+    b.threads = batch_threads;
+    b.verbose = use_verbose;
+    b.convert = encode_to;
+
+    return batch_run(&b);
+}
+
 static int process_long_options(char *arg) {
     /* if (! strcmp(arg, "mipmap"))
         use_mipmap = 1;
@@ -291,13 +287,28 @@ static int process_long_options(char *arg) {
         use_hq = 1; */
     else if(! strcmp(arg, "alpha"))
         use_alpha = 1;
+    else if(! strcmp(arg, "argb4444"))
+        use_alpha = 1;
+    else if(! strcmp(arg, "argb1555"))
+        use_alpha = 2;
+    else if(! strncmp(arg, "files=", 6))
+        batch_list = arg + 6;
+    else if(! strncmp(arg, "cache=", 6))
+        batch_cache = arg + 6;
+    else if(! strncmp(arg, "threads=", 8))
+        batch_threads = atoi(arg + 8);
     else
         return -EINVAL;
 
+    if(batch_list || batch_cache || batch_threads)
+        use_batch = 1;
+
     return 0;
 }
 
-static int process_option(char *arg) {
+/* Returns the number of arguments used (the option may take the next one),
+   or -EINVAL. */
+static int process_option(char *arg, char *next) {
     /* assuming starts with '-' */
     arg++;
 
@@ -313,11 +324,27 @@ static int process_option(char *arg) {
 
         case 'v':
             use_verbose = 1;
-            return 0;
+            return 1;
 
         case 'd':
             use_debug = 1;
-            return 0;
+            return 1;
+
+        case 'f':
+        case 'c':
+        case 'j':
+            if(!next)
+                return -EINVAL;
+
+            if(*arg == 'f')
+                batch_list = next;
+            else if(*arg == 'c')
+                batch_cache = next;
+            else if((batch_threads = atoi(next)) < 1)
+                return -EINVAL;
+
+            use_batch = 1;
+            return 2;
 
             /* case 'q':
                 use_hq = 1;
@@ -333,28 +360,30 @@ static int process_option(char *arg) {
             else
                 return -EINVAL;
 
-            return 0;
+            return 1;
 
         case '-':
-            return process_long_options(arg + 1);
+            return process_long_options(arg + 1) < 0 ? -EINVAL : 1;
     }
 
     return -EINVAL;
 }
 
 static int process(int argc, char *argv[]) {
-    int arg;
+    int arg, used, failed = 0;
 
     arg = 1;
 
     while(arg < argc) {
         if(argv[arg][0] == '-') {
-            if(process_option(argv[arg]) < 0) {
+            used = process_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : NULL);
+
+            if(used < 0) {
                 fprintf(stderr, "invalid option %s\n", argv[arg]);
                 return -EINVAL;
             }
 
-            arg++;
+            arg += used;
             continue;
         }
 
@@ -362,23 +391,31 @@ static int process(int argc, char *argv[]) {
         break;
     }
 
-    if(arg >= argc) {
+    if(arg >= argc && !batch_list) {
         fprintf(stderr, "no files to encode\n");
         return -EINVAL;
     }
 
+    if(use_batch)
+        return encode_batch(argv + arg, argc - arg) ? 1 : 0;
+
     while(arg < argc) {
         /* ordinary image */
-        encode(argv[arg]);
+        if(encode(argv[arg]) < 0)
+            failed = 1;
+
         arg++;
     }
 
-    return 0;
+    return failed;
 }
 
 int main(int argc, char *argv[]) {
     setbuf(stdout, 0);
 
+    /* Settle this before there are any threads about */
+    le_detect();
+
     if(argc < 2) {
         banner(argv[0]);
         return 0;
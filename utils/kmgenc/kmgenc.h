@@ -102,6 +102,8 @@ static inline int le32(int x) {
 
 // Internal includes
 #include "get_image.h"
+#include "twiddle.h"
+#include "batch.h"
 
 
 #endif // __KMGENC_H
@@ -0,0 +1,331 @@
+/* KallistiOS ##version##
+
+   mprof.c
+
+   Reads a heap profile written by mprof_dump() on the Dreamcast and prints
+   per-call-site summaries and a fragmentation timeline.
+
+   The call site addresses can be turned into source lines with
+   sh-elf-addr2line -e your_program.elf <pc>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* These match include/kos/mprof.h. */
+#define MPROF_MAGIC     0x46504d4b
+#define MPROF_VERSION   2
+
+#define OP_MALLOC       0
+#define OP_CALLOC       1
+#define OP_MEMALIGN     2
+#define OP_REALLOC      3
+#define OP_FREE         4
+
+typedef struct {
+    uint64_t time;
+    uint32_t pc, ptr, size;
+} rec_t;
+
+typedef struct {
+    uint32_t pc, allocs, frees, total_bytes, live_bytes, peak_bytes;
+} site_t;
+
+typedef struct {
+    uint32_t magic, version, rec_count, rec_lost, site_count, untracked;
+    uint32_t heap_base, heap_size;
+} hdr_t;
+
+typedef struct {
+    uint32_t ptr, size;
+} blk_t;
+
+/* Live block table used while replaying the trace. */
+static blk_t *live;
+static uint32_t live_mask, live_count;
+
+static uint32_t get32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int read_words(FILE *fp, uint32_t *out, int n) {
+    unsigned char buf[4 * 8];
+    int i;
+
+    if(fread(buf, 4, n, fp) != (size_t)n)
+        return -1;
+
+    for(i = 0; i < n; ++i)
+        out[i] = get32(buf + i * 4);
+
+    return 0;
+}
+
+static uint32_t hash_ptr(uint32_t p) {
+    return ((p >> 3) * 0x9e3779b1u) >> 8;
+}
+
+static void live_put(uint32_t ptr, uint32_t size);
+
+static void live_grow(void) {
+    blk_t *old = live;
+    uint32_t i, osz = live ? live_mask + 1 : 0;
+
+    live_mask = osz ? osz * 2 - 1 : 1023;
+    live = calloc(live_mask + 1, sizeof(blk_t));
+
+    if(!live) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    live_count = 0;
+
+    for(i = 0; i < osz; ++i) {
+        if(old[i].ptr)
+            live_put(old[i].ptr, old[i].size);
+    }
+
+    free(old);
+}
+
+static void live_put(uint32_t ptr, uint32_t size) {
+    uint32_t i;
+
+    if(!live || (live_count + 1) * 4 > (live_mask + 1) * 3)
+        live_grow();
+
+    for(i = hash_ptr(ptr) & live_mask; live[i].ptr; i = (i + 1) & live_mask) {
+        if(live[i].ptr == ptr) {
+            live[i].size = size;
+            return;
+        }
+    }
+
+    live[i].ptr = ptr;
+    live[i].size = size;
+    ++live_count;
+}
+
+static void live_del(uint32_t ptr) {
+    uint32_t i, j, k;
+
+    if(!live)
+        return;
+
+    for(i = hash_ptr(ptr) & live_mask; live[i].ptr != ptr;
+            i = (i + 1) & live_mask) {
+        if(!live[i].ptr)
+            return;
+    }
+
+    --live_count;
+
+    for(j = (i + 1) & live_mask; live[j].ptr; j = (j + 1) & live_mask) {
+        k = hash_ptr(live[j].ptr) & live_mask;
+
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+
+        live[i] = live[j];
+        i = j;
+    }
+
+    live[i].ptr = 0;
+}
+
+static int blk_cmp(const void *a, const void *b) {
+    uint32_t x = ((const blk_t *)a)->ptr, y = ((const blk_t *)b)->ptr;
+    return x < y ? -1 : x > y;
+}
+
+static int site_cmp(const void *a, const void *b) {
+    const site_t *x = a, *y = b;
+
+    if(x->live_bytes != y->live_bytes)
+        return x->live_bytes < y->live_bytes ? 1 : -1;
+
+    if(x->total_bytes != y->total_bytes)
+        return x->total_bytes < y->total_bytes ? 1 : -1;
+
+    return 0;
+}
+
+/* Print one line of the timeline describing the current live set. */
+static void timeline_line(uint64_t t, uint32_t nrecs) {
+    blk_t *b;
+    uint32_t i, n = 0, used = 0, gap = 0, span = 0, hole, end;
+    double frag = 0.0;
+
+    b = malloc((live_count ? live_count : 1) * sizeof(blk_t));
+
+    if(!b) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for(i = 0; live && i <= live_mask; ++i) {
+        if(live[i].ptr)
+            b[n++] = live[i];
+    }
+
+    qsort(b, n, sizeof(blk_t), blk_cmp);
+
+    for(i = 0; i < n; ++i) {
+        used += b[i].size;
+
+        if(i) {
+            end = b[i - 1].ptr + b[i - 1].size;
+            hole = b[i].ptr > end ? b[i].ptr - end : 0;
+
+            if(hole > gap)
+                gap = hole;
+        }
+    }
+
+    if(n) {
+        span = b[n - 1].ptr + b[n - 1].size - b[0].ptr;
+
+        if(span > used)
+            frag = 1.0 - (double)gap / (double)(span - used);
+    }
+
+    printf("%10.3f %8u %10u %8u %10u %10u %6.3f\n", t / 1000000.0, nrecs,
+           used, n, span, gap, frag);
+    free(b);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-n sites] [-t buckets] dumpfile\n"
+            "  -n sites     Number of call sites to list (default 20, 0 = all)\n"
+            "  -t buckets   Number of timeline rows (default 20, 0 = none)\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    FILE *fp;
+    hdr_t hdr;
+    rec_t *recs;
+    site_t *sites;
+    uint32_t i, w[5], nsites = 20, buckets = 20, b;
+    uint64_t t0, t1, next;
+    int arg;
+
+    for(arg = 1; arg < argc && argv[arg][0] == '-'; ++arg) {
+        if(!strcmp(argv[arg], "-n") && arg + 1 < argc)
+            nsites = strtoul(argv[++arg], NULL, 0);
+        else if(!strcmp(argv[arg], "-t") && arg + 1 < argc)
+            buckets = strtoul(argv[++arg], NULL, 0);
+        else
+            usage(argv[0]);
+    }
+
+    if(arg != argc - 1)
+        usage(argv[0]);
+
+    if(!(fp = fopen(argv[arg], "rb"))) {
+        perror(argv[arg]);
+        return 1;
+    }
+
+    if(read_words(fp, &hdr.magic, 8) || hdr.magic != MPROF_MAGIC) {
+        fprintf(stderr, "%s: not a heap profile\n", argv[arg]);
+        return 1;
+    }
+
+    if(hdr.version != MPROF_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u\n", argv[arg],
+                hdr.version);
+        return 1;
+    }
+
+    recs = malloc((hdr.rec_count ? hdr.rec_count : 1) * sizeof(rec_t));
+    sites = malloc((hdr.site_count ? hdr.site_count : 1) * sizeof(site_t));
+
+    if(!recs || !sites) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < hdr.rec_count; ++i) {
+        if(read_words(fp, w, 5))
+            goto trunc;
+
+        recs[i].time = w[0] | ((uint64_t)w[1] << 32);
+        recs[i].pc = w[2];
+        recs[i].ptr = w[3];
+        recs[i].size = w[4];
+    }
+
+    for(i = 0; i < hdr.site_count; ++i) {
+        if(read_words(fp, &sites[i].pc, 6))
+            goto trunc;
+    }
+
+    fclose(fp);
+
+    printf("Heap at %08x, %u bytes; %u records (%u lost), %u sites, "
+           "%u untracked blocks\n\n", hdr.heap_base, hdr.heap_size,
+           hdr.rec_count, hdr.rec_lost, hdr.site_count, hdr.untracked);
+
+    /* Per-site summary, biggest holders first. */
+    qsort(sites, hdr.site_count, sizeof(site_t), site_cmp);
+
+    printf("%-10s %8s %8s %10s %10s %12s\n", "pc", "allocs", "frees",
+           "live", "peak", "total");
+
+    for(i = 0; i < hdr.site_count && (!nsites || i < nsites); ++i) {
+        if(sites[i].pc)
+            printf("%08x  ", sites[i].pc);
+        else
+            printf("%-10s ", "other");
+
+        printf("%8u %8u %10u %10u %12u\n", sites[i].allocs, sites[i].frees,
+               sites[i].live_bytes, sites[i].peak_bytes,
+               sites[i].total_bytes);
+    }
+
+    if(!buckets || !hdr.rec_count)
+        return 0;
+
+    /* Replay the trace and sample the live set at even time steps. Only
+       blocks allocated within the trace are seen, so if records were lost
+       this describes the newest part of the heap rather than all of it.
+       Sizes are as requested, without malloc's own overhead. */
+    printf("\n%10s %8s %10s %8s %10s %10s %6s\n", "time(s)", "records",
+           "live", "blocks", "span", "max gap", "frag");
+
+    t0 = recs[0].time;
+    t1 = recs[hdr.rec_count - 1].time;
+    b = 1;
+    next = t0 + (t1 - t0) * b / buckets;
+
+    for(i = 0; i < hdr.rec_count; ++i) {
+        while(recs[i].time > next && b <= buckets) {
+            timeline_line(next, i);
+            ++b;
+            next = t0 + (t1 - t0) * b / buckets;
+        }
+
+        if((recs[i].size >> 28) == OP_FREE)
+            live_del(recs[i].ptr);
+        else
+            live_put(recs[i].ptr, recs[i].size & 0x0fffffff);
+    }
+
+    timeline_line(t1, hdr.rec_count);
+
+    free(recs);
+    free(sites);
+    free(live);
+
+    return 0;
+
+trunc:
+    fprintf(stderr, "%s: file is truncated\n", argv[arg]);
+    return 1;
+}
@@ -0,0 +1,329 @@
+/* KallistiOS ##version##
+
+   pvrbatch.c
+
+   Runs the transform, near-plane clipper and vertex packer behind
+   pvr_prim_batch() (pvr_batch_core.h) on the host. The checks clip single
+   triangles and strips against the near plane and look at what comes out:
+   vertex counts, winding and end-of-strip flags, and that a batch comes
+   through intact when its buffer has to grow part way. The benchmarks push
+   random triangles and strips through it, with and without clipping, and
+   report vertices per second.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* The vertex formats and commands come from the real dc/pvr.h (the
+   Makefile puts the KOS headers after the host's). The KOS sys/_types.h
+   isn't usable here, and arch/types.h only wants it for the endianness
+   defines, which the host's endian.h provides. */
+#include <endian.h>
+#include <dc/pvr.h>
+
+#include "../hostcheck/hostcheck.h"
+
+/* Stand-in for XMTRX. */
+static float mtx[4][4];
+
+#define PVRB_TRANSFORM(x, y, z, w) do { \
+        float _x = (x), _y = (y), _z = (z), _w = (w); \
+        (x) = mtx[0][0] * _x + mtx[1][0] * _y + mtx[2][0] * _z + mtx[3][0] * _w; \
+        (y) = mtx[0][1] * _x + mtx[1][1] * _y + mtx[2][1] * _z + mtx[3][1] * _w; \
+        (z) = mtx[0][2] * _x + mtx[1][2] * _y + mtx[2][2] * _z + mtx[3][2] * _w; \
+        (w) = mtx[0][3] * _x + mtx[1][3] * _y + mtx[2][3] * _z + mtx[3][3] * _w; \
+    } while(0)
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_batch_core.h"
+
+#define NEAR        0.0001f
+#define BUF_VERTS   1024
+
+static pvr_vertex_t outbuf[BUF_VERTS];
+static long flushed;
+
+static int host_flush(pvrb_sink_t *s) {
+    flushed += s->ptr - outbuf;
+    s->ptr = outbuf;
+    s->end = outbuf + BUF_VERTS;
+    return 0;
+}
+
+static void sink_init(pvrb_sink_t *s) {
+    s->ptr = outbuf;
+    s->end = outbuf + BUF_VERTS;
+    s->flush = host_flush;
+    flushed = 0;
+}
+
+/* A 640x480 perspective projection with w = -z (view space looks down -z),
+   the way the KOS matrix code sets it up. */
+static void setup_matrix(void) {
+    memset(mtx, 0, sizeof(mtx));
+    mtx[0][0] = 320.0f;
+    mtx[2][0] = -320.0f;
+    mtx[1][1] = -240.0f;
+    mtx[2][1] = -240.0f;
+    mtx[2][3] = -1.0f;
+    mtx[3][2] = 1.0f;
+}
+
+static float frand(float lo, float hi) {
+    return lo + (hi - lo) * (float)rand() / (float)RAND_MAX;
+}
+
+static void random_verts(pvr_batch_vtx_t *v, int n, float zlo, float zhi) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        v[i].x = frand(-5.0f, 5.0f);
+        v[i].y = frand(-5.0f, 5.0f);
+        v[i].z = frand(zlo, zhi);
+        v[i].u = frand(0.0f, 1.0f);
+        v[i].v = frand(0.0f, 1.0f);
+        v[i].argb = (uint32)rand();
+        v[i].oargb = 0;
+    }
+}
+
+/* Twice the signed screen-space area of a triangle. */
+static float area(const pvr_vertex_t *a, const pvr_vertex_t *b,
+                  const pvr_vertex_t *c) {
+    return (b->x - a->x) * (c->y - a->y) - (c->x - a->x) * (b->y - a->y);
+}
+
+/* A sink that works like the DMA one in pvr_batch.c: the batch goes
+   straight into a buffer that starts out small, and each flush grows it the
+   way pvr_vertbuf_room_at() does, moving it and keeping only what was
+   written before the flush. The rest of the new buffer is filled with junk,
+   so anything the batch code still expected to find there shows up. */
+typedef struct {
+    pvrb_sink_t     s;
+    pvr_vertex_t    *base;
+    int             size;
+    int             grows;
+} grow_sink_t;
+
+static int grow_flush(pvrb_sink_t *s) {
+    grow_sink_t *g = (grow_sink_t *)s;
+    int off = s->ptr - g->base;
+    pvr_vertex_t *nb;
+
+    if(!(nb = malloc(g->size * 2 * sizeof(pvr_vertex_t))))
+        return -1;
+
+    memset(nb, 0xa5, g->size * 2 * sizeof(pvr_vertex_t));
+    memcpy(nb, g->base, off * sizeof(pvr_vertex_t));
+    free(g->base);
+
+    g->base = nb;
+    g->size *= 2;
+    g->grows++;
+    s->ptr = nb + off;
+    s->end = nb + g->size;
+    return 0;
+}
+
+static int run(const pvr_batch_vtx_t *v, int n, int mode) {
+    pvrb_sink_t s;
+
+    sink_init(&s);
+    pvrb_submit(v, n, mode, NEAR, &s);
+    return (int)(s.ptr - outbuf);
+}
+
+/* Compare field by field: on a 64-bit host, uint32 is a long and the
+   vertex has padding that nothing writes. */
+static int same_verts(const pvr_vertex_t *a, const pvr_vertex_t *b, int n) {
+    for(; n > 0; n--, a++, b++) {
+        if(a->flags != b->flags || a->x != b->x || a->y != b->y ||
+                a->z != b->z || a->u != b->u || a->v != b->v ||
+                a->argb != b->argb || a->oargb != b->oargb)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Push a batch through a buffer that has to grow several times part way
+   through, behind a header written before the batch started, and compare
+   with the same batch written into a buffer big enough for all of it. */
+static void grow_check(void) {
+    pvr_batch_vtx_t v[300];
+    grow_sink_t g;
+    int n, mode;
+
+    for(mode = PVR_BATCH_TRIS; mode <= PVR_BATCH_STRIP; mode++) {
+        srand(2);
+        random_verts(v, 300, -10.0f, 2.0f);
+        n = run(v, 300, mode);
+        CHECK(!flushed, "reference batch (mode %d) didn't fit", mode);
+
+        g.size = 2 * PVRB_MAX_TRI_VERTS;
+        g.grows = 0;
+        g.base = malloc(g.size * sizeof(pvr_vertex_t));
+
+        if(!g.base) {
+            CHECK(0, "out of memory");
+            return;
+        }
+
+        memset(g.base, 0x3c, sizeof(pvr_vertex_t));
+        g.s.ptr = g.base + 1;
+        g.s.end = g.base + g.size;
+        g.s.flush = grow_flush;
+
+        CHECK(pvrb_submit(v, 300, mode, NEAR, &g.s) == 0,
+              "growing batch (mode %d) failed", mode);
+        CHECK(g.grows > 1, "batch (mode %d) only grew %d times", mode,
+              g.grows);
+        CHECK(g.s.ptr - g.base == n + 1, "growing batch (mode %d) gave %d "
+              "vertices, not %d", mode, (int)(g.s.ptr - g.base - 1), n);
+        CHECK(((uint8_t *)g.base)[0] == 0x3c &&
+              ((uint8_t *)g.base)[sizeof(pvr_vertex_t) - 1] == 0x3c,
+              "header lost when the buffer grew (mode %d)", mode);
+        CHECK(same_verts(g.base + 1, outbuf, n),
+              "batch (mode %d) changed when the buffer grew", mode);
+
+        free(g.base);
+    }
+}
+
+static void self_check(void) {
+    pvr_batch_vtx_t v[6];
+    pvr_vertex_t tri[3];
+    int n, i, eols;
+
+    /* A triangle entirely in front of the viewer. */
+    memset(v, 0, sizeof(v));
+    v[0].x = -1; v[0].y = -1; v[0].z = -5;
+    v[1].x = 1;  v[1].y = -1; v[1].z = -5;
+    v[2].x = 0;  v[2].y = 1;  v[2].z = -5;
+    n = run(v, 3, PVR_BATCH_TRIS);
+    CHECK(n == 3, "visible triangle gave %d vertices", n);
+    CHECK(outbuf[2].flags == PVR_CMD_VERTEX_EOL, "missing EOL");
+    memcpy(tri, outbuf, sizeof(tri));
+
+    /* Pull one vertex behind the viewer (keeping the triangle facing the
+       same way): should come out as a quad with the same winding. */
+    v[2].z = 1;
+    n = run(v, 3, PVR_BATCH_TRIS);
+    CHECK(n == 4, "one-behind triangle gave %d vertices", n);
+
+    for(i = 0; i < n; i++)
+        CHECK(outbuf[i].z <= 1.0f / NEAR * 1.001f, "vertex %d past near", i);
+
+    /* The second triangle of a strip is wound the other way. */
+    CHECK((area(outbuf, outbuf + 1, outbuf + 2) > 0) ==
+          (area(tri, tri + 1, tri + 2) > 0), "quad winding flipped");
+    CHECK((area(outbuf + 2, outbuf + 1, outbuf + 3) > 0) ==
+          (area(tri, tri + 1, tri + 2) > 0), "quad winding flipped");
+
+    /* Two behind: a smaller triangle. */
+    v[1].z = 5;
+    n = run(v, 3, PVR_BATCH_TRIS);
+    CHECK(n == 3, "two-behind triangle gave %d vertices", n);
+
+    /* All behind: nothing. */
+    v[0].z = 5;
+    n = run(v, 3, PVR_BATCH_TRIS);
+    CHECK(n == 0, "hidden triangle gave %d vertices", n);
+
+    /* A visible strip passes straight through. */
+    for(i = 0; i < 6; i++) {
+        v[i].x = (float)(i >> 1);
+        v[i].y = (float)(i & 1);
+        v[i].z = -5;
+    }
+
+    n = run(v, 6, PVR_BATCH_STRIP);
+    CHECK(n == 6, "visible strip gave %d vertices", n);
+
+    for(i = eols = 0; i < n; i++)
+        eols += outbuf[i].flags == PVR_CMD_VERTEX_EOL;
+
+    CHECK(eols == 1 && outbuf[n - 1].flags == PVR_CMD_VERTEX_EOL,
+          "visible strip has %d EOLs", eols);
+
+    /* Hide the middle vertex of the strip. Triangles 1-3 touch it and get
+       clipped on their own; triangle 0 still comes out first. */
+    v[2].z = 5;
+    n = run(v, 6, PVR_BATCH_STRIP);
+    CHECK(n > 0 && outbuf[n - 1].flags == PVR_CMD_VERTEX_EOL,
+          "clipped strip isn't terminated");
+
+    grow_check();
+}
+
+static double bench(const pvr_batch_vtx_t *v, int n, int mode, int iters,
+                    long *out) {
+    pvrb_sink_t s;
+    double start;
+    int i;
+
+    start = check_now();
+    *out = 0;
+
+    for(i = 0; i < iters; i++) {
+        sink_init(&s);
+        pvrb_submit(v, n, mode, NEAR, &s);
+        *out += flushed + (s.ptr - outbuf);
+    }
+
+    return check_now() - start;
+}
+
+int main(int argc, char **argv) {
+    pvr_batch_vtx_t *v;
+    int n = 30000, iters = 200;
+    long out;
+    double t;
+    int rv;
+
+    if(argc > 1)
+        n = atoi(argv[1]) / 3 * 3;
+
+    if(argc > 2)
+        iters = atoi(argv[2]);
+
+    if(n < 3 || iters < 1) {
+        fprintf(stderr, "usage: %s [vertices [iterations]]\n", argv[0]);
+        return 1;
+    }
+
+    setup_matrix();
+    self_check();
+    rv = check_result();
+
+    if(!(v = malloc(n * sizeof(pvr_batch_vtx_t)))) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    srand(1);
+
+    random_verts(v, n, -50.0f, -1.0f);
+    t = bench(v, n, PVR_BATCH_TRIS, iters, &out);
+    printf("tris, none clipped:   %8.2f Mverts/s in, %ld out\n",
+           n * (double)iters / t / 1e6, out / iters);
+
+    random_verts(v, n, -10.0f, 2.0f);
+    t = bench(v, n, PVR_BATCH_TRIS, iters, &out);
+    printf("tris, some clipped:   %8.2f Mverts/s in, %ld out\n",
+           n * (double)iters / t / 1e6, out / iters);
+
+    random_verts(v, n, -50.0f, -1.0f);
+    t = bench(v, n, PVR_BATCH_STRIP, iters, &out);
+    printf("strip, none clipped:  %8.2f Mverts/s in, %ld out\n",
+           n * (double)iters / t / 1e6, out / iters);
+
+    random_verts(v, n, -10.0f, 2.0f);
+    t = bench(v, n, PVR_BATCH_STRIP, iters, &out);
+    printf("strip, some clipped:  %8.2f Mverts/s in, %ld out\n",
+           n * (double)iters / t / 1e6, out / iters);
+
+    free(v);
+    return rv;
+}
@@ -0,0 +1,336 @@
+/* KallistiOS ##version##
+
+   pvrtwiddle.c
+
+   Runs the tile twiddlers and VQ encoder behind pvr_txr_load_ex()
+   (pvr_twiddle_core.h) on the host. The checks compare the twiddlers with
+   the per-texel loader they replaced, for every size and depth, and make
+   sure the VQ encoder is lossless when it can be and reasonable when it
+   can't. The benchmarks give MB/s for old against new, and the time to
+   encode a texture.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "../hostcheck/hostcheck.h"
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+
+/* No store queues here; just write the tile. */
+#define PVRT_SQ_STORE(dst, w)   memcpy((dst), (w), 32)
+
+#include "../../kernel/arch/dreamcast/hardware/pvr/pvr_twiddle_core.h"
+
+/* The loader as it was before the tile kernels, for comparison. */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+#define MIN(a, b) ( (a)<(b)? (a):(b) )
+
+static void old_load(void *src, void *dst, uint32 w, uint32 h, uint32 bpp,
+                     int invert) {
+    uint32 x, y, yout, min, mask;
+
+    min = MIN(w, h);
+    mask = min - 1;
+
+    switch(bpp) {
+        case 4: {
+            uint8 * pixels;
+            uint16 * vtex;
+            pixels = (uint8 *) src;
+            vtex = (uint16*)dst;
+
+            for(y = 0; y < h; y += 2) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x += 2) {
+                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
+                         (x / min + yout / min)*min * min / 4] =
+                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                }
+            }
+        }
+        break;
+        case 8: {
+            uint8 * pixels;
+            uint16 * vtex;
+            pixels = (uint8 *) src;
+            vtex = (uint16*)dst;
+
+            for(y = 0; y < h; y += 2) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
+                         (x / min + yout / min)*min * min / 2] =
+                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+                }
+            }
+        }
+        break;
+        case 16: {
+            uint16 * pixels;
+            uint16 * vtex;
+            pixels = (uint16 *) src;
+            vtex = (uint16*)dst;
+
+            for(y = 0; y < h; y++) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT(x & mask, yout & mask) +
+                         (x / min + yout / min)*min * min] = pixels[y * w + x];
+                }
+            }
+        }
+        break;
+    }
+}
+
+static void fill_random(uint8 *p, uint32 n) {
+    uint32 i;
+
+    for(i = 0; i < n; i++)
+        p[i] = (uint8)rand();
+}
+
+/* Flip an image upside down, so the old loader can be checked with
+   invert on: it swaps the rows of each pair at 4 and 8bpp, so it is only
+   compared with a flipped source and invert off. */
+static void flip(const uint8 *src, uint8 *dst, uint32 h, uint32 pitch) {
+    uint32 y;
+
+    for(y = 0; y < h; y++)
+        memcpy(dst + y * pitch, src + (h - 1 - y) * pitch, pitch);
+}
+
+static void self_check(void) {
+    static const uint32 bpps[3] = { 4, 8, 16 };
+    uint32 w, h, b, bytes, pitch;
+    uint8 *src, *flipped, *a, *b1;
+    int sq, inv;
+
+    src = malloc(PVRT_MAX_SIZE * PVRT_MAX_SIZE * 2);
+    flipped = malloc(PVRT_MAX_SIZE * PVRT_MAX_SIZE * 2);
+    a = aligned_alloc(32, PVRT_MAX_SIZE * PVRT_MAX_SIZE * 2);
+    b1 = aligned_alloc(32, PVRT_MAX_SIZE * PVRT_MAX_SIZE * 2);
+
+    for(w = 1; w <= PVRT_MAX_SIZE; w <<= 1) {
+        for(h = 1; h <= PVRT_MAX_SIZE; h <<= 1) {
+            for(b = 0; b < 3; b++) {
+                /* The old loader works on pairs of rows below 16bpp, and
+                   pairs of columns at 4bpp. */
+                if(bpps[b] < 16 && h < 2)
+                    continue;
+
+                if(bpps[b] == 4 && w < 2)
+                    continue;
+
+                bytes = w * h * bpps[b] / 8;
+                pitch = w * bpps[b] / 8;
+                fill_random(src, bytes);
+                flip(src, flipped, h, pitch);
+
+                for(sq = 0; sq < 2; sq++) {
+                    for(inv = 0; inv < 2; inv++) {
+                        memset(a, 0xaa, bytes);
+                        memset(b1, 0x55, bytes);
+
+                        if(!inv || bpps[b] == 16)
+                            old_load(src, a, w, h, bpps[b], inv);
+                        else
+                            old_load(flipped, a, w, h, bpps[b], 0);
+
+                        pvrt_twiddle(src, b1, w, h, bpps[b], inv, sq);
+                        CHECK(!memcmp(a, b1, bytes),
+                              "%ux%u %ubpp%s%s differs from the old loader",
+                              w, h, bpps[b], inv ? " inverted" : "",
+                              sq ? " (sq)" : "");
+                    }
+                }
+            }
+        }
+    }
+
+    free(src);
+    free(flipped);
+    free(a);
+    free(b1);
+}
+
+/* Decode a VQ texture made by pvrt_vq_encode() back to a linear image. */
+static void vq_decode(const uint8 *vq, uint16 *out, uint32 w, uint32 h) {
+    const uint16 *book = (const uint16 *)vq;
+    const uint8 *idx = vq + PVRT_VQ_CODEBOOK;
+    uint32 x, y, c;
+
+    for(y = 0; y < h; y += 2) {
+        for(x = 0; x < w; x += 2) {
+            c = idx[pvrt_index(x / 2, y / 2, w / 2, h / 2)];
+            out[y * w + x] = book[c * 4];
+            out[(y + 1) * w + x] = book[c * 4 + 1];
+            out[y * w + x + 1] = book[c * 4 + 2];
+            out[(y + 1) * w + x + 1] = book[c * 4 + 3];
+        }
+    }
+}
+
+/* A smooth image with some detail, more like a real texture than noise */
+static void make_image(uint16 *p, uint32 w, uint32 h) {
+    uint32 x, y, r, g, b;
+
+    for(y = 0; y < h; y++) {
+        for(x = 0; x < w; x++) {
+            r = (x * 31 / w);
+            g = (y * 63 / h);
+            b = ((x ^ y) >> 3) & 31;
+            p[y * w + x] = (r << 11) | (g << 5) | b;
+        }
+    }
+}
+
+static double psnr565(const uint16 *a, const uint16 *b, uint32 n) {
+    uint8 ca[4], cb[4];
+    double err = 0, d;
+    uint32 i, c;
+
+    for(i = 0; i < n; i++) {
+        pvrt_unpack(a[i], PVRT_RGB565, ca);
+        pvrt_unpack(b[i], PVRT_RGB565, cb);
+
+        for(c = 1; c < 4; c++) {
+            d = (double)ca[c] - cb[c];
+            err += d * d;
+        }
+    }
+
+    if(err == 0)
+        return 99.0;
+
+    err /= n * 3.0;
+    return 10.0 * log10(255.0 * 255.0 / err);
+}
+
+static void vq_check(void) {
+    uint32 w, h, n, i;
+    uint16 *img, *out;
+    uint8 *vq, *scratch;
+    int used;
+
+    w = h = 256;
+    n = w * h;
+    img = malloc(n * 2);
+    out = malloc(n * 2);
+    vq = aligned_alloc(32, PVRT_VQ_CODEBOOK + n / 4);
+    scratch = aligned_alloc(32, (pvrt_vq_scratch(w, h) + 31) & ~31);
+
+    /* An image with at most 256 different blocks must come back exactly. */
+    for(i = 0; i < n; i++)
+        img[i] = ((i / 2) % 16) * 0x1111 ^ (((i / w) / 2) % 16) * 0x0841;
+
+    used = pvrt_vq_encode(img, vq, w, h, PVRT_RGB565, 0, scratch);
+    vq_decode(vq, out, w, h);
+    CHECK(!memcmp(img, out, n * 2), "lossless VQ round trip failed");
+    CHECK(used <= 256, "used %d codebook entries", used);
+
+    make_image(img, w, h);
+    used = pvrt_vq_encode(img, vq, w, h, PVRT_RGB565, 0, scratch);
+    vq_decode(vq, out, w, h);
+    printf("VQ 256x256 gradient: %d codes, PSNR %.2f dB\n", used,
+           psnr565(img, out, n));
+    CHECK(psnr565(img, out, n) > 30.0, "VQ quality is too low");
+
+    free(img);
+    free(out);
+    free(vq);
+    free(scratch);
+}
+
+static void bench(uint32 w, uint32 h, int iters) {
+    static const uint32 bpps[3] = { 4, 8, 16 };
+    uint32 b, bytes;
+    uint8 *src, *dst, *scratch;
+    double t0, told, tnew;
+    int i;
+
+    src = malloc(w * h * 2);
+    dst = aligned_alloc(32, w * h * 2 + PVRT_VQ_CODEBOOK);
+    fill_random(src, w * h * 2);
+
+    for(b = 0; b < 3; b++) {
+        bytes = w * h * bpps[b] / 8;
+
+        t0 = check_now();
+
+        for(i = 0; i < iters; i++)
+            old_load(src, dst, w, h, bpps[b], 0);
+
+        told = check_now() - t0;
+        t0 = check_now();
+
+        for(i = 0; i < iters; i++)
+            pvrt_twiddle(src, dst, w, h, bpps[b], 0, 0);
+
+        tnew = check_now() - t0;
+
+        printf("%4ux%-4u %2ubpp: old %8.1f MB/s, tiles %8.1f MB/s (%.1fx)\n",
+               w, h, bpps[b], bytes * (double)iters / told / 1e6,
+               bytes * (double)iters / tnew / 1e6, told / tnew);
+    }
+
+    make_image((uint16 *)src, w, h);
+    scratch = malloc(pvrt_vq_scratch(w, h));
+    iters = iters / 8 + 1;
+    t0 = check_now();
+
+    for(i = 0; i < iters; i++)
+        pvrt_vq_encode((uint16 *)src, dst, w, h, PVRT_RGB565, 0, scratch);
+
+    tnew = check_now() - t0;
+    printf("%4ux%-4u VQ:    %8.2f ms per texture\n", w, h,
+           tnew * 1000.0 / iters);
+
+    free(scratch);
+    free(src);
+    free(dst);
+}
+
+int main(int argc, char **argv) {
+    int iters = 100, rv;
+
+    if(argc > 1)
+        iters = atoi(argv[1]);
+
+    if(iters < 1) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    srand(1);
+    self_check();
+    vq_check();
+    rv = check_result();
+
+    bench(256, 256, iters);
+    bench(512, 256, iters);
+    bench(1024, 1024, iters / 16 + 1);
+
+    return rv;
+}
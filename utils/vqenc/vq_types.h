@@ -44,9 +44,27 @@ typedef struct code_t {
     fquad_t value;
 } code_t;
 
+/* A node of the k-d tree over the codebook. Inner nodes split on one channel
+   of the quad (seen as 16 floats); leaves hold a run of the order array. */
+typedef struct kd_node_t {
+    int dim;        /* channel split on, or -1 for a leaf */
+    float split;    /* left has values <= split, right >= split */
+    int left, right;
+    int first, count;
+} kd_node_t;
+
+typedef struct kd_tree_t {
+    int nnodes;
+    kd_node_t nodes[512];
+    int order[256];
+} kd_tree_t;
+
 typedef struct context_t {
     int in_use;
     code_t codes[256];
+
+    /* for finding the closest code; rebuilt whenever the codes change */
+    kd_tree_t tree;
 } context_t;
 
 #endif
@@ -18,6 +18,7 @@
 #include <math.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include "get_image.h"
 #include "vq_internal.h"
 #include "vq_types.h"
@@ -29,10 +30,20 @@ static int use_mipmap = 0;
 static int use_twiddle = 0;
 static int use_verbose = 0;
 static int use_debug = 0;
-static int use_hq = 0;
 static int use_kmg = 0;
 static int use_alpha = 0;
 
+/* Quality/speed: passes of place() at each codebook size, stopping early
+   once a pass improves the total distortion by less than min_gain */
+static int iterations = 1;
+static double min_gain = 0.001;
+
+/* Threads used by place(); 0 means one per CPU */
+static int num_threads = 0;
+
+/* File listing more images to encode (batch mode) */
+static const char *file_list = NULL;
+
 #define PACK1555(a, r, g, b) ( (a ? 0x8000 : 0) | ((r>>3)<<10) | ((g>>3)<<5) | ((b >>3)))
 #define PACK4444(a, r, g, b) ( ((a>>4) << 12) | ((r>>4)<<8) | ((g>>4)<<4) | ((b>>4)) )
 #define PACK565(r, g, b) (((r>>3)<<11) | ((g>>2)<<5) | ((b>>3)))
@@ -87,80 +98,254 @@ static int quads_in_map(int res) {
     return (across * across) >> 2;
 }
 
-static double delta_e(fquad_t *a, fquad_t *b) {
+#define QUAD_DIMS 16
+
+static INLINE float quad_dim(const fquad_t *q, int dim) {
+    return ((const float *)q)[dim];
+}
+
+/* squared distance between two quads, giving up once it passes limit */
+static INLINE float dist2(const fquad_t *a, const fquad_t *b, float limit) {
+    const float *pa = (const float *)a, *pb = (const float *)b;
+    float total = 0.0f, d;
     int i;
-    fquad_t sub;
-    double total;
 
-    total = 0.0;
-    sub_quad(&sub, a, b);
+    for(i = 0; i < QUAD_DIMS; i++) {
+        d = pa[i] - pb[i];
+        total += d * d;
 
-    for(i = 0; i < 4; i++) {
-        total += (sub.p[i].a * sub.p[i].a);
-        total += (sub.p[i].r * sub.p[i].r);
-        total += (sub.p[i].g * sub.p[i].g);
-        total += (sub.p[i].b * sub.p[i].b);
+        if(total > limit)
+            break;
     }
 
-    return sqrt(total);
+    return total;
 }
 
-/* returns the closest (most similar) codebook entry to the given quad */
-static int find(context_t *cb, fquad_t *q) {
-    int code, close_entry;
-    double close_dist;
+/* build the part of the tree covering order[first..first+count) */
+static int build_node(context_t *cb, int first, int count) {
+    kd_tree_t *t = &cb->tree;
+    kd_node_t *n = &t->nodes[t->nnodes];
+    int i, j, k, dim, best_dim, mid;
+    float lo, hi, v, range, best_range;
+
+    n->first = first;
+    n->count = count;
+    n->dim = -1;
+    t->nnodes++;
 
-    close_entry = 0;
-    close_dist = delta_e(&cb->codes[0].value, q);
+    if(count <= 4)
+        return n - t->nodes;
 
-    for(code = 1; code < cb->in_use; code++) {
+    /* split on the channel with the widest spread */
+    best_dim = 0;
+    best_range = 0.0f;
 
-        /* hope not to get sued for this variable's name */
-        double d;
+    for(dim = 0; dim < QUAD_DIMS; dim++) {
+        lo = hi = quad_dim(&cb->codes[t->order[first]].value, dim);
 
-        d = delta_e(&cb->codes[code].value, q);
+        for(i = 1; i < count; i++) {
+            v = quad_dim(&cb->codes[t->order[first + i]].value, dim);
 
-        if(d < close_dist) {
-            close_entry = code;
-            close_dist = d;
+            if(v < lo)
+                lo = v;
+
+            if(v > hi)
+                hi = v;
+        }
+
+        range = hi - lo;
+
+        if(range > best_range) {
+            best_range = range;
+            best_dim = dim;
+        }
+    }
 
-            if(d < 0.0001) {
-                /* close enough */
-                return close_entry;
+    if(best_range <= 0.0f)
+        return n - t->nodes;
+
+    /* sort along it (there are never more than 256) and cut in half */
+    for(i = first + 1; i < first + count; i++) {
+        k = t->order[i];
+        v = quad_dim(&cb->codes[k].value, best_dim);
+
+        for(j = i; j > first &&
+                quad_dim(&cb->codes[t->order[j - 1]].value, best_dim) > v; j--)
+            t->order[j] = t->order[j - 1];
+
+        t->order[j] = k;
+    }
+
+    mid = count / 2;
+    n->dim = best_dim;
+    n->split = quad_dim(&cb->codes[t->order[first + mid]].value, best_dim);
+    n->left = build_node(cb, first, mid);
+    n->right = build_node(cb, first + mid, count - mid);
+
+    return n - t->nodes;
+}
+
+static void build_tree(context_t *cb) {
+    int i;
+
+    for(i = 0; i < cb->in_use; i++)
+        cb->tree.order[i] = i;
+
+    cb->tree.nnodes = 0;
+    build_node(cb, 0, cb->in_use);
+}
+
+static void search(context_t *cb, int node, fquad_t *q, int *best,
+                   float *best_dist) {
+    kd_node_t *n = &cb->tree.nodes[node];
+    int i, code;
+    float d;
+
+    if(n->dim < 0) {
+        for(i = 0; i < n->count; i++) {
+            code = cb->tree.order[n->first + i];
+            d = dist2(&cb->codes[code].value, q, *best_dist);
+
+            /* ties go to the lowest code, as with a linear search */
+            if(d < *best_dist || (d == *best_dist && code < *best)) {
+                *best = code;
+                *best_dist = d;
             }
         }
 
+        return;
+    }
+
+    d = quad_dim(q, n->dim) - n->split;
+
+    if(d < 0.0f) {
+        search(cb, n->left, q, best, best_dist);
+
+        if(d * d <= *best_dist)
+            search(cb, n->right, q, best, best_dist);
     }
+    else {
+        search(cb, n->right, q, best, best_dist);
+
+        if(d * d <= *best_dist)
+            search(cb, n->left, q, best, best_dist);
+    }
+}
+
+/* returns the closest (most similar) codebook entry to the given quad, and
+   the squared distance to it */
+static int find(context_t *cb, fquad_t *q, float *d) {
+    int best = 0;
+    float best_dist = dist2(&cb->codes[0].value, q, 1e30f);
+
+    search(cb, 0, q, &best, &best_dist);
+
+    if(d)
+        *d = best_dist;
+
+    return best;
+}
 
-    return close_entry;
+typedef struct place_job_t {
+    context_t *cb;
+    fquad_t *quads;
+    uint8 *idx;
+    float *dist;
+    int first, count;
+} place_job_t;
+
+static void *place_thread(void *arg) {
+    place_job_t *job = (place_job_t *)arg;
+    int i;
+
+    for(i = job->first; i < job->first + job->count; i++)
+        job->idx[i] = find(job->cb, &job->quads[i], &job->dist[i]);
+
+    return NULL;
 }
 
-static void place(context_t *cb, fquad_t *quads, int nquads) {
-    int i, idx;
+static int cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : (int)n;
+}
+
+/* Finding the closest code for each quad is split up among threads; the
+   statistics are then gathered in order, so the output doesn't depend on
+   how many threads there were. Returns the total squared distortion. */
+static double place(context_t *cb, fquad_t *quads, int nquads) {
+    place_job_t jobs[64];
+    pthread_t threads[64];
+    int created[64];
+    int i, n, per;
+    uint8 *idx;
+    float *dist;
+    double total, d;
     code_t *e;
-    double dist;
-    fquad_t *that;
 
-    that = quads;
+    idx = (uint8 *)malloc(nquads);
+    dist = (float *)malloc(nquads * sizeof(float));
+
+    if(idx == NULL || dist == NULL) {
+        fprintf(stderr, "FATAL: out of memory\n");
+        exit(1);
+    }
+
+    n = num_threads > 0 ? num_threads : cpu_count();
+
+    if(n > 64)
+        n = 64;
+
+    /* not worth a thread for less than this */
+    if(n > nquads / 1024)
+        n = nquads / 1024 > 0 ? nquads / 1024 : 1;
+
+    per = (nquads + n - 1) / n;
+
+    for(i = 0; i < n; i++) {
+        jobs[i].cb = cb;
+        jobs[i].quads = quads;
+        jobs[i].idx = idx;
+        jobs[i].dist = dist;
+        jobs[i].first = i * per;
+        jobs[i].count = i * per + per > nquads ? nquads - i * per : per;
+
+        created[i] = i < n - 1 &&
+                     pthread_create(&threads[i], NULL, place_thread,
+                                    &jobs[i]) == 0;
+
+        /* the last part (and any a thread couldn't take) is ours */
+        if(!created[i])
+            place_thread(&jobs[i]);
+    }
+
+    for(i = 0; i < n; i++) {
+        if(created[i])
+            pthread_join(threads[i], NULL);
+    }
+
+    total = 0.0;
 
     for(i = 0; i < nquads; i++) {
-        /* find averages of all codebook entries */
-        idx = find(cb, that);
-        e = &cb->codes[idx];
+        e = &cb->codes[idx[i]];
 
-        add_quad(&e->pos_sum, that);
+        add_quad(&e->pos_sum, &quads[i]);
         e->pos_count++;
+        total += dist[i];
 
         /* see if we have something better in hand */
-        dist = delta_e(&e->value, that);
+        d = sqrt(dist[i]);
 
-        if(dist > e->max_dist) {
-            e->max_dist = dist;
-            copy_quad(&e->max_dist_vec, that);
+        if(d > e->max_dist) {
+            e->max_dist = d;
+            copy_quad(&e->max_dist_vec, &quads[i]);
         }
-
-        that++;
     }
+
+    free(idx);
+    free(dist);
+
+    return total;
 }
 
 static void clean_codebook(context_t *cb) {
@@ -344,7 +529,7 @@ static int write_linear(FILE *out, context_t *cb, mipmap_t *m, int res) {
     nquads = quads_in_map(res);
 
     for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &m->map[res][i]);
+        uint8 c = find(cb, &m->map[res][i], NULL);
 
         if(fputc(c, out) == EOF)
             return -1;
@@ -366,7 +551,7 @@ static int write_twiddled(FILE *out, context_t *cb, mipmap_t *m, int res) {
     map = m->map[res];
 
     for(i = 0; i < nquads; i++) {
-        uint8 c = find(cb, &map[*twididx++]);
+        uint8 c = find(cb, &map[*twididx++], NULL);
 
         if(fputc(c, out) == EOF)
             return -1;
@@ -437,6 +622,9 @@ static int save(const char *filename, context_t *cb, mipmap_t *m, image_t *img)
         }
     }
 
+    /* clean_codebook() may have moved codes around */
+    build_tree(cb);
+
     if(save_codebook(fp, cb) < 0) {
         fprintf(stderr, "FATAL: failed writing codebook to %s\n", filename);
         goto loser;
@@ -479,13 +667,18 @@ loser:
 
 static void banner(const char *progname) {
     printf("Usage: %s [options] image1 [image2..]\n", progname);
+    printf("       %s [options] -f list\n", progname);
     printf("\n");
     printf("Options:\n");
     printf("\t-t, --twiddle\tcreate twiddled textures\n");
     printf("\t-m, --mipmap\tcreate mipmapped textures (EXPERIMENTAL)\n");
     printf("\t-v, --verbose\tverbose\n");
     printf("\t-d, --debug\tshow debug information\n");
-    printf("\t-q, --highq\thigher quality (much slower)\n");
+    printf("\t-q, --highq\thigher quality (slower; same as -i 8)\n");
+    printf("\t-i, --iterations=N\trefinement passes per codebook size (default 1)\n");
+    printf("\t-g, --gain=X\tstop refining once a pass gains less than X (default 0.001)\n");
+    printf("\t-j, --threads=N\tthreads to use (default: one per CPU)\n");
+    printf("\t-f, --files=FILE\talso encode the images listed in FILE (- for stdin)\n");
     printf("\t-k, --kmg\twrite a KMG for output\n");
     printf("\t-a, --alpha\tuse alpha channel (and output ARGB4444)\n");
     printf("\t-b, --amask\tuse 1-bit alpha mask (and output ARGB1555)\n");
@@ -572,7 +765,7 @@ static fquad_t *create_downscaled_map(int res, fquad_t *oneup) {
     fquad_t *q, *larger, tmp;
 
     if(use_debug) {
-        printf("create_downscaled_map(%d %x)\n", res, (unsigned)oneup);
+        printf("create_downscaled_map(%d %p)\n", res, (void *)oneup);
     }
 
     /* each quad in the lower resolution is an average of
@@ -657,31 +850,46 @@ static int build_mipmap(mipmap_t *m, image_t *i) {
     return 0;
 }
 
-static void place_quads(context_t *cb, mipmap_t *m) {
-    int i, j, quads;
-
-    /* run three times to get better quality;
-     * this is not required for most of textures
-     */
+/* one pass of placing every quad (of every resolution) with its closest
+   code and moving each code to the average of its quads; returns the total
+   squared distortion */
+static double place_quads(context_t *cb, mipmap_t *m) {
+    int i;
+    double total;
 
     reset_codebook(cb);
+    build_tree(cb);
+    total = 0.0;
 
-    for(j = 0; j < (use_hq ? 3 : 1); j++) {
-        for(i = 0; i < MAX_MIPMAP; i++) {
-            /* for each mipmap, scan all quads and update
-             * statistics of which quad is the closest to
-             * which codebook index entry
-             */
-            if(m->map[i] != NULL) {
-                quads = quads_in_map(i);
-                place(cb, m->map[i], quads);
-            }
-        }
+    for(i = 0; i < MAX_MIPMAP; i++) {
+        if(m->map[i] != NULL)
+            total += place(cb, m->map[i], quads_in_map(i));
     }
 
     clean_codebook(cb);
+    return total;
 }
 
+/* place_quads() until it stops paying off, or iterations times */
+static void refine(context_t *cb, mipmap_t *m) {
+    int i;
+    double d, last;
+
+    last = 0.0;
+
+    for(i = 0; i < iterations; i++) {
+        d = place_quads(cb, m);
+
+        if(use_debug)
+            printf("refine: %d codes, pass %d, distortion %f\n", cb->in_use,
+                   i, d);
+
+        if(i > 0 && last - d < last * min_gain)
+            break;
+
+        last = d;
+    }
+}
 
 static const char *figure_outfilename(const char *f, const char *newext) {
     char *newname;
@@ -767,20 +975,18 @@ static int encode(const char *infile) {
     build_mipmap(&mipmap, &image);
 
     /* feed all quads (all resolutions) */
-    place_quads(&context, &mipmap);
+    refine(&context, &mipmap);
 
-    /* starting with one codebook entry, split 7 times */
-    for(i = 1; i <= 7; i++) {
+    /* starting with one codebook entry, split 8 times, up to 256 */
+    for(i = 1; i <= 8; i++) {
         if(use_verbose) {
             printf("o");
         }
 
         split(&context);
-        place_quads(&context, &mipmap);
+        refine(&context, &mipmap);
     }
 
-    split(&context);
-
     if(use_verbose) {
         printf("\n");
     }
@@ -789,10 +995,53 @@ static int encode(const char *infile) {
 
     destroy_mipmap(&mipmap);
     destroy_image(&image);
+    free((char *)outfile);
     return ok;
 }
 
+/* options that take a value */
+static int process_value(char opt, const char *val) {
+    char *end;
+
+    switch(opt) {
+        case 'i':
+            iterations = strtol(val, &end, 10);
+            return (*end || iterations < 1) ? -EINVAL : 0;
+
+        case 'g':
+            min_gain = strtod(val, &end);
+            return (*end || min_gain < 0.0) ? -EINVAL : 0;
+
+        case 'j':
+            num_threads = strtol(val, &end, 10);
+            return (*end || num_threads < 0) ? -EINVAL : 0;
+
+        case 'f':
+            file_list = val;
+            return 0;
+    }
+
+    return -EINVAL;
+}
+
 static int process_long_options(char *arg) {
+    char *val;
+
+    if((val = strchr(arg, '=')) != NULL) {
+        *val++ = '\0';
+
+        if(! strcmp(arg, "iterations"))
+            return process_value('i', val);
+        else if(! strcmp(arg, "gain"))
+            return process_value('g', val);
+        else if(! strcmp(arg, "threads"))
+            return process_value('j', val);
+        else if(! strcmp(arg, "files"))
+            return process_value('f', val);
+
+        return -EINVAL;
+    }
+
     if(! strcmp(arg, "mipmap"))
         use_mipmap = 1;
     else if(! strcmp(arg, "twiddle"))
@@ -802,7 +1051,7 @@ static int process_long_options(char *arg) {
     else if(! strcmp(arg, "verbose"))
         use_verbose = 1;
     else if(! strcmp(arg, "highq"))
-        use_hq = 1;
+        iterations = 8;
     else if(! strcmp(arg, "kmg"))
         use_kmg = 1;
     else if(! strcmp(arg, "alpha"))
@@ -815,7 +1064,8 @@ static int process_long_options(char *arg) {
     return 0;
 }
 
-static int process_option(char *arg) {
+/* returns how many arguments were used up, or an error */
+static int process_option(char *arg, char *next) {
     /* assuming starts with '-' */
     arg++;
 
@@ -823,56 +1073,107 @@ static int process_option(char *arg) {
 
         case 'm':
             use_mipmap = 1;
-            return 0;
+            return 1;
 
         case 't':
             use_twiddle = 1;
-            return 0;
+            return 1;
 
         case 'v':
             use_verbose = 1;
-            return 0;
+            return 1;
 
         case 'd':
             use_debug = 1;
-            return 0;
+            return 1;
 
         case 'q':
-            use_hq = 1;
-            return 0;
+            iterations = 8;
+            return 1;
 
         case 'k':
             use_kmg = 1;
-            return 0;
+            return 1;
 
         case 'a':
             use_alpha = 1;
-            return 0;
+            return 1;
 
         case 'b':
             use_alpha = 2;
-            return 0;
+            return 1;
+
+        case 'i':
+        case 'g':
+        case 'j':
+        case 'f':
+            /* either -i4 or -i 4 */
+            if(arg[1])
+                return process_value(*arg, arg + 1) < 0 ? -EINVAL : 1;
+
+            if(next == NULL || process_value(*arg, next) < 0)
+                return -EINVAL;
+
+            return 2;
 
         case '-':
-            return process_long_options(arg + 1);
+            return process_long_options(arg + 1) < 0 ? -EINVAL : 1;
     }
 
     return -EINVAL;
 }
 
+/* encode every image named in a list file, one per line */
+static int encode_list(const char *list, int *count) {
+    char line[1024];
+    FILE *fp;
+    int failed, len;
+
+    if(! strcmp(list, "-"))
+        fp = stdin;
+    else if((fp = fopen(list, "r")) == NULL) {
+        fprintf(stderr, "cannot open %s\n", list);
+        return -1;
+    }
+
+    failed = 0;
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        len = strlen(line);
+
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        if(len == 0 || line[0] == '#')
+            continue;
+
+        (*count)++;
+
+        if(encode(line) < 0)
+            failed++;
+    }
+
+    if(fp != stdin)
+        fclose(fp);
+
+    return failed;
+}
+
 static int process(int argc, char *argv[]) {
-    int arg;
+    int arg, used, count, failed;
 
     arg = 1;
 
     while(arg < argc) {
         if(argv[arg][0] == '-') {
-            if(process_option(argv[arg]) < 0) {
+            used = process_option(argv[arg], arg + 1 < argc ? argv[arg + 1] : NULL);
+
+            if(used < 0) {
                 fprintf(stderr, "invalid option %s\n", argv[arg]);
                 return -EINVAL;
             }
 
-            arg++;
+            arg += used;
             continue;
         }
 
@@ -880,18 +1181,36 @@ static int process(int argc, char *argv[]) {
         break;
     }
 
-    if(arg >= argc) {
+    if(arg >= argc && file_list == NULL) {
         fprintf(stderr, "no files to encode\n");
         return -EINVAL;
     }
 
+    count = failed = 0;
+
     while(arg < argc) {
         /* ordinary image */
-        encode(argv[arg]);
+        count++;
+
+        if(encode(argv[arg]) < 0)
+            failed++;
+
         arg++;
     }
 
-    return 0;
+    if(file_list != NULL) {
+        used = encode_list(file_list, &count);
+
+        if(used < 0)
+            return -EINVAL;
+
+        failed += used;
+    }
+
+    if(count > 1 && (use_verbose || failed))
+        printf("%d of %d images encoded\n", count - failed, count);
+
+    return failed ? -EIO : 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -902,5 +1221,5 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    return process(argc, argv);
+    return process(argc, argv) < 0 ? 1 : 0;
 }
@@ -18,175 +18,71 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-static int diff_lookup[16] = {
-    1, 3, 5, 7, 9, 11, 13, 15,
-    -1, -3, -5, -7, -9, -11, -13, -15,
-};
-
-static int index_scale[16] = {
-    0x0e6, 0x0e6, 0x0e6, 0x0e6, 0x133, 0x199, 0x200, 0x266,
-    0x0e6, 0x0e6, 0x0e6, 0x0e6, 0x133, 0x199, 0x200, 0x266 //same value for speedup
-};
-
-static inline int limit(int val, int min, int max) {
-    if(val < min) return min;
-    else if(val > max) return max;
-    else return val;
-}
-
-void pcm2adpcm(unsigned char *dst, const short *src, size_t length) {
-    int signal, step;
-    signal = 0;
-    step = 0x7f;
-
-    // length/=4;
-    length = (length + 3) / 4;
-
-    do {
-        int data, val, diff;
-
-        /* hign nibble */
-        diff = *src++ - signal;
-        diff = (diff * 8) / step;
-
-        val = abs(diff) / 2;
-
-        if(val > 7) val = 7;
-
-        if(diff < 0) val += 8;
-
-        signal += (step * diff_lookup[val]) / 8;
-        signal = limit(signal, -32768, 32767);
-
-        step = (step * index_scale[val]) >> 8;
-        step = limit(step, 0x7f, 0x6000);
-
-        data = val;
-
-        /* low nibble */
-        diff = *src++ - signal;
-        diff = (diff * 8) / step;
-
-        val = (abs(diff)) / 2;
-
-        if(val > 7) val = 7;
-
-        if(diff < 0) val += 8;
-
-        signal += (step * diff_lookup[val]) / 8;
-        signal = limit(signal, -32768, 32767);
-
-        step = (step * index_scale[val]) >> 8;
-        step = limit(step, 0x7f, 0x6000);
-
-        data |= val << 4;
-
-        *dst++ = data;
-
-    }
-    while(--length);
-}
-
-void adpcm2pcm(short *dst, const unsigned char *src, size_t length) {
-    int signal, step;
-    signal = 0;
-    step = 0x7f;
-
-    do {
-        int data, val;
-
-        data = *src++;
-
-        /* low nibble */
-        val = data & 15;
-
-        signal += (step * diff_lookup[val]) / 8;
-        signal = limit(signal, -32768, 32767);
-
-        step = (step * index_scale[val & 7]) >> 8;
-        step = limit(step, 0x7f, 0x6000);
-
-        *dst++ = signal;
-
-        /* high nibble */
-        val = (data >> 4) & 15;
-
-        signal += (step * diff_lookup[val]) / 8;
-        signal = limit(signal, -32768, 32767);
-
-        step = (step * index_scale[val & 7]) >> 8;
-        step = limit(step, 0x7f, 0x6000);
-
-        *dst++ = signal;
-
-    }
-    while(--length);
-}
-
-void deinterleave(void *buffer, size_t size) {
-    short * buf;
-    short * buf1, * buf2;
-    int i;
-
-    buf = (short *)buffer;
-    buf1 = malloc(size / 2);
-    buf2 = malloc(size / 2);
-
-    for(i = 0; i < size / 4; i++) {
-        buf1[i] = buf[i * 2 + 0];
-        buf2[i] = buf[i * 2 + 1];
-    }
-
-    memcpy(buf, buf1, size / 2);
-    memcpy(buf + size / 4, buf2, size / 2);
-
-    free(buf1);
-    free(buf2);
-}
-
-void interleave(void *buffer, size_t size) {
-    short * buf;
-    short * buf1, * buf2;
-    int i;
-
-    buf = malloc(size);
-    buf1 = (short *)buffer;
-    buf2 = buf1 + size / 4;
-
-    for(i = 0; i < size / 4; i++) {
-        buf[i * 2 + 0] = buf1[i];
-        buf[i * 2 + 1] = buf2[i];
-    }
-
-    memcpy(buffer, buf, size);
-
-    free(buf);
+#include <stdint.h>
+#include <pthread.h>
+#include "batch.h"
+
+typedef uint8_t uint8;
+typedef int16_t int16;
+typedef uint32_t uint32;
+typedef int64_t int64;
+typedef uint64_t uint64;
+
+/* The encoder and decoder are shared with the kernel's snd_adpcm.c */
+#include "../../kernel/arch/dreamcast/sound/snd_adpcm_core.h"
+
+/* Trellis widths for -q 0..3 */
+static const int beams[4] = { 1, 4, 8, 16 };
+static int quality = 0;
+
+/* One channel of a stereo file is encoded on a thread of its own. Stereo
+   input is read straight out of the interleaved buffer, and the ADPCM for
+   each channel is stored separately, as the AICA wants it. */
+typedef struct chan {
+    uint8 *dst;
+    const int16 *src;
+    uint32 samples;
+    uint32 stride;
+} chan_t;
+
+static void *encode_chan(void *p) {
+    chan_t *c = (chan_t *)p;
+    snda_enc_t e;
+    uint8 *dst;
+
+    snda_init(&e, beams[quality]);
+    dst = c->dst + snda_encode(&e, c->dst, c->src, c->samples, c->stride);
+    snda_flush(&e, dst);
+
+    return NULL;
 }
 
 struct wavhdr_t {
     char hdr1[4];
-    long totalsize;
+    int32_t totalsize;
 
     char hdr2[8];
-    long hdrsize;
-    short format;
-    short channels;
-    long freq;
-    long byte_per_sec;
-    short blocksize;
-    short bits;
+    int32_t hdrsize;
+    int16_t format;
+    int16_t channels;
+    int32_t freq;
+    int32_t byte_per_sec;
+    int16_t blocksize;
+    int16_t bits;
 
     char hdr3[4];
-    long datasize;
+    int32_t datasize;
 };
 
 int wav2adpcm(const char *infile, const char *outfile) {
     struct wavhdr_t wavhdr;
     FILE *in, *out;
-    size_t pcmsize, adpcmsize;
+    size_t pcmsize, adpcmsize, chansize;
     short *pcmbuf;
     unsigned char *adpcmbuf;
+    chan_t chans[2];
+    pthread_t thd;
+    int i, threaded = 0;
 
     in = fopen(infile, "rb");
 
@@ -195,48 +91,76 @@ int wav2adpcm(const char *infile, const char *outfile) {
         return -1;
     }
 
-    fread(&wavhdr, 1, sizeof(wavhdr), in);
-
-    if(memcmp(wavhdr.hdr1, "RIFF", 4)
+    if(fread(&wavhdr, 1, sizeof(wavhdr), in) != sizeof(wavhdr)
+            || memcmp(wavhdr.hdr1, "RIFF", 4)
             || memcmp(wavhdr.hdr2, "WAVEfmt ", 8)
             || memcmp(wavhdr.hdr3, "data", 4)
             || wavhdr.hdrsize != 0x10
             || wavhdr.format != 1
             || (wavhdr.channels != 1 && wavhdr.channels != 2)
             || wavhdr.bits != 16) {
-        printf("unsupport format\n");
+        printf("%s: unsupport format\n", infile);
         fclose(in);
         return -1;
     }
 
     pcmsize = wavhdr.datasize;
 
-    adpcmsize = pcmsize / 4;
+    /* Each channel rounds up to whole bytes */
+    chansize = (pcmsize / 2 / wavhdr.channels + 1) / 2;
+    adpcmsize = chansize * wavhdr.channels;
     pcmbuf = malloc(pcmsize);
     adpcmbuf = malloc(adpcmsize);
 
-    fread(pcmbuf, 1, pcmsize, in);
+    if(!pcmbuf || !adpcmbuf || fread(pcmbuf, 1, pcmsize, in) != pcmsize) {
+        printf("%s: can't read the samples\n", infile);
+        fclose(in);
+        free(pcmbuf);
+        free(adpcmbuf);
+        return -1;
+    }
+
     fclose(in);
 
-    if(wavhdr.channels == 1) {
-        pcm2adpcm(adpcmbuf, pcmbuf, pcmsize);
-    }
-    else {
-        /* For stereo we just deinterleave the input and store the
-           left and right channel of the ADPCM data separately. */
-        deinterleave(pcmbuf, pcmsize);
-        pcm2adpcm(adpcmbuf, pcmbuf, pcmsize / 2);
-        pcm2adpcm(adpcmbuf + adpcmsize / 2, pcmbuf + pcmsize / 4, pcmsize / 2);
+    for(i = 0; i < wavhdr.channels; i++) {
+        chans[i].dst = adpcmbuf + i * chansize;
+        chans[i].src = pcmbuf + i;
+        chans[i].samples = pcmsize / 2 / wavhdr.channels;
+        chans[i].stride = wavhdr.channels;
     }
 
+    if(wavhdr.channels == 2)
+        threaded = !pthread_create(&thd, NULL, encode_chan, chans + 1);
+
+    encode_chan(chans);
+
+    if(threaded)
+        pthread_join(thd, NULL);
+    else if(wavhdr.channels == 2)
+        encode_chan(chans + 1);
+
+    free(pcmbuf);
+
     out = fopen(outfile, "wb");
+
+    if(out == NULL) {
+        printf("can't create %s\n", outfile);
+        free(adpcmbuf);
+        return -1;
+    }
+
     wavhdr.datasize = adpcmsize;
     wavhdr.format = 20; /* ITU G.723 ADPCM (Yamaha) */
     wavhdr.bits = 4;
     wavhdr.totalsize = wavhdr.datasize + sizeof(wavhdr) - 8;
     fwrite(&wavhdr, 1, sizeof(wavhdr), out);
     fwrite(adpcmbuf, 1, adpcmsize, out);
-    fclose(out);
+    free(adpcmbuf);
+
+    if(fclose(out)) {
+        printf("can't write %s\n", outfile);
+        return -1;
+    }
 
     return 0;
 }
@@ -255,9 +179,8 @@ int adpcm2wav(const char *infile, const char *outfile) {
         return -1;
     }
 
-    fread(&wavhdr, 1, sizeof(wavhdr), in);
-
-    if(memcmp(wavhdr.hdr1, "RIFF", 4)
+    if(fread(&wavhdr, 1, sizeof(wavhdr), in) != sizeof(wavhdr)
+            || memcmp(wavhdr.hdr1, "RIFF", 4)
             || memcmp(wavhdr.hdr2, "WAVEfmt ", 8)
             || memcmp(wavhdr.hdr3, "data", 4)
             || wavhdr.hdrsize != 0x10
@@ -274,16 +197,23 @@ int adpcm2wav(const char *infile, const char *outfile) {
     adpcmbuf = malloc(adpcmsize);
     pcmbuf = malloc(pcmsize);
 
-    fread(adpcmbuf, 1, adpcmsize, in);
+    if(!adpcmbuf || !pcmbuf || fread(adpcmbuf, 1, adpcmsize, in) != adpcmsize) {
+        printf("%s: can't read the samples\n", infile);
+        fclose(in);
+        free(adpcmbuf);
+        free(pcmbuf);
+        return -1;
+    }
+
     fclose(in);
 
     if(wavhdr.channels == 1) {
-        adpcm2pcm(pcmbuf, adpcmbuf, adpcmsize);
+        snda_decode(pcmbuf, adpcmbuf, adpcmsize, 1);
     }
     else {
-        adpcm2pcm(pcmbuf, adpcmbuf, adpcmsize / 2);
-        adpcm2pcm(pcmbuf + pcmsize / 4, adpcmbuf + adpcmsize / 2, adpcmsize / 2);
-        interleave(pcmbuf, pcmsize);
+        /* Decode each channel straight into its interleaved slots */
+        snda_decode(pcmbuf, adpcmbuf, adpcmsize / 2, 2);
+        snda_decode(pcmbuf + 1, adpcmbuf + adpcmsize / 2, adpcmsize / 2, 2);
     }
 
     wavhdr.blocksize = wavhdr.channels * sizeof(short);
@@ -294,35 +224,95 @@ int adpcm2wav(const char *infile, const char *outfile) {
     wavhdr.bits = 16;
 
     out = fopen(outfile, "wb");
+
+    if(out == NULL) {
+        printf("can't create %s\n", outfile);
+        free(adpcmbuf);
+        free(pcmbuf);
+        return -1;
+    }
+
     fwrite(&wavhdr, 1, sizeof(wavhdr), out);
     fwrite(pcmbuf, 1, pcmsize, out);
-    fclose(out);
+    free(adpcmbuf);
+    free(pcmbuf);
+
+    if(fclose(out)) {
+        printf("can't write %s\n", outfile);
+        return -1;
+    }
 
     return 0;
 }
 
+static int convert_to(const char *infile, const char *outfile, void *data) {
+    return wav2adpcm(infile, outfile);
+}
+
+static int convert_from(const char *infile, const char *outfile, void *data) {
+    return adpcm2wav(infile, outfile);
+}
+
 void usage() {
     printf("wav2adpcm: 16bit mono wav to aica adpcm and vice-versa (c)2002 BERO\n"
-           " wav2adpcm -t <infile.wav> <outfile.wav>   (To adpcm)\n"
-           " wav2adpcm -f <infile.wav> <outfile.wav>   (From adpcm)\n"
+           " wav2adpcm [-q n] -t <infile.wav> <outfile.wav>   (To adpcm)\n"
+           " wav2adpcm -f <infile.wav> <outfile.wav>          (From adpcm)\n"
+           " wav2adpcm [options] -t|-f -l <manifest>          (Batch)\n"
+           "\n"
+           "Options:\n"
+           " -q n      encoding quality: 0 picks the nearest step for each\n"
+           "           sample (the default); 1-3 search for the best steps\n"
+           "           over short windows, keeping transients cleaner\n"
+           " -l file   convert the files listed in file, one \"infile outfile\"\n"
+           "           per line (- for stdin)\n"
+           " -j n      convert n files at once (default: one per CPU)\n"
+           " -c file   remember input hashes in file, and skip inputs that\n"
+           "           haven't changed since the last run\n"
           );
 }
 
 int main(int argc, char **argv) {
-    if(argc == 4) {
-        if(!strcmp(argv[1], "-t")) {
-            return wav2adpcm(argv[2], argv[3]);
-        }
-        else if(!strcmp(argv[1], "-f")) {
-            return adpcm2wav(argv[2], argv[3]);
-        }
-        else {
-            usage();
-            return -1;
-        }
+    batch_t b;
+    char salt[32];
+    int i, mode = 0;
+
+    memset(&b, 0, sizeof(b));
+
+    for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "-f"))
+            mode = argv[i][1];
+        else if(i + 1 >= argc)
+            break;
+        else if(!strcmp(argv[i], "-q"))
+            quality = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-l"))
+            b.manifest = argv[++i];
+        else if(!strcmp(argv[i], "-j"))
+            b.threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-c"))
+            b.cache = argv[++i];
+        else
+            break;
     }
-    else {
+
+    if(!mode || quality < 0 || quality > 3 ||
+            (b.manifest ? i != argc : i + 2 != argc)) {
         usage();
         return -1;
     }
+
+    if(!b.manifest) {
+        if(mode == 't')
+            return wav2adpcm(argv[i], argv[i + 1]);
+        else
+            return adpcm2wav(argv[i], argv[i + 1]);
+    }
+
+    /* The quality changes what -t writes, so it goes in the hash */
+    sprintf(salt, "wav2adpcm 1 %c q%d", mode, mode == 't' ? quality : 0);
+    b.salt = salt;
+    b.verbose = 1;
+    b.convert = mode == 't' ? convert_to : convert_from;
+
+    return batch_run(&b) ? -1 : 0;
 }